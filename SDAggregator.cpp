@@ -0,0 +1,367 @@
+#include "SDAggregator.hpp"
+
+SDAggregator::SDAggregator(SDLogger& logger, SDFile file, const sd_aggregator_config_t& cfg)
+    : logger(logger)
+    , file(file)
+    , cfg(cfg)
+    , active(0)
+    , window_start_us(esp_timer_get_time())
+    , raw_windows(0)
+    , timer(nullptr)
+    , fence(nullptr)
+    , fence_done(xSemaphoreCreateBinary())
+    , stopping(false)
+    , emit_mutex(xSemaphoreCreateMutex())
+    , rows_len(0)
+    , rows_count(0)
+{
+}
+
+SDAggregator::~SDAggregator()
+{
+    if (timer != nullptr)
+        stop();
+
+    vSemaphoreDelete(fence_done);
+    vSemaphoreDelete(emit_mutex);
+}
+
+int SDAggregator::add_channel(const char* name)
+{
+    const constexpr char* SUB_TAG = "SDAggregator->add_channel()";
+
+    if (timer != nullptr)
+    {
+        ESP_LOGE(TAG, "%s: Channels must be added before start().", SUB_TAG);
+        return -1;
+    }
+
+    if (name == nullptr || strlen(name) + 1 > MAX_CHANNEL_NAME_SZ || strchr(name, ',') != nullptr)
+    {
+        ESP_LOGE(TAG, "%s: Invalid channel name.", SUB_TAG);
+        return -1;
+    }
+
+    if (channels.size() >= MAX_CHANNELS)
+    {
+        ESP_LOGE(TAG, "%s: Max channels already added.", SUB_TAG);
+        return -1;
+    }
+
+    channels.emplace_back();
+    channel_t& channel = channels.back();
+
+    strcpy(channel.name, name);
+    channel.count = 0;
+    channel.min = 0.0f;
+    channel.max = 0.0f;
+    channel.sum = 0.0;
+    channel.raw_len = 0;
+
+    // both halves are allocated up front, push() never allocates
+    if (cfg.raw_samples > 0)
+        for (std::unique_ptr<sample_t[]>& raw : channel.raw)
+        {
+            raw.reset(new sample_t[cfg.raw_samples]);
+
+            if (!raw)
+            {
+                ESP_LOGE(TAG, "%s: No heap memory available for %u raw samples.", SUB_TAG, static_cast<unsigned>(cfg.raw_samples));
+                channels.pop_back();
+                return -1;
+            }
+        }
+
+    summaries.resize(channels.size());
+
+    return static_cast<int>(channels.size() - 1);
+}
+
+bool SDAggregator::start()
+{
+    const constexpr char* SUB_TAG = "SDAggregator->start()";
+    esp_err_t err = ESP_OK;
+
+    const esp_timer_create_args_t timer_args = {.callback = &timer_callback,
+            .arg = this,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "sd_aggregator",
+            .skip_unhandled_events = true};
+
+    const esp_timer_create_args_t fence_args = {.callback = &fence_callback,
+            .arg = this,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "sd_aggregator_fence",
+            .skip_unhandled_events = false};
+
+    if (!file || cfg.window_ms == 0 || channels.empty())
+    {
+        ESP_LOGE(TAG, "%s: File, window or channels missing.", SUB_TAG);
+        return false;
+    }
+
+    if (timer != nullptr)
+    {
+        ESP_LOGW(TAG, "%s: Already started.", SUB_TAG);
+        return false;
+    }
+
+    if (!logger.is_io_task_running())
+        ESP_LOGW(TAG, "%s: IO task not running, rows are written to the card from the esp_timer task.", SUB_TAG);
+
+    if (!SDLogger::status_ok(logger.try_write(file, HEADER, strlen(HEADER), cfg.priority)))
+        ESP_LOGW(TAG, "%s: Column header dropped.", SUB_TAG);
+
+    // both are created here, stop() must not fail to allocate
+    err = esp_timer_create(&fence_args, &fence);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "%s: esp_timer_create() failed (0x%x).", SUB_TAG, err);
+        fence = nullptr;
+        return false;
+    }
+
+    err = esp_timer_create(&timer_args, &timer);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "%s: esp_timer_create() failed (0x%x).", SUB_TAG, err);
+        esp_timer_delete(fence);
+        fence = nullptr;
+        timer = nullptr;
+        return false;
+    }
+
+    stopping = false;
+
+    taskENTER_CRITICAL(&lock);
+    window_start_us = esp_timer_get_time();
+    taskEXIT_CRITICAL(&lock);
+
+    err = esp_timer_start_periodic(timer, cfg.window_ms * 1000ULL);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "%s: esp_timer_start_periodic() failed (0x%x).", SUB_TAG, err);
+        esp_timer_delete(timer);
+        esp_timer_delete(fence);
+        timer = nullptr;
+        fence = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+bool SDAggregator::stop()
+{
+    const constexpr char* SUB_TAG = "SDAggregator->stop()";
+
+    if (timer == nullptr)
+    {
+        ESP_LOGW(TAG, "%s: Not started.", SUB_TAG);
+        return false;
+    }
+
+    // esp_timer_stop() does not wait for a callback already dispatched, it may still run after the delete
+    stopping = true;
+    esp_timer_stop(timer);
+    esp_timer_delete(timer);
+    timer = nullptr;
+
+    // the esp_timer task runs callbacks one at a time: once the fence has run, no timer_callback() is left in flight
+    if (esp_timer_start_once(fence, 0) == ESP_OK)
+        xSemaphoreTake(fence_done, portMAX_DELAY);
+    else
+        ESP_LOGE(TAG, "%s: Fence timer failed to start.", SUB_TAG);
+
+    esp_timer_delete(fence);
+    fence = nullptr;
+
+    // the partial window is written so no samples are lost
+    close_window(esp_timer_get_time());
+
+    return true;
+}
+
+void SDAggregator::push(int channel, float value)
+{
+    const int64_t now_us = esp_timer_get_time();
+
+    if (channel < 0 || static_cast<size_t>(channel) >= channels.size())
+        return;
+
+    channel_t& ch = channels[channel];
+
+    taskENTER_CRITICAL(&lock);
+
+    if (ch.count == 0 || value < ch.min)
+        ch.min = value;
+
+    if (ch.count == 0 || value > ch.max)
+        ch.max = value;
+
+    ch.count++;
+    ch.sum += value;
+    stats.samples++;
+
+    if (cfg.raw_samples > 0)
+    {
+        if (ch.raw_len < cfg.raw_samples)
+            ch.raw[active][ch.raw_len++] = {static_cast<uint32_t>(now_us - window_start_us), value};
+        else
+            stats.raw_overflows++;
+    }
+
+    taskEXIT_CRITICAL(&lock);
+}
+
+bool SDAggregator::trigger()
+{
+    const constexpr char* SUB_TAG = "SDAggregator->trigger()";
+
+    if (cfg.raw_samples == 0)
+    {
+        ESP_LOGE(TAG, "%s: Raw capture disabled.", SUB_TAG);
+        return false;
+    }
+
+    // a trigger inside an already triggered stretch extends it
+    taskENTER_CRITICAL(&lock);
+    raw_windows = std::max(raw_windows, cfg.post_trigger_windows + 1);
+    taskEXIT_CRITICAL(&lock);
+
+    return true;
+}
+
+bool SDAggregator::get_stats(sd_aggregator_stats_t& stats)
+{
+    taskENTER_CRITICAL(&lock);
+    stats = this->stats;
+    taskEXIT_CRITICAL(&lock);
+
+    return true;
+}
+
+void SDAggregator::timer_callback(void* arg)
+{
+    SDAggregator* self = static_cast<SDAggregator*>(arg);
+
+    if (self->stopping)
+        return;
+
+    self->close_window(esp_timer_get_time());
+}
+
+void SDAggregator::fence_callback(void* arg)
+{
+    SDAggregator* self = static_cast<SDAggregator*>(arg);
+
+    xSemaphoreGive(self->fence_done);
+}
+
+void SDAggregator::close_window(int64_t now_us)
+{
+    char row[96];
+    int length = 0;
+    int64_t start_us = 0;
+    uint8_t written = 0;
+    bool write_raw = false;
+    uint32_t summary_rows = 0;
+    uint32_t raw_rows = 0;
+
+    xSemaphoreTake(emit_mutex, portMAX_DELAY);
+
+    // accumulators are copied and reset in one go, producers continue into the other raw half right away
+    taskENTER_CRITICAL(&lock);
+
+    start_us = window_start_us;
+    window_start_us = now_us;
+    written = active;
+    active ^= 1;
+
+    write_raw = (raw_windows > 0);
+    if (write_raw)
+        raw_windows--;
+
+    for (size_t i = 0; i < channels.size(); i++)
+    {
+        channel_t& ch = channels[i];
+
+        summaries[i] = {ch.count, ch.min, ch.max, ch.sum, ch.raw_len};
+        ch.count = 0;
+        ch.sum = 0.0;
+        ch.raw_len = 0;
+    }
+
+    stats.windows++;
+
+    taskEXIT_CRITICAL(&lock);
+
+    for (size_t i = 0; i < channels.size(); i++)
+    {
+        const summary_t& summary = summaries[i];
+
+        if (summary.count == 0)
+            continue;
+
+        if (write_raw)
+            for (size_t j = 0; j < summary.raw_len; j++)
+            {
+                const sample_t& sample = channels[i].raw[written][j];
+
+                length = snprintf(row, sizeof(row), "%lld,%s,raw,1,%.7g,%.7g,%.7g\n", static_cast<long long>(start_us + sample.offset_us),
+                        channels[i].name, sample.value, sample.value, sample.value);
+                emit(row, length);
+                raw_rows++;
+            }
+
+        length = snprintf(row, sizeof(row), "%lld,%s,sum,%u,%.7g,%.7g,%.7g\n", static_cast<long long>(start_us), channels[i].name,
+                static_cast<unsigned>(summary.count), summary.min, summary.max, summary.sum / summary.count);
+        emit(row, length);
+        summary_rows++;
+    }
+
+    flush_rows();
+
+    taskENTER_CRITICAL(&lock);
+    stats.summary_rows += summary_rows;
+    stats.raw_rows += raw_rows;
+    taskEXIT_CRITICAL(&lock);
+
+    xSemaphoreGive(emit_mutex);
+}
+
+bool SDAggregator::emit(const char* row, size_t length)
+{
+    bool success = true;
+
+    if (rows_len + length > ROWS_SZ)
+        success = flush_rows();
+
+    memcpy(rows + rows_len, row, length);
+    rows_len += length;
+    rows_count++;
+
+    return success;
+}
+
+bool SDAggregator::flush_rows()
+{
+    bool success = true;
+
+    if (rows_len == 0)
+        return true;
+
+    success = SDLogger::status_ok(logger.try_write(file, rows, rows_len, cfg.priority));
+
+    if (!success)
+    {
+        taskENTER_CRITICAL(&lock);
+        stats.write_failures += rows_count;
+        taskEXIT_CRITICAL(&lock);
+    }
+
+    rows_len = 0;
+    rows_count = 0;
+
+    return success;
+}
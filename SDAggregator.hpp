@@ -0,0 +1,128 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "SDLogger.hpp"
+
+typedef struct sd_aggregator_config_t
+{
+        uint32_t window_ms;            // one summary row per channel and window
+        size_t raw_samples;            // raw samples kept per channel and window for trigger(), 0 to disable raw capture
+        uint32_t post_trigger_windows; // windows after the triggered one that also write their raw samples
+        sd_priority_t priority;        // given to the rows handed to try_write()
+
+        sd_aggregator_config_t()
+            : window_ms(1000)
+            , raw_samples(0)
+            , post_trigger_windows(0)
+            , priority(SD_PRIORITY_BULK)
+        {
+        }
+} sd_aggregator_config_t;
+
+typedef struct sd_aggregator_stats_t
+{
+        uint64_t samples;        // samples pushed
+        uint32_t windows;        // windows closed
+        uint32_t summary_rows;
+        uint32_t raw_rows;
+        uint32_t raw_overflows;  // samples past raw_samples in a window, counted in the summary but not kept raw
+        uint32_t write_failures; // rows dropped by the write queue or a card error
+
+        sd_aggregator_stats_t()
+            : samples(0)
+            , windows(0)
+            , summary_rows(0)
+            , raw_rows(0)
+            , raw_overflows(0)
+            , write_failures(0)
+        {
+        }
+} sd_aggregator_stats_t;
+
+/**
+ * Windowed aggregation in front of an SDFile. Producers push() float samples into per channel accumulators (a few
+ * instructions inside a critical section), and every window_ms one CSV row per channel with samples is written:
+ *
+ *   t_us,channel,type,count,min,max,mean
+ *
+ * t_us is the esp_timer time at the start of the window and type is "sum". With raw_samples set, the samples of the
+ * current window are kept as well and trigger() writes them as "raw" rows (count 1, min = max = mean = value, t_us of
+ * the sample) for the triggered window and the post_trigger_windows after it. Rows are handed to try_write() from the
+ * esp_timer task, so run the logger's io task and give the file a non-blocking overflow policy.
+ */
+class SDAggregator
+{
+    public:
+        SDAggregator(SDLogger& logger, SDFile file, const sd_aggregator_config_t& cfg = sd_aggregator_config_t());
+        ~SDAggregator();
+
+        int add_channel(const char* name);
+        bool start();
+        bool stop();
+        void push(int channel, float value);
+        bool trigger();
+        bool get_stats(sd_aggregator_stats_t& stats);
+
+        static const constexpr size_t MAX_CHANNELS = 16;
+        static const constexpr size_t MAX_CHANNEL_NAME_SZ = 16;
+
+    private:
+        static const constexpr size_t ROWS_SZ = 1024; // rows are collected and handed to try_write() in blocks
+        static const constexpr char* HEADER = "t_us,channel,type,count,min,max,mean\n";
+
+        typedef struct sample_t
+        {
+                uint32_t offset_us; // from the start of the window
+                float value;
+        } sample_t;
+
+        typedef struct channel_t
+        {
+                char name[MAX_CHANNEL_NAME_SZ];
+                uint32_t count;
+                float min;
+                float max;
+                double sum;
+                std::unique_ptr<sample_t[]> raw[2]; // pushed into raw[active], the other one is being written
+                size_t raw_len;
+        } channel_t;
+
+        // one channel's window as copied out of the critical section
+        typedef struct summary_t
+        {
+                uint32_t count;
+                float min;
+                float max;
+                double sum;
+                size_t raw_len;
+        } summary_t;
+
+        static void timer_callback(void* arg);
+        static void fence_callback(void* arg);
+        void close_window(int64_t now_us);
+        bool emit(const char* row, size_t length);
+        bool flush_rows();
+
+        SDLogger& logger;
+        SDFile file;
+        sd_aggregator_config_t cfg;
+        std::vector<channel_t> channels;
+        std::vector<summary_t> summaries;
+        portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED; // guards the accumulators, active, window_start_us and stats
+        uint8_t active;
+        int64_t window_start_us;
+        uint32_t raw_windows;  // windows left whose raw samples are written
+        esp_timer_handle_t timer;
+        esp_timer_handle_t fence;     // one shot, run by stop() to wait out a timer callback already dispatched
+        SemaphoreHandle_t fence_done;
+        volatile bool stopping;       // set by stop(), a callback dispatched before the timer went away returns at once
+        SemaphoreHandle_t emit_mutex; // serializes the timer callback with stop()
+        char rows[ROWS_SZ];
+        size_t rows_len;
+        uint32_t rows_count; // rows held in rows, counted as failed if try_write() drops the block
+        sd_aggregator_stats_t stats;
+
+        static const constexpr char* TAG = "SDAggregator";
+};
@@ -0,0 +1,301 @@
+#include "SDBlackBox.hpp"
+
+SDBlackBox::SDBlackBox(SDLogger& logger, SDFile file, const sd_blackbox_config_t& cfg)
+    : logger(logger)
+    , file(file)
+    , cfg(cfg)
+    , ring(nullptr)
+    , chunk(nullptr)
+    , records_head(0)
+    , records_count(0)
+    , head(0)
+    , tail(0)
+    , state(STATE_RECORDING)
+    , trigger_us(0)
+    , deadline_us(0)
+    , task_hdl(nullptr)
+    , task_stop(false)
+    , task_done(xSemaphoreCreateBinary())
+{
+}
+
+SDBlackBox::~SDBlackBox()
+{
+    if (task_hdl != nullptr)
+    {
+        task_stop = true;
+        xTaskNotifyGive(task_hdl);
+        xSemaphoreTake(task_done, portMAX_DELAY);
+    }
+
+    vSemaphoreDelete(task_done);
+
+    if (ring)
+        heap_caps_free(ring);
+
+    if (chunk)
+        heap_caps_free(chunk);
+}
+
+bool SDBlackBox::begin()
+{
+    const constexpr char* SUB_TAG = "SDBlackBox->begin()";
+
+    if (task_hdl != nullptr)
+    {
+        ESP_LOGW(TAG, "%s: Already started.", SUB_TAG);
+        return false;
+    }
+
+    if (!file || cfg.ring_sz < MAX_RECORD_SZ || cfg.max_records == 0 || cfg.dump_chunk_sz < 512)
+    {
+        ESP_LOGE(TAG, "%s: Invalid file or configuration.", SUB_TAG);
+        return false;
+    }
+
+    ring = static_cast<uint8_t*>(heap_caps_malloc(cfg.ring_sz, cfg.use_psram ? MALLOC_CAP_SPIRAM : MALLOC_CAP_8BIT));
+
+    // the dump buffer is DMA capable and word aligned, write_block() then hands it to the card without bouncing
+    chunk = static_cast<uint8_t*>(heap_caps_malloc(cfg.dump_chunk_sz, MALLOC_CAP_DMA));
+    records = std::unique_ptr<record_t[]>(new record_t[cfg.max_records]);
+
+    if (ring == nullptr || chunk == nullptr || !records)
+    {
+        ESP_LOGE(TAG, "%s: No heap memory available for a %u byte ring.", SUB_TAG, static_cast<unsigned>(cfg.ring_sz));
+        return false;
+    }
+
+    if (xTaskCreate(&writer_task_trampoline, "sd_blackbox", cfg.task_stack_sz, this, cfg.task_priority, &task_hdl) != pdPASS)
+    {
+        ESP_LOGE(TAG, "%s: Could not create writer task.", SUB_TAG);
+        task_hdl = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+sd_write_status_t SDBlackBox::write(const void* data, size_t length)
+{
+    const constexpr char* SUB_TAG = "SDBlackBox->write()";
+    size_t offset = 0;
+    size_t first = 0;
+    bool streaming = false;
+
+    if (ring == nullptr || data == nullptr || length == 0 || length > MAX_RECORD_SZ)
+    {
+        ESP_LOGE(TAG, "%s: Not started or invalid record.", SUB_TAG);
+        return SD_WRITE_ERROR;
+    }
+
+    taskENTER_CRITICAL(&lock);
+
+    streaming = (state == STATE_STREAMING);
+
+    if (streaming)
+    {
+        // bytes not yet on the card are never overwritten
+        if (head - tail + length > cfg.ring_sz || records_count == cfg.max_records)
+        {
+            stats.dropped_records++;
+            taskEXIT_CRITICAL(&lock);
+            return SD_WRITE_DROPPED;
+        }
+    }
+    else
+    {
+        while (head - tail + length > cfg.ring_sz || records_count == cfg.max_records)
+        {
+            pop_record();
+            stats.evicted_records++;
+        }
+    }
+
+    offset = head % cfg.ring_sz;
+    first = std::min(length, cfg.ring_sz - offset);
+
+    memcpy(ring + offset, data, first);
+    memcpy(ring, static_cast<const uint8_t*>(data) + first, length - first);
+
+    records[(records_head + records_count) % cfg.max_records] = {head, esp_timer_get_time()};
+    records_count++;
+    head += length;
+
+    stats.records++;
+    stats.bytes += length;
+
+    taskEXIT_CRITICAL(&lock);
+
+    if (streaming)
+        xTaskNotifyGive(task_hdl);
+
+    return SD_WRITE_QUEUED;
+}
+
+bool SDBlackBox::trigger()
+{
+    const constexpr char* SUB_TAG = "SDBlackBox->trigger()";
+    const int64_t now_us = esp_timer_get_time();
+    bool started = false;
+
+    if (task_hdl == nullptr)
+    {
+        ESP_LOGE(TAG, "%s: Not started.", SUB_TAG);
+        return false;
+    }
+
+    taskENTER_CRITICAL(&lock);
+
+    stats.triggers++;
+    deadline_us = now_us + cfg.post_trigger_ms * 1000LL;
+
+    // a trigger while streaming only extends the window
+    if (state == STATE_RECORDING)
+    {
+        state = STATE_STREAMING;
+        trigger_us = now_us;
+        started = true;
+
+        if (cfg.pre_trigger_ms > 0)
+            while (records_count > 0 && records[records_head].time_us < now_us - cfg.pre_trigger_ms * 1000LL)
+                pop_record();
+    }
+
+    taskEXIT_CRITICAL(&lock);
+
+    if (started)
+        xTaskNotifyGive(task_hdl);
+
+    return true;
+}
+
+bool SDBlackBox::is_streaming()
+{
+    return (state == STATE_STREAMING);
+}
+
+bool SDBlackBox::get_stats(sd_blackbox_stats_t& stats)
+{
+    taskENTER_CRITICAL(&lock);
+    stats = this->stats;
+    taskEXIT_CRITICAL(&lock);
+
+    return true;
+}
+
+void SDBlackBox::pop_record()
+{
+    records_head = (records_head + 1) % cfg.max_records;
+    records_count--;
+    tail = (records_count > 0) ? records[records_head].pos : head;
+}
+
+void SDBlackBox::writer_task_trampoline(void* arg)
+{
+    static_cast<SDBlackBox*>(arg)->writer_task();
+}
+
+void SDBlackBox::writer_task()
+{
+    while (!task_stop)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        if (task_stop)
+            break;
+
+        if (state == STATE_STREAMING)
+            dump();
+    }
+
+    xSemaphoreGive(task_done);
+    vTaskDelete(nullptr);
+}
+
+void SDBlackBox::dump()
+{
+    uint64_t pos = 0;
+    uint64_t history_end = 0;
+    uint64_t limit = 0;
+    uint64_t end = UINT64_MAX; // head once the post-trigger window closed, the last byte streamed
+    size_t length = 0;
+    size_t offset = 0;
+    size_t first = 0;
+    int64_t now_us = 0;
+    int64_t wait_us = 0;
+    bool history_written = false;
+
+    taskENTER_CRITICAL(&lock);
+    history_end = head;
+    stats.dumps++;
+    taskEXIT_CRITICAL(&lock);
+
+    while (!task_stop)
+    {
+        now_us = esp_timer_get_time();
+
+        taskENTER_CRITICAL(&lock);
+
+        // a trigger extending the window reopens it until the new deadline
+        if (end == UINT64_MAX && now_us >= deadline_us)
+            end = head;
+        else if (end != UINT64_MAX && now_us < deadline_us)
+            end = UINT64_MAX;
+
+        // records after the window stay in the ring as history for the next trigger
+        if (tail >= end)
+        {
+            state = STATE_RECORDING;
+            taskEXIT_CRITICAL(&lock);
+            break;
+        }
+
+        pos = tail;
+        limit = std::min(head, end);
+        wait_us = deadline_us - now_us;
+
+        taskEXIT_CRITICAL(&lock);
+
+        // the ring only grows while streaming, bytes between pos and limit stay put without holding the lock
+        length = static_cast<size_t>(std::min<uint64_t>(limit - pos, cfg.dump_chunk_sz));
+
+        if (length == 0)
+        {
+            ulTaskNotifyTake(pdTRUE, (wait_us > 0) ? pdMS_TO_TICKS(wait_us / 1000LL) + 1 : 1);
+            continue;
+        }
+
+        offset = pos % cfg.ring_sz;
+        first = std::min(length, cfg.ring_sz - offset);
+
+        memcpy(chunk, ring + offset, first);
+        memcpy(chunk + first, ring, length - first);
+
+        if (!logger.write_block(file, chunk, length))
+        {
+            taskENTER_CRITICAL(&lock);
+            stats.write_failures++;
+            taskEXIT_CRITICAL(&lock);
+        }
+
+        taskENTER_CRITICAL(&lock);
+
+        tail = pos + length;
+        stats.dumped_bytes += length;
+
+        while (records_count > 0 && records[records_head].pos < tail)
+        {
+            records_head = (records_head + 1) % cfg.max_records;
+            records_count--;
+        }
+
+        if (!history_written && tail >= history_end)
+        {
+            history_written = true;
+            stats.last_dump_us = static_cast<uint32_t>(esp_timer_get_time() - trigger_us);
+            stats.max_dump_us = std::max(stats.max_dump_us, stats.last_dump_us);
+        }
+
+        taskEXIT_CRITICAL(&lock);
+    }
+}
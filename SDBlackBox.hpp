@@ -0,0 +1,118 @@
+#pragma once
+
+#include <memory>
+
+#include "SDLogger.hpp"
+
+typedef struct sd_blackbox_config_t
+{
+        size_t ring_sz;           // bytes of history kept in RAM before a trigger
+        size_t max_records;       // record boundaries tracked, the oldest record is evicted once either limit is hit
+        uint32_t pre_trigger_ms;  // history older than this at the trigger is not written, 0 writes the whole ring
+        uint32_t post_trigger_ms; // records written after a trigger keep streaming to the card this long
+        size_t dump_chunk_sz;     // DMA capable buffer, bytes per write_block() during a dump
+        bool use_psram;           // place the ring in PSRAM, the dump buffer stays in internal RAM
+        UBaseType_t task_priority;
+        uint32_t task_stack_sz;
+
+        sd_blackbox_config_t()
+            : ring_sz(64UL * 1024UL)
+            , max_records(1024)
+            , pre_trigger_ms(0)
+            , post_trigger_ms(1000)
+            , dump_chunk_sz(16UL * 1024UL)
+            , use_psram(false)
+            , task_priority(5)
+            , task_stack_sz(3072)
+        {
+        }
+} sd_blackbox_config_t;
+
+typedef struct sd_blackbox_stats_t
+{
+        uint32_t records;         // records accepted into the ring
+        uint64_t bytes;
+        uint32_t evicted_records; // overwritten before any trigger wanted them
+        uint32_t dropped_records; // ring full while streaming, the card did not keep up
+        uint32_t triggers;
+        uint32_t dumps;           // trigger windows written, triggers during a window extend it
+        uint64_t dumped_bytes;
+        uint32_t write_failures;  // write_block() calls that failed, their bytes are lost
+        uint32_t last_dump_us;    // trigger to the pre-trigger history being on the card
+        uint32_t max_dump_us;
+
+        sd_blackbox_stats_t()
+            : records(0)
+            , bytes(0)
+            , evicted_records(0)
+            , dropped_records(0)
+            , triggers(0)
+            , dumps(0)
+            , dumped_bytes(0)
+            , write_failures(0)
+            , last_dump_us(0)
+            , max_dump_us(0)
+        {
+        }
+} sd_blackbox_stats_t;
+
+/**
+ * Pre-trigger recorder in front of an SDFile. write() copies records into a RAM ring that keeps overwriting its oldest
+ * records, nothing reaches the card. trigger() hands the ring to a writer task that dumps the history in dump_chunk_sz
+ * blocks through write_block(), then keeps streaming records written during the next post_trigger_ms the same way. While
+ * streaming the ring is a FIFO: records that do not fit are dropped instead of overwriting data not yet on the card.
+ */
+class SDBlackBox
+{
+    public:
+        SDBlackBox(SDLogger& logger, SDFile file, const sd_blackbox_config_t& cfg = sd_blackbox_config_t());
+        ~SDBlackBox();
+
+        bool begin();
+        sd_write_status_t write(const void* data, size_t length);
+        bool trigger();
+        bool is_streaming();
+        bool get_stats(sd_blackbox_stats_t& stats);
+
+        static const constexpr size_t MAX_RECORD_SZ = 1024; // copied inside a critical section
+
+    private:
+        typedef enum state_t
+        {
+            STATE_RECORDING, // ring overwrites its oldest records
+            STATE_STREAMING  // ring is drained to the card, full means drop
+        } state_t;
+
+        // positions count every byte ever written, the ring offset is position % ring_sz
+        typedef struct record_t
+        {
+                uint64_t pos;
+                int64_t time_us;
+        } record_t;
+
+        static void writer_task_trampoline(void* arg);
+        void writer_task();
+        void dump();
+        void pop_record();
+
+        SDLogger& logger;
+        SDFile file;
+        sd_blackbox_config_t cfg;
+        uint8_t* ring;
+        uint8_t* chunk;
+        std::unique_ptr<record_t[]> records; // start of each record in the ring, oldest first
+        size_t records_head;
+        size_t records_count;
+        portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED; // guards positions, records, state and stats
+        uint64_t head;
+        uint64_t tail;
+        state_t state;
+        int64_t trigger_us;
+        int64_t deadline_us;
+        TaskHandle_t task_hdl;
+        volatile bool task_stop;
+        SemaphoreHandle_t task_done;
+        sd_blackbox_stats_t stats;
+
+        static const constexpr char* TAG = "SDBlackBox";
+};
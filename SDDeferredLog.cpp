@@ -0,0 +1,263 @@
+#include "SDDeferredLog.hpp"
+
+#ifdef ESP_PLATFORM
+#include <time.h>
+#include <vector>
+#endif
+
+// CRC-8/SMBUS, polynomial 0x07
+static const uint8_t CRC8_TABLE[256] = {
+    0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15, 0x38, 0x3F, 0x36, 0x31, 0x24, 0x23, 0x2A, 0x2D,
+    0x70, 0x77, 0x7E, 0x79, 0x6C, 0x6B, 0x62, 0x65, 0x48, 0x4F, 0x46, 0x41, 0x54, 0x53, 0x5A, 0x5D,
+    0xE0, 0xE7, 0xEE, 0xE9, 0xFC, 0xFB, 0xF2, 0xF5, 0xD8, 0xDF, 0xD6, 0xD1, 0xC4, 0xC3, 0xCA, 0xCD,
+    0x90, 0x97, 0x9E, 0x99, 0x8C, 0x8B, 0x82, 0x85, 0xA8, 0xAF, 0xA6, 0xA1, 0xB4, 0xB3, 0xBA, 0xBD,
+    0xC7, 0xC0, 0xC9, 0xCE, 0xDB, 0xDC, 0xD5, 0xD2, 0xFF, 0xF8, 0xF1, 0xF6, 0xE3, 0xE4, 0xED, 0xEA,
+    0xB7, 0xB0, 0xB9, 0xBE, 0xAB, 0xAC, 0xA5, 0xA2, 0x8F, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9D, 0x9A,
+    0x27, 0x20, 0x29, 0x2E, 0x3B, 0x3C, 0x35, 0x32, 0x1F, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0D, 0x0A,
+    0x57, 0x50, 0x59, 0x5E, 0x4B, 0x4C, 0x45, 0x42, 0x6F, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7D, 0x7A,
+    0x89, 0x8E, 0x87, 0x80, 0x95, 0x92, 0x9B, 0x9C, 0xB1, 0xB6, 0xBF, 0xB8, 0xAD, 0xAA, 0xA3, 0xA4,
+    0xF9, 0xFE, 0xF7, 0xF0, 0xE5, 0xE2, 0xEB, 0xEC, 0xC1, 0xC6, 0xCF, 0xC8, 0xDD, 0xDA, 0xD3, 0xD4,
+    0x69, 0x6E, 0x67, 0x60, 0x75, 0x72, 0x7B, 0x7C, 0x51, 0x56, 0x5F, 0x58, 0x4D, 0x4A, 0x43, 0x44,
+    0x19, 0x1E, 0x17, 0x10, 0x05, 0x02, 0x0B, 0x0C, 0x21, 0x26, 0x2F, 0x28, 0x3D, 0x3A, 0x33, 0x34,
+    0x4E, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5C, 0x5B, 0x76, 0x71, 0x78, 0x7F, 0x6A, 0x6D, 0x64, 0x63,
+    0x3E, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2C, 0x2B, 0x06, 0x01, 0x08, 0x0F, 0x1A, 0x1D, 0x14, 0x13,
+    0xAE, 0xA9, 0xA0, 0xA7, 0xB2, 0xB5, 0xBC, 0xBB, 0x96, 0x91, 0x98, 0x9F, 0x8A, 0x8D, 0x84, 0x83,
+    0xDE, 0xD9, 0xD0, 0xD7, 0xC2, 0xC5, 0xCC, 0xCB, 0xE6, 0xE1, 0xE8, 0xEF, 0xFA, 0xFD, 0xF4, 0xF3,
+};
+
+uint8_t SDDeferredLog::crc8(const uint8_t* data, size_t length, uint8_t crc)
+{
+    for (size_t i = 0; i < length; i++)
+        crc = CRC8_TABLE[crc ^ data[i]];
+
+    return crc;
+}
+
+size_t SDDeferredLog::put_varint(uint8_t* out, uint64_t value)
+{
+    size_t length = 0;
+
+    while (value >= 0x80)
+    {
+        out[length++] = static_cast<uint8_t>(value | 0x80);
+        value >>= 7;
+    }
+
+    out[length++] = static_cast<uint8_t>(value);
+
+    return length;
+}
+
+bool SDDeferredLog::get_varint(const uint8_t*& in, const uint8_t* end, uint64_t& value)
+{
+    value = 0;
+
+    for (int shift = 0; shift < 64 && in < end; shift += 7)
+    {
+        const uint8_t byte = *in++;
+
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+size_t SDDeferredLog::put_frame_header(uint8_t* out, sd_deferred_frame_t type, size_t payload_length)
+{
+    out[0] = FRAME_SYNC;
+    out[1] = static_cast<uint8_t>(type);
+    out[2] = static_cast<uint8_t>(payload_length);
+    out[3] = static_cast<uint8_t>(payload_length >> 8);
+
+    return FRAME_HEADER_SZ;
+}
+
+void SDDeferredLog::put_frame_crc(uint8_t* frame, size_t payload_length)
+{
+    frame[FRAME_HEADER_SZ + payload_length] = crc8(frame + 1, FRAME_HEADER_SZ - 1 + payload_length);
+}
+
+#ifdef ESP_PLATFORM
+SDDeferredLog::SDDeferredLog(SDLogger& logger)
+    : logger(logger)
+    , mutex(xSemaphoreCreateMutex())
+{
+}
+
+SDDeferredLog::~SDDeferredLog()
+{
+    vSemaphoreDelete(mutex);
+}
+
+bool SDDeferredLog::restart(SDFile file)
+{
+    const constexpr char* SUB_TAG = "SDDeferredLog->restart()";
+
+    if (!file)
+    {
+        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
+        return false;
+    }
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    files.erase(file.get());
+    xSemaphoreGive(mutex);
+
+    return true;
+}
+
+SDDeferredLog::file_state_t& SDDeferredLog::get_state(SDFile file)
+{
+    file_state_t& state = files[file.get()];
+
+    // a File freed and reallocated at the same address is a different file
+    if (state.owner.lock() != file)
+    {
+        state = file_state_t();
+        state.owner = file;
+        state.header_written = false;
+    }
+
+    return state;
+}
+
+sd_write_status_t SDDeferredLog::write_record(
+        SDFile file, uint32_t id, const char* fmt, const char* signature, uint8_t* frame, size_t args_length, int64_t now_us)
+{
+    uint8_t prefix[15];
+    size_t prefix_length = 0;
+    size_t payload_length = 0;
+    uint8_t* start = nullptr;
+    sd_write_status_t status = SD_WRITE_OK;
+
+    if (!file)
+    {
+        ESP_LOGE(TAG, "SDDeferredLog->log(): File not correctly initialized.");
+        return SD_WRITE_ERROR;
+    }
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+    file_state_t& state = get_state(file);
+
+    if (!state.header_written)
+        status = write_header(file, state, now_us);
+
+    auto idx = state.strings.find(id);
+
+    // another format string hashed to the same id, the next free (or matching) id is used instead; records only refer to
+    // the session index, the id in the definition is informational
+    while (idx != state.strings.end() && state.formats[id] != fmt && strcmp(state.formats[id], fmt) != 0)
+        idx = state.strings.find(++id);
+
+    if (SDLogger::status_ok(status) && idx == state.strings.end())
+    {
+        status = write_string(file, state, id, fmt, signature);
+        idx = state.strings.find(id);
+    }
+
+    // without its header or definition the record could not be decoded
+    if (idx == state.strings.end() || !SDLogger::status_ok(status))
+    {
+        xSemaphoreGive(mutex);
+        return status;
+    }
+
+    // timestamps are relative to the session header rather than the previous record, dropped records never skew them
+    prefix_length = put_varint(prefix, idx->second);
+    prefix_length += put_varint(prefix + prefix_length, static_cast<uint64_t>(now_us - state.base_us));
+
+    payload_length = prefix_length + args_length;
+    start = frame + ARGS_OFFSET - prefix_length - FRAME_HEADER_SZ;
+
+    put_frame_header(start, SD_FRAME_RECORD, payload_length);
+    memcpy(start + FRAME_HEADER_SZ, prefix, prefix_length);
+    put_frame_crc(start, payload_length);
+
+    status = logger.try_write(file, start, FRAME_OVERHEAD + payload_length);
+
+    xSemaphoreGive(mutex);
+
+    return status;
+}
+
+sd_write_status_t SDDeferredLog::write_header(SDFile file, file_state_t& state, int64_t now_us)
+{
+    uint8_t frame[FRAME_OVERHEAD + 21];
+    uint8_t* payload = frame + FRAME_HEADER_SZ;
+    const uint64_t uptime_us = static_cast<uint64_t>(now_us);
+    const uint64_t unix_s = static_cast<uint64_t>(time(nullptr));
+    sd_write_status_t status = SD_WRITE_OK;
+
+    put_frame_header(frame, SD_FRAME_HEADER, 21);
+
+    for (int i = 0; i < 4; i++)
+        payload[i] = static_cast<uint8_t>(FILE_MAGIC >> (8 * i));
+
+    payload[4] = VERSION;
+
+    for (int i = 0; i < 8; i++)
+    {
+        payload[5 + i] = static_cast<uint8_t>(uptime_us >> (8 * i));
+        payload[13 + i] = static_cast<uint8_t>(unix_s >> (8 * i));
+    }
+
+    put_frame_crc(frame, 21);
+
+    // same lane as the records, the queue keeps them in order without forcing a sync
+    status = logger.try_write(file, frame, sizeof(frame));
+
+    if (SDLogger::status_ok(status))
+    {
+        state.strings.clear();
+        state.formats.clear();
+        state.base_us = now_us;
+        state.header_written = true;
+    }
+
+    return status;
+}
+
+sd_write_status_t SDDeferredLog::write_string(SDFile file, file_state_t& state, uint32_t id, const char* fmt, const char* signature)
+{
+    const size_t signature_length = strlen(signature) + 1;
+    const size_t fmt_length = strlen(fmt);
+    const uint32_t index = static_cast<uint32_t>(state.strings.size());
+    std::vector<uint8_t> frame(FRAME_OVERHEAD + 5 + 4 + signature_length + fmt_length);
+    size_t payload_length = 0;
+    uint8_t* payload = frame.data() + FRAME_HEADER_SZ;
+    sd_write_status_t status = SD_WRITE_OK;
+
+    if (5 + 4 + signature_length + fmt_length > UINT16_MAX)
+    {
+        ESP_LOGE(TAG, "SDDeferredLog->log(): Format string too long.");
+        return SD_WRITE_ERROR;
+    }
+
+    payload_length = put_varint(payload, index);
+
+    for (int i = 0; i < 4; i++)
+        payload[payload_length++] = static_cast<uint8_t>(id >> (8 * i));
+
+    memcpy(payload + payload_length, signature, signature_length);
+    payload_length += signature_length;
+    memcpy(payload + payload_length, fmt, fmt_length);
+    payload_length += fmt_length;
+
+    put_frame_header(frame.data(), SD_FRAME_STRING, payload_length);
+    put_frame_crc(frame.data(), payload_length);
+
+    status = logger.try_write(file, frame.data(), FRAME_OVERHEAD + payload_length);
+
+    if (SDLogger::status_ok(status))
+    {
+        state.strings[id] = index;
+        state.formats[id] = fmt;
+    }
+
+    return status;
+}
+#endif
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <type_traits>
+#include <unordered_map>
+#include <memory>
+
+#ifdef ESP_PLATFORM
+#include "SDLogger.hpp"
+#endif
+
+/**
+ * Frame layout shared by the on-target writer and the host tools in tools/:
+ *
+ *   [0xA5 sync][type][payload length, u16 LE][payload][crc8 over type, length and payload]
+ *
+ * SD_FRAME_HEADER  starts a session: magic u32, version u8, uptime u64 (us), unix time u64 (s), all LE
+ * SD_FRAME_STRING  defines a format string: index varint, id u32 LE, argument signature (NUL terminated), format text
+ * SD_FRAME_RECORD  one log call: index varint, us since the session header varint, arguments as given by the signature
+ *
+ * Signature codes: 'i' signed integer (zigzag varint), 'u' unsigned integer (varint), 'f' float (4 bytes LE),
+ * 'd' double (8 bytes LE), 's' string (varint length + bytes), 'p' pointer (varint).
+ */
+typedef enum sd_deferred_frame_t
+{
+    SD_FRAME_HEADER = 0x01,
+    SD_FRAME_STRING = 0x02,
+    SD_FRAME_RECORD = 0x03
+} sd_deferred_frame_t;
+
+/**
+ * Deferred formatting: a log call stores a per-file format string index, a timestamp and the raw argument bytes instead of
+ * snprintf() output. Each format string is written to the file once, the first time it is used in a session, and
+ * tools/sdlog_render turns the file back into text. Use through SD_LOG_DEFERRED() so the format string id is computed at
+ * compile time.
+ *
+ * Session headers and definitions go through the file's own lane ahead of its records, so a new format string costs no
+ * extra sync. Under SD_OVERFLOW_DROP_OLDEST an evicted definition leaves that format's records of the session
+ * undecodable, restart() begins a new session.
+ */
+class SDDeferredLog
+{
+    public:
+        static const constexpr uint8_t FRAME_SYNC = 0xA5;
+        static const constexpr size_t FRAME_HEADER_SZ = 4; // sync, type, u16 length
+        static const constexpr size_t FRAME_OVERHEAD = FRAME_HEADER_SZ + 1;
+        static const constexpr uint32_t FILE_MAGIC = 0x444C4453UL; // "SDLD"
+        static const constexpr uint8_t VERSION = 1;
+        static const constexpr size_t MAX_ARGS_SZ = 192; // encoded argument bytes per record, strings are truncated to fit
+
+        // FNV-1a, evaluated by the compiler for string literals
+        static constexpr uint32_t hash(const char* str)
+        {
+            uint32_t h = 2166136261UL;
+
+            while (*str != 0)
+                h = (h ^ static_cast<uint8_t>(*str++)) * 16777619UL;
+
+            return h;
+        }
+
+        template <typename T>
+        static constexpr char arg_code()
+        {
+            using U = typename std::decay<T>::type;
+
+            if constexpr (std::is_same<U, const char*>::value || std::is_same<U, char*>::value)
+                return 's';
+            else if constexpr (std::is_pointer<U>::value)
+                return 'p';
+            else if constexpr (std::is_same<U, float>::value)
+                return 'f';
+            else if constexpr (std::is_floating_point<U>::value)
+                return 'd';
+            else if constexpr (std::is_enum<U>::value)
+                return std::is_signed<typename std::underlying_type<U>::type>::value ? 'i' : 'u';
+            else
+            {
+                static_assert(std::is_integral<U>::value, "Unsupported deferred log argument type.");
+                return std::is_signed<U>::value ? 'i' : 'u';
+            }
+        }
+
+        static uint8_t crc8(const uint8_t* data, size_t length, uint8_t crc = 0);
+        static size_t put_varint(uint8_t* out, uint64_t value);
+        static bool get_varint(const uint8_t*& in, const uint8_t* end, uint64_t& value);
+        static size_t put_frame_header(uint8_t* out, sd_deferred_frame_t type, size_t payload_length);
+        static void put_frame_crc(uint8_t* frame, size_t payload_length);
+
+        template <typename T>
+        static size_t encode_arg(uint8_t* out, size_t space, const T& arg)
+        {
+            using U = typename std::decay<T>::type;
+            uint8_t scratch[10];
+            size_t length = 0;
+
+            if constexpr (arg_code<U>() == 's')
+            {
+                const char* str = (arg != nullptr) ? arg : "(null)";
+                size_t str_length = strlen(str);
+
+                if (space < 2)
+                    return 0;
+
+                // leave room for the length prefix, long strings are cut rather than dropping the record
+                if (str_length > space - put_varint(scratch, space))
+                    str_length = space - put_varint(scratch, space);
+
+                length = put_varint(out, str_length);
+                memcpy(out + length, str, str_length);
+
+                return length + str_length;
+            }
+            else if constexpr (arg_code<U>() == 'f' || arg_code<U>() == 'd')
+            {
+                if (space < sizeof(U))
+                    return 0;
+
+                memcpy(out, &arg, sizeof(U)); // targets and hosts are little endian
+
+                return sizeof(U);
+            }
+            else
+            {
+                uint64_t value = 0;
+
+                if constexpr (arg_code<U>() == 'p')
+                    value = reinterpret_cast<uintptr_t>(arg);
+                else if constexpr (arg_code<U>() == 'i')
+                    value = (static_cast<uint64_t>(static_cast<int64_t>(arg)) << 1) ^ static_cast<uint64_t>(static_cast<int64_t>(arg) >> 63);
+                else
+                    value = static_cast<uint64_t>(arg);
+
+                length = put_varint(scratch, value);
+                if (space < length)
+                    return 0;
+
+                memcpy(out, scratch, length);
+
+                return length;
+            }
+        }
+
+        template <typename T>
+        static bool append_arg(uint8_t* out, size_t space, size_t& used, const T& arg)
+        {
+            const size_t length = encode_arg(out + used, space - used, arg);
+
+            used += length;
+
+            return (length > 0);
+        }
+
+        // returns SIZE_MAX once an argument no longer fits
+        template <typename... Args>
+        static size_t encode_args([[maybe_unused]] uint8_t* out, [[maybe_unused]] size_t space, const Args&... args)
+        {
+            size_t used = 0;
+            bool fits = true;
+
+            ((fits = fits && append_arg(out, space, used, args)), ...);
+
+            return fits ? used : SIZE_MAX;
+        }
+
+#ifdef ESP_PLATFORM
+        SDDeferredLog(SDLogger& logger);
+        ~SDDeferredLog();
+
+        template <typename... Args>
+        sd_write_status_t log(SDFile file, uint32_t id, const char* fmt, const Args&... args)
+        {
+            static const char signature[] = {arg_code<Args>()..., 0};
+            const int64_t now_us = esp_timer_get_time();
+            uint8_t frame[RECORD_FRAME_SZ];
+            const size_t args_length = encode_args(frame + ARGS_OFFSET, MAX_ARGS_SZ, args...);
+
+            if (args_length == SIZE_MAX)
+            {
+                ESP_LOGE(TAG, "SDDeferredLog->log(): Arguments exceed %u bytes.", static_cast<unsigned>(MAX_ARGS_SZ));
+                return SD_WRITE_ERROR;
+            }
+
+            return write_record(file, id, fmt, signature, frame, args_length, now_us);
+        }
+
+        bool restart(SDFile file);
+
+    private:
+        static const constexpr size_t ARGS_OFFSET = FRAME_HEADER_SZ + 5 + 10; // room for the index and timestamp varints
+        static const constexpr size_t RECORD_FRAME_SZ = ARGS_OFFSET + MAX_ARGS_SZ + 1;
+
+        // per file session state, reset when a new session header is due
+        typedef struct file_state_t
+        {
+                std::weak_ptr<SDLogger::File> owner;
+                std::unordered_map<uint32_t, uint32_t> strings; // format string id -> index within the session
+                std::unordered_map<uint32_t, const char*> formats;
+                int64_t base_us;
+                bool header_written;
+        } file_state_t;
+
+        sd_write_status_t write_record(
+                SDFile file, uint32_t id, const char* fmt, const char* signature, uint8_t* frame, size_t args_length, int64_t now_us);
+        sd_write_status_t write_header(SDFile file, file_state_t& state, int64_t now_us);
+        sd_write_status_t write_string(SDFile file, file_state_t& state, uint32_t id, const char* fmt, const char* signature);
+        file_state_t& get_state(SDFile file);
+
+        SDLogger& logger;
+        SemaphoreHandle_t mutex; // keeps a file's header, definitions and records in submission order
+        std::unordered_map<const SDLogger::File*, file_state_t> files;
+
+        static const constexpr char* TAG = "SDDeferredLog";
+#endif
+};
+
+#ifdef ESP_PLATFORM
+// format must be a string literal, its id is computed at compile time
+#define SD_LOG_DEFERRED(deferred, file, format, ...)                                                                         \
+    (deferred).log((file), std::integral_constant<uint32_t, SDDeferredLog::hash(format)>::value, (format), ##__VA_ARGS__)
+#endif
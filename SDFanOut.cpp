@@ -0,0 +1,175 @@
+#include "SDFanOut.hpp"
+
+SDFanOut::SDFanOut(SDLogger& logger)
+    : logger(logger)
+    , pending_sz(0)
+{
+}
+
+bool SDFanOut::add_target(SDFile file, sd_priority_t priority)
+{
+    return add_target(logger, file, priority);
+}
+
+bool SDFanOut::add_target(SDLogger& logger, SDFile file, sd_priority_t priority)
+{
+    const constexpr char* SUB_TAG = "SDFanOut->add_target()";
+
+    if (!file || priority >= SD_PRIORITY_MAX)
+    {
+        ESP_LOGE(TAG, "%s: Invalid file or priority.", SUB_TAG);
+        return false;
+    }
+
+    if (targets.size() >= MAX_TARGETS)
+    {
+        ESP_LOGE(TAG, "%s: Max targets already added.", SUB_TAG);
+        return false;
+    }
+
+    for (target_t& target : targets)
+        if (target.file == file)
+        {
+            ESP_LOGE(TAG, "%s: %s is already a target.", SUB_TAG, file->get_path());
+            return false;
+        }
+
+    targets.push_back({&logger, file, priority});
+
+    return true;
+}
+
+sd_write_status_t SDFanOut::write(const void* data, size_t length)
+{
+    const constexpr char* SUB_TAG = "SDFanOut->write()";
+    SDBuffer buffer;
+
+    if (data == nullptr || length == 0)
+    {
+        ESP_LOGE(TAG, "%s: Invalid record.", SUB_TAG);
+        return SD_WRITE_ERROR;
+    }
+
+    buffer = alloc_buffer(length);
+    if (!buffer)
+    {
+        ESP_LOGE(TAG, "%s: No heap memory available for a %u byte record.", SUB_TAG, static_cast<unsigned>(length));
+
+        taskENTER_CRITICAL(&lock);
+        stats.alloc_failures++;
+        taskEXIT_CRITICAL(&lock);
+
+        return SD_WRITE_ERROR;
+    }
+
+    // the only copy of the record, every target queues a reference to it
+    memcpy(const_cast<char*>(buffer.get()), data, length);
+
+    return fan_out(buffer, length);
+}
+
+char* SDFanOut::acquire(size_t max_length)
+{
+    const constexpr char* SUB_TAG = "SDFanOut->acquire()";
+
+    if (max_length == 0)
+    {
+        ESP_LOGE(TAG, "%s: Invalid length.", SUB_TAG);
+        return nullptr;
+    }
+
+    // a buffer acquired but never committed is dropped here
+    pending = alloc_buffer(max_length);
+    pending_sz = pending ? max_length : 0;
+
+    if (!pending)
+    {
+        ESP_LOGE(TAG, "%s: No heap memory available for a %u byte record.", SUB_TAG, static_cast<unsigned>(max_length));
+
+        taskENTER_CRITICAL(&lock);
+        stats.alloc_failures++;
+        taskEXIT_CRITICAL(&lock);
+
+        return nullptr;
+    }
+
+    return const_cast<char*>(pending.get());
+}
+
+sd_write_status_t SDFanOut::commit(size_t length)
+{
+    const constexpr char* SUB_TAG = "SDFanOut->commit()";
+    SDBuffer buffer;
+
+    if (!pending || length == 0 || length > pending_sz)
+    {
+        ESP_LOGE(TAG, "%s: Nothing acquired or invalid length.", SUB_TAG);
+        return SD_WRITE_ERROR;
+    }
+
+    // the group gives up its reference, the targets' queued records own the buffer from here on
+    buffer.swap(pending);
+    pending_sz = 0;
+
+    return fan_out(buffer, length);
+}
+
+bool SDFanOut::get_stats(sd_fan_out_stats_t& stats)
+{
+    taskENTER_CRITICAL(&lock);
+    stats = this->stats;
+    taskEXIT_CRITICAL(&lock);
+
+    return true;
+}
+
+sd_write_status_t SDFanOut::fan_out(const SDBuffer& buffer, size_t length)
+{
+    const constexpr char* SUB_TAG = "SDFanOut->fan_out()";
+    sd_write_status_t status = SD_WRITE_QUEUED;
+    sd_write_status_t target_status = SD_WRITE_QUEUED;
+    size_t accepted = 0;
+
+    if (targets.empty())
+    {
+        ESP_LOGE(TAG, "%s: No targets added.", SUB_TAG);
+        return SD_WRITE_ERROR;
+    }
+
+    for (size_t i = 0; i < targets.size(); i++)
+    {
+        target_status = targets[i].logger->try_write(targets[i].file, buffer, length, targets[i].priority);
+
+        if (SDLogger::status_ok(target_status))
+            accepted++;
+
+        // the first target that did not take the record decides the status, an eviction is reported otherwise
+        if (i == 0 || (SDLogger::status_ok(status) &&
+                (!SDLogger::status_ok(target_status) || target_status == SD_WRITE_QUEUED_EVICTED)))
+            status = target_status;
+    }
+
+    taskENTER_CRITICAL(&lock);
+
+    stats.writes++;
+    stats.bytes += length;
+
+    if (accepted == 0)
+        stats.failed_writes++;
+    else if (accepted < targets.size())
+        stats.partial_writes++;
+
+    taskEXIT_CRITICAL(&lock);
+
+    return status;
+}
+
+SDBuffer SDFanOut::alloc_buffer(size_t length)
+{
+    char* data = new char[length];
+
+    if (data == nullptr)
+        return SDBuffer();
+
+    return SDBuffer(data, std::default_delete<char[]>());
+}
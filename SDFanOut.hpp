@@ -0,0 +1,68 @@
+#pragma once
+
+#include <vector>
+
+#include "SDLogger.hpp"
+
+typedef struct sd_fan_out_stats_t
+{
+        uint32_t writes;          // records handed to the group
+        uint64_t bytes;           // record bytes, counted once however many targets there are
+        uint32_t partial_writes;  // records some targets did not accept, see their sd_file_stats_t
+        uint32_t failed_writes;   // records no target accepted
+        uint32_t alloc_failures;  // records lost because no shared buffer could be allocated
+
+        sd_fan_out_stats_t()
+            : writes(0)
+            , bytes(0)
+            , partial_writes(0)
+            , failed_writes(0)
+            , alloc_failures(0)
+        {
+        }
+} sd_fan_out_stats_t;
+
+/**
+ * Writes one record to several files, ie. a per channel file and a combined session file, or the same file mirrored on
+ * a second card. The record is copied once into a reference counted immutable buffer and every target queues a
+ * reference to it through try_write(). The buffer is freed once the last target wrote and synced it.
+ *
+ * Each target keeps its own flush and sync policy: its priority picks the lane (bulk is batched, critical is synced right
+ * away) and its file's write cache, alignment and overflow policy apply as usual. Targets on a logger without a running
+ * io task are written from the caller's context. acquire() and commit() let the record be formatted straight into the
+ * shared buffer, the pair is not thread safe, write() is.
+ */
+class SDFanOut
+{
+    public:
+        SDFanOut(SDLogger& logger);
+
+        bool add_target(SDFile file, sd_priority_t priority = SD_PRIORITY_BULK);
+        bool add_target(SDLogger& logger, SDFile file, sd_priority_t priority = SD_PRIORITY_BULK);
+        sd_write_status_t write(const void* data, size_t length);
+        char* acquire(size_t max_length);
+        sd_write_status_t commit(size_t length);
+        bool get_stats(sd_fan_out_stats_t& stats);
+
+        static const constexpr size_t MAX_TARGETS = 8;
+
+    private:
+        typedef struct target_t
+        {
+                SDLogger* logger;
+                SDFile file;
+                sd_priority_t priority;
+        } target_t;
+
+        sd_write_status_t fan_out(const SDBuffer& buffer, size_t length);
+        static SDBuffer alloc_buffer(size_t length);
+
+        SDLogger& logger;
+        std::vector<target_t> targets;
+        SDBuffer pending; // handed out by acquire(), queued by commit()
+        size_t pending_sz;
+        portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED; // guards stats
+        sd_fan_out_stats_t stats;
+
+        static const constexpr char* TAG = "SDFanOut";
+};
@@ -1,30 +1,115 @@
 #include "SDLogger.hpp"
 
+SDLogger::partition_view_t SDLogger::partition_views[FF_VOLUMES] = {};
+SDLogger::meta_cache_t SDLogger::meta_caches[FF_VOLUMES] = {};
+
+uint8_t SDLogger::bus_users[SPI_HOST_MAX] = {};
+bool SDLogger::bus_owned[SPI_HOST_MAX] = {};
+
 SDLogger::SDLogger(sd_logger_config_t cfg)
     : initialized(false)
     , mounted(false)
     , cfg(cfg)
+    , spi_host(static_cast<spi_host_device_t>(cfg.sdmmc_host.slot))
+    , card_handle(-1)
     , pdrv(FF_DRV_NOT_USED)
+    , file_tick(0)
+    , pool_refill_due(false)
+    , pool_retry_us(0)
+    , io_mutex(xSemaphoreCreateRecursiveMutex())
+    , queue_mutex(xSemaphoreCreateRecursiveMutex())
+    , io_task_done(xSemaphoreCreateBinary())
+    , io_task_hdl(nullptr)
+    , io_task_stop(false)
+    , queued_bytes{0, 0}
+    , queue_space(xSemaphoreCreateCounting(UINT8_MAX, 0))
+    , queue_space_waiters(0)
+    , force_drain(false)
+    , next_seq(0)
+    , budget_tokens(0)
+    , budget_refill_us(0)
+    , budget_wait_since_us(0)
+    , emergency(false)
+    , repair_buf(nullptr)
+    , repair_lba(0)
+    , repair_sectors(0)
+    , last_violation_log_us(0)
+    , card_present(true)
+    , card_detect_pending(false)
+    , card_detect_installed(false)
+    , card_retry(false)
+    , trace()
 {
+    const constexpr char* SUB_TAG = "SD->SDLogger()";
+    esp_err_t err = ESP_OK;
+
     spi_bus_config_t spi_bus_cfg = {.mosi_io_num = cfg.io_mosi,
             .miso_io_num = cfg.io_miso,
             .sclk_io_num = cfg.io_sclk,
             .quadwp_io_num = -1,
             .quadhd_io_num = -1,
-            .max_transfer_sz = 4000};
+            .max_transfer_sz = static_cast<int>(cfg.spi_max_transfer_sz)};
 
-    cfg.sdmmc_host.max_freq_khz = cfg.sclk_speed_hz / 100000UL;
+    // the parameter shadows the member, the host config init() uses is the member copy
+    this->cfg.sdmmc_host.max_freq_khz = cfg.sclk_speed_hz / 1000UL;
+
+    // a bus that is already initialized (second card, flash chip, etc.) is attached to instead of aborting
+    if (cfg.init_spi_bus && !bus_owned[spi_host])
+    {
+        err = spi_bus_initialize(spi_host, &spi_bus_cfg, SDSPI_DEFAULT_DMA);
+
+        if (err == ESP_OK)
+            bus_owned[spi_host] = true;
+        else if (err == ESP_ERR_INVALID_STATE)
+            ESP_LOGI(TAG, "%s: SPI host %d already initialized, attaching to existing bus.", SUB_TAG, spi_host);
+        else
+            ESP_LOGE(TAG, "%s: spi_bus_initialize() call failed (0x%x)", SUB_TAG, err);
+    }
 
-    ESP_ERROR_CHECK(spi_bus_initialize(static_cast<spi_host_device_t>(cfg.sdmmc_host.slot), &spi_bus_cfg, SDSPI_DEFAULT_DMA));
+    bus_users[spi_host]++;
 
     slot_cfg = SDSPI_DEVICE_CONFIG_DEFAULT();
     slot_cfg.gpio_cs = cfg.io_cs;
-    slot_cfg.host_id = static_cast<spi_host_device_t>(cfg.sdmmc_host.slot);
+    slot_cfg.host_id = spi_host;
+
+    latency_stats[SD_PRIORITY_BULK].target_ms = cfg.bulk_latency_ms;
+    latency_stats[SD_PRIORITY_CRITICAL].target_ms = cfg.critical_latency_ms;
+    queue_stats.capacity = cfg.queue_capacity;
+
+    // tracing runs from the first mount, set_tracing() pauses it
+    if (cfg.trace_events > 0 && trace_alloc(SUB_TAG))
+        trace.enabled = true;
 }
 
 SDLogger::~SDLogger()
 {
-    close_all_files();
+    if (io_task_hdl != nullptr)
+        stop_io_task();
+
+    if (mounted)
+        unmount();
+    else
+        close_all_files();
+
+    if (card_handle >= 0)
+        sdspi_host_remove_device(card_handle);
+
+    bus_users[spi_host]--;
+
+    // only free buses an SDLogger initialized, and only once the last instance on them is gone
+    if (bus_users[spi_host] == 0 && bus_owned[spi_host])
+    {
+        spi_bus_free(spi_host);
+        bus_owned[spi_host] = false;
+    }
+
+    vSemaphoreDelete(queue_space);
+    vSemaphoreDelete(io_task_done);
+    vSemaphoreDelete(queue_mutex);
+    vSemaphoreDelete(io_mutex);
+
+    if (trace.events != nullptr)
+        heap_caps_free(trace.events);
 }
 
 bool SDLogger::init()
@@ -44,16 +129,21 @@ bool SDLogger::init()
     err = sdspi_host_init_device(&slot_cfg, &card_hdl);
     if (err != ESP_OK)
     {
-        // de-initialize host
-        if (cfg.sdmmc_host.flags & SDMMC_HOST_FLAG_DEINIT_ARG)
-            (cfg.sdmmc_host.deinit_p)(cfg.sdmmc_host.slot);
-        else
-            (cfg.sdmmc_host.deinit)();
+        // de-initialize host, unless other instances still have devices attached to it
+        if (bus_users[spi_host] <= 1)
+        {
+            if (cfg.sdmmc_host.flags & SDMMC_HOST_FLAG_DEINIT_ARG)
+                (cfg.sdmmc_host.deinit_p)(cfg.sdmmc_host.slot);
+            else
+                (cfg.sdmmc_host.deinit)();
+        }
 
         ESP_LOGE(TAG, "%s: Slot init failed.", SUB_TAG);
         return initialized;
     }
 
+    card_handle = card_hdl;
+
     if (card_hdl != cfg.sdmmc_host.slot)
         cfg.sdmmc_host.slot = card_hdl;
 
@@ -76,6 +166,11 @@ bool SDLogger::init()
     }
 
     initialized = true;
+
+    // a failed tuning leaves the card at the configured clock
+    if (cfg.auto_tune && !tune_card(false, SUB_TAG))
+        ESP_LOGW(TAG, "%s: Auto tuning failed, running at %d kHz.", SUB_TAG, card.real_freq_khz);
+
     return initialized;
 }
 
@@ -83,6 +178,8 @@ bool SDLogger::mount(size_t unit_size, int max_open_files, const char* path)
 {
     const char* SUB_TAG = "SD->mount()";
 
+    ScopedLock lock(io_mutex);
+
     esp_err_t err = ESP_OK;
     FRESULT res = FR_OK;
 
@@ -98,7 +195,7 @@ bool SDLogger::mount(size_t unit_size, int max_open_files, const char* path)
         return false;
     }
 
-    if (open_files.size() > 0)
+    if (open_files.size() + parked_files.size() > 0)
         close_all_files();
 
     this->max_open_files = max_open_files;
@@ -122,23 +219,39 @@ bool SDLogger::mount(size_t unit_size, int max_open_files, const char* path)
         return false;
     }
 
+    meta_cache_attach(SUB_TAG); // failure leaves the volume on the plain sdmmc driver
+
     res = f_mount(fs, drv, 1);
     if (res != FR_OK)
     {
         print_fatfs_error(res, SUB_TAG, "f_mount()");
+        meta_cache_detach(SUB_TAG);
         return false;
     }
 
     mounted = true;
+    emergency = false;
 
     load_info(); // ignore return statement, info can fail to load but card can still be mounted and usable
 
+    // restores the sizes an emergency flush before the last power loss left behind, then reserves the journal again
+    if (cfg.repair_journal)
+        repair_journal_open(SUB_TAG);
+
+    // pools added before the mount are filled by the io task or fill_file_pools()
+    file_pool_forget();
+    if (io_task_hdl != nullptr && !file_pools.empty())
+        xTaskNotifyGive(io_task_hdl);
+
     return true;
 }
 
 bool SDLogger::unmount()
 {
     const char* SUB_TAG = "SD->unmount()";
+
+    ScopedLock lock(io_mutex);
+
     FRESULT res = FR_OK;
 
     if (!mounted)
@@ -147,9 +260,17 @@ bool SDLogger::unmount()
         return false;
     }
 
-    if (open_files.size() > 0)
+    if (delete_job)
+        delete_directory_cancel();
+
+    if (open_files.size() + parked_files.size() > 0)
         close_all_files();
 
+    file_pool_forget();
+    repair_journal_close();
+
+    meta_cache_detach(SUB_TAG); // write back FAT/directory sectors held in RAM
+
     res = f_mount(nullptr, drv, 0); // unregister file system object and unmount
 
     if (res != FR_OK)
@@ -171,14 +292,22 @@ bool SDLogger::is_mounted()
     return mounted;
 }
 
+bool SDLogger::is_card_present()
+{
+    return card_present;
+}
+
 bool SDLogger::is_initialized()
 {
     return initialized;
 }
 
-bool SDLogger::format(size_t unit_size)
+bool SDLogger::format(size_t unit_size, sd_format_mode_t mode)
 {
     const constexpr char* SUB_TAG = "SD->format()";
+
+    ScopedLock lock(io_mutex);
+
     FRESULT res = FR_OK;
     const constexpr size_t work_buff_sz = 4096;
     void* work_buff = nullptr;
@@ -197,6 +326,10 @@ bool SDLogger::format(size_t unit_size)
         return false;
     }
 
+    // cached FAT/directory sectors describe the volume about to be overwritten
+    meta_cache_discard();
+    file_pool_forget();
+
     work_buff = ff_memalloc(work_buff_sz);
     if (work_buff == nullptr)
     {
@@ -212,6 +345,19 @@ bool SDLogger::format(size_t unit_size)
             return false;
     }
 
+    if (mode == SD_FORMAT_AU_ALIGNED)
+    {
+        bool success = format_au_aligned(unit_size, work_buff, work_buff_sz, SUB_TAG);
+        free(work_buff);
+
+        if (mounted)
+            register_volume_driver();
+        else
+            ff_diskio_unregister(pdrv);
+
+        return success;
+    }
+
     // partition sd card
     LBA_t plist[] = {100, 0, 0, 0}; // format entire drive, see f_fdisk documentation on elm-chan.org
 
@@ -248,128 +394,1393 @@ bool SDLogger::format(size_t unit_size)
     return true;
 }
 
-bool SDLogger::get_info(sd_info_t& sd_info)
+bool SDLogger::format_au_aligned(size_t unit_size, void* work_buff, size_t work_buff_sz, const char* SUB_TAG)
 {
-    const constexpr char* SUB_TAG = "SD->get_info()";
+    static const ff_diskio_impl_t partition_view_impl = {.init = &partition_view_init,
+            .status = &partition_view_status,
+            .read = &partition_view_read,
+            .write = &partition_view_write,
+            .ioctl = &partition_view_ioctl};
+
+    const LBA_t total_sectors = static_cast<LBA_t>(card.csd.capacity);
+    const uint32_t au_sz = get_allocation_unit_size();
+    const LBA_t au_sectors = au_sz / card.csd.sector_size;
+    BYTE* sector = static_cast<BYTE*>(work_buff);
+    BYTE part_type = 0;
+    size_t alloc_unit_sz = 0;
+    esp_err_t err = ESP_OK;
+    FRESULT res = FR_OK;
 
-    if (!usability_check(SUB_TAG))
+    if (total_sectors < 2 * au_sectors)
+    {
+        ESP_LOGE(TAG, "%s: Card too small for an AU aligned layout.", SUB_TAG);
         return false;
+    }
 
-    if (!info.initialized)
+    // the first AU holds only the MBR, the partition covers every remaining whole AU
+    partition_views[pdrv].card = &card;
+    partition_views[pdrv].offset = au_sectors;
+    partition_views[pdrv].sector_count = ((total_sectors - au_sectors) / au_sectors) * au_sectors;
+    partition_views[pdrv].block_size = au_sectors;
+
+    // clusters must never straddle an AU, both sizes are powers of 2 so clamping is enough
+    alloc_unit_sz = esp_vfs_fat_get_allocation_unit_size(card.csd.sector_size, unit_size);
+    if (alloc_unit_sz > au_sz)
+        alloc_unit_sz = au_sz;
+
+    ESP_LOGI(TAG, "%s: AU: %lu KiB, partition: %lu sectors at LBA %lu, cluster: %u bytes.", SUB_TAG,
+            static_cast<unsigned long>(au_sz / 1024UL), static_cast<unsigned long>(partition_views[pdrv].sector_count),
+            static_cast<unsigned long>(au_sectors), static_cast<unsigned>(alloc_unit_sz));
+
+    // build the volume inside the partition, align is given in sectors and applies to the FAT and data region
+    ff_diskio_register(pdrv, &partition_view_impl);
+
+    const MKFS_PARM opt = {static_cast<BYTE>(FM_ANY | FM_SFD), 0, static_cast<UINT>(au_sectors), 0, static_cast<DWORD>(alloc_unit_sz)};
+    res = f_mkfs(drv, &opt, work_buff, work_buff_sz);
+    if (res != FR_OK)
     {
-        ESP_LOGE(TAG, "%s: Card info never loaded.", SUB_TAG);
+        print_fatfs_error(res, SUB_TAG, "f_mkfs()");
         return false;
     }
 
-    sd_info = info;
+    // read the new boot sector back to find the file system type f_mkfs() settled on
+    err = sdmmc_read_sectors(&card, sector, au_sectors, 1);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "%s: Boot sector read failed (0x%x).", SUB_TAG, err);
+        return false;
+    }
+
+    if (memcmp(sector + 3, "EXFAT   ", 8) == 0)
+    {
+        part_type = 0x07;
+    }
+    else
+    {
+        if (memcmp(sector + 82, "FAT32   ", 8) == 0)
+            part_type = 0x0C;
+        else if (memcmp(sector + 54, "FAT12   ", 8) == 0)
+            part_type = 0x01;
+        else
+            part_type = 0x0E;
+
+        // FAT boot sectors record the partition offset in BPB_HiddSec, f_mkfs() left it at 0 for a super floppy
+        sector[28] = static_cast<BYTE>(au_sectors);
+        sector[29] = static_cast<BYTE>(au_sectors >> 8);
+        sector[30] = static_cast<BYTE>(au_sectors >> 16);
+        sector[31] = static_cast<BYTE>(au_sectors >> 24);
+
+        err = sdmmc_write_sectors(&card, sector, au_sectors, 1);
+        if (err == ESP_OK && part_type == 0x0C)
+            err = sdmmc_write_sectors(&card, sector, au_sectors + 6, 1); // FAT32 backup boot sector
+
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "%s: Boot sector write failed (0x%x).", SUB_TAG, err);
+            return false;
+        }
+    }
+
+    // write an MBR with a single LBA addressed partition starting on the first AU boundary
+    memset(sector, 0, SD_SECTOR_SZ);
+
+    BYTE* entry = sector + 446;
+    entry[1] = 0xFE; // CHS start/end fields unused, mark as LBA only
+    entry[2] = 0xFF;
+    entry[3] = 0xFF;
+    entry[4] = part_type;
+    entry[5] = 0xFE;
+    entry[6] = 0xFF;
+    entry[7] = 0xFF;
+
+    for (int i = 0; i < 4; i++)
+    {
+        entry[8 + i] = static_cast<BYTE>(partition_views[pdrv].offset >> (8 * i));
+        entry[12 + i] = static_cast<BYTE>(partition_views[pdrv].sector_count >> (8 * i));
+    }
+
+    sector[510] = 0x55;
+    sector[511] = 0xAA;
+
+    err = sdmmc_write_sectors(&card, sector, 0, 1);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "%s: MBR write failed (0x%x).", SUB_TAG, err);
+        return false;
+    }
 
     return true;
 }
 
-void SDLogger::print_info()
+uint32_t SDLogger::get_allocation_unit_size()
 {
-    const constexpr char* SUB_TAG = "SD->print_info()";
+    if (!initialized)
+        return 0;
 
-    if (!usability_check(SUB_TAG))
-        return;
+    if (card.ssr.alloc_unit_kb > 0)
+        return card.ssr.alloc_unit_kb * 1024UL;
 
-    if (!info.initialized)
+    return DEFAULT_AU_SZ;
+}
+
+DSTATUS SDLogger::partition_view_init(BYTE pdrv)
+{
+    return partition_view_status(pdrv);
+}
+
+DSTATUS SDLogger::partition_view_status(BYTE pdrv)
+{
+    return (partition_views[pdrv].card != nullptr) ? 0 : STA_NOINIT;
+}
+
+DRESULT SDLogger::partition_view_read(BYTE pdrv, BYTE* buff, uint32_t sector, UINT count)
+{
+    partition_view_t& view = partition_views[pdrv];
+
+    if (sector + count > view.sector_count)
+        return RES_PARERR;
+
+    return (sdmmc_read_sectors(view.card, buff, view.offset + sector, count) == ESP_OK) ? RES_OK : RES_ERROR;
+}
+
+DRESULT SDLogger::partition_view_write(BYTE pdrv, const BYTE* buff, uint32_t sector, UINT count)
+{
+    partition_view_t& view = partition_views[pdrv];
+
+    if (sector + count > view.sector_count)
+        return RES_PARERR;
+
+    return (sdmmc_write_sectors(view.card, buff, view.offset + sector, count) == ESP_OK) ? RES_OK : RES_ERROR;
+}
+
+DRESULT SDLogger::partition_view_ioctl(BYTE pdrv, BYTE cmd, void* buff)
+{
+    partition_view_t& view = partition_views[pdrv];
+
+    switch (cmd)
     {
-        ESP_LOGE(TAG, "%s: Card info never loaded.", SUB_TAG);
-        return;
+    case CTRL_SYNC:
+        return RES_OK;
+    case GET_SECTOR_COUNT:
+        *static_cast<LBA_t*>(buff) = view.sector_count;
+        return RES_OK;
+    case GET_SECTOR_SIZE:
+        *static_cast<WORD*>(buff) = static_cast<WORD>(view.card->csd.sector_size);
+        return RES_OK;
+    case GET_BLOCK_SIZE:
+        *static_cast<DWORD*>(buff) = view.block_size;
+        return RES_OK;
+    default:
+        return RES_ERROR;
     }
+}
 
-    ESP_LOGI(TAG,
-            "\n ------ SD Info ------ \n"
-            "Name: %s \n"
-            "Type: %s \n"
-            "Speed (MHz): %.2f \n"
-            "Size (MB): %lu \n"
-            "SSR->Bus Width: %d \n"
-            "CSD->Version: %d \n"
-            "CSD->Sector Size: %d \n"
-            "CSD->Capacity (bytes): %llu \n"
-            "CSD->Read Block Length: %d \n"
-            "-------------------- \n",
-            info.name, info.type, info.speed_mhz, info.size_mb, info.ssr_bus_width, info.csd.ver, info.csd.sector_sz, info.csd.capacity,
-            info.csd.read_bl_len);
+bool SDLogger::meta_cache_attach(const char* SUB_TAG)
+{
+    meta_cache_t& cache = meta_caches[pdrv];
+    const sd_erase_stats_t erase_stats = cache.erase_stats;
+    bool success = true;
+
+    // the driver also queues clusters freed by FatFs for erase and traces card commands, it is installed for any of them
+    if (cfg.meta_cache_sectors == 0 && cfg.erase_chunk_sectors == 0 && cfg.trace_events == 0)
+        return true;
+
+    if (cfg.meta_cache_sectors > 0)
+    {
+        cache.slots = static_cast<meta_cache_slot_t*>(calloc(cfg.meta_cache_sectors, sizeof(meta_cache_slot_t)));
+        cache.sectors = static_cast<BYTE*>(heap_caps_malloc(cfg.meta_cache_sectors * SD_SECTOR_SZ, MALLOC_CAP_DMA));
+
+        if (cache.slots == nullptr || cache.sectors == nullptr)
+        {
+            ESP_LOGW(TAG, "%s: Failed to allocate %u sector metadata cache, mounting uncached.", SUB_TAG,
+                    static_cast<unsigned>(cfg.meta_cache_sectors));
+            free(cache.slots);
+            heap_caps_free(cache.sectors);
+            cache = meta_cache_t();
+            cache.erase_stats = erase_stats;
+            success = false;
+
+            if (cfg.erase_chunk_sectors == 0 && cfg.trace_events == 0)
+                return false;
+        }
+    }
+
+    cache.card = &card;
+    cache.fs = fs;
+    cache.win = fs->win;
+    cache.slot_count = (cache.slots != nullptr) ? cfg.meta_cache_sectors : 0;
+    cache.tick = 0;
+    cache.stats = sd_meta_cache_stats_t();
+    cache.stats.sectors = cache.slot_count;
+    cache.erase_count = 0;
+    cache.erase_enabled = (cfg.erase_chunk_sectors > 0);
+    cache.erase_arg = (sdmmc_can_discard(&card) == ESP_OK) ? SDMMC_DISCARD_ARG : SDMMC_ERASE_ARG;
+    cache.erase_stats.discard = (cache.erase_arg == SDMMC_DISCARD_ARG);
+    cache.trace = &trace;
+    cache.block_size = get_allocation_unit_size() / card.csd.sector_size;
+
+#if !FF_USE_TRIM
+    if (cache.erase_enabled)
+        ESP_LOGW(TAG, "%s: FatFs built without FF_USE_TRIM, freed clusters are not erased.", SUB_TAG);
+#endif
+
+    register_volume_driver();
+
+    return success;
 }
 
-const char* SDLogger::get_root_path()
+void SDLogger::meta_cache_detach(const char* SUB_TAG)
 {
-    const constexpr char* SUB_TAG = "SD->get_root_path()";
+    meta_cache_t& cache = meta_caches[pdrv];
+    sd_meta_cache_stats_t stats = cache.stats;
+    sd_erase_stats_t erase_stats;
 
-    if (!usability_check(SUB_TAG))
-        return nullptr;
+    if (cache.card == nullptr)
+        return;
+
+    if (meta_cache_write_back(cache) != RES_OK)
+        ESP_LOGE(TAG, "%s: Metadata cache write back failed.", SUB_TAG);
+
+    free(cache.slots);
+    heap_caps_free(cache.sectors);
+
+    // ranges still queued belong to a volume no longer mounted, or to a card already pulled
+    erase_queue_drop(cache);
+    erase_stats = cache.erase_stats;
+
+    // counters stay readable after unmount
+    cache = meta_cache_t();
+    cache.stats = stats;
+    cache.erase_stats = erase_stats;
+
+    register_volume_driver();
+}
+
+void SDLogger::meta_cache_discard()
+{
+    if (pdrv >= FF_VOLUMES)
+        return;
+
+    meta_cache_t& cache = meta_caches[pdrv];
+
+    for (size_t i = 0; i < cache.slot_count; i++)
+    {
+        cache.slots[i].valid = false;
+        cache.slots[i].dirty = false;
+    }
+}
+
+void SDLogger::register_volume_driver()
+{
+    static const ff_diskio_impl_t meta_cache_impl = {.init = &meta_cache_init,
+            .status = &meta_cache_status,
+            .read = &meta_cache_read,
+            .write = &meta_cache_write,
+            .ioctl = &meta_cache_ioctl};
+
+    if (meta_caches[pdrv].card != nullptr)
+        ff_diskio_register(pdrv, &meta_cache_impl);
     else
-        return root_path;
+        ff_diskio_register_sdmmc(pdrv, &card);
 }
 
-void SDLogger::print_fatfs_error(FRESULT f_res, const char* SUBTAG, const char* fatfs_fxn)
+DSTATUS SDLogger::meta_cache_init(BYTE pdrv)
 {
-    char res_str[40];
-    fatfs_res_to_str(f_res, res_str);
-    ESP_LOGE(TAG, "%s: %s did not return FR_OK, FRESULT: %s", SUBTAG, fatfs_fxn, res_str);
+    return meta_cache_status(pdrv);
 }
 
-bool SDLogger::posix_perms_2_fatfs_perms(const char* posix_perms, uint8_t& fatfs_perms)
+DSTATUS SDLogger::meta_cache_status(BYTE pdrv)
 {
-    auto idx = permission_flag_map.find(posix_perms);
+    return (meta_caches[pdrv].card != nullptr) ? 0 : STA_NOINIT;
+}
 
-    if (idx != permission_flag_map.end())
+DRESULT SDLogger::meta_cache_read(BYTE pdrv, BYTE* buff, uint32_t sector, UINT count)
+{
+    meta_cache_t& cache = meta_caches[pdrv];
+    meta_cache_slot_t* slot = nullptr;
+    DRESULT res = RES_OK;
+
+    if (meta_cache_holds(cache, buff, sector, count))
     {
-        fatfs_perms = idx->second;
-        return true;
+        slot = meta_cache_find(cache, sector);
+
+        if (slot != nullptr)
+        {
+            cache.stats.hits++;
+        }
+        else
+        {
+            slot = meta_cache_claim(cache, sector, res);
+            if (slot == nullptr)
+                return res;
+
+            if (meta_cache_read_sectors(cache, cache.sectors + (slot - cache.slots) * SD_SECTOR_SZ, sector, 1) != ESP_OK)
+            {
+                slot->valid = false;
+                return RES_ERROR;
+            }
+
+            cache.stats.misses++;
+        }
+
+        slot->last_use = ++cache.tick;
+        memcpy(buff, cache.sectors + (slot - cache.slots) * SD_SECTOR_SZ, SD_SECTOR_SZ);
+
+        return RES_OK;
     }
 
-    return false;
+    if (meta_cache_read_sectors(cache, buff, sector, count) != ESP_OK)
+        return RES_ERROR;
+
+    // dirty cached sectors are newer than what the card returned
+    for (size_t i = 0; i < cache.slot_count; i++)
+    {
+        slot = &cache.slots[i];
+
+        if (slot->valid && slot->dirty && slot->sector >= sector && slot->sector < sector + count)
+            memcpy(buff + (slot->sector - sector) * SD_SECTOR_SZ, cache.sectors + i * SD_SECTOR_SZ, SD_SECTOR_SZ);
+    }
+
+    return RES_OK;
 }
 
-bool SDLogger::path_exists(const char* path, const char* SUB_TAG, bool suppress_no_dir_warning)
+DRESULT SDLogger::meta_cache_write(BYTE pdrv, const BYTE* buff, uint32_t sector, UINT count)
 {
-    FRESULT res = FR_OK;
+    meta_cache_t& cache = meta_caches[pdrv];
+    meta_cache_slot_t* slot = nullptr;
+    DRESULT res = RES_OK;
 
-    if (!usability_check(SUB_TAG))
-        return false;
+    if (cache.erase_count > 0)
+        erase_queue_cut(cache, sector, count);
 
-    res = f_stat(path, nullptr);
+    if (meta_cache_holds(cache, buff, sector, count))
+    {
+        slot = meta_cache_find(cache, sector);
 
-    if (res != FR_OK && res != FR_NO_FILE)
-        print_fatfs_error(res, SUB_TAG, "f_stat()");
-    else if (res == FR_NO_FILE && !suppress_no_dir_warning)
-        ESP_LOGW(TAG, "%s: File or path does not exist.", SUB_TAG);
+        if (slot == nullptr)
+        {
+            slot = meta_cache_claim(cache, sector, res);
+            if (slot == nullptr)
+                return res;
+        }
 
-    return (res == FR_OK);
+        memcpy(cache.sectors + (slot - cache.slots) * SD_SECTOR_SZ, buff, SD_SECTOR_SZ);
+        slot->dirty = true;
+        slot->last_use = ++cache.tick;
+        cache.stats.absorbed++;
+
+        return RES_OK;
+    }
+
+    // file data written over a cached sector (ie. a freed directory cluster reused by a file) supersedes the cached copy
+    for (size_t i = 0; i < cache.slot_count; i++)
+    {
+        slot = &cache.slots[i];
+
+        if (slot->valid && slot->sector >= sector && slot->sector < sector + count)
+        {
+            slot->valid = false;
+            slot->dirty = false;
+        }
+    }
+
+    return (meta_cache_write_sectors(cache, buff, sector, count) == ESP_OK) ? RES_OK : RES_ERROR;
 }
 
-bool SDLogger::get_and_register_free_drive(const char* SUB_TAG)
+DRESULT SDLogger::meta_cache_ioctl(BYTE pdrv, BYTE cmd, void* buff)
 {
-    pdrv = FF_DRV_NOT_USED;
-    if (ff_diskio_get_drive(&pdrv) != ESP_OK || pdrv == FF_DRV_NOT_USED)
+    meta_cache_t& cache = meta_caches[pdrv];
+
+    switch (cmd)
     {
-        ESP_LOGE(TAG, "%s: Max volumes already mounted, could not take sdmmc driver resource.", SUB_TAG);
-        return false;
+    case CTRL_SYNC:
+        return meta_cache_write_back(cache);
+    case GET_SECTOR_COUNT:
+        *static_cast<LBA_t*>(buff) = static_cast<LBA_t>(cache.card->csd.capacity);
+        return RES_OK;
+    case GET_SECTOR_SIZE:
+        *static_cast<WORD*>(buff) = static_cast<WORD>(cache.card->csd.sector_size);
+        return RES_OK;
+    case GET_BLOCK_SIZE:
+        *static_cast<DWORD*>(buff) = cache.block_size;
+        return RES_OK;
+#if FF_USE_TRIM
+    case CTRL_TRIM:
+        // first and last sector of a freed run, the erase itself waits for an idle io task
+        if (cache.erase_enabled)
+            erase_queue_add(cache, static_cast<LBA_t*>(buff)[0], static_cast<LBA_t*>(buff)[1]);
+        return RES_OK;
+#endif
+    default:
+        return RES_ERROR;
     }
+}
 
-    ff_diskio_register_sdmmc(pdrv, &card);
-    drv[0] = static_cast<char>('0' + pdrv);
+bool SDLogger::meta_cache_holds(const meta_cache_t& cache, const BYTE* buff, LBA_t sector, UINT count)
+{
+    if (cache.slot_count == 0 || buff != cache.win || count != 1)
+        return false;
 
+#if FF_FS_TINY
+    // file data moves through the window too, only the reserved and FAT area ahead of the data region is surely metadata
+    return sector < cache.fs->database;
+#else
     return true;
+#endif
 }
 
-void SDLogger::fatfs_res_to_str(FRESULT f_res, char* dest_str)
+SDLogger::meta_cache_slot_t* SDLogger::meta_cache_find(meta_cache_t& cache, LBA_t sector)
 {
-    switch (f_res)
+    for (size_t i = 0; i < cache.slot_count; i++)
+        if (cache.slots[i].valid && cache.slots[i].sector == sector)
+            return &cache.slots[i];
+
+    return nullptr;
+}
+
+SDLogger::meta_cache_slot_t* SDLogger::meta_cache_claim(meta_cache_t& cache, LBA_t sector, DRESULT& res)
+{
+    meta_cache_slot_t* victim = &cache.slots[0];
+
+    // free slot first, least recently used otherwise
+    for (size_t i = 0; i < cache.slot_count; i++)
     {
-    case FR_OK:
-        sprintf(dest_str, "FR_OK");
-        break;
-    case FR_DISK_ERR:
-        sprintf(dest_str, "FR_DISK_ERR");
-        break;
-    case FR_INT_ERR:
-        sprintf(dest_str, "FR_INT_ERR");
-        break;
+        if (!cache.slots[i].valid)
+        {
+            victim = &cache.slots[i];
+            break;
+        }
+
+        if (cache.slots[i].last_use < victim->last_use)
+            victim = &cache.slots[i];
+    }
+
+    if (victim->valid)
+    {
+        if (victim->dirty)
+        {
+            if (meta_cache_write_sectors(cache, cache.sectors + (victim - cache.slots) * SD_SECTOR_SZ, victim->sector, 1) != ESP_OK)
+            {
+                res = RES_ERROR;
+                return nullptr;
+            }
+
+            cache.stats.write_backs++;
+        }
+
+        cache.stats.evictions++;
+    }
+
+    victim->sector = sector;
+    victim->valid = true;
+    victim->dirty = false;
+
+    return victim;
+}
+
+DRESULT SDLogger::meta_cache_write_back(meta_cache_t& cache, const FATFS* essential_only)
+{
+    const FATFS* fs = essential_only;
+    const LBA_t mirror_first = fs ? fs->fatbase + fs->fsize : 0;
+    const LBA_t mirror_end = fs ? fs->fatbase + fs->fsize * fs->n_fats : 0;
+    const LBA_t fsinfo = (fs && fs->fs_type == FS_FAT32) ? fs->volbase + 1 : 0;
+    DRESULT res = RES_OK;
+
+    for (size_t i = 0; i < cache.slot_count; i++)
+    {
+        meta_cache_slot_t& slot = cache.slots[i];
+
+        if (!slot.valid || !slot.dirty)
+            continue;
+
+        // FatFs only reads the first FAT, and the FSInfo free count is invalidated by the repair at the next mount
+        if (fs != nullptr && ((slot.sector >= mirror_first && slot.sector < mirror_end) || slot.sector == fsinfo))
+            continue;
+
+        if (meta_cache_write_sectors(cache, cache.sectors + i * SD_SECTOR_SZ, slot.sector, 1) != ESP_OK)
+        {
+            res = RES_ERROR;
+            continue;
+        }
+
+        slot.dirty = false;
+        cache.stats.write_backs++;
+    }
+
+    return res;
+}
+
+esp_err_t SDLogger::meta_cache_read_sectors(meta_cache_t& cache, void* buff, LBA_t sector, size_t count)
+{
+    const int64_t start_us = esp_timer_get_time();
+    const esp_err_t err = sdmmc_read_sectors(cache.card, buff, sector, count);
+
+    trace_record(cache.trace, TRACE_SECTOR_READ, start_us, sector, count, 0, err != ESP_OK);
+
+    return err;
+}
+
+esp_err_t SDLogger::meta_cache_write_sectors(meta_cache_t& cache, const void* buff, LBA_t sector, size_t count)
+{
+    const int64_t start_us = esp_timer_get_time();
+    const esp_err_t err = sdmmc_write_sectors(cache.card, buff, sector, count);
+
+    trace_record(cache.trace, TRACE_SECTOR_WRITE, start_us, sector, count, 0, err != ESP_OK);
+
+    return err;
+}
+
+bool SDLogger::get_meta_cache_stats(sd_meta_cache_stats_t& stats)
+{
+    const constexpr char* SUB_TAG = "SD->get_meta_cache_stats()";
+
+    ScopedLock lock(io_mutex);
+
+    if (pdrv >= FF_VOLUMES)
+    {
+        ESP_LOGE(TAG, "%s: No drive registered.", SUB_TAG);
+        return false;
+    }
+
+    stats = meta_caches[pdrv].stats;
+
+    return true;
+}
+
+void SDLogger::erase_queue_add(meta_cache_t& cache, LBA_t first, LBA_t last)
+{
+    const LBA_t count = last - first + 1;
+
+    cache.erase_stats.ranges++;
+    cache.erase_stats.sectors_queued += count;
+
+    // FatFs reports a chain one run at a time, runs touching a queued range extend it
+    for (size_t i = 0; i < cache.erase_count; i++)
+    {
+        erase_range_t& range = cache.erase_ranges[i];
+
+        if (range.start + range.count == first)
+        {
+            range.count += count;
+            return;
+        }
+
+        if (last + 1 == range.start)
+        {
+            range.start = first;
+            range.count += count;
+            return;
+        }
+    }
+
+    if (cache.erase_count == MAX_ERASE_RANGES)
+    {
+        cache.erase_stats.sectors_dropped += count;
+        return;
+    }
+
+    cache.erase_ranges[cache.erase_count++] = {first, count};
+}
+
+void SDLogger::erase_queue_cut(meta_cache_t& cache, LBA_t sector, LBA_t count)
+{
+    const LBA_t end = sector + count;
+    size_t i = 0;
+
+    // a freed cluster handed out again holds new data once written, its erase must not come up afterwards
+    while (i < cache.erase_count)
+    {
+        erase_range_t& range = cache.erase_ranges[i];
+        const LBA_t range_end = range.start + range.count;
+
+        if (range_end <= sector || range.start >= end)
+        {
+            i++;
+            continue;
+        }
+
+        cache.erase_stats.sectors_reused += std::min(range_end, end) - std::max(range.start, sector);
+
+        if (range.start >= sector && range_end <= end)
+        {
+            erase_queue_remove(cache, i);
+            continue;
+        }
+
+        if (range.start < sector && range_end > end)
+        {
+            // the write splits the range, without a free slot the tail is given up
+            if (cache.erase_count < MAX_ERASE_RANGES)
+                cache.erase_ranges[cache.erase_count++] = {end, range_end - end};
+            else
+                cache.erase_stats.sectors_dropped += range_end - end;
+
+            range.count = sector - range.start;
+        }
+        else if (range.start < sector)
+        {
+            range.count = sector - range.start;
+        }
+        else
+        {
+            range.start = end;
+            range.count = range_end - end;
+        }
+
+        i++;
+    }
+}
+
+void SDLogger::erase_queue_remove(meta_cache_t& cache, size_t idx)
+{
+    for (size_t i = idx + 1; i < cache.erase_count; i++)
+        cache.erase_ranges[i - 1] = cache.erase_ranges[i];
+
+    cache.erase_count--;
+}
+
+void SDLogger::erase_queue_drop(meta_cache_t& cache)
+{
+    for (size_t i = 0; i < cache.erase_count; i++)
+        cache.erase_stats.sectors_dropped += cache.erase_ranges[i].count;
+
+    cache.erase_count = 0;
+}
+
+bool SDLogger::erase_pending()
+{
+    return mounted && card_present && pdrv < FF_VOLUMES && meta_caches[pdrv].erase_count > 0;
+}
+
+bool SDLogger::erase_freed_sectors(uint32_t budget_us)
+{
+    const constexpr char* SUB_TAG = "SD->erase_freed_sectors()";
+
+    ScopedLock lock(io_mutex);
+
+    const int64_t start_us = esp_timer_get_time();
+    int64_t command_us = 0;
+    LBA_t count = 0;
+    esp_err_t err = ESP_OK;
+
+    if (!usability_check(SUB_TAG))
+        return false;
+
+    meta_cache_t& cache = meta_caches[pdrv];
+
+    if (cache.erase_count == 0)
+        return true;
+
+    // FatFs syncs its window before f_unlink()/f_close() return, cached FAT sectors freeing the ranges go out first so a
+    // power loss never leaves a file pointing at erased clusters
+    if (meta_cache_write_back(cache) != RES_OK)
+    {
+        ESP_LOGE(TAG, "%s: Metadata cache write back failed.", SUB_TAG);
+        return false;
+    }
+
+    while (cache.erase_count > 0)
+    {
+        if (budget_us > 0 && (esp_timer_get_time() - start_us) >= budget_us)
+            return true;
+
+        erase_range_t& range = cache.erase_ranges[0];
+        count = std::min(range.count, static_cast<LBA_t>(cfg.erase_chunk_sectors));
+
+        command_us = esp_timer_get_time();
+        err = sdmmc_erase_sectors(&card, range.start, count, cache.erase_arg);
+        trace_record(cache.trace, TRACE_ERASE, command_us, range.start, count, 0, err != ESP_OK);
+        command_us = esp_timer_get_time() - command_us;
+
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "%s: sdmmc_erase_sectors() failed (0x%x).", SUB_TAG, err);
+            cache.erase_stats.errors++;
+
+            // cards without erase support never get another command
+            if (err == ESP_ERR_NOT_SUPPORTED)
+            {
+                cache.erase_enabled = false;
+                erase_queue_drop(cache);
+            }
+            else
+            {
+                cache.erase_stats.sectors_dropped += range.count;
+                erase_queue_remove(cache, 0);
+            }
+
+            return false;
+        }
+
+        cache.erase_stats.commands++;
+        cache.erase_stats.sectors_erased += count;
+        cache.erase_stats.max_command_us = std::max(cache.erase_stats.max_command_us, static_cast<uint32_t>(command_us));
+
+        range.start += count;
+        range.count -= count;
+
+        if (range.count == 0)
+            erase_queue_remove(cache, 0);
+    }
+
+    return true;
+}
+
+bool SDLogger::get_erase_stats(sd_erase_stats_t& stats)
+{
+    const constexpr char* SUB_TAG = "SD->get_erase_stats()";
+
+    ScopedLock lock(io_mutex);
+
+    if (pdrv >= FF_VOLUMES)
+    {
+        ESP_LOGE(TAG, "%s: No drive registered.", SUB_TAG);
+        return false;
+    }
+
+    stats = meta_caches[pdrv].erase_stats;
+    stats.sectors_pending = 0;
+
+    for (size_t i = 0; i < meta_caches[pdrv].erase_count; i++)
+        stats.sectors_pending += meta_caches[pdrv].erase_ranges[i].count;
+
+    return true;
+}
+
+bool SDLogger::set_tracing(bool enabled)
+{
+    const constexpr char* SUB_TAG = "SD->set_tracing()";
+
+    ScopedLock lock(io_mutex);
+
+    if (cfg.trace_events == 0)
+    {
+        ESP_LOGE(TAG, "%s: Tracing disabled in the config (trace_events is 0).", SUB_TAG);
+        return false;
+    }
+
+    if (enabled && trace.events == nullptr && !trace_alloc(SUB_TAG))
+        return false;
+
+    trace.enabled = enabled;
+
+    return true;
+}
+
+bool SDLogger::clear_trace()
+{
+    ScopedLock lock(io_mutex);
+
+    trace.recorded = 0;
+    trace.task_count = 0;
+
+    for (uint32_t& max_us : trace.max_us)
+        max_us = 0;
+
+    return true;
+}
+
+bool SDLogger::export_trace(const char* path)
+{
+    const constexpr char* SUB_TAG = "SD->export_trace()";
+    static const constexpr char* SPAN_NAMES[TRACE_SPAN_MAX] = {"f_write", "f_sync", "write_sectors", "read_sectors", "erase_sectors"};
+
+    ScopedLock lock(io_mutex);
+
+    std::unique_ptr<FIL> out(new FIL());
+    std::unique_ptr<char[]> buffer(new char[TRACE_EXPORT_BUF_SZ]);
+    const bool was_enabled = trace.enabled;
+    const uint64_t first = (trace.recorded > trace.capacity) ? trace.recorded - trace.capacity : 0;
+    size_t length = 0;
+    FRESULT res = FR_OK;
+    bool success = true;
+
+    if (!usability_check(SUB_TAG))
+        return false;
+
+    if (trace.events == nullptr)
+    {
+        ESP_LOGE(TAG, "%s: Tracing never enabled.", SUB_TAG);
+        return false;
+    }
+
+    res = bus_f_open(out.get(), path, FA_CREATE_ALWAYS | FA_WRITE);
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_open()");
+        return false;
+    }
+
+    // the export's own writes stay out of the ring
+    trace.enabled = false;
+
+    // Chrome trace event format, complete ("X") events with microsecond timestamps, one track per task
+    length = snprintf(buffer.get(), TRACE_EXPORT_BUF_SZ,
+            "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":0,\"args\":{\"name\":\"SDLogger %s\"}}",
+            static_cast<unsigned>(pdrv), root_path);
+
+    // tasks past MAX_TRACE_TASKS were recorded on the track after the named ones
+    for (uint8_t i = 0; i < trace.task_count + ((trace.task_count == MAX_TRACE_TASKS) ? 1 : 0); i++)
+    {
+        length += snprintf(buffer.get() + length, TRACE_EXPORT_BUF_SZ - length,
+                ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                static_cast<unsigned>(pdrv), static_cast<unsigned>(i), (i < MAX_TRACE_TASKS) ? trace.task_names[i] : "other");
+
+        if (length + TRACE_EVENT_JSON_MAX > TRACE_EXPORT_BUF_SZ)
+            success &= trace_flush(out.get(), buffer.get(), length, SUB_TAG);
+    }
+
+    for (uint64_t seq = first; seq < trace.recorded && success; seq++)
+    {
+        const trace_event_t& event = trace.events[seq % trace.capacity];
+
+        if (event.span == TRACE_F_WRITE || event.span == TRACE_F_SYNC)
+            length += snprintf(buffer.get() + length, TRACE_EXPORT_BUF_SZ - length,
+                    ",\n{\"name\":\"%s\",\"cat\":\"file\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lu,\"pid\":%u,\"tid\":%u,"
+                    "\"args\":{\"offset\":%llu,\"bytes\":%lu,\"cluster\":%lu,\"failed\":%u}}",
+                    SPAN_NAMES[event.span], static_cast<long long>(event.start_us), static_cast<unsigned long>(event.dur_us),
+                    static_cast<unsigned>(pdrv), static_cast<unsigned>(event.task), static_cast<unsigned long long>(event.offset),
+                    static_cast<unsigned long>(event.length), static_cast<unsigned long>(event.cluster), event.failed ? 1U : 0U);
+        else
+            length += snprintf(buffer.get() + length, TRACE_EXPORT_BUF_SZ - length,
+                    ",\n{\"name\":\"%s\",\"cat\":\"card\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lu,\"pid\":%u,\"tid\":%u,"
+                    "\"args\":{\"sector\":%llu,\"count\":%lu,\"failed\":%u}}",
+                    SPAN_NAMES[event.span], static_cast<long long>(event.start_us), static_cast<unsigned long>(event.dur_us),
+                    static_cast<unsigned>(pdrv), static_cast<unsigned>(event.task), static_cast<unsigned long long>(event.offset),
+                    static_cast<unsigned long>(event.length), event.failed ? 1U : 0U);
+
+        if (length + TRACE_EVENT_JSON_MAX > TRACE_EXPORT_BUF_SZ)
+            success &= trace_flush(out.get(), buffer.get(), length, SUB_TAG);
+    }
+
+    length += snprintf(buffer.get() + length, TRACE_EXPORT_BUF_SZ - length, "\n]}\n");
+
+    if (success)
+        success = trace_flush(out.get(), buffer.get(), length, SUB_TAG);
+
+    res = bus_f_close(out.get());
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_close()");
+        success = false;
+    }
+
+    trace.enabled = was_enabled;
+
+    return success;
+}
+
+bool SDLogger::get_trace_stats(sd_trace_stats_t& stats)
+{
+    ScopedLock lock(io_mutex);
+
+    stats.spans = trace.recorded;
+    stats.overwritten = (trace.recorded > trace.capacity) ? trace.recorded - trace.capacity : 0;
+    stats.max_f_write_us = trace.max_us[TRACE_F_WRITE];
+    stats.max_f_sync_us = trace.max_us[TRACE_F_SYNC];
+    stats.max_sector_write_us = trace.max_us[TRACE_SECTOR_WRITE];
+    stats.max_sector_read_us = trace.max_us[TRACE_SECTOR_READ];
+    stats.max_erase_us = trace.max_us[TRACE_ERASE];
+    stats.enabled = trace.enabled;
+
+    return true;
+}
+
+void SDLogger::trace_record(trace_ring_t* ring, trace_span_t span, int64_t start_us, uint64_t offset, uint32_t length, uint32_t cluster,
+        bool failed)
+{
+    const int64_t end_us = esp_timer_get_time();
+    TaskHandle_t task = nullptr;
+    uint8_t task_idx = 0;
+
+    if (ring == nullptr || !ring->enabled)
+        return;
+
+    // tasks are numbered as they first show up, names are copied while the task is known to exist
+    task = xTaskGetCurrentTaskHandle();
+
+    while (task_idx < ring->task_count && ring->tasks[task_idx] != task)
+        task_idx++;
+
+    if (task_idx == ring->task_count && task_idx < MAX_TRACE_TASKS)
+    {
+        ring->tasks[task_idx] = task;
+        strncpy(ring->task_names[task_idx], pcTaskGetName(task), configMAX_TASK_NAME_LEN - 1);
+        ring->task_names[task_idx][configMAX_TASK_NAME_LEN - 1] = '\0';
+        ring->task_count++;
+    }
+
+    trace_event_t& event = ring->events[ring->recorded % ring->capacity];
+
+    event.start_us = start_us;
+    event.dur_us = static_cast<uint32_t>(end_us - start_us);
+    event.span = span;
+    event.task = task_idx;
+    event.failed = failed;
+    event.offset = offset;
+    event.length = length;
+    event.cluster = cluster;
+
+    ring->recorded++;
+    ring->max_us[span] = std::max(ring->max_us[span], event.dur_us);
+}
+
+FRESULT SDLogger::trace_f_write(FIL* fp, const void* buff, UINT btw, UINT* bw)
+{
+    const uint64_t offset = f_tell(fp);
+    const int64_t start_us = esp_timer_get_time();
+    const FRESULT res = f_write(fp, buff, btw, bw);
+
+    trace_record(&trace, TRACE_F_WRITE, start_us, offset, btw, fp->clust, res != FR_OK);
+
+    return res;
+}
+
+FRESULT SDLogger::trace_f_sync(FIL* fp)
+{
+    const int64_t start_us = esp_timer_get_time();
+    FRESULT res = FR_OK;
+
+    // f_sync() writes the FIL buffer and the directory entry, both go over the shared bus
+    if (cfg.bus_quantum_sz > 0)
+        get_bus_arbiter().acquire();
+
+    res = f_sync(fp);
+
+    if (cfg.bus_quantum_sz > 0)
+        get_bus_arbiter().release();
+
+    trace_record(&trace, TRACE_F_SYNC, start_us, f_tell(fp), 0, fp->clust, res != FR_OK);
+
+    return res;
+}
+
+bool SDLogger::trace_alloc(const char* SUB_TAG)
+{
+    trace.events = static_cast<trace_event_t*>(heap_caps_malloc(cfg.trace_events * sizeof(trace_event_t), MALLOC_CAP_8BIT));
+
+    if (trace.events == nullptr)
+    {
+        ESP_LOGE(TAG, "%s: No heap memory available for %u trace spans.", SUB_TAG, static_cast<unsigned>(cfg.trace_events));
+        return false;
+    }
+
+    trace.capacity = cfg.trace_events;
+    trace.recorded = 0;
+
+    return true;
+}
+
+bool SDLogger::trace_flush(FIL* out, char* buffer, size_t& length, const char* SUB_TAG)
+{
+    UINT bytes_written = 0;
+    FRESULT res = f_write(out, buffer, length, &bytes_written);
+
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_write()");
+        return false;
+    }
+
+    if (bytes_written < length)
+    {
+        ESP_LOGE(TAG, "%s: Volume full, trace incomplete.", SUB_TAG);
+        return false;
+    }
+
+    length = 0;
+
+    return true;
+}
+
+bool SDLogger::tune()
+{
+    const constexpr char* SUB_TAG = "SD->tune()";
+
+    ScopedLock lock(io_mutex);
+
+    if (!initialized)
+    {
+        ESP_LOGE(TAG, "%s: Card not initialized.", SUB_TAG);
+        return false;
+    }
+
+    // the test region is written around FatFs, the volume must not be in use
+    if (mounted)
+    {
+        ESP_LOGE(TAG, "%s: Unmount before tuning.", SUB_TAG);
+        return false;
+    }
+
+    return tune_card(true, SUB_TAG);
+}
+
+bool SDLogger::get_tune_results(std::vector<sd_tune_result_t>& results)
+{
+    const constexpr char* SUB_TAG = "SD->get_tune_results()";
+
+    ScopedLock lock(io_mutex);
+
+    if (tune_results.empty())
+    {
+        ESP_LOGE(TAG, "%s: Card never tuned.", SUB_TAG);
+        return false;
+    }
+
+    results = tune_results;
+
+    return true;
+}
+
+void SDLogger::print_tune_results()
+{
+    const constexpr char* SUB_TAG = "SD->print_tune_results()";
+
+    ScopedLock lock(io_mutex);
+
+    if (tune_results.empty())
+    {
+        ESP_LOGE(TAG, "%s: Card never tuned.", SUB_TAG);
+        return;
+    }
+
+    ESP_LOGI(TAG, "\n ------ SD Tuning ------ \n"
+                  "Clock (kHz) | Transfer (bytes) | Write (KiB/s) | Read (KiB/s) | Result");
+
+    for (const sd_tune_result_t& result : tune_results)
+        ESP_LOGI(TAG, "%11lu | %16u | %13lu | %12lu | %s", static_cast<unsigned long>(result.freq_khz),
+                static_cast<unsigned>(result.transfer_sz), static_cast<unsigned long>(result.write_kib_s),
+                static_cast<unsigned long>(result.read_kib_s), result.selected ? "selected" : (result.stable ? "stable" : "failed"));
+}
+
+bool SDLogger::get_info(sd_info_t& sd_info)
+{
+    const constexpr char* SUB_TAG = "SD->get_info()";
+
+    if (!usability_check(SUB_TAG))
+        return false;
+
+    if (!info.initialized)
+    {
+        ESP_LOGE(TAG, "%s: Card info never loaded.", SUB_TAG);
+        return false;
+    }
+
+    sd_info = info;
+
+    return true;
+}
+
+void SDLogger::print_info()
+{
+    const constexpr char* SUB_TAG = "SD->print_info()";
+
+    if (!usability_check(SUB_TAG))
+        return;
+
+    if (!info.initialized)
+    {
+        ESP_LOGE(TAG, "%s: Card info never loaded.", SUB_TAG);
+        return;
+    }
+
+    ESP_LOGI(TAG,
+            "\n ------ SD Info ------ \n"
+            "Name: %s \n"
+            "Type: %s \n"
+            "Speed (MHz): %.2f \n"
+            "Size (MB): %lu \n"
+            "SSR->Bus Width: %d \n"
+            "CSD->Version: %d \n"
+            "CSD->Sector Size: %d \n"
+            "CSD->Capacity (bytes): %llu \n"
+            "CSD->Read Block Length: %d \n"
+            "-------------------- \n",
+            info.name, info.type, info.speed_mhz, info.size_mb, info.ssr_bus_width, info.csd.ver, info.csd.sector_sz, info.csd.capacity,
+            info.csd.read_bl_len);
+
+    if (!info.profile.valid)
+        return;
+
+    const sd_profile_t& profile = info.profile;
+
+    ESP_LOGI(TAG, "\n ------ SD Profile (%lu KiB region) ------ ", static_cast<unsigned long>(profile.region_sz / 1024UL));
+
+    for (size_t i = 0; i < sd_profile_t::BLOCK_SIZES; i++)
+        ESP_LOGI(TAG, "Sequential write, %6lu byte blocks: %lu KiB/s", static_cast<unsigned long>(profile.seq_block_sz[i]),
+                static_cast<unsigned long>(profile.seq_write_kib_s[i]));
+
+    ESP_LOGI(TAG, "Random 512 byte writes (%lu): avg %lu us, p99 %lu us, max %lu us", static_cast<unsigned long>(profile.random_writes),
+            static_cast<unsigned long>(profile.random_avg_us), static_cast<unsigned long>(profile.random_p99_us),
+            static_cast<unsigned long>(profile.random_max_us));
+
+    ESP_LOGI(TAG, "Write commands: %lu, slowest %lu us", static_cast<unsigned long>(profile.write_commands),
+            static_cast<unsigned long>(profile.max_write_us));
+
+    for (size_t i = 0; i < sd_profile_t::STALL_BUCKETS; i++)
+    {
+        if (i < sd_profile_t::STALL_BUCKETS - 1)
+            ESP_LOGI(TAG, "  < %3lu ms: %lu", static_cast<unsigned long>(PROFILE_STALL_MS[i]), static_cast<unsigned long>(profile.stall_hist[i]));
+        else
+            ESP_LOGI(TAG, " >= %3lu ms: %lu", static_cast<unsigned long>(PROFILE_STALL_MS[i - 1]), static_cast<unsigned long>(profile.stall_hist[i]));
+    }
+}
+
+bool SDLogger::profile_card(uint32_t region_sz)
+{
+    const constexpr char* SUB_TAG = "SD->profile_card()";
+
+    ScopedLock lock(io_mutex);
+
+#if FF_USE_EXPAND
+    const uint32_t max_block_sz = PROFILE_BLOCK_SZ[sd_profile_t::BLOCK_SIZES - 1];
+    std::unique_ptr<FIL> region(new FIL());
+    std::vector<uint32_t> latencies;
+    sd_profile_t profile;
+    uint8_t* buffer = nullptr;
+    LBA_t first = 0;
+    LBA_t sectors = 0;
+    uint32_t block_sectors = 0;
+    uint32_t latency_us = 0;
+    uint32_t seed = 0;
+    uint64_t total_us = 0;
+    int64_t start_us = 0;
+    FRESULT res = FR_OK;
+    bool success = true;
+
+    if (!usability_check(SUB_TAG))
+        return false;
+
+    region_sz -= region_sz % max_block_sz;
+    if (region_sz == 0)
+    {
+        ESP_LOGE(TAG, "%s: Region must hold at least one %lu byte block.", SUB_TAG, static_cast<unsigned long>(max_block_sz));
+        return false;
+    }
+
+    res = bus_f_open(region.get(), PROFILE_PATH, FA_CREATE_ALWAYS | FA_WRITE);
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_open()");
+        return false;
+    }
+
+    // one contiguous run, test writes go to its sectors directly and never touch another file's clusters
+    res = f_expand(region.get(), region_sz, 1);
+    if (res != FR_OK)
+    {
+        ESP_LOGE(TAG, "%s: No contiguous space for a %lu byte test region.", SUB_TAG, static_cast<unsigned long>(region_sz));
+        bus_f_close(region.get());
+        f_unlink(drive_path(PROFILE_PATH).get());
+        return false;
+    }
+
+    first = fs->database + static_cast<LBA_t>(fs->csize) * (region->obj.sclust - 2);
+    sectors = region_sz / SD_SECTOR_SZ;
+
+    res = bus_f_close(region.get());
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_close()");
+        f_unlink(drive_path(PROFILE_PATH).get());
+        return false;
+    }
+
+    buffer = static_cast<uint8_t*>(heap_caps_malloc(max_block_sz, MALLOC_CAP_DMA));
+    if (buffer == nullptr)
+    {
+        ESP_LOGE(TAG, "%s: No DMA capable memory available for a %lu byte block.", SUB_TAG, static_cast<unsigned long>(max_block_sz));
+        f_unlink(drive_path(PROFILE_PATH).get());
+        return false;
+    }
+
+    // incompressible test data, xorshift seeded from the clock
+    seed = static_cast<uint32_t>(esp_timer_get_time()) | 1U;
+    for (uint32_t i = 0; i < max_block_sz; i++)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        buffer[i] = static_cast<uint8_t>(seed);
+    }
+
+    profile.region_sz = region_sz;
+
+    // sequential, the whole region once per block size
+    for (size_t i = 0; i < sd_profile_t::BLOCK_SIZES && success; i++)
+    {
+        block_sectors = PROFILE_BLOCK_SZ[i] / SD_SECTOR_SZ;
+        start_us = esp_timer_get_time();
+
+        for (LBA_t offset = 0; offset < sectors && success; offset += block_sectors)
+            success = profile_write(first + offset, block_sectors, buffer, profile, latency_us);
+
+        profile.seq_block_sz[i] = PROFILE_BLOCK_SZ[i];
+        profile.seq_write_kib_s[i] =
+                static_cast<uint32_t>(region_sz * 1000000ULL / 1024ULL / std::max<int64_t>(esp_timer_get_time() - start_us, 1));
+    }
+
+    // random single sectors, the pattern that makes cards relocate and garbage collect
+    latencies.reserve(PROFILE_RANDOM_WRITES);
+
+    for (uint32_t i = 0; i < PROFILE_RANDOM_WRITES && success; i++)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+
+        success = profile_write(first + seed % sectors, 1, buffer, profile, latency_us);
+        latencies.push_back(latency_us);
+        total_us += latency_us;
+    }
+
+    heap_caps_free(buffer);
+
+    res = f_unlink(drive_path(PROFILE_PATH).get());
+    if (res != FR_OK)
+        print_fatfs_error(res, SUB_TAG, "f_unlink()");
+
+    if (!success)
+    {
+        ESP_LOGE(TAG, "%s: Write to the test region failed.", SUB_TAG);
+        return false;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+
+    profile.random_writes = static_cast<uint32_t>(latencies.size());
+    profile.random_avg_us = static_cast<uint32_t>(total_us / latencies.size());
+    profile.random_p99_us = latencies[(latencies.size() * 99) / 100];
+    profile.random_max_us = latencies.back();
+    profile.serial = static_cast<uint32_t>(card.cid.serial);
+    profile.valid = true;
+
+    info.profile = profile;
+
+    return true;
+#else
+    ESP_LOGE(TAG, "%s: FatFs built without FF_USE_EXPAND, no contiguous test region.", SUB_TAG);
+    return false;
+#endif
+}
+
+const char* SDLogger::get_root_path()
+{
+    const constexpr char* SUB_TAG = "SD->get_root_path()";
+
+    if (!usability_check(SUB_TAG))
+        return nullptr;
+    else
+        return root_path;
+}
+
+SDLogger::BusArbiter& SDLogger::get_bus_arbiter()
+{
+    return BusArbiter::get(spi_host);
+}
+
+SDLogger::DrivePath SDLogger::drive_path(const char* path)
+{
+    // without the prefix every path lands on drive 0
+    return DrivePath(drv, path);
+}
+
+FRESULT SDLogger::bus_f_open(FIL* fp, const char* path, BYTE mode)
+{
+    FRESULT res = FR_OK;
+
+    if (cfg.bus_quantum_sz > 0)
+        get_bus_arbiter().acquire();
+
+    res = f_open(fp, drive_path(path).get(), mode);
+
+    if (cfg.bus_quantum_sz > 0)
+        get_bus_arbiter().release();
+
+    return res;
+}
+
+FRESULT SDLogger::bus_f_close(FIL* fp)
+{
+    FRESULT res = FR_OK;
+
+    if (cfg.bus_quantum_sz > 0)
+        get_bus_arbiter().acquire();
+
+    res = f_close(fp);
+
+    if (cfg.bus_quantum_sz > 0)
+        get_bus_arbiter().release();
+
+    return res;
+}
+
+void SDLogger::print_fatfs_error(FRESULT f_res, const char* SUBTAG, const char* fatfs_fxn)
+{
+    char res_str[40];
+    fatfs_res_to_str(f_res, res_str);
+    ESP_LOGE(TAG, "%s: %s did not return FR_OK, FRESULT: %s", SUBTAG, fatfs_fxn, res_str);
+}
+
+bool SDLogger::posix_perms_2_fatfs_perms(const char* posix_perms, uint8_t& fatfs_perms)
+{
+    auto idx = permission_flag_map.find(posix_perms);
+
+    if (idx != permission_flag_map.end())
+    {
+        fatfs_perms = idx->second;
+        return true;
+    }
+
+    return false;
+}
+
+bool SDLogger::path_exists(const char* path, const char* SUB_TAG, bool suppress_no_dir_warning)
+{
+    FRESULT res = FR_OK;
+
+    if (!usability_check(SUB_TAG))
+        return false;
+
+    res = f_stat(drive_path(path).get(), nullptr);
+
+    if (res != FR_OK && res != FR_NO_FILE)
+        print_fatfs_error(res, SUB_TAG, "f_stat()");
+    else if (res == FR_NO_FILE && !suppress_no_dir_warning)
+        ESP_LOGW(TAG, "%s: File or path does not exist.", SUB_TAG);
+
+    return (res == FR_OK);
+}
+
+bool SDLogger::get_and_register_free_drive(const char* SUB_TAG)
+{
+    pdrv = FF_DRV_NOT_USED;
+    if (ff_diskio_get_drive(&pdrv) != ESP_OK || pdrv == FF_DRV_NOT_USED)
+    {
+        ESP_LOGE(TAG, "%s: Max volumes already mounted, could not take sdmmc driver resource.", SUB_TAG);
+        return false;
+    }
+
+    ff_diskio_register_sdmmc(pdrv, &card);
+    drv[0] = static_cast<char>('0' + pdrv);
+
+    return true;
+}
+
+void SDLogger::fatfs_res_to_str(FRESULT f_res, char* dest_str)
+{
+    switch (f_res)
+    {
+    case FR_OK:
+        sprintf(dest_str, "FR_OK");
+        break;
+    case FR_DISK_ERR:
+        sprintf(dest_str, "FR_DISK_ERR");
+        break;
+    case FR_INT_ERR:
+        sprintf(dest_str, "FR_INT_ERR");
+        break;
     case FR_NOT_READY:
         sprintf(dest_str, "FR_NOT_READY");
         break;
@@ -409,523 +1820,4643 @@ void SDLogger::fatfs_res_to_str(FRESULT f_res, char* dest_str)
     case FR_TIMEOUT:
         sprintf(dest_str, "FR_TIMEOUT");
         break;
-    case FR_LOCKED:
-        sprintf(dest_str, "FR_LOCKED");
+    case FR_LOCKED:
+        sprintf(dest_str, "FR_LOCKED");
+        break;
+    case FR_NOT_ENOUGH_CORE:
+        sprintf(dest_str, "FR_NOT_ENOUGH_CORE");
+        break;
+    case FR_TOO_MANY_OPEN_FILES:
+        sprintf(dest_str, "FR_TOO_MANY_OPEN_FILES");
+        break;
+    case FR_INVALID_PARAMETER:
+        sprintf(dest_str, "FR_INVALID_PARAMETER");
+        break;
+    default:
+        sprintf(dest_str, "UNKNOWN_CODE");
+        break;
+    }
+}
+
+bool SDLogger::open_file(SDFile file, const char* permissions)
+{
+    const constexpr char* SUB_TAG = "SD->open_file()";
+
+    ScopedLock lock(io_mutex);
+
+    const int64_t start_us = esp_timer_get_time();
+    char full_path[100];
+    FRESULT res;
+    uint8_t fatfs_mode = 0;
+    bool seek_end = false;
+    file_pool_t* pool = nullptr;
+    pool_entry_t pool_entry = {};
+
+    if (!usability_check(SUB_TAG))
+        return false;
+
+    if (!file || !file->initialized)
+    {
+        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
+        return false;
+    }
+
+    if (open_files.size() + 1 > max_open_files)
+    {
+        if (open_files.size() + parked_files.size() + 1 > cfg.max_virtual_files)
+        {
+            ESP_LOGE(TAG, "%s: Max files already opened.", SUB_TAG);
+            return false;
+        }
+
+        if (!file_park_oldest(file, SUB_TAG))
+            return false;
+    }
+
+    if (!posix_perms_2_fatfs_perms(permissions, fatfs_mode))
+    {
+        ESP_LOGE(TAG, "%s: Invalid posix permission flag.", SUB_TAG);
+        return false;
+    }
+
+    file->preallocated = false;
+    file->data_end = 0;
+
+    // a new file is a pool file renamed into place, its directory exists and the file is opened at offset 0
+    if ((fatfs_mode & (FA_CREATE_ALWAYS | FA_OPEN_ALWAYS | FA_CREATE_NEW)) != 0)
+        pool = file_pool_take(file, pool_entry, SUB_TAG);
+
+    if (pool != nullptr)
+        fatfs_mode = (fatfs_mode & (FA_READ | FA_WRITE)) | FA_OPEN_EXISTING;
+
+    // build directory path if it does not exist
+    if (pool == nullptr && strcmp(file->directory_path, "") != 0)
+    {
+        if (!path_exists(file->directory_path, SUB_TAG, true))
+            if (!build_path(file->directory_path))
+            {
+                ESP_LOGE(TAG, "%s: Directory does not exist and path failed to build.", SUB_TAG);
+            }
+    }
+
+    // append root path to file path to create the full path
+    strcpy(full_path, root_path);
+    strcat(full_path, file->path);
+
+    // FA_OPEN_APPEND makes f_open() follow the whole cluster chain, the end is reached through the fast seek table instead
+    if (cfg.fast_seek_max_fragments > 0 && (fatfs_mode & FA_OPEN_APPEND) == FA_OPEN_APPEND)
+    {
+        fatfs_mode = (fatfs_mode & ~FA_OPEN_APPEND) | FA_OPEN_ALWAYS;
+        seek_end = true;
+    }
+
+    if (!file->stream)
+        file->stream.reset(new FIL());
+
+    // open the file
+    res = bus_f_open(file->stream.get(), file->path, fatfs_mode);
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_open()");
+
+        if (pool != nullptr)
+            file_pool_give_back(*pool, pool_entry, file, SUB_TAG);
+
+        return false;
+    }
+
+    file->open_mode = fatfs_mode;
+    file->resume_offset = 0;
+    file->unsynced = false;
+
+    if (cfg.fast_seek_max_fragments > 0 && !clmt_open(file, seek_end, SUB_TAG))
+    {
+        bus_f_close(file->stream.get());
+        clmt_reset(file, true);
+
+        if (pool != nullptr)
+            file_pool_give_back(*pool, pool_entry, file, SUB_TAG);
+
+        return false;
+    }
+
+    // failure to get the cache leaves the file usable, writes go straight to FatFs
+    alloc_cache(file, SUB_TAG);
+
+    // add pointer newly opened file to open_files vector
+    open_files.push_back(file);
+    file->open = true;
+    file->parked = false;
+    file->last_use = ++file_tick;
+
+    if (pool != nullptr)
+        pool->stats.max_open_us = std::max(pool->stats.max_open_us, static_cast<uint32_t>(esp_timer_get_time() - start_us));
+
+    return true;
+}
+
+bool SDLogger::close_file(SDFile file)
+{
+    const constexpr char* SUB_TAG = "SD->close_file()";
+
+    ScopedLock lock(io_mutex);
+
+    bool found = false;
+    int idx = 0;
+    FRESULT res = FR_OK;
+
+    if (!file || !file->initialized)
+    {
+        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
+        return false;
+    }
+
+    // FatFs state of a removed card is gone, the file is dropped without touching the bus so a reinsert does not reopen it
+    if (!card_present && file->open)
+    {
+        file_discard(file, SUB_TAG);
+        open_files.erase(std::remove(open_files.begin(), open_files.end(), file), open_files.end());
+        parked_files.erase(std::remove(parked_files.begin(), parked_files.end(), file), parked_files.end());
+        return true;
+    }
+
+    if (!usability_check(SUB_TAG))
+        return false;
+
+    // a parked file is opened again, trimming and the final sync need its FIL
+    if (file->open && file->parked && !file_resident(file, SUB_TAG))
+        return false;
+
+    // a suppression still running is reported before the file is closed
+    if (file->open)
+        rate_limit_summary(file, file->priority, SUB_TAG);
+
+    // queued records belong in the file before it is closed
+    if (file->open)
+        drain_file(file, SUB_TAG);
+
+    if (open_files.size() != 0)
+        for (int i = 0; i < open_files.size(); i++)
+        {
+
+            if (strcmp(open_files[i]->path, file->path) == 0)
+            {
+                flush_cache(file, SUB_TAG);
+                free_cache(file);
+                file_pool_trim(file, SUB_TAG);
+                clmt_save(file, SUB_TAG);
+
+                res = bus_f_close(file->stream.get());
+                if (res != FR_OK)
+                {
+                    print_fatfs_error(res, SUB_TAG, "f_close()");
+                }
+                idx = i;
+                found = true;
+            }
+        }
+
+    if (found)
+    {
+        clmt_reset(file, true);
+        open_files.erase(open_files.begin() + idx);
+        open_files.shrink_to_fit();
+        file->open = false;
+    }
+    else
+    {
+        ESP_LOGW(TAG, "%s:  No matching open file found for path: %s", SUB_TAG, file->get_path());
+    }
+
+    // f_close() synced whatever reached the file, tickets past that will never be written
+    durable_resolve(file, found && res == FR_OK, true);
+
+    return found;
+}
+
+bool SDLogger::close_all_files()
+{
+    const constexpr char* SUB_TAG = "SD->close_all_files()";
+
+    ScopedLock lock(io_mutex);
+
+    FRESULT res = FR_OK;
+
+    // FatFs state of a removed card is gone, files are dropped without touching the bus
+    if (!card_present)
+    {
+        for (SDFile& f : open_files)
+            file_discard(f, SUB_TAG);
+
+        for (SDFile& f : parked_files)
+            file_discard(f, SUB_TAG);
+
+        open_files.clear();
+        open_files.shrink_to_fit();
+        parked_files.clear();
+        parked_files.shrink_to_fit();
+
+        return true;
+    }
+
+    // parked files are swapped in and closed one by one
+    while (!parked_files.empty())
+        if (!close_file(parked_files.back()))
+            return false;
+
+    for (SDFile& f : open_files)
+    {
+        drain_file(f, SUB_TAG);
+        flush_cache(f, SUB_TAG);
+        free_cache(f);
+        file_pool_trim(f, SUB_TAG);
+        clmt_save(f, SUB_TAG);
+
+        res = bus_f_close(f->stream.get());
+        durable_resolve(f, res == FR_OK, true);
+
+        if (res != FR_OK)
+        {
+            print_fatfs_error(res, SUB_TAG, "f_close()");
+            return false;
+        }
+
+        f->open = false;
+        clmt_reset(f, true);
+    }
+
+    open_files.clear();
+    open_files.shrink_to_fit();
+
+    return true;
+}
+
+bool SDLogger::create_directory(const char* path, bool suppress_dir_exists_warning)
+{
+    const constexpr char* SUB_TAG = "SD->create_directory()";
+
+    ScopedLock lock(io_mutex);
+
+    FRESULT res = FR_OK;
+
+    if (!usability_check(SUB_TAG))
+        return false;
+
+    res = f_mkdir(drive_path(path).get());
+
+    if (res != FR_OK)
+    {
+
+        switch (res)
+        {
+        case FR_NO_PATH:
+            // attempt to build the path if it doesn't exists
+            if (!build_path(path))
+            {
+                ESP_LOGE(TAG, "%s: Path does not exist and could not be built.", SUB_TAG);
+                return false;
+            }
+            break;
+
+        case FR_EXIST:
+            if (!suppress_dir_exists_warning)
+                ESP_LOGW(TAG, "%s: Directory already exists.", SUB_TAG);
+            return true;
+            break;
+
+        default:
+            print_fatfs_error(res, SUB_TAG, "f_mkdir()");
+            return false;
+            break;
+        }
+    }
+
+    return true;
+}
+
+bool SDLogger::delete_file(SDFile file)
+{
+    const constexpr char* SUB_TAG = "SD->delete_file()";
+
+    ScopedLock lock(io_mutex);
+
+    FRESULT res = FR_OK;
+    DWORD sclust = 0;
+
+    if (!usability_check(SUB_TAG))
+        return false;
+
+    if (!file || !file->initialized)
+    {
+        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
+        return false;
+    }
+
+    if (file->open)
+    {
+        ESP_LOGE(TAG, "%s: Close file before deleting.", SUB_TAG);
+        return false;
+    }
+
+    if (!path_exists(file->path, SUB_TAG))
+        return false;
+
+    // the file's fast seek table goes with it, a new file starting on the same cluster must not pick it up
+    if (cfg.fast_seek_max_fragments > 0)
+        sclust = file_start_cluster(file->path);
+
+    res = f_unlink(drive_path(file->path).get());
+
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_unlink()");
+        return false;
+    }
+
+    if (sclust != 0)
+        clmt_delete(sclust);
+
+    return true;
+}
+
+bool SDLogger::delete_directory(const char* path)
+{
+    const constexpr char* SUB_TAG = "SD->delete_directory()";
+    sd_delete_status_t status = SD_DELETE_IN_PROGRESS;
+
+    if (!delete_directory_begin(path))
+        return false;
+
+    // run the traversal to completion in the caller's context, budget of 0 means no slice limit
+    while (status == SD_DELETE_IN_PROGRESS)
+        status = delete_directory_continue(0);
+
+    if (status != SD_DELETE_DONE)
+        return false;
+
+    if (last_delete_stats.files_skipped > 0)
+        ESP_LOGW(TAG, "%s: %lu open file(s) skipped, directory not removed.", SUB_TAG,
+                static_cast<unsigned long>(last_delete_stats.files_skipped));
+
+    return (last_delete_stats.errors == 0 && last_delete_stats.files_skipped == 0);
+}
+
+bool SDLogger::delete_directory_begin(const char* path)
+{
+    const constexpr char* SUB_TAG = "SD->delete_directory_begin()";
+
+    ScopedLock lock(io_mutex);
+
+    size_t length = 0;
+    FRESULT res = FR_OK;
+
+    if (!usability_check(SUB_TAG))
+        return false;
+
+    if (path == nullptr)
+    {
+        ESP_LOGE(TAG, "%s: Invalid path.", SUB_TAG);
+        return false;
+    }
+
+    if (delete_job)
+    {
+        ESP_LOGE(TAG, "%s: Delete already in progress.", SUB_TAG);
+        return false;
+    }
+
+    delete_job = std::unique_ptr<delete_job_t>(new delete_job_t());
+    if (!delete_job)
+    {
+        ESP_LOGE(TAG, "%s: No heap memory available for delete job.", SUB_TAG);
+        return false;
+    }
+
+    // normalize to a path with a leading '/' and no trailing '/', the root directory is stored as ""
+    if (path[0] != '/')
+        strcpy(delete_job->path, "/");
+
+    length = strlen(delete_job->path) + strlen(path);
+    if (length + 1 > MAX_DELETE_PATH_SZ)
+    {
+        ESP_LOGE(TAG, "%s: Max path length exceeded.", SUB_TAG);
+        delete_job.reset();
+        return false;
+    }
+
+    strcat(delete_job->path, path);
+
+    while (length > 0 && delete_job->path[length - 1] == '/')
+        delete_job->path[--length] = '\0';
+
+    res = f_opendir(&delete_job->dirs[0], drive_path((length > 0) ? delete_job->path : "/").get());
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_opendir()");
+        delete_job.reset();
+        return false;
+    }
+
+    delete_job->parent_path_len[0] = length;
+    delete_job->blocked[0] = false;
+    delete_job->depth = 1;
+
+    // pool files inside the directory go with it, the pools are rescanned once the delete is done
+    file_pool_forget(delete_job->path);
+
+    return true;
+}
+
+sd_delete_status_t SDLogger::delete_directory_continue(uint32_t budget_us)
+{
+    const constexpr char* SUB_TAG = "SD->delete_directory_continue()";
+
+    ScopedLock lock(io_mutex);
+
+    const int64_t start_us = esp_timer_get_time();
+    FRESULT res = FR_OK;
+    uint8_t level = 0;
+
+    if (!usability_check(SUB_TAG))
+        return SD_DELETE_ERROR;
+
+    if (!delete_job)
+    {
+        ESP_LOGE(TAG, "%s: No delete in progress.", SUB_TAG);
+        return SD_DELETE_ERROR;
+    }
+
+    delete_job->stats.slices++;
+
+    while (delete_job->depth > 0)
+    {
+        if (budget_us > 0 && (esp_timer_get_time() - start_us) >= budget_us)
+        {
+            delete_job->stats.elapsed_us += esp_timer_get_time() - start_us;
+            return SD_DELETE_IN_PROGRESS;
+        }
+
+        level = delete_job->depth - 1;
+
+        res = f_readdir(&delete_job->dirs[level], &delete_job->fno);
+        if (res != FR_OK)
+        {
+            print_fatfs_error(res, SUB_TAG, "f_readdir()");
+            delete_job->stats.errors++;
+            delete_job->blocked[level] = true;
+            delete_job->fno.fname[0] = '\0'; // abandon this level
+        }
+
+        // end of directory reached, remove what is left in the batch then the directory itself
+        if (delete_job->fno.fname[0] == '\0')
+        {
+            delete_job_flush_batch(SUB_TAG);
+            delete_job_pop(SUB_TAG);
+            continue;
+        }
+
+        if (delete_job->fno.fattrib & AM_DIR)
+        {
+            // batch entries are relative to the current level, they must be removed before descending
+            delete_job_flush_batch(SUB_TAG);
+
+            if (!delete_job_push(delete_job->fno.fname, SUB_TAG))
+            {
+                delete_job->stats.errors++;
+                delete_job->blocked[level] = true;
+            }
+        }
+        else
+        {
+            // only files that reached the sidecar size can have a fast seek table to delete along with them
+            delete_job->batch_sidecar[delete_job->batch_count] =
+                    (cfg.fast_seek_max_fragments > 0 && delete_job->fno.fsize >= cfg.fast_seek_sidecar_sz);
+            strcpy(delete_job->batch[delete_job->batch_count++], delete_job->fno.fname);
+
+            if (delete_job->batch_count == DELETE_BATCH_SZ)
+                delete_job_flush_batch(SUB_TAG);
+        }
+    }
+
+    delete_job->stats.elapsed_us += esp_timer_get_time() - start_us;
+    last_delete_stats = delete_job->stats;
+    delete_job.reset();
+
+    return SD_DELETE_DONE;
+}
+
+bool SDLogger::delete_directory_cancel()
+{
+    const constexpr char* SUB_TAG = "SD->delete_directory_cancel()";
+
+    ScopedLock lock(io_mutex);
+
+    if (!delete_job)
+    {
+        ESP_LOGW(TAG, "%s: No delete in progress.", SUB_TAG);
+        return false;
+    }
+
+    for (uint8_t i = 0; i < delete_job->depth; i++)
+        f_closedir(&delete_job->dirs[i]);
+
+    last_delete_stats = delete_job->stats;
+    delete_job.reset();
+
+    return true;
+}
+
+bool SDLogger::delete_directory_in_progress()
+{
+    return (delete_job != nullptr);
+}
+
+bool SDLogger::get_delete_stats(sd_delete_stats_t& stats)
+{
+    if (delete_job)
+        stats = delete_job->stats;
+    else
+        stats = last_delete_stats;
+
+    return true;
+}
+
+bool SDLogger::delete_job_push(const char* name, const char* SUB_TAG)
+{
+    const size_t parent_len = strlen(delete_job->path);
+    const uint8_t level = delete_job->depth;
+    FRESULT res = FR_OK;
+
+    if (level >= MAX_DELETE_DEPTH)
+    {
+        ESP_LOGE(TAG, "%s: Max directory depth exceeded at %s/%s.", SUB_TAG, delete_job->path, name);
+        return false;
+    }
+
+    if (parent_len + strlen(name) + 2 > MAX_DELETE_PATH_SZ)
+    {
+        ESP_LOGE(TAG, "%s: Max path length exceeded at %s/%s.", SUB_TAG, delete_job->path, name);
+        return false;
+    }
+
+    strcat(delete_job->path, "/");
+    strcat(delete_job->path, name);
+
+    res = f_opendir(&delete_job->dirs[level], drive_path(delete_job->path).get());
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_opendir()");
+        delete_job->path[parent_len] = '\0';
+        return false;
+    }
+
+    delete_job->parent_path_len[level] = parent_len;
+    delete_job->blocked[level] = false;
+    delete_job->depth++;
+
+    return true;
+}
+
+void SDLogger::delete_job_pop(const char* SUB_TAG)
+{
+    const uint8_t level = delete_job->depth - 1;
+    FRESULT res = FR_OK;
+
+    f_closedir(&delete_job->dirs[level]);
+
+    // the root directory itself can never be removed, only emptied
+    if (!delete_job->blocked[level] && delete_job->path[0] != '\0')
+    {
+        res = f_unlink(drive_path(delete_job->path).get());
+
+        if (res == FR_OK)
+        {
+            delete_job->stats.dirs_deleted++;
+        }
+        else
+        {
+            print_fatfs_error(res, SUB_TAG, "f_unlink()");
+            delete_job->stats.errors++;
+            delete_job->blocked[level] = true;
+        }
+    }
+
+    // a directory that could not be emptied keeps all of its parents alive as well
+    if (level > 0 && delete_job->blocked[level])
+        delete_job->blocked[level - 1] = true;
+
+    delete_job->path[delete_job->parent_path_len[level]] = '\0';
+    delete_job->depth--;
+}
+
+void SDLogger::delete_job_flush_batch(const char* SUB_TAG)
+{
+    const uint8_t level = delete_job->depth - 1;
+    char file_path[MAX_DELETE_PATH_SZ];
+    DWORD sclust = 0;
+    FRESULT res = FR_OK;
+
+    for (uint8_t i = 0; i < delete_job->batch_count; i++)
+    {
+        if (strlen(delete_job->path) + strlen(delete_job->batch[i]) + 2 > MAX_DELETE_PATH_SZ)
+        {
+            ESP_LOGE(TAG, "%s: Max path length exceeded at %s/%s.", SUB_TAG, delete_job->path, delete_job->batch[i]);
+            delete_job->stats.errors++;
+            delete_job->blocked[level] = true;
+            continue;
+        }
+
+        strcpy(file_path, delete_job->path);
+        strcat(file_path, "/");
+        strcat(file_path, delete_job->batch[i]);
+
+        if (is_path_open(file_path))
+        {
+            ESP_LOGW(TAG, "%s: Skipping open file %s.", SUB_TAG, file_path);
+            delete_job->stats.files_skipped++;
+            delete_job->blocked[level] = true;
+            continue;
+        }
+
+        sclust = delete_job->batch_sidecar[i] ? file_start_cluster(file_path) : 0;
+
+        res = f_unlink(drive_path(file_path).get());
+        if (res == FR_OK)
+        {
+            delete_job->stats.files_deleted++;
+
+            if (sclust != 0)
+                clmt_delete(sclust);
+        }
+        else
+        {
+            print_fatfs_error(res, SUB_TAG, "f_unlink()");
+            delete_job->stats.errors++;
+            delete_job->blocked[level] = true;
+        }
+    }
+
+    delete_job->batch_count = 0;
+}
+
+bool SDLogger::add_file_pool(const char* directory, size_t count, uint32_t preallocate_sz)
+{
+    const constexpr char* SUB_TAG = "SD->add_file_pool()";
+
+    ScopedLock lock(io_mutex);
+
+    char normalized[MAX_POOL_DIR_SZ];
+    file_pool_t* pool = nullptr;
+
+    if (directory == nullptr || !file_pool_normalize(directory, normalized))
+    {
+        ESP_LOGE(TAG, "%s: Invalid directory.", SUB_TAG);
+        return false;
+    }
+
+    if (count == 0)
+    {
+        ESP_LOGE(TAG, "%s: Pool must keep at least one file ready.", SUB_TAG);
+        return false;
+    }
+
+    pool = file_pool_find(normalized);
+    if (pool == nullptr)
+    {
+        if (file_pools.size() >= MAX_FILE_POOLS)
+        {
+            ESP_LOGE(TAG, "%s: Max file pools already added.", SUB_TAG);
+            return false;
+        }
+
+        file_pools.emplace_back();
+        pool = &file_pools.back();
+        strcpy(pool->directory, normalized);
+        pool->next_number = 0;
+        pool->scanned = false;
+    }
+
+    // a pool whose count shrinks hands out its surplus files before creating new ones
+    pool->count = count;
+    pool->preallocate_sz = preallocate_sz;
+
+    pool_refill_due = true;
+    pool_retry_us = 0;
+
+    if (io_task_hdl != nullptr)
+        xTaskNotifyGive(io_task_hdl);
+
+    return true;
+}
+
+bool SDLogger::remove_file_pool(const char* directory)
+{
+    const constexpr char* SUB_TAG = "SD->remove_file_pool()";
+
+    ScopedLock lock(io_mutex);
+
+    char normalized[MAX_POOL_DIR_SZ];
+    char path[MAX_POOL_PATH_SZ];
+    file_pool_t* pool = nullptr;
+    FRESULT res = FR_OK;
+
+    if (directory == nullptr || !file_pool_normalize(directory, normalized))
+    {
+        ESP_LOGE(TAG, "%s: Invalid directory.", SUB_TAG);
+        return false;
+    }
+
+    pool = file_pool_find(normalized);
+    if (pool == nullptr)
+    {
+        ESP_LOGW(TAG, "%s: No file pool for %s.", SUB_TAG, directory);
+        return false;
+    }
+
+    // files already handed out belong to the application, only the unused ones are deleted
+    if (mounted && card_present)
+        for (const pool_entry_t& entry : pool->ready)
+        {
+            file_pool_path(*pool, entry.number, path);
+
+            res = f_unlink(drive_path(path).get());
+            if (res != FR_OK)
+                print_fatfs_error(res, SUB_TAG, "f_unlink()");
+        }
+
+    file_pools.erase(file_pools.begin() + (pool - file_pools.data()));
+
+    return true;
+}
+
+bool SDLogger::fill_file_pools(uint32_t budget_us)
+{
+    const constexpr char* SUB_TAG = "SD->fill_file_pools()";
+
+    ScopedLock lock(io_mutex);
+
+    const int64_t start_us = esp_timer_get_time();
+    bool short_pool = false;
+
+    if (!usability_check(SUB_TAG))
+        return false;
+
+    pool_refill_due = false;
+
+    for (file_pool_t& pool : file_pools)
+    {
+        // files left by an earlier mount are adopted first so their numbers are never reused
+        if (!pool.scanned)
+        {
+            if (!file_pool_scan(pool, SUB_TAG))
+            {
+                pool_retry_us = esp_timer_get_time() + (POOL_RETRY_MS * 1000LL);
+                pool_refill_due = true;
+                return false;
+            }
+
+            pool.scanned = true;
+        }
+
+        while (pool.ready.size() < pool.count)
+        {
+            if (budget_us > 0 && (esp_timer_get_time() - start_us) >= budget_us)
+            {
+                short_pool = true;
+                break;
+            }
+
+            if (!file_pool_create(pool, SUB_TAG))
+            {
+                pool_retry_us = esp_timer_get_time() + (POOL_RETRY_MS * 1000LL);
+                pool_refill_due = true;
+                return false;
+            }
+        }
+    }
+
+    pool_refill_due = short_pool;
+
+    return true;
+}
+
+bool SDLogger::get_file_pool_stats(const char* directory, sd_file_pool_stats_t& stats)
+{
+    const constexpr char* SUB_TAG = "SD->get_file_pool_stats()";
+
+    ScopedLock lock(io_mutex);
+
+    char normalized[MAX_POOL_DIR_SZ];
+    file_pool_t* pool = nullptr;
+
+    if (directory == nullptr || !file_pool_normalize(directory, normalized) || (pool = file_pool_find(normalized)) == nullptr)
+    {
+        ESP_LOGE(TAG, "%s: No file pool for directory.", SUB_TAG);
+        return false;
+    }
+
+    stats = pool->stats;
+    stats.ready = pool->ready.size();
+
+    return true;
+}
+
+SDLogger::file_pool_t* SDLogger::file_pool_find(const char* directory)
+{
+    for (file_pool_t& pool : file_pools)
+        if (strcasecmp(pool.directory, directory) == 0)
+            return &pool;
+
+    return nullptr;
+}
+
+SDLogger::file_pool_t* SDLogger::file_pool_take(SDFile file, pool_entry_t& entry, const char* SUB_TAG)
+{
+    file_pool_t* pool = file_pool_find(file->directory_path);
+    char path[MAX_POOL_PATH_SZ];
+    FRESULT res = FR_OK;
+
+    if (pool == nullptr)
+        return nullptr;
+
+    pool_refill_due = true;
+
+    while (!pool->ready.empty())
+    {
+        entry = pool->ready.front();
+        pool->ready.pop_front();
+
+        file_pool_path(*pool, entry.number, path);
+
+        res = f_rename(drive_path(path).get(), drive_path(file->path).get());
+        if (res == FR_OK)
+        {
+            file->preallocated = entry.preallocated;
+            pool->stats.taken++;
+            return pool;
+        }
+
+        // an existing file is opened the regular way and keeps its contents, the pool file waits for the next open
+        if (res == FR_EXIST)
+        {
+            pool->ready.push_front(entry);
+            pool->stats.collisions++;
+            return nullptr;
+        }
+
+        // the pool file was removed behind the pool's back, try the next one
+        print_fatfs_error(res, SUB_TAG, "f_rename()");
+    }
+
+    pool->stats.empty++;
+
+    return nullptr;
+}
+
+void SDLogger::file_pool_give_back(file_pool_t& pool, const pool_entry_t& entry, SDFile file, const char* SUB_TAG)
+{
+    char path[MAX_POOL_PATH_SZ];
+    FRESULT res = FR_OK;
+
+    file->preallocated = false;
+    file_pool_path(pool, entry.number, path);
+
+    // the open failed after the rename, the pool file returns under its pool name instead of staying at the caller's path
+    res = f_rename(drive_path(file->path).get(), drive_path(path).get());
+    if (res == FR_OK)
+    {
+        pool.ready.push_front(entry);
+        pool.stats.taken--;
+        return;
+    }
+
+    print_fatfs_error(res, SUB_TAG, "f_rename()");
+
+    if (f_unlink(drive_path(file->path).get()) != FR_OK)
+        ESP_LOGW(TAG, "%s: Pool file left at %s.", SUB_TAG, file->get_path());
+}
+
+bool SDLogger::file_pool_scan(file_pool_t& pool, const char* SUB_TAG)
+{
+    std::unique_ptr<FF_DIR> dir(new FF_DIR());
+    std::unique_ptr<FILINFO> fno(new FILINFO());
+    char path[MAX_POOL_PATH_SZ];
+    char* end = nullptr;
+    unsigned long number = 0;
+    FRESULT res = FR_OK;
+
+    pool.ready.clear();
+    pool.next_number = 0;
+
+    res = f_opendir(dir.get(), drive_path((strlen(pool.directory) > 0) ? pool.directory : "/").get());
+
+    // nothing to adopt, the directory is created for the first pool file
+    if (res == FR_NO_PATH || res == FR_NO_FILE)
+        return build_path(pool.directory);
+
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_opendir()");
+        return false;
+    }
+
+    while ((res = f_readdir(dir.get(), fno.get())) == FR_OK && fno->fname[0] != '\0')
+    {
+        if ((fno->fattrib & AM_DIR) || strlen(fno->fname) != 12 || strncasecmp(fno->fname, "SDLP", 4) != 0 ||
+                strcasecmp(fno->fname + 8, ".TMP") != 0)
+            continue;
+
+        number = strtoul(fno->fname + 4, &end, 16);
+        if (end != fno->fname + 8)
+            continue;
+
+        file_pool_path(pool, static_cast<uint16_t>(number), path);
+
+        if (number >= pool.next_number)
+            pool.next_number = static_cast<uint16_t>(number + 1);
+
+        // a pool file holding anything but its reserved clusters was written to, surplus files are not kept either
+        if ((fno->fsize == 0 || fno->fsize == pool.preallocate_sz) && pool.ready.size() < pool.count)
+        {
+            pool.ready.push_back({static_cast<uint16_t>(number), fno->fsize > 0});
+            pool.stats.adopted++;
+        }
+        else if (f_unlink(drive_path(path).get()) != FR_OK)
+        {
+            ESP_LOGW(TAG, "%s: Failed to remove stale pool file %s.", SUB_TAG, path);
+        }
+    }
+
+    f_closedir(dir.get());
+
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_readdir()");
+        return false;
+    }
+
+    return true;
+}
+
+bool SDLogger::file_pool_create(file_pool_t& pool, const char* SUB_TAG)
+{
+    std::unique_ptr<FIL> fil(new FIL());
+    char path[MAX_POOL_PATH_SZ];
+    pool_entry_t entry = {0, false};
+    FRESULT res = FR_EXIST;
+
+    // numbers wrap after 0xFFFF, ones still held by the pool or the application are skipped
+    for (uint8_t attempt = 0; attempt < POOL_CREATE_ATTEMPTS && res == FR_EXIST; attempt++)
+    {
+        entry.number = pool.next_number++;
+        file_pool_path(pool, entry.number, path);
+
+        res = bus_f_open(fil.get(), path, FA_CREATE_NEW | FA_WRITE);
+    }
+
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_open()");
+        return false;
+    }
+
+#if FF_USE_EXPAND
+    // one contiguous run, writes to the file never allocate clusters and go out as long multi-sector transfers
+    if (pool.preallocate_sz > 0)
+    {
+        res = f_expand(fil.get(), pool.preallocate_sz, 1);
+        if (res == FR_OK)
+        {
+            entry.preallocated = true;
+        }
+        else
+        {
+            ESP_LOGW(TAG, "%s: No contiguous space for %lu bytes, %s stays empty.", SUB_TAG,
+                    static_cast<unsigned long>(pool.preallocate_sz), path);
+            pool.stats.prealloc_failures++;
+        }
+    }
+#endif
+
+    res = bus_f_close(fil.get());
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_close()");
+        f_unlink(drive_path(path).get());
+        return false;
+    }
+
+    pool.ready.push_back(entry);
+    pool.stats.created++;
+
+    return true;
+}
+
+bool SDLogger::file_pool_trim(SDFile file, const char* SUB_TAG)
+{
+    FRESULT res = FR_OK;
+
+    if (!file->preallocated)
+        return true;
+
+    file->preallocated = false;
+
+    if (!clmt_seek(file, std::min(file->data_end, f_size(file->stream.get())), SUB_TAG))
+        return false;
+
+    // release the reserved clusters past the written data, the chain map no longer matches the FAT
+    res = f_truncate(file->stream.get());
+
+    if (file->clmt_active)
+        clmt_reset(file);
+
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_truncate()");
+        return false;
+    }
+
+    return true;
+}
+
+void SDLogger::file_pool_forget(const char* path)
+{
+    const size_t length = (path != nullptr) ? strlen(path) : 0;
+
+    for (file_pool_t& pool : file_pools)
+    {
+        // only pools at or below a deleted directory lose their files
+        if (path != nullptr && (strncasecmp(pool.directory, path, length) != 0 ||
+                                       (pool.directory[length] != '\0' && pool.directory[length] != '/')))
+            continue;
+
+        pool.ready.clear();
+        pool.scanned = false;
+    }
+
+    pool_refill_due = !file_pools.empty();
+}
+
+bool SDLogger::file_pool_normalize(const char* directory, char* normalized)
+{
+    size_t length = 0;
+
+    // same form as File::directory_path, a leading '/' and no trailing '/', the root directory is stored as ""
+    normalized[0] = '\0';
+    if (directory[0] != '/')
+        strcpy(normalized, "/");
+
+    length = strlen(normalized) + strlen(directory);
+    if (length + 1 > MAX_POOL_DIR_SZ)
+        return false;
+
+    strcat(normalized, directory);
+
+    while (length > 0 && normalized[length - 1] == '/')
+        normalized[--length] = '\0';
+
+    return true;
+}
+
+void SDLogger::file_pool_path(const file_pool_t& pool, uint16_t number, char* path)
+{
+    snprintf(path, MAX_POOL_PATH_SZ, "%s/SDLP%04X.TMP", pool.directory, static_cast<unsigned>(number));
+}
+
+bool SDLogger::is_path_open(const char* path)
+{
+    for (SDFile& f : open_files)
+        if (strcasecmp(f->path, path) == 0)
+            return true;
+
+    for (SDFile& f : parked_files)
+        if (strcasecmp(f->path, path) == 0)
+            return true;
+
+    return false;
+}
+
+bool SDLogger::file_resident(SDFile file, const char* SUB_TAG)
+{
+    FRESULT res = FR_OK;
+
+    if (!file->parked)
+        return true;
+
+    if (open_files.size() + 1 > max_open_files && !file_park_oldest(file, SUB_TAG))
+        return false;
+
+    file->stream.reset(new FIL());
+
+    // same reopen as after a card removal, the position was kept at park time
+    res = bus_f_open(file->stream.get(), file->path, (file->open_mode & (FA_READ | FA_WRITE)) | FA_OPEN_ALWAYS);
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_open()");
+        file->stream.reset();
+        return false;
+    }
+
+    if (cfg.fast_seek_max_fragments > 0)
+        clmt_open(file, false, SUB_TAG);
+
+    if (!clmt_seek(file, file->resume_offset, SUB_TAG))
+    {
+        bus_f_close(file->stream.get());
+        file->stream.reset();
+        clmt_reset(file, true);
+        return false;
+    }
+
+    parked_files.erase(std::find(parked_files.begin(), parked_files.end(), file));
+    open_files.push_back(file);
+    file->parked = false;
+    file->unsynced = false;
+    file->stats.reopens++;
+
+    // failure leaves the file writing uncached, as in open_file()
+    alloc_cache(file, SUB_TAG);
+
+    return true;
+}
+
+bool SDLogger::file_park(SDFile file, const char* SUB_TAG)
+{
+    FRESULT res = FR_OK;
+
+    // a parked file holds neither its write cache nor its FIL, the next write opens it again and allocates both
+    if (!flush_cache(file, SUB_TAG))
+        return false;
+
+    free_cache(file);
+
+    file->resume_offset = f_tell(file->stream.get());
+    clmt_save(file, SUB_TAG);
+
+    res = bus_f_close(file->stream.get());
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_close()");
+        return false;
+    }
+
+    file->stream.reset();
+    clmt_reset(file, true);
+
+    open_files.erase(std::find(open_files.begin(), open_files.end(), file));
+    parked_files.push_back(file);
+    file->parked = true;
+
+    return true;
+}
+
+bool SDLogger::file_park_oldest(SDFile keep, const char* SUB_TAG)
+{
+    SDFile oldest = nullptr;
+
+    for (SDFile& f : open_files)
+        if (f != keep && (!oldest || f->last_use < oldest->last_use))
+            oldest = f;
+
+    if (!oldest)
+    {
+        ESP_LOGE(TAG, "%s: No open file to park.", SUB_TAG);
+        return false;
+    }
+
+    return file_park(oldest, SUB_TAG);
+}
+
+void SDLogger::file_discard(SDFile file, const char* SUB_TAG)
+{
+    WriteBatch batch;
+
+    {
+        ScopedLock queue_lock(queue_mutex);
+        extract_file_records(file, batch);
+    }
+
+    notify_space_waiters();
+
+    if (!batch.empty() || file->cache_len > 0)
+        ESP_LOGW(TAG, "%s: Card removed, discarding unwritten data of %s.", SUB_TAG, file->get_path());
+
+    for (queued_write_t& record : batch)
+    {
+        file->stats.records_dropped++;
+        file->stats.bytes_dropped += record.length;
+        ticket_lost(file, record.ticket, record.ticket);
+    }
+
+    // written to the cache or FatFs but never synced, a sync after the file is opened again must not vouch for them
+    if (file->written_seq != file->durable_seq)
+        ticket_lost(file, file->durable_seq + 1, file->written_seq);
+
+    free_cache(file);
+    clmt_reset(file, true);
+    file->open = false;
+    file->parked = false;
+    durable_resolve(file, false, true);
+}
+
+bool SDLogger::file_exists(SDFile file)
+{
+    const constexpr char* SUB_TAG = "SD->file_exists()";
+
+    ScopedLock lock(io_mutex);
+
+    if (!file || !file->initialized)
+    {
+        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
+        return false;
+    }
+
+    if (!path_exists(file->path, SUB_TAG))
+        return false;
+
+    return true;
+}
+
+bool SDLogger::path_exists(const char* path)
+{
+    const constexpr char* SUB_TAG = "SD->path_exists()";
+
+    ScopedLock lock(io_mutex);
+
+    if (!path_exists(path, SUB_TAG))
+        return false;
+
+    return true;
+}
+
+bool SDLogger::build_path(const char* path)
+{
+    const constexpr char* SUB_TAG = "SD->build_path()";
+
+    const char* start = path;
+    const char* end;
+    size_t length;
+    char* part = nullptr;
+    char path_str[100] = "";
+
+    while ((end = strchr(start, '/')) != nullptr)
+    {
+        length = end - start;
+
+        if (length > 0)
+        {
+            part = static_cast<char*>(malloc(length));
+
+            if (part == nullptr)
+            {
+                ESP_LOGE(TAG, "%s: No heap memory available to parse path.", SUB_TAG);
+                return false;
+            }
+
+            part[length] = '\0';
+            strncpy(part, start, length);
+            strcat(path_str, "/");
+            strcat(path_str, part);
+            free(part);
+
+            if (!path_exists(path_str, SUB_TAG, true))
+                if (!create_directory(path_str, true))
+                    return false;
+        }
+
+        start = end + 1;
+    }
+
+    if (start != nullptr)
+    {
+
+        part = static_cast<char*>(malloc(strlen(start)));
+
+        if (part == nullptr)
+        {
+            ESP_LOGE(TAG, "%s: No heap memory available to parse path.", SUB_TAG);
+            return false;
+        }
+
+        strcpy(part, start);
+        strcat(path_str, "/");
+        strcat(path_str, part);
+        free(part);
+
+        if (!path_exists(path_str, SUB_TAG, true))
+            if (!create_directory(path_str, true))
+                return false;
+    }
+
+    return true;
+}
+
+bool SDLogger::write(SDFile file, const char* data)
+{
+    const constexpr char* SUB_TAG = "SD->write()";
+
+    if (!file || !file->initialized)
+    {
+        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
+        return false;
+    }
+
+    return status_ok(submit(file, data, strlen(data), false, file->priority, SUB_TAG));
+}
+
+bool SDLogger::write(SDFile file, const char* data, sd_priority_t priority)
+{
+    const constexpr char* SUB_TAG = "SD->write()";
+
+    return status_ok(submit(file, data, strlen(data), false, priority, SUB_TAG));
+}
+
+bool SDLogger::write_line(SDFile file, const char* line)
+{
+    const constexpr char* SUB_TAG = "SD->write_line()";
+
+    if (!file || !file->initialized)
+    {
+        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
+        return false;
+    }
+
+    return status_ok(submit(file, line, strlen(line), true, file->priority, SUB_TAG));
+}
+
+bool SDLogger::write_line(SDFile file, const char* line, sd_priority_t priority)
+{
+    const constexpr char* SUB_TAG = "SD->write_line()";
+
+    return status_ok(submit(file, line, strlen(line), true, priority, SUB_TAG));
+}
+
+sd_write_status_t SDLogger::try_write(SDFile file, const void* data, size_t length)
+{
+    const constexpr char* SUB_TAG = "SD->try_write()";
+
+    if (!file || !file->initialized)
+    {
+        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
+        return SD_WRITE_ERROR;
+    }
+
+    return submit(file, static_cast<const char*>(data), length, false, file->priority, SUB_TAG);
+}
+
+sd_write_status_t SDLogger::try_write(SDFile file, const void* data, size_t length, sd_priority_t priority)
+{
+    const constexpr char* SUB_TAG = "SD->try_write()";
+
+    return submit(file, static_cast<const char*>(data), length, false, priority, SUB_TAG);
+}
+
+sd_write_status_t SDLogger::try_write(SDFile file, const SDBuffer& data, size_t length, sd_priority_t priority)
+{
+    const constexpr char* SUB_TAG = "SD->try_write()";
+
+    if (!data)
+    {
+        ESP_LOGE(TAG, "%s: Invalid buffer.", SUB_TAG);
+        return SD_WRITE_ERROR;
+    }
+
+    // the queued record references the buffer instead of copying it
+    return submit(file, data.get(), length, false, priority, SUB_TAG, &data);
+}
+
+sd_write_status_t SDLogger::try_write(SDFile file, const void* data, size_t length, sd_priority_t priority, uint32_t& ticket)
+{
+    const constexpr char* SUB_TAG = "SD->try_write()";
+
+    ticket = 0;
+
+    return submit(file, static_cast<const char*>(data), length, false, priority, SUB_TAG, nullptr, &ticket);
+}
+
+bool SDLogger::wait_durable(SDFile file, uint32_t ticket, uint32_t timeout_ms)
+{
+    const constexpr char* SUB_TAG = "SD->wait_durable()";
+    StaticSemaphore_t done_buffer;
+    SemaphoreHandle_t done = nullptr;
+    TaskHandle_t task = nullptr;
+    bool durable = false;
+
+    if (!file || !file->initialized)
+    {
+        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
+        return false;
+    }
+
+    {
+        ScopedLock queue_lock(queue_mutex);
+
+        if (ticket == 0 || !ticket_reached(file->write_seq, ticket))
+        {
+            ESP_LOGE(TAG, "%s: Invalid ticket.", SUB_TAG);
+            return false;
+        }
+
+        if (ticket_durable(file, ticket))
+            return true;
+
+        if (ticket_was_lost(file, ticket))
+            return false;
+
+        if (!file->open)
+        {
+            ESP_LOGE(TAG, "%s: File not open.", SUB_TAG);
+            return false;
+        }
+
+        done = xSemaphoreCreateBinaryStatic(&done_buffer);
+        durable_waiters.push_back({file, ticket, nullptr, nullptr, done, &durable});
+        queue_stats.durable_waits++;
+        task = io_task_hdl;
+    }
+
+    // without an io task the caller syncs the file itself
+    if (task == nullptr)
+        sync(file);
+    else
+        xTaskNotifyGive(task);
+
+    if (xSemaphoreTake(done, pdMS_TO_TICKS(timeout_ms)) != pdTRUE)
+    {
+        ScopedLock queue_lock(queue_mutex);
+
+        // the semaphore lives on this stack, the waiter must be gone before returning; if it is already gone the io task
+        // resolved it between the timeout and taking the lock and durable holds the result
+        for (auto it = durable_waiters.begin(); it != durable_waiters.end(); ++it)
+            if (it->done == done)
+            {
+                durable_waiters.erase(it);
+                break;
+            }
+    }
+
+    vSemaphoreDelete(done);
+
+    return durable;
+}
+
+bool SDLogger::on_durable(SDFile file, uint32_t ticket, DurableCallback callback, void* arg)
+{
+    const constexpr char* SUB_TAG = "SD->on_durable()";
+    TaskHandle_t task = nullptr;
+    bool durable = false;
+
+    if (!file || !file->initialized || callback == nullptr)
+    {
+        ESP_LOGE(TAG, "%s: File not correctly initialized or no callback.", SUB_TAG);
+        return false;
+    }
+
+    {
+        ScopedLock queue_lock(queue_mutex);
+
+        if (ticket == 0 || !ticket_reached(file->write_seq, ticket))
+        {
+            ESP_LOGE(TAG, "%s: Invalid ticket.", SUB_TAG);
+            return false;
+        }
+
+        durable = ticket_durable(file, ticket);
+
+        if (!durable && !ticket_was_lost(file, ticket))
+        {
+            if (!file->open)
+            {
+                ESP_LOGE(TAG, "%s: File not open.", SUB_TAG);
+                return false;
+            }
+
+            durable_waiters.push_back({file, ticket, callback, arg, nullptr, nullptr});
+            queue_stats.durable_waits++;
+            task = io_task_hdl;
+            callback = nullptr;
+        }
+    }
+
+    // already synced or lost, called right away from the caller's context
+    if (callback != nullptr)
+    {
+        callback(file, ticket, durable, arg);
+        return true;
+    }
+
+    if (task == nullptr)
+        sync(file);
+    else
+        xTaskNotifyGive(task);
+
+    return true;
+}
+
+bool SDLogger::is_durable(SDFile file, uint32_t ticket)
+{
+    if (!file || ticket == 0)
+        return false;
+
+    ScopedLock queue_lock(queue_mutex);
+
+    return ticket_durable(file, ticket);
+}
+
+bool SDLogger::write_block(SDFile file, const void* data, size_t length)
+{
+    const constexpr char* SUB_TAG = "SD->write_block()";
+
+    budget_pace(SD_PRIORITY_BULK);
+
+    ScopedLock lock(io_mutex);
+
+    if (!usability_check(SUB_TAG))
+        return false;
+
+    if (!file || !file->initialized || !file->open)
+    {
+        ESP_LOGE(TAG, "%s: File not open.", SUB_TAG);
+        return false;
+    }
+
+    // bypasses the write queue for dumps larger than it, records queued before stay ahead of the block
+    if (!drain_file(file, SUB_TAG))
+        return false;
+
+    if (!write_bytes(file, static_cast<const char*>(data), length, SUB_TAG))
+        return false;
+
+    file->stats.records_written++;
+
+    return true;
+}
+
+bool SDLogger::set_overflow_policy(SDFile file, sd_overflow_policy_t policy, uint32_t block_timeout_ms)
+{
+    const constexpr char* SUB_TAG = "SD->set_overflow_policy()";
+
+    if (!file || !file->initialized)
+    {
+        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
+        return false;
+    }
+
+    if (policy > SD_OVERFLOW_DROP_LOW_PRIORITY)
+    {
+        ESP_LOGE(TAG, "%s: Invalid overflow policy.", SUB_TAG);
+        return false;
+    }
+
+    ScopedLock queue_lock(queue_mutex);
+    file->overflow_policy = policy;
+    file->block_timeout_ms = block_timeout_ms;
+    file->overflow_policy_set = true;
+
+    return true;
+}
+
+bool SDLogger::set_rate_limit(SDFile file, const sd_rate_limit_t& limit)
+{
+    const constexpr char* SUB_TAG = "SD->set_rate_limit()";
+
+    if (!file || !file->initialized)
+    {
+        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
+        return false;
+    }
+
+    ScopedLock queue_lock(queue_mutex);
+    file->rate_limit = limit;
+
+    if (file->rate_limit.burst_bytes == 0)
+        file->rate_limit.burst_bytes = limit.bytes_per_s;
+
+    // a new limit starts with a full bucket, a suppression still running is reported by the next record that passes
+    file->rate_tokens = file->rate_limit.burst_bytes * 1000000LL;
+    file->rate_refill_us = esp_timer_get_time();
+    file->sample_count = 0;
+
+    return true;
+}
+
+bool SDLogger::set_bandwidth_budget(uint32_t kib_per_s)
+{
+    ScopedLock lock(io_mutex);
+
+    ScopedLock queue_lock(queue_mutex);
+
+    cfg.bandwidth_budget_kib_s = kib_per_s;
+    budget_tokens = 0;
+    budget_refill_us = esp_timer_get_time();
+
+    return true;
+}
+
+bool SDLogger::get_file_stats(SDFile file, sd_file_stats_t& stats)
+{
+    const constexpr char* SUB_TAG = "SD->get_file_stats()";
+
+    if (!file || !file->initialized)
+    {
+        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
+        return false;
+    }
+
+    ScopedLock lock(io_mutex);
+    ScopedLock queue_lock(queue_mutex);
+    stats = file->stats;
+
+    return true;
+}
+
+bool SDLogger::get_queue_stats(sd_queue_stats_t& stats)
+{
+    ScopedLock queue_lock(queue_mutex);
+
+    stats = queue_stats;
+    stats.queued_bytes = queued_bytes[SD_PRIORITY_BULK] + queued_bytes[SD_PRIORITY_CRITICAL];
+
+    return true;
+}
+
+bool SDLogger::set_priority(SDFile file, sd_priority_t priority)
+{
+    const constexpr char* SUB_TAG = "SD->set_priority()";
+
+    if (!file || !file->initialized)
+    {
+        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
+        return false;
+    }
+
+    if (priority >= SD_PRIORITY_MAX)
+    {
+        ESP_LOGE(TAG, "%s: Invalid priority.", SUB_TAG);
+        return false;
+    }
+
+    file->priority = priority;
+
+    return true;
+}
+
+bool SDLogger::sync(SDFile file)
+{
+    const constexpr char* SUB_TAG = "SD->sync()";
+    FRESULT res = FR_OK;
+
+    ScopedLock lock(io_mutex);
+
+    if (!usability_check(SUB_TAG))
+        return false;
+
+    if (!file || !file->initialized)
+    {
+        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
+        return false;
+    }
+
+    if (!file->open)
+    {
+        ESP_LOGE(TAG, "%s: File not open.", SUB_TAG);
+        return false;
+    }
+
+    if (!drain_file(file, SUB_TAG) || !flush_cache(file, SUB_TAG))
+    {
+        durable_resolve(file, false);
+        return false;
+    }
+
+    // still parked means nothing was written since f_close() synced it
+    if (file->parked)
+    {
+        durable_resolve(file, true);
+        return true;
+    }
+
+    res = trace_f_sync(file->stream.get());
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_sync()");
+        durable_resolve(file, false);
+        return false;
+    }
+
+    file->unsynced = false;
+    durable_resolve(file, true);
+
+    // keep the saved fast seek table close to the file's end so a resume after power loss walks few clusters
+    if (file->clmt_active && f_size(file->stream.get()) >= file->clmt_saved_sz + cfg.fast_seek_sidecar_sz)
+        clmt_save(file, SUB_TAG);
+
+    return true;
+}
+
+bool SDLogger::seek(SDFile file, uint64_t offset)
+{
+    const constexpr char* SUB_TAG = "SD->seek()";
+
+    ScopedLock lock(io_mutex);
+
+    if (!usability_check(SUB_TAG))
+        return false;
+
+    if (!file || !file->initialized)
+    {
+        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
+        return false;
+    }
+
+    if (!file->open)
+    {
+        ESP_LOGE(TAG, "%s: File not open.", SUB_TAG);
+        return false;
+    }
+
+    // queued and cached bytes belong in front of the new position
+    if (!drain_file(file, SUB_TAG))
+        return false;
+
+    if (!flush_cache(file, SUB_TAG))
+        return false;
+
+    if (!file_resident(file, SUB_TAG))
+        return false;
+
+    return clmt_seek(file, static_cast<FSIZE_t>(offset), SUB_TAG);
+}
+
+bool SDLogger::sync_all()
+{
+    const constexpr char* SUB_TAG = "SD->sync_all()";
+    bool success = true;
+
+    ScopedLock lock(io_mutex);
+
+    if (!usability_check(SUB_TAG))
+        return false;
+
+    // syncing a parked file with queued records swaps it in and another one out, the lists change underneath
+    std::vector<SDFile> files(open_files);
+    files.insert(files.end(), parked_files.begin(), parked_files.end());
+
+    for (SDFile& f : files)
+        success &= sync(f);
+
+    return success;
+}
+
+bool SDLogger::start_io_task()
+{
+    const constexpr char* SUB_TAG = "SD->start_io_task()";
+
+    if (!usability_check(SUB_TAG))
+        return false;
+
+    if (io_task_hdl != nullptr)
+    {
+        ESP_LOGW(TAG, "%s: IO task already running.", SUB_TAG);
+        return false;
+    }
+
+    io_task_stop = false;
+
+    if (xTaskCreatePinnedToCore(&io_task_trampoline, "sd_logger_io", cfg.io_task_stack_sz, this, cfg.io_task_priority, &io_task_hdl,
+                cfg.io_task_core) != pdPASS)
+    {
+        ESP_LOGE(TAG, "%s: Could not create io task.", SUB_TAG);
+        io_task_hdl = nullptr;
+        return false;
+    }
+
+    // hot-plug is handled by the io task, hot-plug monitoring only runs alongside it
+    if (cfg.card_detect && !card_detect_start(SUB_TAG))
+        ESP_LOGW(TAG, "%s: Card detect unavailable, card removal will not be handled.", SUB_TAG);
+
+    return true;
+}
+
+bool SDLogger::stop_io_task()
+{
+    const constexpr char* SUB_TAG = "SD->stop_io_task()";
+    TaskHandle_t task = nullptr;
+
+    // clear the handle first so producers fall back to direct writes and never notify a deleted task
+    {
+        ScopedLock queue_lock(queue_mutex);
+        task = io_task_hdl;
+        io_task_hdl = nullptr;
+    }
+
+    if (task == nullptr)
+    {
+        ESP_LOGW(TAG, "%s: IO task not running.", SUB_TAG);
+        return false;
+    }
+
+    card_detect_stop();
+
+    io_task_stop = true;
+    xTaskNotifyGive(task);
+    xSemaphoreTake(io_task_done, portMAX_DELAY);
+
+    // hand anything still queued to FatFs from the caller's context
+    if (mounted)
+        return sync_all();
+
+    return true;
+}
+
+bool SDLogger::is_io_task_running()
+{
+    return (io_task_hdl != nullptr);
+}
+
+bool SDLogger::set_latency_target(sd_priority_t priority, uint32_t target_ms)
+{
+    const constexpr char* SUB_TAG = "SD->set_latency_target()";
+
+    if (priority >= SD_PRIORITY_MAX)
+    {
+        ESP_LOGE(TAG, "%s: Invalid priority.", SUB_TAG);
+        return false;
+    }
+
+    ScopedLock queue_lock(queue_mutex);
+    latency_stats[priority].target_ms = target_ms;
+
+    return true;
+}
+
+bool SDLogger::get_latency_stats(sd_priority_t priority, sd_latency_stats_t& stats)
+{
+    const constexpr char* SUB_TAG = "SD->get_latency_stats()";
+
+    if (priority >= SD_PRIORITY_MAX)
+    {
+        ESP_LOGE(TAG, "%s: Invalid priority.", SUB_TAG);
+        return false;
+    }
+
+    ScopedLock queue_lock(queue_mutex);
+    stats = latency_stats[priority];
+
+    return true;
+}
+
+sd_write_status_t SDLogger::submit(SDFile file, const char* data, size_t length, bool append_newline, sd_priority_t priority,
+        const char* SUB_TAG, const SDBuffer* shared, uint32_t* ticket)
+{
+    if (!file || !file->initialized)
+    {
+        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
+        return SD_WRITE_ERROR;
+    }
+
+    if (!file->open)
+    {
+        ESP_LOGE(TAG, "%s: File not open.", SUB_TAG);
+        return SD_WRITE_ERROR;
+    }
+
+    if (priority >= SD_PRIORITY_MAX)
+    {
+        ESP_LOGE(TAG, "%s: Invalid priority.", SUB_TAG);
+        return SD_WRITE_ERROR;
+    }
+
+    // power is going away, producers are not slowed down by logging
+    if (emergency)
+        return SD_WRITE_ERROR;
+
+    // sampling and the rate limit decide before any copy is made or queue space is taken
+    if (!rate_limit_admit(file, length + (append_newline ? 1 : 0)))
+        return SD_WRITE_SUPPRESSED;
+
+    rate_limit_summary(file, priority, SUB_TAG);
+
+    return submit_admitted(file, data, length, append_newline, priority, SUB_TAG, shared, ticket);
+}
+
+sd_write_status_t SDLogger::submit_admitted(SDFile file, const char* data, size_t length, bool append_newline,
+        sd_priority_t priority, const char* SUB_TAG, const SDBuffer* shared, uint32_t* ticket)
+{
+    FRESULT res = FR_OK;
+    uint32_t seq = 0;
+
+    // the queue keeps accepting writes while the card is out, the io task drains them once it is remounted
+    if (io_task_hdl != nullptr)
+        return enqueue(file, data, length, append_newline, priority, SUB_TAG, shared, ticket);
+
+    if (!usability_check(SUB_TAG))
+        return SD_WRITE_ERROR;
+
+    budget_pace(priority);
+
+    ScopedLock lock(io_mutex);
+
+    {
+        ScopedLock queue_lock(queue_mutex);
+        seq = ticket_next(file);
+    }
+
+    if (!write_bytes(file, data, length, SUB_TAG) || (append_newline && !write_bytes(file, "\n", 1, SUB_TAG)))
+    {
+        ticket_lost(file, seq, seq);
+        return SD_WRITE_ERROR;
+    }
+
+    file->stats.records_written++;
+    file->written_seq = seq;
+
+    if (ticket != nullptr)
+        *ticket = seq;
+
+    // without an io task there is nothing to batch, critical data is synced before returning
+    if (priority == SD_PRIORITY_CRITICAL)
+    {
+        if (!flush_cache(file, SUB_TAG))
+            return SD_WRITE_ERROR;
+
+        res = file->parked ? FR_OK : trace_f_sync(file->stream.get());
+        if (res != FR_OK)
+        {
+            print_fatfs_error(res, SUB_TAG, "f_sync()");
+            return SD_WRITE_ERROR;
+        }
+
+        file->unsynced = false;
+
+        durable_resolve(file, true);
+    }
+
+    return SD_WRITE_OK;
+}
+
+sd_write_status_t SDLogger::enqueue(SDFile file, const char* data, size_t length, bool append_newline, sd_priority_t priority,
+        const char* SUB_TAG, const SDBuffer* shared, uint32_t* ticket)
+{
+    queued_write_t record;
+    TaskHandle_t task = nullptr;
+    sd_write_status_t status = SD_WRITE_QUEUED;
+    sd_overflow_policy_t policy = SD_OVERFLOW_BLOCK;
+    uint32_t block_timeout_ms = 0;
+    int64_t block_start_us = 0;
+    int64_t remaining_us = 0;
+    bool evicted = false;
+    bool wake = false;
+    bool woken = false;
+    const TaskHandle_t self = xTaskGetCurrentTaskHandle();
+
+    // the blocking wait below releases one level of queue_mutex and none of io_mutex: a caller already holding either
+    // (ie. a durable callback writing again) or the io task itself would wait on the drain it is holding up
+    const bool can_block = (self != io_task_hdl) && (xSemaphoreGetMutexHolder(queue_mutex) != self) &&
+                           (xSemaphoreGetMutexHolder(io_mutex) != self);
+
+    record.length = length + (append_newline ? 1 : 0);
+
+    if (shared != nullptr && !append_newline)
+    {
+        record.data = *shared;
+    }
+    else
+    {
+        char* copy = new char[record.length];
+
+        if (copy == nullptr)
+        {
+            ESP_LOGE(TAG, "%s: No heap memory available for queued write.", SUB_TAG);
+            return SD_WRITE_ERROR;
+        }
+
+        memcpy(copy, data, length);
+
+        if (append_newline)
+            copy[length] = '\n';
+
+        record.data = SDBuffer(copy, std::default_delete<char[]>());
+    }
+
+    record.file = file;
+    record.priority = priority;
+    record.enqueue_us = esp_timer_get_time();
+
+    while (true)
+    {
+        ScopedLock queue_lock(queue_mutex);
+
+        task = io_task_hdl;
+        if (task == nullptr)
+            break;
+
+        policy = file->overflow_policy_set ? file->overflow_policy : static_cast<sd_overflow_policy_t>(cfg.overflow_policy);
+        block_timeout_ms = file->overflow_policy_set ? file->block_timeout_ms : cfg.block_timeout_ms;
+
+        // nothing drains while the card is out, waiting for space would only stall the producer
+        if (policy == SD_OVERFLOW_BLOCK && (!card_present || !can_block))
+            policy = SD_OVERFLOW_DROP_NEWEST;
+
+        if (record.length > cfg.queue_capacity)
+        {
+            ESP_LOGE(TAG, "%s: Record larger than write queue capacity.", SUB_TAG);
+            return SD_WRITE_ERROR;
+        }
+
+        if (make_room(record.length, policy, priority, evicted))
+        {
+            if (evicted)
+                status = SD_WRITE_QUEUED_EVICTED;
+
+            record.seq = next_seq++;
+            record.ticket = ticket_next(file);
+            queued_bytes[priority] += record.length;
+            file->queued_records++;
+            file->queued_bytes += record.length;
+
+            if (file->queued_bytes > file->stats.max_queued_bytes)
+                file->stats.max_queued_bytes = file->queued_bytes;
+
+            if (queued_bytes[SD_PRIORITY_BULK] + queued_bytes[SD_PRIORITY_CRITICAL] > queue_stats.max_queued_bytes)
+                queue_stats.max_queued_bytes = queued_bytes[SD_PRIORITY_BULK] + queued_bytes[SD_PRIORITY_CRITICAL];
+
+            if (block_start_us != 0)
+            {
+                const uint32_t blocked_us = static_cast<uint32_t>(esp_timer_get_time() - block_start_us);
+
+                if (blocked_us > file->stats.max_block_us)
+                    file->stats.max_block_us = blocked_us;
+            }
+
+            wake = (priority == SD_PRIORITY_CRITICAL) || (queued_bytes[SD_PRIORITY_BULK] >= cfg.bulk_batch_sz);
+            lanes[priority].push_back(std::move(record));
+            break;
+        }
+
+        if (policy == SD_OVERFLOW_BLOCK)
+        {
+            if (block_start_us == 0)
+            {
+                block_start_us = esp_timer_get_time();
+                file->stats.blocked_writes++;
+            }
+
+            remaining_us = block_start_us + (block_timeout_ms * 1000LL) - esp_timer_get_time();
+        }
+
+        // policy could not make room, or the block timeout has expired
+        if (policy != SD_OVERFLOW_BLOCK || remaining_us <= 0)
+        {
+            file->stats.records_dropped++;
+            file->stats.bytes_dropped += record.length;
+            queue_stats.drops++;
+
+            if (policy == SD_OVERFLOW_BLOCK)
+            {
+                const uint32_t blocked_us = static_cast<uint32_t>(esp_timer_get_time() - block_start_us);
+
+                if (blocked_us > file->stats.max_block_us)
+                    file->stats.max_block_us = blocked_us;
+
+                return SD_WRITE_TIMEOUT;
+            }
+
+            return SD_WRITE_DROPPED;
+        }
+
+        // wait for the io task to drain, it is told to skip batching so the wait is as short as possible
+        force_drain = true;
+        queue_space_waiters++;
+        xSemaphoreGiveRecursive(queue_mutex);
+
+        xTaskNotifyGive(task);
+        woken = xSemaphoreTake(queue_space, pdMS_TO_TICKS(remaining_us / 1000LL) + 1) == pdTRUE;
+
+        xSemaphoreTakeRecursive(queue_mutex, portMAX_DELAY);
+
+        // timed out: either still counted, or a token was given for this wait after the timeout and is taken back
+        if (!woken && queue_space_waiters > 0)
+            queue_space_waiters--;
+        else if (!woken)
+            xSemaphoreTake(queue_space, 0);
+    }
+
+    if (task == nullptr)
+    {
+        // io task stopped while this write was being prepared, write it from the caller's context instead
+        budget_pace(priority);
+
+        ScopedLock lock(io_mutex);
+
+        {
+            ScopedLock queue_lock(queue_mutex);
+            record.ticket = ticket_next(file);
+        }
+
+        if (!write_bytes(file, record.data.get(), record.length, SUB_TAG))
+        {
+            ticket_lost(file, record.ticket, record.ticket);
+            return SD_WRITE_ERROR;
+        }
+
+        file->stats.records_written++;
+        file->written_seq = record.ticket;
+
+        if (ticket != nullptr)
+            *ticket = record.ticket;
+
+        return SD_WRITE_OK;
+    }
+
+    if (ticket != nullptr)
+        *ticket = record.ticket;
+
+    if (wake)
+        xTaskNotifyGive(task);
+
+    return status;
+}
+
+bool SDLogger::make_room(size_t length, sd_overflow_policy_t policy, sd_priority_t priority, bool& evicted)
+{
+    auto queued = [this]() { return queued_bytes[SD_PRIORITY_BULK] + queued_bytes[SD_PRIORITY_CRITICAL]; };
+    const uint32_t evictions = queue_stats.evictions;
+
+    if (queued() + length <= cfg.queue_capacity)
+        return true;
+
+    switch (policy)
+    {
+    case SD_OVERFLOW_DROP_OLDEST:
+        while (queued() + length > cfg.queue_capacity && !lanes[priority].empty())
+            evict_oldest(priority);
+        break;
+
+    case SD_OVERFLOW_DROP_LOW_PRIORITY:
+        for (int lane = SD_PRIORITY_BULK; lane < priority; lane++)
+            while (queued() + length > cfg.queue_capacity && !lanes[lane].empty())
+                evict_oldest(static_cast<sd_priority_t>(lane));
         break;
-    case FR_NOT_ENOUGH_CORE:
-        sprintf(dest_str, "FR_NOT_ENOUGH_CORE");
+
+    default:
         break;
-    case FR_TOO_MANY_OPEN_FILES:
-        sprintf(dest_str, "FR_TOO_MANY_OPEN_FILES");
+    }
+
+    evicted = (queue_stats.evictions != evictions);
+
+    return (queued() + length <= cfg.queue_capacity);
+}
+
+void SDLogger::evict_oldest(sd_priority_t lane)
+{
+    queued_write_t& record = lanes[lane].front();
+
+    queued_bytes[lane] -= record.length;
+    record.file->queued_records--;
+    record.file->queued_bytes -= record.length;
+    record.file->stats.records_dropped++;
+    record.file->stats.bytes_dropped += record.length;
+    queue_stats.evictions++;
+    ticket_lost(record.file, record.ticket, record.ticket);
+
+    lanes[lane].pop_front();
+}
+
+bool SDLogger::rate_limit_admit(SDFile file, size_t length)
+{
+    ScopedLock queue_lock(queue_mutex);
+    const sd_rate_limit_t& limit = file->rate_limit;
+    const int64_t full = limit.burst_bytes * 1000000LL;
+    int64_t now_us = 0;
+
+    if (limit.sample_every > 1 && (file->sample_count++ % limit.sample_every) != 0)
+    {
+        file->stats.records_sampled++;
+        return false;
+    }
+
+    if (limit.bytes_per_s == 0)
+        return true;
+
+    // tokens are kept in byte microseconds so refills never lose a fraction of a byte
+    now_us = esp_timer_get_time();
+
+    if (now_us - file->rate_refill_us >= (full - file->rate_tokens) / limit.bytes_per_s)
+        file->rate_tokens = full;
+    else
+        file->rate_tokens += (now_us - file->rate_refill_us) * limit.bytes_per_s;
+
+    file->rate_refill_us = now_us;
+
+    if (file->rate_tokens >= static_cast<int64_t>(length) * 1000000LL)
+    {
+        file->rate_tokens -= static_cast<int64_t>(length) * 1000000LL;
+        return true;
+    }
+
+    if (file->suppressed_records == 0)
+        file->suppressed_since_us = now_us;
+
+    file->suppressed_records++;
+    file->suppressed_bytes += length;
+    file->stats.records_suppressed++;
+    file->stats.bytes_suppressed += length;
+
+    return false;
+}
+
+void SDLogger::rate_limit_summary(SDFile file, sd_priority_t priority, const char* SUB_TAG)
+{
+    char summary[96];
+    int length = 0;
+    uint32_t records = 0;
+    uint64_t bytes = 0;
+    int64_t since_us = 0;
+
+    {
+        ScopedLock queue_lock(queue_mutex);
+
+        if (file->suppressed_records == 0)
+            return;
+
+        records = file->suppressed_records;
+        bytes = file->suppressed_bytes;
+        since_us = file->suppressed_since_us;
+        file->suppressed_records = 0;
+        file->suppressed_bytes = 0;
+
+        if (!file->rate_limit.write_summary)
+            return;
+    }
+
+    length = snprintf(summary, sizeof(summary), "# suppressed %lu records (%llu bytes) over %lld ms\n",
+            static_cast<unsigned long>(records), static_cast<unsigned long long>(bytes),
+            static_cast<long long>((esp_timer_get_time() - since_us) / 1000LL));
+
+    // bypasses the limiter, it is what lets the reader tell a gap from a quiet channel
+    if (!status_ok(submit_admitted(file, summary, length, false, priority, SUB_TAG)))
+        ESP_LOGW(TAG, "%s: Suppression summary for %s dropped.", SUB_TAG, file->get_path());
+}
+
+void SDLogger::budget_charge(size_t length)
+{
+    ScopedLock queue_lock(queue_mutex);
+    const int64_t rate = cfg.bandwidth_budget_kib_s * 1024LL;
+    const int64_t burst = rate * BUDGET_BURST_MS * 1000LL;
+    int64_t now_us = 0;
+
+    if (rate == 0 || emergency)
+        return;
+
+    now_us = esp_timer_get_time();
+
+    // compared before multiplying, a long idle stretch would overflow the product
+    if (now_us - budget_refill_us >= (burst - budget_tokens) / rate)
+        budget_tokens = burst;
+    else
+        budget_tokens += (now_us - budget_refill_us) * rate;
+
+    budget_refill_us = now_us;
+    budget_tokens -= static_cast<int64_t>(length) * 1000000LL;
+}
+
+int64_t SDLogger::budget_deficit_us()
+{
+    ScopedLock queue_lock(queue_mutex);
+    const int64_t rate = cfg.bandwidth_budget_kib_s * 1024LL;
+    int64_t now_us = esp_timer_get_time();
+    int64_t wait_us = 0;
+
+    // the write that overdrew the budget already went ahead, the next one waits until the budget has caught up with it
+    if (rate > 0 && !emergency && budget_tokens < 0 && now_us - budget_refill_us < -budget_tokens / rate)
+        wait_us = (-budget_tokens + rate - 1) / rate - (now_us - budget_refill_us);
+
+    if (wait_us > 0 && budget_wait_since_us == 0)
+    {
+        budget_wait_since_us = now_us;
+        queue_stats.budget_waits++;
+    }
+    else if (wait_us <= 0 && budget_wait_since_us != 0)
+    {
+        queue_stats.budget_wait_us += now_us - budget_wait_since_us;
+        budget_wait_since_us = 0;
+    }
+
+    return wait_us;
+}
+
+void SDLogger::budget_pace(sd_priority_t priority)
+{
+    const TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    int64_t wait_us = 0;
+
+    // critical records are never held back, and a caller already holding io_mutex would stall everyone else waiting
+    if (priority == SD_PRIORITY_CRITICAL || xSemaphoreGetMutexHolder(io_mutex) == self)
+        return;
+
+    while ((wait_us = budget_deficit_us()) > 0)
+        vTaskDelay(pdMS_TO_TICKS(wait_us / 1000LL) + 1);
+}
+
+void SDLogger::notify_space_waiters()
+{
+    ScopedLock queue_lock(queue_mutex);
+
+    // one token per blocked producer, a producer counted here is never given a second one
+    for (; queue_space_waiters > 0; queue_space_waiters--)
+        xSemaphoreGive(queue_space);
+}
+
+bool SDLogger::card_detect_start(const char* SUB_TAG)
+{
+    esp_err_t err = ESP_OK;
+    gpio_config_t io_cfg = {};
+
+    if (card_detect_installed)
+        return true;
+
+    io_cfg.pin_bit_mask = 1ULL << cfg.io_cd;
+    io_cfg.mode = GPIO_MODE_INPUT;
+    io_cfg.pull_up_en = (cfg.card_detect_level == 0) ? GPIO_PULLUP_ENABLE : GPIO_PULLUP_DISABLE;
+    io_cfg.pull_down_en = GPIO_PULLDOWN_DISABLE;
+    io_cfg.intr_type = GPIO_INTR_ANYEDGE;
+
+    err = gpio_config(&io_cfg);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "%s: gpio_config() call failed (0x%x)", SUB_TAG, err);
+        return false;
+    }
+
+    // the ISR service is shared with the rest of the application, it may already be installed
+    err = gpio_install_isr_service(0);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE)
+    {
+        ESP_LOGE(TAG, "%s: gpio_install_isr_service() call failed (0x%x)", SUB_TAG, err);
+        return false;
+    }
+
+    err = gpio_isr_handler_add(cfg.io_cd, &card_detect_isr, this);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "%s: gpio_isr_handler_add() call failed (0x%x)", SUB_TAG, err);
+        return false;
+    }
+
+    card_detect_installed = true;
+
+    // the card may have been pulled before the pin was watched
+    card_detect_pending = true;
+    xTaskNotifyGive(io_task_hdl);
+
+    return true;
+}
+
+void SDLogger::card_detect_stop()
+{
+    if (!card_detect_installed)
+        return;
+
+    gpio_isr_handler_remove(cfg.io_cd);
+    card_detect_installed = false;
+}
+
+void IRAM_ATTR SDLogger::card_detect_isr(void* arg)
+{
+    SDLogger* logger = static_cast<SDLogger*>(arg);
+    BaseType_t woken = pdFALSE;
+
+    logger->card_detect_pending = true;
+
+    if (logger->io_task_hdl != nullptr)
+        vTaskNotifyGiveFromISR(logger->io_task_hdl, &woken);
+
+    portYIELD_FROM_ISR(woken);
+}
+
+void SDLogger::card_detect_check()
+{
+    bool present = false;
+
+    // contacts bounce while the card slides in or out, only act on a level that held for the debounce time
+    do
+    {
+        card_detect_pending = false;
+        vTaskDelay(pdMS_TO_TICKS(cfg.card_detect_debounce_ms));
+    } while (card_detect_pending && !io_task_stop);
+
+    present = (gpio_get_level(cfg.io_cd) == cfg.card_detect_level);
+
+    if (!present)
+    {
+        card_retry = false;
+
+        if (card_present)
+            card_detach();
+    }
+    else if (!card_present || card_retry)
+    {
+        card_retry = !card_attach();
+    }
+}
+
+void SDLogger::card_detach()
+{
+    const constexpr char* SUB_TAG = "SD->card_detach()";
+
+    ScopedLock lock(io_mutex);
+
+    card_present = false;
+
+    ESP_LOGW(TAG, "%s: Card removed, holding writes in the write queue.", SUB_TAG);
+
+    // FatFs objects of the removed card are dropped without any bus traffic, queued records and write caches stay in RAM
+    for (SDFile& f : open_files)
+    {
+        f->resume_offset = f_tell(f->stream.get());
+        clmt_reset(f);
+    }
+
+    if (delete_job)
+        delete_directory_cancel();
+
+    // the reinserted card may not be the same one, pools are scanned again
+    file_pool_forget();
+    repair_journal_close();
+
+    if (mounted)
+    {
+        meta_cache_discard();
+        meta_cache_detach(SUB_TAG);
+        f_mount(nullptr, drv, 0);
+    }
+
+    if (card_handle >= 0)
+    {
+        sdspi_host_remove_device(card_handle);
+        card_handle = -1;
+    }
+
+    initialized = false;
+}
+
+bool SDLogger::card_attach()
+{
+    const constexpr char* SUB_TAG = "SD->card_attach()";
+    FRESULT res = FR_OK;
+    FSIZE_t offset = 0;
+
+    ScopedLock lock(io_mutex);
+
+    if (!initialized && !init())
+    {
+        ESP_LOGW(TAG, "%s: Reinserted card failed to initialize, retrying.", SUB_TAG);
+        return false;
+    }
+
+    // the logger was never mounted, the application takes it from here
+    if (!mounted)
+    {
+        card_present = true;
+        return true;
+    }
+
+    meta_cache_attach(SUB_TAG);
+
+    res = f_mount(fs, drv, 1);
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_mount()");
+        meta_cache_detach(SUB_TAG);
+        return false;
+    }
+
+    load_info();
+    emergency = false;
+
+    if (cfg.repair_journal)
+        repair_journal_open(SUB_TAG);
+
+    // reopen without truncating, whatever was created before the removal is continued
+    for (SDFile& f : open_files)
+    {
+        res = bus_f_open(f->stream.get(), f->path, (f->open_mode & (FA_READ | FA_WRITE)) | FA_OPEN_ALWAYS);
+        if (res != FR_OK)
+        {
+            print_fatfs_error(res, SUB_TAG, "f_open()");
+            f_mount(nullptr, drv, 0);
+            meta_cache_detach(SUB_TAG);
+            return false;
+        }
+
+        if (cfg.fast_seek_max_fragments > 0)
+            clmt_open(f, false, SUB_TAG);
+
+        // data written but not synced before the removal never made it to the card
+        offset = std::min(f->resume_offset, f_size(f->stream.get()));
+        if (offset < f->resume_offset)
+            ESP_LOGW(TAG, "%s: %s lost %llu unsynced bytes.", SUB_TAG, f->get_path(),
+                    static_cast<unsigned long long>(f->resume_offset - offset));
+
+        clmt_seek(f, offset, SUB_TAG);
+    }
+
+    card_present = true;
+    force_drain = true;
+
+    ESP_LOGI(TAG, "%s: Card reinserted, draining %u queued bytes.", SUB_TAG,
+            static_cast<unsigned>(queued_bytes[SD_PRIORITY_BULK] + queued_bytes[SD_PRIORITY_CRITICAL]));
+
+    return true;
+}
+
+void SDLogger::io_task_trampoline(void* arg)
+{
+    static_cast<SDLogger*>(arg)->io_task();
+}
+
+void SDLogger::io_task()
+{
+    while (!io_task_stop)
+    {
+        ulTaskNotifyTake(pdTRUE, io_task_wait_ticks());
+
+        if (io_task_stop)
+            break;
+
+        if (card_detect_pending || card_retry)
+            card_detect_check();
+
+        // writes stay queued until the card is back
+        if (!card_present)
+            continue;
+
+        ScopedLock lock(io_mutex);
+
+        drain_critical();
+        drain_durable();
+
+        // held back while the bandwidth budget is overdrawn, io_task_wait_ticks() sleeps it off without io_mutex held
+        if (budget_deficit_us() == 0)
+            drain_bulk();
+
+        // maintenance only runs once every lane is empty so it never delays logged data
+        if (queued_bytes[SD_PRIORITY_BULK] == 0 && queued_bytes[SD_PRIORITY_CRITICAL] == 0)
+        {
+            if (delete_job)
+                delete_directory_continue(cfg.idle_slice_us);
+            else if (pool_refill_due && mounted && esp_timer_get_time() >= pool_retry_us)
+                fill_file_pools(cfg.idle_slice_us);
+            else if (erase_pending())
+                erase_freed_sectors(cfg.idle_slice_us);
+        }
+    }
+
+    xSemaphoreGive(io_task_done);
+    vTaskDelete(nullptr);
+}
+
+TickType_t SDLogger::io_task_wait_ticks()
+{
+    ScopedLock queue_lock(queue_mutex);
+    int64_t remaining_us = 0;
+
+    if (card_detect_pending)
+        return 0;
+
+    if (!card_present)
+        return card_retry ? pdMS_TO_TICKS(CARD_RETRY_MS) : portMAX_DELAY;
+
+    if (!lanes[SD_PRIORITY_CRITICAL].empty() || !durable_waiters.empty())
+        return 0;
+
+    // bulk is drained once its oldest record has used half of its latency target, the rest is left for the write and sync
+    if (!lanes[SD_PRIORITY_BULK].empty())
+    {
+        remaining_us = budget_deficit_us();
+        if (remaining_us > 0)
+            return pdMS_TO_TICKS(remaining_us / 1000LL) + 1;
+
+        remaining_us = lanes[SD_PRIORITY_BULK].front().enqueue_us + (latency_stats[SD_PRIORITY_BULK].target_ms * 500LL) -
+                       esp_timer_get_time();
+
+        if (remaining_us <= 0)
+            return 0;
+
+        return pdMS_TO_TICKS(remaining_us / 1000LL) + 1;
+    }
+
+    if (delete_job || erase_pending())
+        return 1;
+
+    if (pool_refill_due && mounted)
+    {
+        remaining_us = pool_retry_us - esp_timer_get_time();
+        return (remaining_us > 0) ? pdMS_TO_TICKS(remaining_us / 1000LL) + 1 : 1;
+    }
+
+    return portMAX_DELAY;
+}
+
+void SDLogger::drain_critical(WriteBatch* in_flight, size_t in_flight_idx)
+{
+    const constexpr char* SUB_TAG = "SD->drain_critical()";
+    WriteBatch batch;
+    std::vector<SDFile> touched;
+
+    {
+        ScopedLock queue_lock(queue_mutex);
+
+        if (lanes[SD_PRIORITY_CRITICAL].empty())
+            return;
+
+        while (!lanes[SD_PRIORITY_CRITICAL].empty())
+        {
+            queued_write_t& record = lanes[SD_PRIORITY_CRITICAL].front();
+            queued_bytes[SD_PRIORITY_CRITICAL] -= record.length;
+            record.file->queued_records--;
+            record.file->queued_bytes -= record.length;
+            batch.push_back(std::move(record));
+            lanes[SD_PRIORITY_CRITICAL].pop_front();
+        }
+
+        // bulk records queued earlier for the same files have to land first to keep each file in submission order
+        const size_t critical_count = batch.size();
+        for (size_t i = 0; i < critical_count; i++)
+        {
+            if (batch[i].file->queued_records > 0)
+                extract_file_records(batch[i].file, batch);
+
+            // the same goes for records of a bulk batch that is being written when the critical record arrived
+            if (in_flight != nullptr)
+                for (size_t j = in_flight_idx; j < in_flight->size(); j++)
+                    if ((*in_flight)[j].file == batch[i].file)
+                        batch.push_back(std::move((*in_flight)[j]));
+        }
+    }
+
+    notify_space_waiters();
+
+    std::sort(batch.begin(), batch.end(), [](const queued_write_t& a, const queued_write_t& b) { return a.seq < b.seq; });
+
+    write_batch(batch, touched, SUB_TAG);
+    sync_files(touched, SUB_TAG);
+    record_latency(batch, esp_timer_get_time());
+}
+
+void SDLogger::drain_bulk()
+{
+    const constexpr char* SUB_TAG = "SD->drain_bulk()";
+    WriteBatch batch;
+    std::vector<SDFile> touched;
+
+    {
+        ScopedLock queue_lock(queue_mutex);
+
+        if (lanes[SD_PRIORITY_BULK].empty())
+            return;
+
+        const int64_t age_us = esp_timer_get_time() - lanes[SD_PRIORITY_BULK].front().enqueue_us;
+
+        // keep batching until the lane is large enough or the oldest record is about to miss its target
+        if (!force_drain && queued_bytes[SD_PRIORITY_BULK] < cfg.bulk_batch_sz &&
+                age_us < latency_stats[SD_PRIORITY_BULK].target_ms * 500LL)
+            return;
+
+        force_drain = false;
+
+        while (!lanes[SD_PRIORITY_BULK].empty())
+        {
+            queued_write_t& record = lanes[SD_PRIORITY_BULK].front();
+            queued_bytes[SD_PRIORITY_BULK] -= record.length;
+            record.file->queued_records--;
+            record.file->queued_bytes -= record.length;
+            batch.push_back(std::move(record));
+            lanes[SD_PRIORITY_BULK].pop_front();
+        }
+    }
+
+    notify_space_waiters();
+
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+        // critical records jump ahead of the remainder of the bulk batch
+        if (critical_pending())
+            drain_critical(&batch, i);
+
+        // record was pulled into the critical drain to keep its file in order
+        if (!batch[i].file)
+            continue;
+
+        write_record(batch[i], touched, SUB_TAG);
+    }
+
+    sync_files(touched, SUB_TAG);
+    record_latency(batch, esp_timer_get_time());
+}
+
+void SDLogger::extract_file_records(SDFile file, WriteBatch& batch)
+{
+    for (std::deque<queued_write_t>& lane : lanes)
+    {
+        for (auto it = lane.begin(); it != lane.end();)
+        {
+            if (it->file == file)
+            {
+                queued_bytes[it->priority] -= it->length;
+                file->queued_records--;
+                file->queued_bytes -= it->length;
+                batch.push_back(std::move(*it));
+                it = lane.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+}
+
+bool SDLogger::drain_file(SDFile file, const char* SUB_TAG)
+{
+    WriteBatch batch;
+    std::vector<SDFile> touched;
+
+    {
+        ScopedLock queue_lock(queue_mutex);
+
+        if (file->queued_records == 0)
+            return true;
+
+        extract_file_records(file, batch);
+    }
+
+    notify_space_waiters();
+
+    std::sort(batch.begin(), batch.end(), [](const queued_write_t& a, const queued_write_t& b) { return a.seq < b.seq; });
+
+    return write_batch(batch, touched, SUB_TAG);
+}
+
+bool SDLogger::write_batch(WriteBatch& batch, std::vector<SDFile>& touched, const char* SUB_TAG)
+{
+    bool success = true;
+
+    for (queued_write_t& record : batch)
+        success &= write_record(record, touched, SUB_TAG);
+
+    return success;
+}
+
+bool SDLogger::write_record(queued_write_t& record, std::vector<SDFile>& touched, const char* SUB_TAG)
+{
+    if (!record.file->open)
+    {
+        ESP_LOGE(TAG, "%s: Dropping queued write for closed file %s.", SUB_TAG, record.file->get_path());
+        ticket_lost(record.file, record.ticket, record.ticket);
+        return false;
+    }
+
+    if (!write_bytes(record.file, record.data.get(), record.length, SUB_TAG))
+    {
+        ticket_lost(record.file, record.ticket, record.ticket);
+        return false;
+    }
+
+    record.file->stats.records_written++;
+    record.file->written_seq = record.ticket;
+
+    if (std::find(touched.begin(), touched.end(), record.file) == touched.end())
+        touched.push_back(record.file);
+
+    return true;
+}
+
+bool SDLogger::status_ok(sd_write_status_t status)
+{
+    return (status == SD_WRITE_OK || status == SD_WRITE_QUEUED || status == SD_WRITE_QUEUED_EVICTED);
+}
+
+bool SDLogger::critical_pending()
+{
+    ScopedLock queue_lock(queue_mutex);
+
+    return !lanes[SD_PRIORITY_CRITICAL].empty();
+}
+
+bool SDLogger::sync_files(std::vector<SDFile>& touched, const char* SUB_TAG)
+{
+    FRESULT res = FR_OK;
+    bool success = true;
+
+    for (SDFile& file : touched)
+    {
+        if (!flush_cache(file, SUB_TAG))
+        {
+            durable_resolve(file, false);
+            success = false;
+            continue;
+        }
+
+        // parked files were synced by f_close()
+        res = file->parked ? FR_OK : trace_f_sync(file->stream.get());
+        if (res != FR_OK)
+        {
+            print_fatfs_error(res, SUB_TAG, "f_sync()");
+            success = false;
+        }
+        else
+        {
+            file->unsynced = false;
+        }
+
+        durable_resolve(file, res == FR_OK);
+    }
+
+    touched.clear();
+
+    return success;
+}
+
+void SDLogger::record_latency(const WriteBatch& batch, int64_t durable_us)
+{
+    ScopedLock queue_lock(queue_mutex);
+    bool violated = false;
+
+    for (const queued_write_t& record : batch)
+    {
+        if (!record.file)
+            continue;
+
+        sd_latency_stats_t& stats = latency_stats[record.priority];
+        const uint32_t latency_us = static_cast<uint32_t>(durable_us - record.enqueue_us);
+
+        stats.records++;
+        stats.total_us += latency_us;
+
+        if (latency_us > stats.max_us)
+            stats.max_us = latency_us;
+
+        if (latency_us > stats.target_ms * 1000UL)
+        {
+            stats.violations++;
+            violated = true;
+        }
+    }
+
+    // report violations at most once a second, the counters keep the full picture
+    if (violated && (durable_us - last_violation_log_us) > 1000000LL)
+    {
+        last_violation_log_us = durable_us;
+        ESP_LOGW(TAG, "SD->record_latency(): Latency target missed, bulk: %lu/%lu, critical: %lu/%lu violations/records.",
+                static_cast<unsigned long>(latency_stats[SD_PRIORITY_BULK].violations),
+                static_cast<unsigned long>(latency_stats[SD_PRIORITY_BULK].records),
+                static_cast<unsigned long>(latency_stats[SD_PRIORITY_CRITICAL].violations),
+                static_cast<unsigned long>(latency_stats[SD_PRIORITY_CRITICAL].records));
+    }
+}
+
+uint32_t SDLogger::ticket_next(SDFile file)
+{
+    // 0 means no ticket, skipped when the sequence wraps
+    if (++file->write_seq == 0)
+        file->write_seq = 1;
+
+    return file->write_seq;
+}
+
+bool SDLogger::ticket_reached(uint32_t seq, uint32_t ticket)
+{
+    // wrap safe, tickets are compared by their distance
+    return static_cast<int32_t>(seq - ticket) >= 0;
+}
+
+void SDLogger::drain_durable()
+{
+    const constexpr char* SUB_TAG = "SD->drain_durable()";
+    std::vector<SDFile> touched;
+
+    {
+        ScopedLock queue_lock(queue_mutex);
+
+        if (durable_waiters.empty())
+            return;
+
+        // one sync per file however many tickets are waited for on it
+        for (durable_waiter_t& waiter : durable_waiters)
+            if (std::find(touched.begin(), touched.end(), waiter.file) == touched.end())
+                touched.push_back(waiter.file);
+    }
+
+    for (auto it = touched.begin(); it != touched.end();)
+    {
+        // closed after the waiter was added
+        if (!(*it)->open)
+        {
+            durable_resolve(*it, false, true);
+            it = touched.erase(it);
+            continue;
+        }
+
+        // only this file's queued records are written ahead of the rest of the queue
+        drain_file(*it, SUB_TAG);
+        ++it;
+    }
+
+    {
+        ScopedLock queue_lock(queue_mutex);
+        queue_stats.durable_syncs += touched.size();
+    }
+
+    sync_files(touched, SUB_TAG);
+}
+
+void SDLogger::durable_resolve(SDFile file, bool synced, bool closing)
+{
+    std::vector<durable_waiter_t> resolved;
+    std::vector<bool> results;
+
+    {
+        ScopedLock queue_lock(queue_mutex);
+
+        if (synced)
+            file->durable_seq = file->written_seq;
+
+        for (auto it = durable_waiters.begin(); it != durable_waiters.end();)
+        {
+            // a ticket neither synced nor still queued will not get there, its write failed, was dropped or missed the sync
+            if (it->file != file || !(ticket_reached(file->durable_seq, it->ticket) || closing || file->queued_records == 0 ||
+                                            ticket_reached(file->written_seq, it->ticket) || ticket_was_lost(file, it->ticket)))
+            {
+                ++it;
+                continue;
+            }
+
+            // the waiting task's semaphore is only valid while its waiter is listed, it is given under the lock
+            if (it->callback == nullptr)
+            {
+                *it->durable = ticket_durable(file, it->ticket);
+                xSemaphoreGive(it->done);
+            }
+            else
+            {
+                resolved.push_back(*it);
+                results.push_back(ticket_durable(file, it->ticket));
+            }
+
+            it = durable_waiters.erase(it);
+        }
+    }
+
+    // called without queue_mutex so callbacks may write again
+    for (size_t i = 0; i < resolved.size(); i++)
+        resolved[i].callback(file, resolved[i].ticket, results[i], resolved[i].arg);
+}
+
+void SDLogger::ticket_lost(SDFile file, uint32_t first, uint32_t last)
+{
+    ScopedLock queue_lock(queue_mutex);
+    std::vector<std::pair<uint32_t, uint32_t>>& lost = file->lost_seqs;
+
+    if (first == 0 || last == 0)
+        return;
+
+    // evictions and failures come in ticket order, a run of them extends the newest range
+    if (!lost.empty() && lost.back().second + 1 == first)
+    {
+        lost.back().second = last;
+    }
+    else
+    {
+        lost.push_back({first, last});
+
+        // merged, the tickets between the two oldest ranges are no longer vouched for either
+        if (lost.size() > LOST_RANGES_MAX)
+        {
+            lost[0].second = lost[1].second;
+            lost.erase(lost.begin() + 1);
+        }
+    }
+
+    // a blocked task learns right away, callbacks are left to the io task's next durable_resolve() for the file
+    for (auto it = durable_waiters.begin(); it != durable_waiters.end();)
+    {
+        if (it->file == file && it->callback == nullptr && ticket_was_lost(file, it->ticket))
+        {
+            *it->durable = false;
+            xSemaphoreGive(it->done);
+            it = durable_waiters.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+bool SDLogger::ticket_was_lost(SDFile file, uint32_t ticket)
+{
+    for (const std::pair<uint32_t, uint32_t>& range : file->lost_seqs)
+        if (ticket_reached(ticket, range.first) && ticket_reached(range.second, ticket))
+            return true;
+
+    return false;
+}
+
+bool SDLogger::ticket_durable(SDFile file, uint32_t ticket)
+{
+    // durable_seq only says the file was synced after the ticket, not that the ticket's record was in it
+    return ticket_reached(file->durable_seq, ticket) && !ticket_was_lost(file, ticket);
+}
+
+bool SDLogger::set_write_alignment(SDFile file, size_t alignment)
+{
+    const constexpr char* SUB_TAG = "SD->set_write_alignment()";
+
+    if (!file || !file->initialized)
+    {
+        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
+        return false;
+    }
+
+    // must be a power of 2 multiple of the sector size (ie. the AU size from get_allocation_unit_size()), 0 disables
+    if (alignment != 0 && (alignment % SD_SECTOR_SZ != 0 || (alignment & (alignment - 1)) != 0))
+    {
+        ESP_LOGE(TAG, "%s: Alignment must be a power of 2 multiple of %u bytes.", SUB_TAG, static_cast<unsigned>(SD_SECTOR_SZ));
+        return false;
+    }
+
+    file->write_alignment = alignment;
+
+    return true;
+}
+
+bool SDLogger::write_bytes(SDFile file, const char* data, size_t length, const char* SUB_TAG)
+{
+    size_t fill_target = 0;
+    size_t chunk = 0;
+    const char* first_full_sector = nullptr;
+
+    file->last_use = ++file_tick;
+
+    // the cache of a parked file is allocated again when it is opened again
+    if (file->parked && !file_resident(file, SUB_TAG))
+        return false;
+
+    if (file->cache == nullptr)
+        return write_through(file, data, length, SUB_TAG);
+
+    while (length > 0)
+    {
+        // fill up to the point where the flush leaves the file offset on a sector boundary, every flush after the first
+        // is then written by FatFs straight from the cache as whole sectors instead of through the FIL buffer
+        fill_target = file->write_cache_sz - (file_tell(file) % SD_SECTOR_SZ);
+
+        if (file->cache_len == 0 && length >= fill_target)
+        {
+            // FatFs transfers whole sectors straight from the caller's buffer, only worth it when the card driver does
+            // not have to bounce them sector by sector through a DMA capable buffer
+            first_full_sector = data + (fill_target % SD_SECTOR_SZ);
+
+            if (esp_ptr_dma_capable(first_full_sector) && (reinterpret_cast<uintptr_t>(first_full_sector) % 4) == 0)
+            {
+                chunk = fill_target + ((length - fill_target) / SD_SECTOR_SZ) * SD_SECTOR_SZ;
+
+                if (!write_through(file, data, chunk, SUB_TAG))
+                    return false;
+
+                file->stats.cache_bypasses++;
+                data += chunk;
+                length -= chunk;
+                continue;
+            }
+        }
+
+        chunk = std::min(length, fill_target - file->cache_len);
+        memcpy(file->cache + file->cache_len, data, chunk);
+        file->cache_len += chunk;
+        data += chunk;
+        length -= chunk;
+
+        if (file->cache_len == fill_target && !flush_cache(file, SUB_TAG))
+            return false;
+    }
+
+    return true;
+}
+
+FSIZE_t SDLogger::file_tell(SDFile file)
+{
+    // a parked file's FIL was closed, its position is whatever file_park() saved rather than what FatFs left behind
+    if (file->parked)
+        return file->resume_offset;
+
+    return f_tell(file->stream.get());
+}
+
+bool SDLogger::write_through(SDFile file, const char* data, size_t length, const char* SUB_TAG)
+{
+    FRESULT res = FR_OK;
+    UINT bytes_written = 0;
+    size_t chunk = 0;
+    size_t misalignment = 0;
+    BusArbiter& arbiter = get_bus_arbiter();
+    size_t quantum = cfg.bus_quantum_sz;
+    bool had_cluster = false;
+
+    // alignment and quantum are both powers of 2, a quantum below the alignment would split aligned units
+    if (quantum > 0 && quantum < file->write_alignment)
+        quantum = file->write_alignment;
+
+    if (!file_resident(file, SUB_TAG))
+        return false;
+
+    had_cluster = (file->stream->obj.sclust != 0);
+
+    while (length > 0)
+    {
+        chunk = length;
+
+        // split large writes so the body starts on an alignment boundary of the file offset and spans whole units,
+        // FatFs then hands each unit to the card as one multi-sector transfer instead of staging it in the FIL buffer
+        if (file->write_alignment > 0 && length >= file->write_alignment)
+        {
+            misalignment = f_tell(file->stream.get()) % file->write_alignment;
+
+            if (misalignment != 0)
+                chunk = file->write_alignment - misalignment;
+            else
+                chunk = length - (length % file->write_alignment);
+        }
+
+        // bound the time this instance holds the bus so other cards/devices on the host get their turn
+        if (quantum > 0 && chunk > quantum)
+            chunk = quantum;
+
+        // only charged here, the wait for the budget happens before io_mutex is taken, see budget_pace()
+        budget_charge(chunk);
+
+        if (quantum > 0)
+            arbiter.acquire();
+
+        res = trace_f_write(file->stream.get(), data, chunk, &bytes_written);
+
+        if (quantum > 0)
+            arbiter.release();
+
+        if (res != FR_OK)
+        {
+            print_fatfs_error(res, SUB_TAG, "f_write()");
+            return false;
+        }
+
+        if (bytes_written < chunk)
+        {
+            ESP_LOGE(TAG, "%s: Volume full, %u of %u bytes written.", SUB_TAG, bytes_written, static_cast<unsigned>(chunk));
+            return false;
+        }
+
+        file->stats.bytes_written += chunk;
+        file->unsynced = true;
+        data += chunk;
+        length -= chunk;
+
+        if (file->preallocated && f_tell(file->stream.get()) > file->data_end)
+            file->data_end = f_tell(file->stream.get());
+    }
+
+    // repair_files() extends a file along its chain with f_lseek(), which needs the first cluster in the directory entry,
+    // so a new chain is linked there as soon as FatFs allocates it
+    if (repair_sectors > 0 && !had_cluster && file->stream->obj.sclust != 0)
+    {
+        res = trace_f_sync(file->stream.get());
+        if (res != FR_OK)
+        {
+            print_fatfs_error(res, SUB_TAG, "f_sync()");
+            return false;
+        }
+
+        file->unsynced = false;
+    }
+
+    return true;
+}
+
+bool SDLogger::clmt_open(SDFile file, bool seek_end, const char* SUB_TAG)
+{
+    bool loaded = false;
+
+    clmt_reset(file);
+    file->clmt_active = true;
+
+    // a missing or stale sidecar only means the chain is walked once more
+    if (file->stream->obj.sclust != 0)
+        loaded = clmt_load(file, SUB_TAG);
+
+    if (!seek_end)
+        return true;
+
+    if (!clmt_seek(file, f_size(file->stream.get()), SUB_TAG))
+        return false;
+
+    // the FAT has no link back from a chain's end, so without a sidecar the walk above was over the whole chain: it is
+    // saved right away, later opens must not repeat it even if this one never gets to close the file
+    if (!loaded)
+        clmt_save(file, SUB_TAG);
+
+    return true;
+}
+
+bool SDLogger::clmt_seek(SDFile file, FSIZE_t offset, const char* SUB_TAG)
+{
+    FRESULT res = FR_OK;
+
+#if FF_USE_FASTSEEK
+    const FSIZE_t cluster_sz = static_cast<FSIZE_t>(file->stream->obj.fs->csize) * SD_SECTOR_SZ;
+
+    // fast seek mode never extends the file, seeks past the end take the regular path below
+    if (file->clmt_active && offset > 0 && offset <= f_size(file->stream.get()))
+    {
+        if (file->clmt_clusters * cluster_sz < offset)
+            clmt_extend(file, SUB_TAG);
+
+        if (file->clmt_active && file->clmt_clusters * cluster_sz >= offset)
+        {
+            file->stream->cltbl = file->clmt.data();
+            res = f_lseek(file->stream.get(), offset);
+
+            // appends past the mapped chain need create_chain(), which fast seek mode disables
+            file->stream->cltbl = nullptr;
+
+            if (res == FR_OK)
+                return true;
+
+            print_fatfs_error(res, SUB_TAG, "f_lseek()");
+            clmt_reset(file, true);
+        }
+    }
+#endif
+
+    res = f_lseek(file->stream.get(), offset);
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_lseek()");
+        return false;
+    }
+
+    return true;
+}
+
+bool SDLogger::clmt_extend(SDFile file, const char* SUB_TAG)
+{
+    FIL& stream = *file->stream;
+    FATFS* fs = stream.obj.fs;
+    DWORD next = 0;
+    LBA_t buff_sect = 0;
+    BYTE* buff = nullptr;
+    bool success = true;
+
+    if (!file->clmt_active)
+        return false;
+
+    if (stream.obj.sclust == 0)
+        return true;
+
+    // FAT12 volumes are too small to need fast seek
+    if (fs->fs_type == FS_FAT12)
+    {
+        clmt_reset(file, true);
+        return false;
+    }
+
+#if FF_FS_EXFAT
+    // contiguous exFAT files have no FAT chain, every cluster follows the first one
+    if (fs->fs_type == FS_EXFAT && (stream.obj.stat & 2))
+    {
+        const FSIZE_t cluster_sz = static_cast<FSIZE_t>(fs->csize) * SD_SECTOR_SZ;
+        const DWORD clusters = std::max<DWORD>(1, static_cast<DWORD>((stream.obj.objsize + cluster_sz - 1) / cluster_sz));
+
+        clmt_reset(file);
+        clmt_append(file, stream.obj.sclust);
+        file->clmt[1] = clusters;
+        file->clmt_clusters = clusters;
+        file->clmt_last = stream.obj.sclust + clusters - 1;
+
+        return true;
+    }
+#endif
+
+    if (file->clmt_clusters == 0 && !clmt_append(file, stream.obj.sclust))
+        return false;
+
+    buff = static_cast<BYTE*>(heap_caps_malloc(SD_SECTOR_SZ, MALLOC_CAP_DMA));
+    if (buff == nullptr)
+    {
+        ESP_LOGE(TAG, "%s: No heap memory available for FAT sector buffer.", SUB_TAG);
+        return false;
+    }
+
+    buff_sect = static_cast<LBA_t>(-1);
+
+    if (!fat_lock(fs))
+    {
+        ESP_LOGE(TAG, "%s: Timed out waiting for the FatFs volume lock.", SUB_TAG);
+        heap_caps_free(buff);
+        return false;
+    }
+
+    // only clusters added since the last walk (or the loaded sidecar) are visited
+    while (true)
+    {
+        if (!fat_next_cluster(fs, file->clmt_last, next, buff, buff_sect))
+        {
+            ESP_LOGE(TAG, "%s: Broken cluster chain in %s, fast seek disabled.", SUB_TAG, file->get_path());
+            clmt_reset(file, true);
+            success = false;
+            break;
+        }
+
+        if (next == 0)
+            break;
+
+        if (!clmt_append(file, next))
+        {
+            ESP_LOGW(TAG, "%s: %s has more than %u fragments, fast seek disabled.", SUB_TAG, file->get_path(),
+                    static_cast<unsigned>(cfg.fast_seek_max_fragments));
+            success = false;
+            break;
+        }
+    }
+
+    fat_unlock(fs);
+    heap_caps_free(buff);
+
+    return success;
+}
+
+bool SDLogger::clmt_append(SDFile file, DWORD cluster)
+{
+    std::vector<DWORD>& clmt = file->clmt;
+    const size_t fragments = (clmt.size() - 2) / 2;
+
+    // layout: clmt[0] table size, fragment n at clmt[1 + 2n] (run length) and clmt[2 + 2n] (first cluster), 0 terminated
+    if (fragments > 0 && clmt[2 * fragments] + clmt[2 * fragments - 1] == cluster)
+    {
+        clmt[2 * fragments - 1]++;
+    }
+    else
+    {
+        if (fragments >= cfg.fast_seek_max_fragments)
+        {
+            clmt_reset(file, true);
+            return false;
+        }
+
+        clmt.back() = 1;
+        clmt.push_back(cluster);
+        clmt.push_back(0);
+        clmt[0] = static_cast<DWORD>(clmt.size());
+    }
+
+    file->clmt_clusters++;
+    file->clmt_last = cluster;
+
+    return true;
+}
+
+void SDLogger::clmt_reset(SDFile file, bool release)
+{
+    if (release)
+    {
+        std::vector<DWORD>().swap(file->clmt);
+        file->clmt_active = false;
+    }
+    else
+    {
+        file->clmt.assign({2, 0});
+    }
+
+    file->clmt_clusters = 0;
+    file->clmt_last = 0;
+    file->clmt_saved_sz = 0;
+}
+
+bool SDLogger::fat_next_cluster(FATFS* fs, DWORD cluster, DWORD& next, BYTE* buff, LBA_t& buff_sect)
+{
+    const BYTE* entries = buff;
+    LBA_t sect = 0;
+    UINT offset = 0;
+    DWORD value = 0;
+
+    switch (fs->fs_type)
+    {
+    case FS_FAT16:
+        sect = fs->fatbase + cluster / (SD_SECTOR_SZ / 2);
+        offset = (cluster % (SD_SECTOR_SZ / 2)) * 2;
         break;
-    case FR_INVALID_PARAMETER:
-        sprintf(dest_str, "FR_INVALID_PARAMETER");
+    case FS_FAT32:
+    case FS_EXFAT:
+        sect = fs->fatbase + cluster / (SD_SECTOR_SZ / 4);
+        offset = (cluster % (SD_SECTOR_SZ / 4)) * 4;
         break;
     default:
-        sprintf(dest_str, "UNKNOWN_CODE");
-        break;
+        return false;
+    }
+
+    // FatFs writes FAT entries through its window, the sector it holds may be newer than the disk
+    if (sect == fs->winsect)
+    {
+        entries = fs->win;
+    }
+    // consecutive clusters mostly share a FAT sector
+    else if (sect != buff_sect)
+    {
+        if (disk_read(fs->pdrv, buff, sect, 1) != RES_OK)
+            return false;
+
+        buff_sect = sect;
+    }
+
+    if (fs->fs_type == FS_FAT16)
+    {
+        value = entries[offset] | (static_cast<DWORD>(entries[offset + 1]) << 8);
+    }
+    else
+    {
+        value = entries[offset] | (static_cast<DWORD>(entries[offset + 1]) << 8) |
+                (static_cast<DWORD>(entries[offset + 2]) << 16) | (static_cast<DWORD>(entries[offset + 3]) << 24);
+
+        if (fs->fs_type == FS_FAT32)
+            value &= 0x0FFFFFFFUL;
     }
+
+    // a free entry inside a chain means the chain is broken
+    if (value < 2)
+        return false;
+
+    // end of chain markers (and bad cluster marks FatFs would reject as well) are all past the last cluster
+    next = (value < fs->n_fatent) ? value : 0;
+
+    return true;
 }
 
-bool SDLogger::open_file(SDFile file, const char* permissions)
+bool SDLogger::fat_lock(FATFS* fs)
 {
-    const constexpr char* SUB_TAG = "SD->open_file()";
-    char full_path[100];
-    FRESULT res;
-    uint8_t fatfs_mode = 0;
+#if FF_FS_REENTRANT
+    // the lock every f_*() call takes, held it keeps FatFs (and the volume driver under it) off the FAT during a walk
+    return ff_mutex_take(fs->ldrv) != 0;
+#else
+    return true;
+#endif
+}
+
+void SDLogger::fat_unlock(FATFS* fs)
+{
+#if FF_FS_REENTRANT
+    ff_mutex_give(fs->ldrv);
+#endif
+}
+
+void SDLogger::clmt_sidecar_path(DWORD sclust, char* path)
+{
+    sprintf(path, "%s/%08lX.CLM", CLMT_DIR, static_cast<unsigned long>(sclust));
+}
+
+bool SDLogger::clmt_load(SDFile file, const char* SUB_TAG)
+{
+    FATFS* fs = file->stream->obj.fs;
+    const FSIZE_t cluster_sz = static_cast<FSIZE_t>(fs->csize) * SD_SECTOR_SZ;
+    std::unique_ptr<FIL> sidecar(new FIL());
+    std::unique_ptr<FILINFO> fno(new FILINFO());
+    clmt_sidecar_t header;
+    std::vector<DWORD> fragments;
+    char path[32];
+    UINT bytes_read = 0;
+    DWORD next = 0;
+    FSIZE_t mapped = 0;
+    LBA_t buff_sect = static_cast<LBA_t>(-1);
+    BYTE* buff = nullptr;
+    bool exact = false;
+    bool valid = true;
+
+#if FF_FS_EXFAT
+    // contiguous exFAT files are mapped without a walk, see clmt_extend()
+    if (fs->fs_type == FS_EXFAT && (file->stream->obj.stat & 2))
+        return false;
+#endif
+
+    clmt_sidecar_path(file->stream->obj.sclust, path);
+
+    if (f_stat(drive_path(file->path).get(), fno.get()) != FR_OK)
+        return false;
+
+    if (bus_f_open(sidecar.get(), path, FA_READ) != FR_OK)
+        return false;
+
+    if (f_read(sidecar.get(), &header, sizeof(header), &bytes_read) != FR_OK || bytes_read != sizeof(header) ||
+            header.magic != CLMT_MAGIC || header.sclust != file->stream->obj.sclust || header.csize != fs->csize ||
+            header.size > f_size(file->stream.get()) || header.fragments == 0 || header.fragments > cfg.fast_seek_max_fragments)
+    {
+        bus_f_close(sidecar.get());
+        return false;
+    }
+
+    fragments.resize(2 * header.fragments);
+    if (f_read(sidecar.get(), fragments.data(), fragments.size() * sizeof(DWORD), &bytes_read) != FR_OK ||
+            bytes_read != fragments.size() * sizeof(DWORD))
+    {
+        bus_f_close(sidecar.get());
+        return false;
+    }
+
+    bus_f_close(sidecar.get());
+
+    exact = (header.size == fno->fsize && header.fdate == fno->fdate && header.ftime == fno->ftime);
+
+    // the table must map exactly the clusters its recorded size needs, all of them inside the volume
+    for (size_t i = 0; i < header.fragments; i++)
+    {
+        if (fragments[2 * i] == 0 || fragments[2 * i + 1] < 2 || fragments[2 * i + 1] + fragments[2 * i] > fs->n_fatent)
+            valid = false;
+
+        mapped += fragments[2 * i];
+    }
+
+    if (!valid || fragments[1] != header.sclust || mapped != std::max<FSIZE_t>(1, (header.size + cluster_sz - 1) / cluster_sz))
+    {
+        ESP_LOGW(TAG, "%s: Invalid fast seek table for %s, walking cluster chain.", SUB_TAG, file->get_path());
+        return false;
+    }
+
+    // the file changed since the save (ie. appends before a power loss) and cannot be older than the table
+    if (!exact &&
+            (static_cast<uint32_t>(fno->fdate) << 16 | fno->ftime) < (static_cast<uint32_t>(header.fdate) << 16 | header.ftime))
+        return false;
+
+    buff = static_cast<BYTE*>(heap_caps_malloc(SD_SECTOR_SZ, MALLOC_CAP_DMA));
+    if (buff == nullptr)
+        return false;
+
+    if (!fat_lock(fs))
+    {
+        heap_caps_free(buff);
+        return false;
+    }
+
+    // every fragment must still link to the next one, and the last mapped cluster must end the chain of an unchanged
+    // file; a grown file only needs it still allocated, the clusters added after it are walked by clmt_extend()
+    for (size_t i = 0; i < header.fragments && valid; i++)
+    {
+        const DWORD last = fragments[2 * i + 1] + fragments[2 * i] - 1;
+
+        if (!fat_next_cluster(fs, last, next, buff, buff_sect))
+            valid = false;
+        else if (i + 1 < header.fragments && next != fragments[2 * (i + 1) + 1])
+            valid = false;
+        else if (i + 1 == header.fragments && exact && next != 0)
+            valid = false;
+    }
+
+    fat_unlock(fs);
+    heap_caps_free(buff);
+
+    if (!valid)
+    {
+        ESP_LOGW(TAG, "%s: Stale fast seek table for %s, walking cluster chain.", SUB_TAG, file->get_path());
+        return false;
+    }
+
+    clmt_reset(file);
+
+    for (size_t i = 0; i < header.fragments; i++)
+    {
+        file->clmt.back() = fragments[2 * i];
+        file->clmt.push_back(fragments[2 * i + 1]);
+        file->clmt.push_back(0);
+        file->clmt_clusters += fragments[2 * i];
+        file->clmt_last = fragments[2 * i + 1] + fragments[2 * i] - 1;
+    }
+
+    file->clmt[0] = static_cast<DWORD>(file->clmt.size());
+    file->clmt_saved_sz = header.size;
+
+    return true;
+}
+
+bool SDLogger::clmt_save(SDFile file, const char* SUB_TAG)
+{
+    FATFS* fs = file->stream->obj.fs;
+    std::unique_ptr<FIL> sidecar(new FIL());
+    std::unique_ptr<FILINFO> fno(new FILINFO());
+    clmt_sidecar_t header;
+    char path[32];
+    UINT bytes_written = 0;
+    FRESULT res = FR_OK;
+
+    if (!file->clmt_active || file->stream->obj.sclust == 0 || f_size(file->stream.get()) < cfg.fast_seek_sidecar_sz ||
+            f_size(file->stream.get()) == file->clmt_saved_sz)
+        return true;
+
+    // maps the clusters added since the last save
+    if (!clmt_extend(file, SUB_TAG))
+        return false;
+
+    // the directory entry must hold the size and time recorded below
+    res = trace_f_sync(file->stream.get());
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_sync()");
+        return false;
+    }
+
+    file->unsynced = false;
+
+    res = f_stat(drive_path(file->path).get(), fno.get());
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_stat()");
+        return false;
+    }
+
+    res = f_mkdir(drive_path(CLMT_DIR).get());
+    if (res != FR_OK && res != FR_EXIST)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_mkdir()");
+        return false;
+    }
+
+    clmt_sidecar_path(file->stream->obj.sclust, path);
+
+    res = bus_f_open(sidecar.get(), path, FA_CREATE_ALWAYS | FA_WRITE);
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_open()");
+        return false;
+    }
+
+    header.magic = CLMT_MAGIC;
+    header.sclust = file->stream->obj.sclust;
+    header.size = f_size(file->stream.get());
+    header.fdate = fno->fdate;
+    header.ftime = fno->ftime;
+    header.csize = fs->csize;
+    header.fragments = static_cast<uint32_t>((file->clmt.size() - 2) / 2);
+
+    res = f_write(sidecar.get(), &header, sizeof(header), &bytes_written);
+    if (res == FR_OK)
+        res = f_write(sidecar.get(), &file->clmt[1], header.fragments * 2 * sizeof(DWORD), &bytes_written);
+
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_write()");
+        bus_f_close(sidecar.get());
+        return false;
+    }
+
+    res = bus_f_close(sidecar.get());
+    if (res != FR_OK)
+    {
+        print_fatfs_error(res, SUB_TAG, "f_close()");
+        return false;
+    }
+
+    file->clmt_saved_sz = header.size;
+
+    return true;
+}
+
+void SDLogger::clmt_delete(DWORD sclust)
+{
+    char path[32];
+
+    clmt_sidecar_path(sclust, path);
+    f_unlink(drive_path(path).get()); // most files never had one
+}
+
+DWORD SDLogger::file_start_cluster(const char* path)
+{
+    std::unique_ptr<FIL> probe(new FIL());
+    DWORD sclust = 0;
+
+    if (bus_f_open(probe.get(), path, FA_READ) == FR_OK)
+    {
+        sclust = probe->obj.sclust;
+        bus_f_close(probe.get());
+    }
+
+    return sclust;
+}
+
+bool SDLogger::flush_cache(SDFile file, const char* SUB_TAG)
+{
+    size_t length = file->cache_len;
+
+    if (length == 0)
+        return true;
+
+    // the cache is emptied even on failure, a retry would duplicate whatever part FatFs already accepted
+    file->cache_len = 0;
+    file->stats.cache_flushes++;
+
+    return write_through(file, file->cache, length, SUB_TAG);
+}
+
+bool SDLogger::alloc_cache(SDFile file, const char* SUB_TAG)
+{
+    if (!file->write_cache_set)
+        file->write_cache_sz = cfg.write_cache_sz;
+
+    file->cache_len = 0;
+
+    if (file->write_cache_sz == 0 || !(file->stream->flag & FA_WRITE))
+        return true;
+
+    // card driver DMAs straight out of the cache, anything else is bounced through a one sector buffer
+    file->cache = static_cast<char*>(heap_caps_malloc(file->write_cache_sz, MALLOC_CAP_DMA));
+    if (file->cache == nullptr)
+    {
+        ESP_LOGW(TAG, "%s: Failed to allocate %u byte write cache for %s, writing uncached.", SUB_TAG,
+                static_cast<unsigned>(file->write_cache_sz), file->get_path());
+        return false;
+    }
+
+    return true;
+}
+
+void SDLogger::free_cache(SDFile file)
+{
+    if (file->cache)
+        heap_caps_free(file->cache);
+
+    file->cache = nullptr;
+    file->cache_len = 0;
+}
+
+bool SDLogger::set_write_cache(SDFile file, size_t size)
+{
+    const constexpr char* SUB_TAG = "SD->set_write_cache()";
+    bool success = true;
+
+    ScopedLock lock(io_mutex);
+
+    if (!file || !file->initialized)
+    {
+        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
+        return false;
+    }
+
+    if (size % SD_SECTOR_SZ != 0)
+    {
+        ESP_LOGE(TAG, "%s: Cache size must be a multiple of %u bytes.", SUB_TAG, static_cast<unsigned>(SD_SECTOR_SZ));
+        return false;
+    }
+
+    // an open file keeps its data, cached bytes are written out before the cache is replaced
+    if (file->open)
+    {
+        success = drain_file(file, SUB_TAG);
+        success &= flush_cache(file, SUB_TAG);
+        free_cache(file);
+    }
+
+    file->write_cache_set = true;
+    file->write_cache_sz = size;
+
+    // a parked file gets its cache when it is opened again
+    if (file->open && !file->parked)
+        success &= alloc_cache(file, SUB_TAG);
+
+    return success;
+}
+
+bool SDLogger::parse_info(const char* info_buffer)
+{
+    char temp_buff[50];
+
+    if (!parse_info_field(info_buffer, "Name", info.name, sizeof(info.name)))
+        return false;
+
+    if (!parse_info_field(info_buffer, "Type", info.type, sizeof(info.type)))
+        return false;
+
+    if (!parse_info_field(info_buffer, "Speed", temp_buff, sizeof(temp_buff)))
+        return false;
+
+    info.speed_mhz = strtof(temp_buff, nullptr);
+
+    if (!parse_info_field(info_buffer, "Size", temp_buff, sizeof(temp_buff)))
+        return false;
+
+    info.size_mb = strtoul(temp_buff, nullptr, 10);
+
+    if (!parse_info_field(info_buffer, "bus_width", temp_buff, sizeof(temp_buff)))
+        return false;
+
+    info.ssr_bus_width = static_cast<uint8_t>(strtoul(temp_buff, nullptr, 10));
 
-    if (!usability_check(SUB_TAG))
+    if (!parse_info_field(info_buffer, "ver", temp_buff, sizeof(temp_buff)))
         return false;
 
-    if (!file || !file->initialized)
-    {
-        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
+    info.csd.ver = static_cast<uint8_t>(strtoul(temp_buff, nullptr, 10));
+
+    if (!parse_info_field(info_buffer, "sector_size", temp_buff, sizeof(temp_buff)))
         return false;
-    }
 
-    if (open_files.size() + 1 > max_open_files)
-    {
-        ESP_LOGE(TAG, "%s: Max files already opened.", SUB_TAG);
+    info.csd.sector_sz = static_cast<uint16_t>(strtoul(temp_buff, nullptr, 10));
+
+    if (!parse_info_field(info_buffer, "capacity", temp_buff, sizeof(temp_buff)))
         return false;
-    }
 
-    if (!posix_perms_2_fatfs_perms(permissions, fatfs_mode))
-    {
-        ESP_LOGE(TAG, "%s: Invalid posix permission flag.", SUB_TAG);
+    info.csd.capacity = strtoull(temp_buff, nullptr, 10);
+
+    if (!parse_info_field(info_buffer, "read_bl_len", temp_buff, sizeof(temp_buff)))
         return false;
-    }
+    info.csd.read_bl_len = static_cast<uint8_t>(strtoul(temp_buff, nullptr, 10));
 
-    // build directory path if it does not exist
-    if (strcmp(file->directory_path, "") != 0)
+    info.initialized = true;
+
+    return true;
+}
+
+bool SDLogger::parse_info_field(const char* info_buffer, const char* key, char* output, size_t output_sz)
+{
+    const char* key_start = strstr(info_buffer, key);
+    if (!key_start)
+        return false;
+
+    key_start += strlen(key) + 1; // skip key string and colon
+
+    const char* key_end = strchr(key_start, '\n');
+    if (key_end)
     {
-        if (!path_exists(file->directory_path, SUB_TAG, true))
-            if (!build_path(file->directory_path))
-            {
-                ESP_LOGE(TAG, "%s: Directory does not exist and path failed to build.", SUB_TAG);
-            }
-    }
 
-    // append root path to file path to create the full path
-    strcpy(full_path, root_path);
-    strcat(full_path, file->path);
+        size_t length = key_end - key_start;
 
-    // open the file
-    res = f_open(&file->stream, file->path, fatfs_mode);
-    if (res != FR_OK)
+        if (length >= output_sz)
+            length = output_sz - 1;
+
+        strncpy(output, key_start, length);
+        output[length] = '\0';
+    }
+    else
     {
-        print_fatfs_error(res, SUB_TAG, "f_open()");
-        return false;
+        strncpy(output, key_start, output_sz - 1);
+        output[output_sz - 1] = '\0';
     }
 
-    // add pointer newly opened file to open_files vector
-    open_files.push_back(file);
-    file->open = true;
-
     return true;
 }
 
-bool SDLogger::close_file(SDFile file)
+bool SDLogger::profile_write(LBA_t sector, UINT count, const uint8_t* buffer, sd_profile_t& profile, uint32_t& latency_us)
 {
-    const constexpr char* SUB_TAG = "SD->close_file()";
-    bool found = false;
-    int idx = 0;
-    FRESULT res = FR_OK;
+    const int64_t start_us = esp_timer_get_time();
+    const DRESULT res = disk_write(pdrv, buffer, sector, count);
+    size_t bucket = 0;
 
-    if (!usability_check(SUB_TAG))
+    latency_us = static_cast<uint32_t>(esp_timer_get_time() - start_us);
+
+    while (bucket < sd_profile_t::STALL_BUCKETS - 1 && latency_us >= PROFILE_STALL_MS[bucket] * 1000UL)
+        bucket++;
+
+    profile.stall_hist[bucket]++;
+    profile.write_commands++;
+    profile.max_write_us = std::max(profile.max_write_us, latency_us);
+
+    return (res == RES_OK);
+}
+
+bool SDLogger::tune_card(bool force, const char* SUB_TAG)
+{
+    const size_t region_sz = TUNE_REGION_SECTORS * SD_SECTOR_SZ;
+    const uint32_t base_khz = static_cast<uint32_t>(card.real_freq_khz);
+    tune_record_t record = {};
+    sd_tune_result_t result;
+    std::vector<uint32_t> freqs;
+    uint8_t* saved = nullptr;
+    uint8_t* scratch = nullptr;
+    size_t start = 0;
+    size_t selected = SIZE_MAX; // index into tune_results
+    uint32_t best_write_kib_s = 0;
+    uint32_t best_freq_khz = 0;
+    bool restored = false;
+    bool stable = false;
+
+    if (card.csd.capacity <= static_cast<int>(TUNE_REGION_SECTORS))
+    {
+        ESP_LOGE(TAG, "%s: Card too small to tune.", SUB_TAG);
+        return false;
+    }
+
+    start = card.csd.capacity - TUNE_REGION_SECTORS;
+
+    saved = static_cast<uint8_t*>(heap_caps_malloc(region_sz, MALLOC_CAP_DMA));
+    scratch = static_cast<uint8_t*>(heap_caps_malloc(region_sz, MALLOC_CAP_DMA));
+
+    if (saved == nullptr || scratch == nullptr)
+    {
+        ESP_LOGE(TAG, "%s: No DMA capable memory available for tuning buffers.", SUB_TAG);
+        heap_caps_free(saved);
+        heap_caps_free(scratch);
         return false;
+    }
 
-    if (!file || !file->initialized)
+    // the region is read twice at the clock the card came up with, every setting writes these contents back unchanged
+    if (sdmmc_read_sectors(&card, saved, start, TUNE_REGION_SECTORS) != ESP_OK ||
+            sdmmc_read_sectors(&card, scratch, start, TUNE_REGION_SECTORS) != ESP_OK || memcmp(saved, scratch, region_sz) != 0)
     {
-        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
+        ESP_LOGE(TAG, "%s: Could not read a stable copy of the test region.", SUB_TAG);
+        heap_caps_free(saved);
+        heap_caps_free(scratch);
         return false;
     }
 
-    if (open_files.size() != 0)
-        for (int i = 0; i < open_files.size(); i++)
+    tune_results.clear();
+
+    // a setting saved for this card only needs one verification pass
+    if (!force && tune_load(record) && record.serial == static_cast<uint32_t>(card.cid.serial))
+    {
+        if (tune_measure(record.freq_khz, record.transfer_sz / SD_SECTOR_SZ, start, saved, scratch, result, SUB_TAG))
         {
+            tune_results.push_back(result);
+            selected = 0;
+            restored = true;
+        }
+        else
+        {
+            ESP_LOGW(TAG, "%s: Saved setting (%lu kHz, %lu bytes) failed verification, tuning again.", SUB_TAG,
+                    static_cast<unsigned long>(record.freq_khz), static_cast<unsigned long>(record.transfer_sz));
+            tune_recover(base_khz, SUB_TAG);
+        }
+    }
 
-            if (strcmp(open_files[i]->path, file->path) == 0)
+    if (!restored)
+    {
+        // the clock the card came up with is measured as well, it is the fallback if nothing faster holds
+        freqs.push_back(base_khz);
+
+        for (uint32_t freq_khz : TUNE_FREQS_KHZ)
+            if (freq_khz > base_khz && freq_khz <= cfg.tune_max_freq_khz)
+                freqs.push_back(freq_khz);
+
+        for (uint32_t freq_khz : freqs)
+        {
+            for (size_t sectors : TUNE_SECTORS)
             {
-                res = f_close(&file->stream);
-                if (res != FR_OK)
-                {
-                    print_fatfs_error(res, SUB_TAG, "f_close()");
-                }
-                idx = i;
-                found = true;
+                stable = tune_measure(freq_khz, sectors, start, saved, scratch, result, SUB_TAG);
+                tune_results.push_back(result);
+
+                if (!stable)
+                    break;
             }
+
+            if (stable)
+                continue;
+
+            // one failed transfer rules out the whole clock and everything faster
+            for (sd_tune_result_t& r : tune_results)
+                if (r.freq_khz == freq_khz)
+                    r.stable = false;
+
+            tune_recover(base_khz, SUB_TAG);
+            break;
         }
 
-    if (found)
+        for (const sd_tune_result_t& r : tune_results)
+            if (r.stable && r.write_kib_s > best_write_kib_s)
+            {
+                best_write_kib_s = r.write_kib_s;
+                best_freq_khz = r.freq_khz;
+            }
+
+        // larger transfers cost a larger write cache per file, the smallest one close to the best is taken
+        for (size_t i = 0; i < tune_results.size() && selected == SIZE_MAX; i++)
+            if (tune_results[i].stable && tune_results[i].freq_khz == best_freq_khz &&
+                    tune_results[i].write_kib_s >= best_write_kib_s * TUNE_SIZE_MARGIN / 100U)
+                selected = i;
+    }
+
+    // a setting that failed may have written garbage, the region is put back at the base clock
+    if (tune_set_clock(base_khz, SUB_TAG))
     {
-        open_files.erase(open_files.begin() + idx);
-        open_files.shrink_to_fit();
-        file->open = false;
+        if (sdmmc_write_sectors(&card, saved, start, TUNE_REGION_SECTORS) != ESP_OK ||
+                sdmmc_read_sectors(&card, scratch, start, TUNE_REGION_SECTORS) != ESP_OK || memcmp(saved, scratch, region_sz) != 0)
+            ESP_LOGE(TAG, "%s: Test region (sectors %u-%u) could not be restored.", SUB_TAG, static_cast<unsigned>(start),
+                    static_cast<unsigned>(start + TUNE_REGION_SECTORS - 1));
     }
-    else
+
+    heap_caps_free(saved);
+    heap_caps_free(scratch);
+
+    if (selected == SIZE_MAX)
     {
-        ESP_LOGW(TAG, "%s:  No matching open file found for path: %s", SUB_TAG, file->get_path());
+        ESP_LOGE(TAG, "%s: No stable setting found.", SUB_TAG);
+        return false;
     }
 
-    return found;
-}
+    tune_results[selected].selected = true;
 
-bool SDLogger::close_all_files()
-{
-    const constexpr char* SUB_TAG = "SD->close_all_files()";
-    FRESULT res = FR_OK;
+    if (!tune_set_clock(tune_results[selected].freq_khz, SUB_TAG))
+        return false;
 
-    for (SDFile& f : open_files)
-    {
-        res = f_close(&f->stream);
+    // files opened from now on get caches of the tuned transfer size, a disabled cache stays disabled
+    if (cfg.write_cache_sz > 0)
+        cfg.write_cache_sz = tune_results[selected].transfer_sz;
 
-        if (res != FR_OK)
-        {
-            print_fatfs_error(res, SUB_TAG, "f_close()");
-            return false;
-        }
+    ESP_LOGI(TAG, "%s: Running at %lu kHz with %u byte transfers (%lu KiB/s write, %lu KiB/s read)%s.", SUB_TAG,
+            static_cast<unsigned long>(tune_results[selected].freq_khz), static_cast<unsigned>(tune_results[selected].transfer_sz),
+            static_cast<unsigned long>(tune_results[selected].write_kib_s), static_cast<unsigned long>(tune_results[selected].read_kib_s),
+            restored ? ", saved setting" : "");
 
-        f->open = false;
-    }
+    if (!restored)
+    {
+        print_tune_results();
 
-    open_files.clear();
-    open_files.shrink_to_fit();
+        record.magic = TUNE_MAGIC;
+        record.serial = static_cast<uint32_t>(card.cid.serial);
+        record.freq_khz = tune_results[selected].freq_khz;
+        record.transfer_sz = tune_results[selected].transfer_sz;
+        tune_save(record, SUB_TAG);
+    }
 
     return true;
 }
 
-bool SDLogger::create_directory(const char* path, bool suppress_dir_exists_warning)
+bool SDLogger::tune_measure(uint32_t freq_khz, size_t sectors, size_t start, const uint8_t* saved, uint8_t* scratch, sd_tune_result_t& result,
+        const char* SUB_TAG)
 {
-    const constexpr char* SUB_TAG = "SD->create_directory()";
-    FRESULT res = FR_OK;
+    const size_t region_sz = TUNE_REGION_SECTORS * SD_SECTOR_SZ;
+    esp_err_t err = ESP_OK;
+    int64_t start_us = 0;
+    int64_t write_us = 0;
+    int64_t read_us = 0;
 
-    if (!usability_check(SUB_TAG))
-        return false;
+    result = sd_tune_result_t();
+    result.freq_khz = freq_khz;
+    result.transfer_sz = sectors * SD_SECTOR_SZ;
 
-    res = f_mkdir(path);
+    if (sectors == 0 || TUNE_REGION_SECTORS % sectors != 0 || !tune_set_clock(freq_khz, SUB_TAG))
+        return false;
 
-    if (res != FR_OK)
+    for (uint8_t pass = 0; pass < TUNE_PASSES; pass++)
     {
+        start_us = esp_timer_get_time();
+        for (size_t offset = 0; offset < TUNE_REGION_SECTORS && err == ESP_OK; offset += sectors)
+            err = sdmmc_write_sectors(&card, saved + offset * SD_SECTOR_SZ, start + offset, sectors);
+        write_us += esp_timer_get_time() - start_us;
 
-        switch (res)
-        {
-        case FR_NO_PATH:
-            // attempt to build the path if it doesn't exists
-            if (!build_path(path))
-            {
-                ESP_LOGE(TAG, "%s: Path does not exist and could not be built.", SUB_TAG);
-                return false;
-            }
-            break;
+        // stale contents from the previous pass must not pass verification
+        memset(scratch, 0, region_sz);
 
-        case FR_EXIST:
-            if (!suppress_dir_exists_warning)
-                ESP_LOGW(TAG, "%s: Directory already exists.", SUB_TAG);
-            return true;
-            break;
+        start_us = esp_timer_get_time();
+        for (size_t offset = 0; offset < TUNE_REGION_SECTORS && err == ESP_OK; offset += sectors)
+            err = sdmmc_read_sectors(&card, scratch + offset * SD_SECTOR_SZ, start + offset, sectors);
+        read_us += esp_timer_get_time() - start_us;
 
-        default:
-            print_fatfs_error(res, SUB_TAG, "f_mkdir()");
+        if (err != ESP_OK || memcmp(saved, scratch, region_sz) != 0)
             return false;
-            break;
-        }
     }
 
+    result.write_kib_s = static_cast<uint32_t>(TUNE_PASSES * region_sz * 1000000ULL / 1024ULL / std::max<int64_t>(write_us, 1));
+    result.read_kib_s = static_cast<uint32_t>(TUNE_PASSES * region_sz * 1000000ULL / 1024ULL / std::max<int64_t>(read_us, 1));
+    result.stable = true;
+
     return true;
 }
 
-bool SDLogger::delete_file(SDFile file)
+bool SDLogger::tune_set_clock(uint32_t freq_khz, const char* SUB_TAG)
 {
-    const constexpr char* SUB_TAG = "SD->delete_file()";
-    FRESULT res = FR_OK;
-
-    if (!usability_check(SUB_TAG))
-        return false;
+    esp_err_t err = sdspi_host_set_card_clk(card_handle, freq_khz);
 
-    if (!file || !file->initialized)
+    if (err != ESP_OK)
     {
-        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
+        ESP_LOGE(TAG, "%s: sdspi_host_set_card_clk() failed for %lu kHz (0x%x).", SUB_TAG, static_cast<unsigned long>(freq_khz), err);
         return false;
     }
 
-    if (file->open)
-    {
-        ESP_LOGE(TAG, "%s: Close file before deleting.", SUB_TAG);
-        return false;
-    }
+    card.real_freq_khz = static_cast<int>(freq_khz);
 
-    if (!path_exists(file->path, SUB_TAG))
-        return false;
+    return true;
+}
 
-    res = f_unlink(file->path);
+bool SDLogger::tune_recover(uint32_t base_khz, const char* SUB_TAG)
+{
+    // a transfer failing at a high clock can leave the card mid command
+    if (tune_set_clock(base_khz, SUB_TAG) && sdmmc_get_status(&card) == ESP_OK)
+        return true;
 
-    if (res != FR_OK)
+    ESP_LOGW(TAG, "%s: Card unresponsive after a failed setting, initializing it again.", SUB_TAG);
+
+    if (sdmmc_card_init(&cfg.sdmmc_host, &card) != ESP_OK)
     {
-        print_fatfs_error(res, SUB_TAG, "f_unlink()");
+        ESP_LOGE(TAG, "%s: sdmmc_card_init() call failure.", SUB_TAG);
         return false;
     }
 
-    return true;
+    return tune_set_clock(base_khz, SUB_TAG);
 }
 
-bool SDLogger::delete_directory(const char* path)
+bool SDLogger::tune_load(tune_record_t& record)
 {
-    // todo:
-    // 1) check if directory is empty
-    // 2) if it is proceed to 4, else 3
-    // 3) delete any files or sub_directories within the passed directory path while checking for errors (ie a file is open)
-    // 4) delete the passed directory
+    char key[16];
+    nvs_handle_t nvs = 0;
+    size_t length = sizeof(record);
+    esp_err_t err = ESP_OK;
 
-    // this is the reverse of the the build_path function
-    return true;
+    snprintf(key, sizeof(key), "tune_cs%d", static_cast<int>(cfg.io_cs));
+
+    if (nvs_open(TUNE_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK)
+        return false;
+
+    err = nvs_get_blob(nvs, key, &record, &length);
+    nvs_close(nvs);
+
+    return (err == ESP_OK && length == sizeof(record) && record.magic == TUNE_MAGIC);
 }
 
-bool SDLogger::file_exists(SDFile file)
+bool SDLogger::tune_save(const tune_record_t& record, const char* SUB_TAG)
 {
-    const constexpr char* SUB_TAG = "SD->file_exists()";
+    char key[16];
+    nvs_handle_t nvs = 0;
+    esp_err_t err = ESP_OK;
 
-    if (!file || !file->initialized)
+    snprintf(key, sizeof(key), "tune_cs%d", static_cast<int>(cfg.io_cs));
+
+    err = nvs_open(TUNE_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK)
     {
-        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
-        return false;
+        err = nvs_set_blob(nvs, key, &record, sizeof(record));
+
+        if (err == ESP_OK)
+            err = nvs_commit(nvs);
+
+        nvs_close(nvs);
     }
 
-    if (!path_exists(file->path, SUB_TAG))
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "%s: Could not save tuning result to NVS (0x%x), tuning runs again next boot.", SUB_TAG, err);
         return false;
+    }
 
     return true;
 }
 
-bool SDLogger::path_exists(const char* path)
+bool SDLogger::load_info()
 {
-    const constexpr char* SUB_TAG = "SD->path_exists()";
+    const constexpr char* SUB_TAG = "SD->load_info()";
 
-    if (!path_exists(path, SUB_TAG))
+    size_t buffer_sz = 1024;
+    char* buffer = static_cast<char*>(malloc(buffer_sz));
+    FILE* memstream;
+
+    if (buffer == nullptr)
+    {
+        ESP_LOGE(TAG, "%s: No heap memory available for info buffer.", SUB_TAG);
+        return false;
+    }
+
+    memstream = fmemopen(buffer, buffer_sz, "w");
+    if (memstream == nullptr)
+    {
+        ESP_LOGW(TAG, "%s: Failed to open memory stream.", SUB_TAG);
+        free(buffer);
+        return false;
+    }
+
+    // a profile belongs to the card it was measured on
+    if (info.profile.valid && info.profile.serial != static_cast<uint32_t>(card.cid.serial))
+        info.profile = sd_profile_t();
+
+    sdmmc_card_print_info(memstream, &card);
+    fclose(memstream);
+
+    // parse info
+    if (!parse_info(buffer))
+    {
+        ESP_LOGW(TAG, "%s: Failed to parse info buffer.", SUB_TAG);
+        free(buffer);
         return false;
+    }
+
+    free(buffer);
 
     return true;
 }
 
-bool SDLogger::build_path(const char* path)
+bool SDLogger::emergency_flush(uint32_t budget_us)
 {
-    const constexpr char* SUB_TAG = "SD->build_path()";
+    const constexpr char* SUB_TAG = "SD->emergency_flush()";
+    const int64_t start_us = esp_timer_get_time();
+    const int64_t deadline_us = start_us + budget_us;
+    repair_header_t* header = reinterpret_cast<repair_header_t*>(repair_buf);
+    repair_entry_t* entries = reinterpret_cast<repair_entry_t*>(repair_buf + SD_SECTOR_SZ);
+    const size_t max_entries = (repair_sectors > 0) ? (repair_sectors - 1) * REPAIR_ENTRIES_PER_SECTOR : 0;
+    WriteBatch batch;
+    std::vector<SDFile> files;
+    std::vector<FSIZE_t> start_pos;
+    size_t entry_count = 0;
+    uint64_t bytes = 0;
+    uint32_t duration_us = 0;
+    bool complete = true;
+    bool success = true;
+
+    // the io task may be in the middle of a write, it is given the budget to finish it. A blocking take would wait whole
+    // ticks, longer than the budget at 100 Hz, so the mutex is polled against the clock instead.
+    bool locked = (xSemaphoreTakeRecursive(io_mutex, 0) == pdTRUE);
+
+    while (!locked && esp_timer_get_time() < deadline_us)
+    {
+        taskYIELD();
+        locked = (xSemaphoreTakeRecursive(io_mutex, 0) == pdTRUE);
+    }
 
-    const char* start = path;
-    const char* end;
-    size_t length;
-    char* part = nullptr;
-    char path_str[100] = "";
+    if (!locked)
+    {
+        ESP_LOGE(TAG, "%s: Card busy for the whole budget.", SUB_TAG);
+        return false;
+    }
 
-    while ((end = strchr(start, '/')) != nullptr)
+    if (!initialized || !mounted || !card_present)
     {
-        length = end - start;
+        xSemaphoreGiveRecursive(io_mutex);
+        ESP_LOGE(TAG, "%s: No card mounted.", SUB_TAG);
+        return false;
+    }
 
-        if (length > 0)
-        {
-            part = static_cast<char*>(malloc(length));
+    // nothing is logged until the card is done, one UART line costs more than a sector write
+    emergency = true;
 
-            if (part == nullptr)
+    {
+        ScopedLock queue_lock(queue_mutex);
+
+        for (std::deque<queued_write_t>& lane : lanes)
+        {
+            for (queued_write_t& record : lane)
             {
-                ESP_LOGE(TAG, "%s: No heap memory available to parse path.", SUB_TAG);
-                return false;
+                record.file->queued_records--;
+                record.file->queued_bytes -= record.length;
+                batch.push_back(std::move(record));
             }
 
-            part[length] = '\0';
-            strncpy(part, start, length);
-            strcat(path_str, "/");
-            strcat(path_str, part);
-            free(part);
-
-            if (!path_exists(path_str, SUB_TAG, true))
-                if (!create_directory(path_str, true))
-                    return false;
+            lane.clear();
         }
 
-        start = end + 1;
+        queued_bytes[SD_PRIORITY_BULK] = 0;
+        queued_bytes[SD_PRIORITY_CRITICAL] = 0;
     }
 
-    if (start != nullptr)
+    notify_space_waiters();
+
+    std::sort(batch.begin(), batch.end(), [](const queued_write_t& a, const queued_write_t& b) { return a.seq < b.seq; });
+
+    // files with critical records first, then files with bulk records, then files with data in their write cache or FIL
+    for (int lane = SD_PRIORITY_MAX - 1; lane >= SD_PRIORITY_BULK; lane--)
+        for (queued_write_t& record : batch)
+            if (record.priority == lane && record.file->open &&
+                    std::find(files.begin(), files.end(), record.file) == files.end())
+                files.push_back(record.file);
+
+    for (std::vector<SDFile>* list : {&open_files, &parked_files})
+        for (SDFile& f : *list)
+            if ((f->cache_len > 0 || f->unsynced) && std::find(files.begin(), files.end(), f) == files.end())
+                files.push_back(f);
+
+    for (SDFile& f : files)
+        start_pos.push_back(file_tell(f) + f->cache_len);
+
+    for (size_t i = 0; i < files.size(); i++)
     {
+        SDFile& f = files[i];
 
-        part = static_cast<char*>(malloc(strlen(start)));
+        // records go through the write cache, which hands them to FatFs as multi-sector transfers
+        for (queued_write_t& record : batch)
+        {
+            if (record.file != f)
+                continue;
 
-        if (part == nullptr)
+            if (esp_timer_get_time() >= deadline_us)
+            {
+                complete = false;
+                break;
+            }
+
+            if (write_bytes(f, record.data.get(), record.length, SUB_TAG))
+                f->stats.records_written++;
+            else
+                success = false;
+        }
+
+        // past the deadline whatever is still in RAM is given up, only the sectors FatFs already holds are written
+        if (esp_timer_get_time() >= deadline_us)
         {
-            ESP_LOGE(TAG, "%s: No heap memory available to parse path.", SUB_TAG);
-            return false;
+            complete = false;
+            f->cache_len = 0;
         }
 
-        strcpy(part, start);
-        strcat(path_str, "/");
-        strcat(path_str, part);
-        free(part);
+        success &= flush_cache(f, SUB_TAG);
 
-        if (!path_exists(path_str, SUB_TAG, true))
-            if (!create_directory(path_str, true))
-                return false;
-    }
+        if (f->parked)
+            continue;
 
-    return true;
-}
+#if !FF_FS_TINY
+        // the partial sector at the end of the data, f_sync() would also rewrite the directory entry and FSInfo. FatFs
+        // keeps that sector in the FIL buffer while the position is inside it, written again if it was not dirty after all
+        if (f->unsynced && f->stream->sect != 0 && f_tell(f->stream.get()) % SD_SECTOR_SZ != 0 &&
+                disk_write(pdrv, f->stream->buf, f->stream->sect, 1) != RES_OK)
+            success = false;
+#endif
 
-bool SDLogger::write(SDFile file, const char* data)
-{
-    const constexpr char* SUB_TAG = "SD->write()";
+        bytes += file_tell(f) - std::min(start_pos[i], file_tell(f));
 
-    FRESULT res = FR_OK;
-    UINT bytes_written;
+        if (f->unsynced && entry_count < max_entries && strlen(f->path) < REPAIR_PATH_SZ)
+        {
+            entries[entry_count].size = f_size(f->stream.get());
+            entries[entry_count].sclust = f->stream->obj.sclust;
+            strcpy(entries[entry_count].path, f->path);
+            entry_count++;
+        }
+    }
 
-    if (!usability_check(SUB_TAG))
-        return false;
+    // the FAT sectors linking the new clusters, the second FAT and FSInfo are left out. The journal names the first FAT
+    // sectors so the next mount can copy them over the second.
+    header->fat_sectors = 0;
 
-    if (!file || !file->initialized)
+    if (fs->wflag && fs->winsect >= fs->fatbase && fs->winsect < fs->fatbase + fs->fsize)
+        repair_log_fat(header, fs->winsect);
+
+    if (meta_caches[pdrv].card != nullptr && fs->n_fats > 1)
     {
-        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
-        return false;
+        const meta_cache_t& cache = meta_caches[pdrv];
+
+        for (size_t i = 0; i < cache.slot_count; i++)
+            if (cache.slots[i].valid && cache.slots[i].dirty && cache.slots[i].sector >= fs->fatbase + fs->fsize &&
+                    cache.slots[i].sector < fs->fatbase + static_cast<LBA_t>(fs->fsize) * fs->n_fats)
+                repair_log_fat(header, fs->fatbase + (cache.slots[i].sector - fs->fatbase) % fs->fsize);
     }
 
-    if (!file->open)
+    if (fs->wflag)
     {
-        ESP_LOGE(TAG, "%s: File not open.", SUB_TAG);
-        return false;
+        if (disk_write(pdrv, fs->win, fs->winsect, 1) == RES_OK)
+            fs->wflag = 0;
+        else
+            success = false;
     }
 
-    // write here
-    res = f_write(&file->stream, data, strlen(data), &bytes_written);
-    if (res != FR_OK)
+    if (meta_caches[pdrv].card != nullptr && meta_cache_write_back(meta_caches[pdrv], fs) != RES_OK)
+        success = false;
+
+    duration_us = static_cast<uint32_t>(esp_timer_get_time() - start_us);
+
+    if (repair_sectors > 0 && (entry_count > 0 || header->fat_sectors > 0))
     {
-        print_fatfs_error(res, SUB_TAG, "f_write()");
+        header->magic = REPAIR_MAGIC;
+        header->entries = entry_count;
+        header->duration_us = duration_us;
+        header->complete = complete ? 1 : 0;
+        header->bytes = bytes;
+
+        // header and entries in one multi-sector write
+        if (disk_write(pdrv, repair_buf, repair_lba, 1 + (entry_count + REPAIR_ENTRIES_PER_SECTOR - 1) / REPAIR_ENTRIES_PER_SECTOR) !=
+                RES_OK)
+            success = false;
     }
 
-    return true;
+    emergency_stats.flushes++;
+    emergency_stats.last_us = duration_us;
+    emergency_stats.max_us = std::max(emergency_stats.max_us, duration_us);
+    emergency_stats.last_files = files.size();
+    emergency_stats.last_bytes = bytes;
+    emergency_stats.last_complete = complete;
+
+    xSemaphoreGiveRecursive(io_mutex);
+
+    return success && complete;
 }
 
-bool SDLogger::write_line(SDFile file, const char* line)
+bool SDLogger::get_emergency_stats(sd_emergency_stats_t& stats)
 {
-    const constexpr char* SUB_TAG = "SD->write_line()";
+    ScopedLock lock(io_mutex);
 
-    size_t line_length;
-    size_t temp_buffer_sz;
-    char* temp_buffer;
-    FRESULT res;
-    UINT bytes_written;
+    stats = emergency_stats;
 
-    if (!usability_check(SUB_TAG))
-        return false;
+    return true;
+}
 
-    if (!file || !file->initialized)
+bool SDLogger::repair_journal_open(const char* SUB_TAG)
+{
+    std::unique_ptr<FIL> journal(new FIL());
+    const repair_header_t* header = nullptr;
+    size_t entries = std::max(static_cast<size_t>(max_open_files), cfg.max_virtual_files);
+    size_t sectors = 0;
+    UINT bytes_done = 0;
+    FRESULT res = FR_OK;
+
+#if FF_FS_EXFAT
+    // an exFAT file's allocation state and fragment count live in the directory entry set, a size alone does not
+    // restore them
+    if (fs->fs_type == FS_EXFAT)
     {
-        ESP_LOGE(TAG, "%s: File not correctly initialized.", SUB_TAG);
+        ESP_LOGW(TAG, "%s: No repair journal on exFAT, files written by an emergency flush keep their last synced size.",
+                SUB_TAG);
         return false;
     }
+#endif
 
-    if (!file->open)
+    entries = std::min(entries, REPAIR_MAX_ENTRIES);
+    sectors = std::min<size_t>(1 + (entries + REPAIR_ENTRIES_PER_SECTOR - 1) / REPAIR_ENTRIES_PER_SECTOR, fs->csize);
+
+    repair_buf = static_cast<BYTE*>(heap_caps_malloc(sectors * SD_SECTOR_SZ, MALLOC_CAP_DMA));
+    if (repair_buf == nullptr)
     {
-        ESP_LOGE(TAG, "%s: File not open.", SUB_TAG);
+        ESP_LOGW(TAG, "%s: No DMA capable memory available for the repair journal.", SUB_TAG);
         return false;
     }
 
-    line_length = strlen(line);
-    temp_buffer_sz = line_length + 2;
-    temp_buffer = new char[temp_buffer_sz];
+    header = reinterpret_cast<const repair_header_t*>(repair_buf);
 
-    if (temp_buffer == nullptr)
+    // the journal left by the last emergency flush, if there was one
+    memset(repair_buf, 0, sectors * SD_SECTOR_SZ);
+
+    res = bus_f_open(journal.get(), REPAIR_PATH, FA_READ);
+    if (res == FR_OK)
     {
-        ESP_LOGE(TAG, "%s: No heap memory available for line buffer.", SUB_TAG);
-        return false;
+        f_read(journal.get(), repair_buf, sectors * SD_SECTOR_SZ, &bytes_done);
+        bus_f_close(journal.get());
+
+        if (header->magic == REPAIR_MAGIC)
+        {
+            emergency_stats.recovered_us = header->duration_us;
+            emergency_stats.recovered_complete = (header->complete != 0);
+            repair_fat_mirror(header, SUB_TAG);
+            emergency_stats.repaired_files = repair_files(repair_buf, bytes_done, SUB_TAG);
+
+            ESP_LOGW(TAG, "%s: Emergency flush before power loss took %lu us (%s, %llu bytes), %lu file sizes restored.", SUB_TAG,
+                    static_cast<unsigned long>(header->duration_us), header->complete ? "complete" : "budget exceeded",
+                    static_cast<unsigned long long>(header->bytes), static_cast<unsigned long>(emergency_stats.repaired_files));
+        }
     }
 
-    strncpy(temp_buffer, line, line_length);
+    // reserved with zeros, a clean header means no repair
+    memset(repair_buf, 0, sectors * SD_SECTOR_SZ);
+
+    res = bus_f_open(journal.get(), REPAIR_PATH, FA_CREATE_ALWAYS | FA_WRITE);
+    if (res == FR_OK)
+    {
+        res = f_write(journal.get(), repair_buf, sectors * SD_SECTOR_SZ, &bytes_done);
+
+        if (res == FR_OK && bytes_done < sectors * SD_SECTOR_SZ)
+            res = FR_DENIED;
 
-    temp_buffer[line_length] = '\n';
-    temp_buffer[line_length + 1] = '\0';
+        if (res == FR_OK)
+            repair_lba = fs->database + static_cast<LBA_t>(fs->csize) * (journal->obj.sclust - 2);
 
-    res = f_write(&file->stream, temp_buffer, strlen(temp_buffer), &bytes_written);
-    delete[] temp_buffer;
+        if (bus_f_close(journal.get()) != FR_OK && res == FR_OK)
+            res = FR_DISK_ERR;
+    }
 
     if (res != FR_OK)
     {
-        print_fatfs_error(res, SUB_TAG, "f_write()");
+        print_fatfs_error(res, SUB_TAG, "repair journal");
+        repair_journal_close();
         return false;
     }
 
+    repair_sectors = sectors;
+
     return true;
 }
 
-bool SDLogger::parse_info(const char* info_buffer)
+void SDLogger::repair_journal_close()
 {
-    char temp_buff[50];
-
-    if (!parse_info_field(info_buffer, "Name", info.name, sizeof(info.name)))
-        return false;
+    heap_caps_free(repair_buf);
+    repair_buf = nullptr;
+    repair_lba = 0;
+    repair_sectors = 0;
+}
 
-    if (!parse_info_field(info_buffer, "Type", info.type, sizeof(info.type)))
-        return false;
+void SDLogger::repair_log_fat(repair_header_t* header, LBA_t sector)
+{
+    const uint32_t offset = static_cast<uint32_t>(sector - fs->fatbase);
 
-    if (!parse_info_field(info_buffer, "Speed", temp_buff, sizeof(temp_buff)))
-        return false;
+    if (header->fat_sectors == REPAIR_FAT_ALL ||
+            std::find(header->fat_offsets, header->fat_offsets + header->fat_sectors, offset) != header->fat_offsets + header->fat_sectors)
+        return;
 
-    info.speed_mhz = strtof(temp_buff, nullptr);
+    if (header->fat_sectors < REPAIR_MAX_FAT_SECTORS)
+        header->fat_offsets[header->fat_sectors++] = offset;
+    else
+        header->fat_sectors = REPAIR_FAT_ALL;
+}
 
-    if (!parse_info_field(info_buffer, "Size", temp_buff, sizeof(temp_buff)))
-        return false;
+bool SDLogger::repair_fat_mirror(const repair_header_t* header, const char* SUB_TAG)
+{
+    const bool whole_fat = (header->fat_sectors == REPAIR_FAT_ALL);
+    const DWORD count = whole_fat ? fs->fsize : std::min<DWORD>(header->fat_sectors, REPAIR_MAX_FAT_SECTORS);
+    BYTE* buf = nullptr;
+    bool success = true;
 
-    info.size_mb = strtoul(temp_buff, nullptr, 10);
+    if (fs->n_fats < 2 || count == 0)
+        return true;
 
-    if (!parse_info_field(info_buffer, "bus_width", temp_buff, sizeof(temp_buff)))
+    buf = static_cast<BYTE*>(heap_caps_malloc(SD_SECTOR_SZ, MALLOC_CAP_DMA));
+    if (buf == nullptr)
+    {
+        ESP_LOGW(TAG, "%s: No DMA capable memory available to copy the FAT.", SUB_TAG);
         return false;
+    }
 
-    info.ssr_bus_width = static_cast<uint8_t>(strtoul(temp_buff, nullptr, 10));
-
-    if (!parse_info_field(info_buffer, "ver", temp_buff, sizeof(temp_buff)))
+    // the flush wrote only the first FAT, its sectors are copied over the stale ones of the second before anything
+    // allocates again
+    if (!fat_lock(fs))
+    {
+        heap_caps_free(buf);
         return false;
+    }
 
-    info.csd.ver = static_cast<uint8_t>(strtoul(temp_buff, nullptr, 10));
-
-    if (!parse_info_field(info_buffer, "sector_size", temp_buff, sizeof(temp_buff)))
-        return false;
+    for (DWORD i = 0; i < count; i++)
+    {
+        const DWORD offset = whole_fat ? i : header->fat_offsets[i];
 
-    info.csd.sector_sz = static_cast<uint16_t>(strtoul(temp_buff, nullptr, 10));
+        if (offset >= fs->fsize)
+            continue;
 
-    if (!parse_info_field(info_buffer, "capacity", temp_buff, sizeof(temp_buff)))
-        return false;
+        if (disk_read(pdrv, buf, fs->fatbase + offset, 1) != RES_OK)
+        {
+            success = false;
+            continue;
+        }
 
-    info.csd.capacity = strtoull(temp_buff, nullptr, 10);
+        for (BYTE n = 1; n < fs->n_fats; n++)
+            if (disk_write(pdrv, buf, fs->fatbase + offset + static_cast<LBA_t>(fs->fsize) * n, 1) != RES_OK)
+                success = false;
+    }
 
-    if (!parse_info_field(info_buffer, "read_bl_len", temp_buff, sizeof(temp_buff)))
-        return false;
-    info.csd.read_bl_len = static_cast<uint8_t>(strtoul(temp_buff, nullptr, 10));
+    fat_unlock(fs);
+    heap_caps_free(buf);
 
-    info.initialized = true;
+    if (!success)
+        ESP_LOGW(TAG, "%s: The second FAT could not be brought up to date.", SUB_TAG);
 
-    return true;
+    return success;
 }
 
-bool SDLogger::parse_info_field(const char* info_buffer, const char* key, char* output, size_t output_sz)
+uint32_t SDLogger::repair_files(const BYTE* journal, size_t journal_sz, const char* SUB_TAG)
 {
-    const char* key_start = strstr(info_buffer, key);
-    if (!key_start)
-        return false;
-
-    key_start += strlen(key) + 1; // skip key string and colon
+    const repair_header_t* header = reinterpret_cast<const repair_header_t*>(journal);
+    const repair_entry_t* entries = reinterpret_cast<const repair_entry_t*>(journal + SD_SECTOR_SZ);
+    const size_t stored = (journal_sz > SD_SECTOR_SZ) ? (journal_sz - SD_SECTOR_SZ) / sizeof(repair_entry_t) : 0;
+    const size_t count = std::min<size_t>(header->entries, stored);
+    std::unique_ptr<FIL> file(new FIL());
+    uint32_t repaired = 0;
+    FRESULT res = FR_OK;
 
-    const char* key_end = strchr(key_start, '\n');
-    if (key_end)
+    // the flush skipped FSInfo, FatFs counts free clusters again on the next f_getfree()
+    if (fs->fs_type == FS_FAT32)
     {
-
-        size_t length = key_end - key_start;
-
-        if (length >= output_sz)
-            length = output_sz - 1;
-
-        strncpy(output, key_start, length);
-        output[length] = '\0';
+        fs->free_clst = 0xFFFFFFFF;
+        fs->fsi_flag |= 1;
     }
-    else
+
+    for (size_t i = 0; i < count; i++)
     {
-        strncpy(output, key_start, output_sz - 1);
-        output[output_sz - 1] = '\0';
-    }
+        if (memchr(entries[i].path, '\0', REPAIR_PATH_SZ) == nullptr)
+            continue;
 
-    return true;
-}
+        res = bus_f_open(file.get(), entries[i].path, FA_READ | FA_WRITE | FA_OPEN_EXISTING);
+        if (res != FR_OK)
+        {
+            ESP_LOGW(TAG, "%s: %s not repaired, f_open() failed (%d).", SUB_TAG, entries[i].path, res);
+            continue;
+        }
 
-bool SDLogger::load_info()
-{
-    const constexpr char* SUB_TAG = "SD->load_info()";
+        // a chain other than the journaled one means the file was replaced after the flush, it is left alone
+        if (f_size(file.get()) < entries[i].size && entries[i].sclust >= 2 && file->obj.sclust == entries[i].sclust)
+        {
+            // the flush linked the chain up to the journaled size, a seek past the end of a file open for writing follows
+            // those links instead of allocating and f_close() writes the new size to the directory entry
+            res = f_lseek(file.get(), entries[i].size);
 
-    size_t buffer_sz = 1024;
-    char* buffer = static_cast<char*>(malloc(buffer_sz));
-    FILE* memstream;
+            if (res == FR_OK && f_size(file.get()) != entries[i].size)
+                res = FR_INT_ERR;
 
-    if (buffer == nullptr)
-    {
-        ESP_LOGE(TAG, "%s: No heap memory available for info buffer.", SUB_TAG);
-        return false;
-    }
+            if (res == FR_OK)
+                res = bus_f_close(file.get());
+            else
+                bus_f_close(file.get());
 
-    memstream = fmemopen(buffer, buffer_sz, "w");
-    if (memstream == nullptr)
-    {
-        ESP_LOGW(TAG, "%s: Failed to open memory stream.", SUB_TAG);
-        free(buffer);
-        return false;
-    }
+            if (res == FR_OK)
+                repaired++;
+            else
+                ESP_LOGW(TAG, "%s: %s not repaired (%d).", SUB_TAG, entries[i].path, res);
 
-    sdmmc_card_print_info(memstream, &card);
-    fclose(memstream);
+            continue;
+        }
 
-    // parse info
-    if (!parse_info(buffer))
-    {
-        ESP_LOGW(TAG, "%s: Failed to parse info buffer.", SUB_TAG);
-        free(buffer);
-        return false;
+        bus_f_close(file.get());
     }
 
-    free(buffer);
-
-    return true;
+    return repaired;
 }
 
 bool SDLogger::usability_check(const char* SUB_TAG)
@@ -942,6 +6473,12 @@ bool SDLogger::usability_check(const char* SUB_TAG)
         return false;
     }
 
+    if (!card_present)
+    {
+        ESP_LOGE(TAG, "%s: Card removed.", SUB_TAG);
+        return false;
+    }
+
     return true;
 }
 
@@ -958,6 +6495,37 @@ SDFile SDLogger::File::create(const char* path)
 SDLogger::File::File()
     : initialized(false)
     , open(false)
+    , write_alignment(0)
+    , priority(SD_PRIORITY_BULK)
+    , overflow_policy_set(false)
+    , overflow_policy(SD_OVERFLOW_BLOCK)
+    , block_timeout_ms(0)
+    , queued_records(0)
+    , queued_bytes(0)
+    , write_cache_set(false)
+    , write_cache_sz(0)
+    , cache(nullptr)
+    , cache_len(0)
+    , clmt_clusters(0)
+    , clmt_last(0)
+    , clmt_active(false)
+    , clmt_saved_sz(0)
+    , open_mode(0)
+    , resume_offset(0)
+    , preallocated(false)
+    , data_end(0)
+    , parked(false)
+    , unsynced(false)
+    , last_use(0)
+    , rate_tokens(0)
+    , rate_refill_us(0)
+    , sample_count(0)
+    , suppressed_records(0)
+    , suppressed_bytes(0)
+    , suppressed_since_us(0)
+    , write_seq(0)
+    , written_seq(0)
+    , durable_seq(0)
     , path(nullptr)
     , directory_path(nullptr)
 {
@@ -965,6 +6533,9 @@ SDLogger::File::File()
 
 SDLogger::File::~File()
 {
+    if (cache)
+        heap_caps_free(cache);
+
     if (path)
         delete[] path;
 
@@ -1159,3 +6730,78 @@ const char* SDLogger::File::get_directory_path()
 {
     return directory_path;
 }
+
+
+SDLogger::BusArbiter& SDLogger::BusArbiter::get(spi_host_device_t host)
+{
+    static BusArbiter arbiters[SPI_HOST_MAX];
+
+    return arbiters[host];
+}
+
+void SDLogger::BusArbiter::acquire()
+{
+    StaticSemaphore_t turn_buffer;
+    SemaphoreHandle_t turn = nullptr;
+
+    while (true)
+    {
+        taskENTER_CRITICAL(&lock);
+
+        if (!busy)
+        {
+            busy = true;
+            taskEXIT_CRITICAL(&lock);
+            return;
+        }
+
+        if (waiters_count < MAX_WAITERS)
+        {
+            // queue up, release() hands the bus directly to the longest waiting task
+            if (turn == nullptr)
+                turn = xSemaphoreCreateBinaryStatic(&turn_buffer);
+
+            waiters[(waiters_head + waiters_count) % MAX_WAITERS] = turn;
+            waiters_count++;
+            taskEXIT_CRITICAL(&lock);
+
+            xSemaphoreTake(turn, portMAX_DELAY);
+            return;
+        }
+
+        taskEXIT_CRITICAL(&lock);
+
+        // wait list full, retry on the next tick
+        vTaskDelay(1);
+    }
+}
+
+void SDLogger::BusArbiter::release()
+{
+    SemaphoreHandle_t next = nullptr;
+
+    taskENTER_CRITICAL(&lock);
+
+    if (waiters_count > 0)
+    {
+        // bus stays busy, ownership passes to the next waiter in FIFO order
+        next = waiters[waiters_head];
+        waiters_head = (waiters_head + 1) % MAX_WAITERS;
+        waiters_count--;
+        handoffs++;
+    }
+    else
+    {
+        busy = false;
+    }
+
+    taskEXIT_CRITICAL(&lock);
+
+    if (next != nullptr)
+        xSemaphoreGive(next);
+}
+
+uint32_t SDLogger::BusArbiter::get_handoff_count()
+{
+    return handoffs;
+}
\ No newline at end of file
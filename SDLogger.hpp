@@ -7,11 +7,22 @@
 #include <array>
 #include <memory>
 #include <unordered_map>
+#include <deque>
+#include <algorithm>
+#include <utility>
 
 // esp-idf includes
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "driver/gpio.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_memory_utils.h"
 #include "esp_vfs_fat.h"
 #include "sdmmc_cmd.h"
+#include "nvs.h"
+#include "diskio.h"
 #include "diskio_impl.h"
 #include "diskio_sdmmc.h"
 #include "vfs_fat_internal.h"
@@ -24,6 +35,33 @@ typedef struct sd_logger_config_t
         gpio_num_t io_miso; // io 2
         gpio_num_t io_sclk; // io 14
         uint32_t sclk_speed_hz;
+        size_t spi_max_transfer_sz;  // max bytes per SPI transaction, given to spi_bus_initialize()
+        bool auto_tune;              // measure faster clocks and write cache sizes in init(), the result is kept in NVS
+        uint32_t tune_max_freq_khz;  // highest clock tried by auto tuning
+        bool card_detect;                 // watch io_cd for card removal/insertion while the io task runs
+        uint8_t card_detect_level;        // io_cd level with a card inserted
+        uint32_t card_detect_debounce_ms;
+        bool init_spi_bus;    // false to attach to a bus already initialized by the application
+        size_t bus_quantum_sz; // max bytes written per turn on the shared bus arbiter, 0 to disable arbitration
+        uint32_t bandwidth_budget_kib_s; // cap on file data written to the card by this instance, 0 for no cap
+        UBaseType_t io_task_priority;
+        uint32_t io_task_stack_sz;
+        BaseType_t io_task_core;
+        size_t queue_capacity;        // max bytes held in the write queue while the io task is running
+        size_t bulk_batch_sz;         // queued bulk bytes that trigger a drain
+        uint32_t bulk_latency_ms;     // bulk target, enqueue to synced
+        uint32_t critical_latency_ms; // critical target, enqueue to synced
+        uint32_t idle_slice_us;       // time budget for background maintenance (ie. delete jobs) per idle io task pass
+        uint8_t overflow_policy;      // sd_overflow_policy_t given to newly created files
+        uint32_t block_timeout_ms;    // SD_OVERFLOW_BLOCK wait given to newly created files
+        size_t write_cache_sz;        // per file write cache in front of FatFs, multiple of 512 bytes, 0 to disable
+        size_t max_virtual_files;     // files open at once, only max_open_files hold a FIL and cache, 0 for max_open_files
+        size_t meta_cache_sectors;    // FAT/directory sectors cached by the mounted volume, 0 to disable
+        size_t fast_seek_max_fragments; // cluster runs in a file's fast seek table, 0 to disable fast seek
+        uint32_t fast_seek_sidecar_sz;  // file size from which fast seek tables are saved to /SDLCLMT/
+        size_t erase_chunk_sectors;     // freed clusters erased in the background, sectors per erase command, 0 to disable
+        bool repair_journal;            // reserve /SDLREPR.BIN so emergency_flush() can leave file sizes for the next mount
+        size_t trace_events;            // spans kept in the write stall trace ring, 0 to disable tracing
         sdmmc_host_t sdmmc_host;
 
         sd_logger_config_t()
@@ -33,6 +71,69 @@ typedef struct sd_logger_config_t
             , io_miso(static_cast<gpio_num_t>(CONFIG_ESP32_SDLOGGER_GPIO_MISO))
             , io_sclk(static_cast<gpio_num_t>(CONFIG_ESP32_SDLOGGER_GPIO_SCLK))
             , sclk_speed_hz(static_cast<uint32_t>(CONFIG_ESP32_SDLOGGER_SCLK_SPEED_HZ))
+            , spi_max_transfer_sz(static_cast<size_t>(CONFIG_ESP32_SDLOGGER_SPI_MAX_TRANSFER_SZ))
+#ifdef CONFIG_ESP32_SDLOGGER_AUTO_TUNE
+            , auto_tune(true)
+            , tune_max_freq_khz(static_cast<uint32_t>(CONFIG_ESP32_SDLOGGER_AUTO_TUNE_MAX_FREQ_KHZ))
+#else
+            , auto_tune(false)
+            , tune_max_freq_khz(0)
+#endif
+#ifdef CONFIG_ESP32_SDLOGGER_CARD_DETECT
+            , card_detect(true)
+#ifdef CONFIG_ESP32_SDLOGGER_CARD_DETECT_ACTIVE_LOW
+            , card_detect_level(0)
+#else
+            , card_detect_level(1)
+#endif
+            , card_detect_debounce_ms(static_cast<uint32_t>(CONFIG_ESP32_SDLOGGER_CARD_DETECT_DEBOUNCE_MS))
+#else
+            , card_detect(false)
+            , card_detect_level(0)
+            , card_detect_debounce_ms(0)
+#endif
+#ifdef CONFIG_ESP32_SDLOGGER_INIT_SPI_BUS
+            , init_spi_bus(true)
+#else
+            , init_spi_bus(false)
+#endif
+            , bus_quantum_sz(static_cast<size_t>(CONFIG_ESP32_SDLOGGER_BUS_QUANTUM_SZ))
+            , bandwidth_budget_kib_s(static_cast<uint32_t>(CONFIG_ESP32_SDLOGGER_BANDWIDTH_BUDGET_KIB_S))
+            , io_task_priority(static_cast<UBaseType_t>(CONFIG_ESP32_SDLOGGER_IO_TASK_PRIORITY))
+            , io_task_stack_sz(static_cast<uint32_t>(CONFIG_ESP32_SDLOGGER_IO_TASK_STACK_SZ))
+            , io_task_core((CONFIG_ESP32_SDLOGGER_IO_TASK_CORE < 0) ? tskNO_AFFINITY : CONFIG_ESP32_SDLOGGER_IO_TASK_CORE)
+            , queue_capacity(static_cast<size_t>(CONFIG_ESP32_SDLOGGER_QUEUE_CAPACITY))
+            , bulk_batch_sz(static_cast<size_t>(CONFIG_ESP32_SDLOGGER_BULK_BATCH_SZ))
+            , bulk_latency_ms(static_cast<uint32_t>(CONFIG_ESP32_SDLOGGER_BULK_LATENCY_MS))
+            , critical_latency_ms(static_cast<uint32_t>(CONFIG_ESP32_SDLOGGER_CRITICAL_LATENCY_MS))
+            , idle_slice_us(static_cast<uint32_t>(CONFIG_ESP32_SDLOGGER_IDLE_SLICE_US))
+            , overflow_policy(static_cast<uint8_t>(CONFIG_ESP32_SDLOGGER_OVERFLOW_POLICY))
+            , block_timeout_ms(static_cast<uint32_t>(CONFIG_ESP32_SDLOGGER_BLOCK_TIMEOUT_MS))
+            , write_cache_sz(static_cast<size_t>(CONFIG_ESP32_SDLOGGER_WRITE_CACHE_SZ))
+            , max_virtual_files(static_cast<size_t>(CONFIG_ESP32_SDLOGGER_MAX_VIRTUAL_FILES))
+            , meta_cache_sectors(static_cast<size_t>(CONFIG_ESP32_SDLOGGER_META_CACHE_SECTORS))
+#ifdef CONFIG_ESP32_SDLOGGER_FAST_SEEK
+            , fast_seek_max_fragments(static_cast<size_t>(CONFIG_ESP32_SDLOGGER_FAST_SEEK_MAX_FRAGMENTS))
+            , fast_seek_sidecar_sz(static_cast<uint32_t>(CONFIG_ESP32_SDLOGGER_FAST_SEEK_SIDECAR_SZ))
+#else
+            , fast_seek_max_fragments(0)
+            , fast_seek_sidecar_sz(0)
+#endif
+#ifdef CONFIG_ESP32_SDLOGGER_ERASE_FREED
+            , erase_chunk_sectors(static_cast<size_t>(CONFIG_ESP32_SDLOGGER_ERASE_CHUNK_SECTORS))
+#else
+            , erase_chunk_sectors(0)
+#endif
+#ifdef CONFIG_ESP32_SDLOGGER_REPAIR_JOURNAL
+            , repair_journal(true)
+#else
+            , repair_journal(false)
+#endif
+#ifdef CONFIG_ESP32_SDLOGGER_TRACE
+            , trace_events(static_cast<size_t>(CONFIG_ESP32_SDLOGGER_TRACE_EVENTS))
+#else
+            , trace_events(0)
+#endif
             , sdmmc_host(SDSPI_HOST_DEFAULT())
         {
         }
@@ -47,6 +148,337 @@ typedef struct csd_info_t
         uint8_t read_bl_len;
 } csd_info_t;
 
+typedef enum sd_delete_status_t
+{
+    SD_DELETE_DONE,        // traversal finished, see sd_delete_stats_t for skipped entries
+    SD_DELETE_IN_PROGRESS, // time budget for this slice expired, call delete_directory_continue() again
+    SD_DELETE_ERROR        // no job could be run (not mounted, no job started, etc.)
+} sd_delete_status_t;
+
+typedef enum sd_priority_t
+{
+    SD_PRIORITY_BULK,     // batched in the write queue, drained in large batches
+    SD_PRIORITY_CRITICAL, // drained ahead of bulk data and synced immediately
+    SD_PRIORITY_MAX
+} sd_priority_t;
+
+typedef enum sd_overflow_policy_t
+{
+    SD_OVERFLOW_BLOCK,            // wait up to the file's block timeout for queue space, then drop the record; never waits
+                                  // from the io task or a durable callback, drops the record right away there
+    SD_OVERFLOW_DROP_NEWEST,      // drop the record being written
+    SD_OVERFLOW_DROP_OLDEST,      // evict the oldest queued records of the same priority
+    SD_OVERFLOW_DROP_LOW_PRIORITY // evict the oldest queued records of lower priorities, then drop the record being written
+} sd_overflow_policy_t;
+
+typedef enum sd_write_status_t
+{
+    SD_WRITE_OK,             // handed to FatFs (no io task running)
+    SD_WRITE_QUEUED,         // accepted by the write queue
+    SD_WRITE_QUEUED_EVICTED, // accepted, queued records were dropped to make room
+    SD_WRITE_DROPPED,        // dropped by the overflow policy
+    SD_WRITE_TIMEOUT,        // dropped after blocking for the full block timeout
+    SD_WRITE_SUPPRESSED,     // dropped by the file's rate limit or sampler, see set_rate_limit()
+    SD_WRITE_ERROR           // invalid arguments, file not open, card error
+} sd_write_status_t;
+
+typedef struct sd_rate_limit_t
+{
+        uint32_t bytes_per_s;  // token bucket refill rate, 0 disables the limiter
+        uint32_t burst_bytes;  // bucket size, must hold the largest record, 0 for one second of bytes_per_s
+        uint32_t sample_every; // keep 1 in N records before the limiter, 0 or 1 keeps every record
+        bool write_summary;    // write a "# suppressed ..." line once records pass the limiter again, text files only
+
+        sd_rate_limit_t()
+            : bytes_per_s(0)
+            , burst_bytes(0)
+            , sample_every(0)
+            , write_summary(false)
+        {
+        }
+} sd_rate_limit_t;
+
+typedef struct sd_file_stats_t
+{
+        uint32_t records_written;  // records handed to FatFs
+        uint64_t bytes_written;
+        uint32_t records_dropped;  // records dropped by the overflow policy, including evicted ones
+        uint64_t bytes_dropped;
+        uint32_t blocked_writes;   // writes that had to wait for queue space
+        uint32_t max_block_us;
+        size_t max_queued_bytes;   // high water mark of this file's bytes in the write queue
+        uint32_t cache_flushes;    // transfers handed to FatFs from the write cache
+        uint32_t cache_bypasses;   // writes large enough to skip the write cache
+        uint32_t reopens;          // times the file was parked and opened again, see max_virtual_files
+        uint32_t records_sampled;  // records skipped by the 1 in N sampler
+        uint32_t records_suppressed; // records over the rate limit
+        uint64_t bytes_suppressed;
+
+        sd_file_stats_t()
+            : records_written(0)
+            , bytes_written(0)
+            , records_dropped(0)
+            , bytes_dropped(0)
+            , blocked_writes(0)
+            , max_block_us(0)
+            , max_queued_bytes(0)
+            , cache_flushes(0)
+            , cache_bypasses(0)
+            , reopens(0)
+            , records_sampled(0)
+            , records_suppressed(0)
+            , bytes_suppressed(0)
+        {
+        }
+} sd_file_stats_t;
+
+typedef struct sd_queue_stats_t
+{
+        size_t capacity;
+        size_t queued_bytes;
+        size_t max_queued_bytes; // high water mark, use with sd_file_stats_t to size queue_capacity
+        uint32_t evictions;
+        uint32_t drops;
+        uint32_t budget_waits;   // writes held back to stay under bandwidth_budget_kib_s
+        uint64_t budget_wait_us;
+        uint32_t durable_waits;  // tickets waited for or given a callback, see wait_durable()
+        uint32_t durable_syncs;  // f_sync() calls made for them, waiters on the same file share one
+
+        sd_queue_stats_t()
+            : capacity(0)
+            , queued_bytes(0)
+            , max_queued_bytes(0)
+            , evictions(0)
+            , drops(0)
+            , budget_waits(0)
+            , budget_wait_us(0)
+            , durable_waits(0)
+            , durable_syncs(0)
+        {
+        }
+} sd_queue_stats_t;
+
+typedef struct sd_latency_stats_t
+{
+        uint32_t target_ms; // max time from write() until the record is synced to the card
+        uint32_t records;
+        uint32_t violations; // records that took longer than target_ms
+        uint32_t max_us;
+        uint64_t total_us;
+
+        sd_latency_stats_t()
+            : target_ms(0)
+            , records(0)
+            , violations(0)
+            , max_us(0)
+            , total_us(0)
+        {
+        }
+} sd_latency_stats_t;
+
+typedef struct sd_meta_cache_stats_t
+{
+        uint32_t sectors;     // cache capacity
+        uint32_t hits;        // FAT/directory sector reads served from RAM
+        uint32_t misses;      // FAT/directory sector reads that went to the card
+        uint32_t absorbed;    // FAT/directory sector writes held in RAM until the next sync or eviction
+        uint32_t write_backs; // dirty sectors written to the card (sync, unmount, eviction)
+        uint32_t evictions;
+
+        sd_meta_cache_stats_t()
+            : sectors(0)
+            , hits(0)
+            , misses(0)
+            , absorbed(0)
+            , write_backs(0)
+            , evictions(0)
+        {
+        }
+} sd_meta_cache_stats_t;
+
+typedef struct sd_erase_stats_t
+{
+        uint32_t ranges;          // contiguous runs of freed clusters reported by FatFs
+        uint64_t sectors_queued;
+        uint64_t sectors_erased;
+        uint64_t sectors_reused;  // queued sectors written again before their erase came up, left alone
+        uint64_t sectors_dropped; // queue full, erase failed or card removed before the erase
+        uint64_t sectors_pending;
+        uint32_t commands;        // erase commands sent to the card
+        uint32_t errors;
+        uint32_t max_command_us;  // slowest erase command
+        bool discard;             // card erases with DISCARD rather than ERASE
+
+        sd_erase_stats_t()
+            : ranges(0)
+            , sectors_queued(0)
+            , sectors_erased(0)
+            , sectors_reused(0)
+            , sectors_dropped(0)
+            , sectors_pending(0)
+            , commands(0)
+            , errors(0)
+            , max_command_us(0)
+            , discard(false)
+        {
+        }
+} sd_erase_stats_t;
+
+typedef enum sd_format_mode_t
+{
+    SD_FORMAT_DEFAULT,   // single partition laid out by f_fdisk() and f_mkfs()
+    SD_FORMAT_AU_ALIGNED // partition start, FAT and cluster heap aligned to the card's allocation unit (AU)
+} sd_format_mode_t;
+
+typedef struct sd_delete_stats_t
+{
+        uint32_t files_deleted;
+        uint32_t dirs_deleted;
+        uint32_t files_skipped; // files left in place because they are currently open
+        uint32_t errors;
+        uint32_t slices;
+        int64_t elapsed_us; // time spent inside slices, excludes time between slices
+
+        sd_delete_stats_t()
+            : files_deleted(0)
+            , dirs_deleted(0)
+            , files_skipped(0)
+            , errors(0)
+            , slices(0)
+            , elapsed_us(0)
+        {
+        }
+} sd_delete_stats_t;
+
+typedef struct sd_file_pool_stats_t
+{
+        uint32_t ready;             // pool files waiting to be taken
+        uint32_t created;
+        uint32_t adopted;           // pool files left behind by an earlier mount and reused
+        uint32_t taken;             // open_file() calls served by renaming a pool file into place
+        uint32_t empty;             // open_file() calls that found the pool empty and created the file the regular way
+        uint32_t collisions;        // target file already existed and was opened the regular way
+        uint32_t prealloc_failures; // no contiguous free space, the file was pooled without preallocation
+        uint32_t max_open_us;       // slowest open_file() served from the pool
+
+        sd_file_pool_stats_t()
+            : ready(0)
+            , created(0)
+            , adopted(0)
+            , taken(0)
+            , empty(0)
+            , collisions(0)
+            , prealloc_failures(0)
+            , max_open_us(0)
+        {
+        }
+} sd_file_pool_stats_t;
+
+typedef struct sd_trace_stats_t
+{
+        uint64_t spans;               // spans recorded since the ring was cleared
+        uint64_t overwritten;         // oldest spans lost to the ring wrapping
+        uint32_t max_f_write_us;
+        uint32_t max_f_sync_us;
+        uint32_t max_sector_write_us; // longest single sector write command, card garbage collection shows up here
+        uint32_t max_sector_read_us;
+        uint32_t max_erase_us;
+        bool enabled;
+
+        sd_trace_stats_t()
+            : spans(0)
+            , overwritten(0)
+            , max_f_write_us(0)
+            , max_f_sync_us(0)
+            , max_sector_write_us(0)
+            , max_sector_read_us(0)
+            , max_erase_us(0)
+            , enabled(false)
+        {
+        }
+} sd_trace_stats_t;
+
+typedef struct sd_emergency_stats_t
+{
+        uint32_t flushes;          // emergency_flush() calls that got hold of the card
+        uint32_t last_us;          // duration of the last flush up to its journal write
+        uint32_t max_us;           // worst case since boot, size the holdup energy from this
+        uint32_t last_files;       // files written by the last flush
+        uint64_t last_bytes;       // bytes handed to FatFs by the last flush
+        bool last_complete;        // false when the budget ran out with data still in RAM
+        uint32_t recovered_us;     // duration of the flush before the last power loss, read from the journal at mount
+        bool recovered_complete;
+        uint32_t repaired_files;   // file sizes restored from the journal at the last mount
+
+        sd_emergency_stats_t()
+            : flushes(0)
+            , last_us(0)
+            , max_us(0)
+            , last_files(0)
+            , last_bytes(0)
+            , last_complete(false)
+            , recovered_us(0)
+            , recovered_complete(false)
+            , repaired_files(0)
+        {
+        }
+} sd_emergency_stats_t;
+
+typedef struct sd_tune_result_t
+{
+        uint32_t freq_khz;    // clock requested from the SPI host
+        size_t transfer_sz;   // bytes per sdmmc_write_sectors()/sdmmc_read_sectors() call
+        uint32_t write_kib_s;
+        uint32_t read_kib_s;
+        bool stable;          // every transfer succeeded and read back what was written
+        bool selected;
+
+        sd_tune_result_t()
+            : freq_khz(0)
+            , transfer_sz(0)
+            , write_kib_s(0)
+            , read_kib_s(0)
+            , stable(false)
+            , selected(false)
+        {
+        }
+} sd_tune_result_t;
+
+typedef struct sd_profile_t
+{
+        static const constexpr size_t BLOCK_SIZES = 4;    // sequential write sizes measured
+        static const constexpr size_t STALL_BUCKETS = 10; // write latency buckets, upper bounds in SDLogger::PROFILE_STALL_MS
+
+        bool valid;
+        uint32_t serial;                          // CID serial number of the profiled card
+        uint32_t region_sz;                       // bytes of the contiguous test region, written once per block size
+        uint32_t seq_block_sz[BLOCK_SIZES];
+        uint32_t seq_write_kib_s[BLOCK_SIZES];
+        uint32_t random_writes;                   // single sector writes at random offsets in the region
+        uint32_t random_avg_us;
+        uint32_t random_p99_us;
+        uint32_t random_max_us;
+        uint32_t write_commands;                  // every write command of the profile, sequential and random
+        uint32_t stall_hist[STALL_BUCKETS];       // write commands per latency bucket
+        uint32_t max_write_us;
+
+        sd_profile_t()
+            : valid(false)
+            , serial(0)
+            , region_sz(0)
+            , seq_block_sz{0}
+            , seq_write_kib_s{0}
+            , random_writes(0)
+            , random_avg_us(0)
+            , random_p99_us(0)
+            , random_max_us(0)
+            , write_commands(0)
+            , stall_hist{0}
+            , max_write_us(0)
+        {
+        }
+} sd_profile_t;
+
 typedef struct sd_info_t
 {
         bool initialized;
@@ -56,6 +488,7 @@ typedef struct sd_info_t
         uint32_t size_mb;
         uint8_t ssr_bus_width;
         csd_info_t csd;
+        sd_profile_t profile; // filled by profile_card()
 
         sd_info_t()
             : initialized(false)
@@ -65,6 +498,7 @@ typedef struct sd_info_t
             , size_mb(0)
             , ssr_bus_width(0)
             , csd({0, 0, 0, 0})
+            , profile()
         {
         }
 } sd_info_t;
@@ -96,7 +530,43 @@ class SDLogger
                 bool create_directory_path(char* dir_path, const char* SUB_TAG);
                 bool initialized;
                 bool open;
-                FIL stream;
+                size_t write_alignment; // 0 when writes are passed to f_write() unsplit
+                sd_priority_t priority; // used by writes that do not pass a priority
+                bool overflow_policy_set; // false while the logger's configured default applies
+                sd_overflow_policy_t overflow_policy;
+                uint32_t block_timeout_ms;
+                uint32_t queued_records;
+                size_t queued_bytes;
+                sd_file_stats_t stats;
+                bool write_cache_set; // false while the logger's configured default applies
+                size_t write_cache_sz;
+                char* cache;          // DMA capable, allocated while the file is open for writing
+                size_t cache_len;
+                std::vector<DWORD> clmt; // FatFs cluster link map: size, (run length, first cluster) pairs, 0 terminated
+                DWORD clmt_clusters;     // clusters mapped by clmt
+                DWORD clmt_last;         // last mapped cluster, tail walks continue from here
+                bool clmt_active;        // false when fast seek is disabled or the file has too many fragments
+                FSIZE_t clmt_saved_sz;   // file size recorded by the last sidecar save
+                BYTE open_mode;          // FatFs mode the file was opened with, reused when the card is reinserted
+                FSIZE_t resume_offset;   // file position when the card was removed
+                bool preallocated;       // taken from a file pool with clusters reserved past the written data
+                FSIZE_t data_end;        // end of the written data of a preallocated file, the rest is cut at close
+                bool parked;             // open, but its FIL is closed to make room for another file
+                bool unsynced;           // written since the last f_sync(), the directory entry is behind the FIL
+                uint32_t last_use;       // SDLogger::file_tick of the last write, the oldest open file is parked first
+                sd_rate_limit_t rate_limit;
+                int64_t rate_tokens;     // byte microseconds, bytes_per_s of them accrue per microsecond
+                int64_t rate_refill_us;
+                uint32_t sample_count;
+                uint32_t suppressed_records; // since the last record that passed, reported by the summary line
+                uint64_t suppressed_bytes;
+                int64_t suppressed_since_us;
+                uint32_t write_seq;      // ticket of the last write accepted for the file, guarded by queue_mutex
+                uint32_t written_seq;    // ticket of the last write handed to FatFs (or the write cache)
+                uint32_t durable_seq;    // ticket of the last write synced to the card
+                std::vector<std::pair<uint32_t, uint32_t>> lost_seqs; // ticket ranges evicted or failed, durable_seq does
+                                                                      // not vouch for them, guarded by queue_mutex
+                std::unique_ptr<FIL> stream; // released while the file is parked
                 char* path;
                 char* directory_path;
                 static const constexpr char* TAG = "SDLogger::File";
@@ -104,29 +574,108 @@ class SDLogger
                 friend class SDLogger;
         };
 
+        /**
+         * Hands a shared SPI host to its users one at a time in FIFO order. SDLogger instances take the arbiter around each
+         * write of at most bus_quantum_sz bytes, other drivers on the same host (ie. a flash chip) may take it around their
+         * own transactions to get a fair share of the bus.
+         */
+        class BusArbiter
+        {
+            public:
+                static BusArbiter& get(spi_host_device_t host);
+                void acquire();
+                void release();
+                uint32_t get_handoff_count();
+
+            private:
+                static const constexpr size_t MAX_WAITERS = 8;
+                portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+                bool busy = false;
+                SemaphoreHandle_t waiters[MAX_WAITERS] = {};
+                uint8_t waiters_head = 0;
+                uint8_t waiters_count = 0;
+                uint32_t handoffs = 0;
+        };
+
         using SDFile = std::shared_ptr<File>;
+        using SDBuffer = std::shared_ptr<const char>; // immutable record queued for several files without a copy each
+        // ticket from try_write() synced (durable) or lost to a failed write, a dropped record or a closed file; called from the
+        // io task, or from the syncing caller without one, with file I/O locked: it may write but must not wait_durable()
+        using DurableCallback = void (*)(SDFile file, uint32_t ticket, bool durable, void* arg);
 
         SDLogger(sd_logger_config_t cfg = sd_logger_config_t());
         ~SDLogger();
         bool init();
         bool mount(size_t unit_size = 16 * 1024, int max_open_files = 5, const char* path = "/sdcard");
         bool unmount();
-        bool format(size_t unit_size = 16 * 1024);
+        bool format(size_t unit_size = 16 * 1024, sd_format_mode_t mode = SD_FORMAT_DEFAULT);
+        uint32_t get_allocation_unit_size();
         bool open_file(SDFile file, const char* permissions = "a+");
         bool close_file(SDFile file);
         bool close_all_files();
         bool write(SDFile file, const char* data);
+        bool write(SDFile file, const char* data, sd_priority_t priority);
         bool write_line(SDFile file, const char* line);
+        bool write_line(SDFile file, const char* line, sd_priority_t priority);
+        sd_write_status_t try_write(SDFile file, const void* data, size_t length);
+        sd_write_status_t try_write(SDFile file, const void* data, size_t length, sd_priority_t priority);
+        sd_write_status_t try_write(SDFile file, const SDBuffer& data, size_t length, sd_priority_t priority);
+        sd_write_status_t try_write(SDFile file, const void* data, size_t length, sd_priority_t priority, uint32_t& ticket);
+        bool wait_durable(SDFile file, uint32_t ticket, uint32_t timeout_ms);
+        bool on_durable(SDFile file, uint32_t ticket, DurableCallback callback, void* arg = nullptr);
+        bool is_durable(SDFile file, uint32_t ticket);
+        bool write_block(SDFile file, const void* data, size_t length);
+        static bool status_ok(sd_write_status_t status);
+        bool set_priority(SDFile file, sd_priority_t priority);
+        bool set_overflow_policy(SDFile file, sd_overflow_policy_t policy, uint32_t block_timeout_ms = 0);
+        bool set_rate_limit(SDFile file, const sd_rate_limit_t& limit);
+        bool set_bandwidth_budget(uint32_t kib_per_s);
+        bool get_file_stats(SDFile file, sd_file_stats_t& stats);
+        bool get_queue_stats(sd_queue_stats_t& stats);
+        bool seek(SDFile file, uint64_t offset);
+        bool sync(SDFile file);
+        bool sync_all();
+        bool start_io_task();
+        bool stop_io_task();
+        bool is_io_task_running();
+        bool set_latency_target(sd_priority_t priority, uint32_t target_ms);
+        bool get_latency_stats(sd_priority_t priority, sd_latency_stats_t& stats);
+        bool set_write_alignment(SDFile file, size_t alignment);
+        bool set_write_cache(SDFile file, size_t size);
         bool create_directory(const char* path, bool suppress_dir_exists_warning = false);
         bool delete_file(SDFile file);
-        bool delete_directory(const char *path);
+        bool delete_directory(const char* path);
+        bool delete_directory_begin(const char* path);
+        sd_delete_status_t delete_directory_continue(uint32_t budget_us = 5000UL);
+        bool delete_directory_cancel();
+        bool delete_directory_in_progress();
+        bool get_delete_stats(sd_delete_stats_t& stats);
+        bool add_file_pool(const char* directory, size_t count, uint32_t preallocate_sz = 0);
+        bool remove_file_pool(const char* directory);
+        bool fill_file_pools(uint32_t budget_us = 0);
+        bool get_file_pool_stats(const char* directory, sd_file_pool_stats_t& stats);
+        bool get_meta_cache_stats(sd_meta_cache_stats_t& stats);
+        bool erase_freed_sectors(uint32_t budget_us = 0);
+        bool get_erase_stats(sd_erase_stats_t& stats);
+        bool set_tracing(bool enabled);
+        bool clear_trace();
+        bool export_trace(const char* path);
+        bool get_trace_stats(sd_trace_stats_t& stats);
+        bool emergency_flush(uint32_t budget_us = 5000UL);
+        bool get_emergency_stats(sd_emergency_stats_t& stats);
         bool file_exists(SDFile file);
         bool path_exists(const char* path);
+        bool tune();
+        bool get_tune_results(std::vector<sd_tune_result_t>& results);
+        void print_tune_results();
         bool get_info(sd_info_t& sd_info);
         void print_info();
+        bool profile_card(uint32_t region_sz = 4UL * 1024UL * 1024UL);
         bool is_initialized();
         bool is_mounted();
+        bool is_card_present();
         const char* get_root_path();
+        BusArbiter& get_bus_arbiter();
 
     private:
         const std::unordered_map<const char*, uint8_t> permission_flag_map = {{"r", FA_READ}, {"r+", FA_READ | FA_WRITE},
@@ -136,7 +685,396 @@ class SDLogger
         static const constexpr size_t SD_SECTOR_SZ = 512U;
         static const constexpr size_t MAX_ROOT_PATH_SZ = 40;
         static const constexpr char* TAG = "SDLogger";
+        static const constexpr uint32_t DEFAULT_AU_SZ = 4UL * 1024UL * 1024UL; // used when the SSR reports no AU size
+        static const constexpr size_t MAX_DELETE_DEPTH = 8;     // max nested directory levels below the deleted directory
+        static const constexpr size_t DELETE_BATCH_SZ = 16;     // file names collected per directory before unlinking them
+        static const constexpr size_t MAX_DELETE_PATH_SZ = 256;
+
+        // state of an iterative delete_directory() traversal, heap allocated so deep trees never touch the task stack
+        typedef struct delete_job_t
+        {
+                FF_DIR dirs[MAX_DELETE_DEPTH];
+                size_t parent_path_len[MAX_DELETE_DEPTH]; // path length to restore when leaving a level
+                bool blocked[MAX_DELETE_DEPTH];           // level holds entries that could not be deleted
+                uint8_t depth;
+                char path[MAX_DELETE_PATH_SZ];
+                char batch[DELETE_BATCH_SZ][FF_MAX_LFN + 1];
+                bool batch_sidecar[DELETE_BATCH_SZ]; // entry may have a fast seek table in CLMT_DIR
+                uint8_t batch_count;
+                FILINFO fno;
+                sd_delete_stats_t stats;
+        } delete_job_t;
+
+        static const constexpr size_t MAX_FILE_POOLS = 4;
+        static const constexpr size_t MAX_POOL_DIR_SZ = 64;
+        static const constexpr size_t MAX_POOL_PATH_SZ = MAX_POOL_DIR_SZ + 14; // "/SDLPxxxx.TMP"
+        static const constexpr uint8_t POOL_CREATE_ATTEMPTS = 8;
+        static const constexpr uint32_t POOL_RETRY_MS = 1000; // delay before refilling again after a failed create
+
+        typedef struct pool_entry_t
+        {
+                uint16_t number; // pool files are named SDLPxxxx.TMP after it
+                bool preallocated;
+        } pool_entry_t;
+
+        // empty files created ahead of time in a directory, open_file() renames one into place instead of creating the file
+        typedef struct file_pool_t
+        {
+                char directory[MAX_POOL_DIR_SZ]; // same form as File::directory_path, "" for the root directory
+                size_t count;                    // files kept ready
+                FSIZE_t preallocate_sz;          // contiguous clusters reserved per file, 0 for empty files
+                std::deque<pool_entry_t> ready;
+                uint16_t next_number;
+                bool scanned; // files left by an earlier mount were adopted
+                sd_file_pool_stats_t stats;
+        } file_pool_t;
+
+        // holds a recursive mutex for the lifetime of the scope
+        class ScopedLock
+        {
+            public:
+                ScopedLock(SemaphoreHandle_t mutex)
+                    : mutex(mutex)
+                {
+                    xSemaphoreTakeRecursive(mutex, portMAX_DELAY);
+                }
+
+                ~ScopedLock()
+                {
+                    xSemaphoreGiveRecursive(mutex);
+                }
+
+            private:
+                SemaphoreHandle_t mutex;
+        };
+
+        // path with this logger's "<pdrv>:" prefix, built on the stack as FatFs picks the volume from the prefix
+        class DrivePath
+        {
+            public:
+                DrivePath(const char* drv, const char* path)
+                {
+                    const size_t drv_len = strlen(drv);
+                    const size_t path_len = strlen(path);
+
+                    memcpy(full, drv, drv_len);
+
+                    // '?' is never valid in a FatFs name, an overlong path fails with FR_INVALID_NAME rather than being cut short
+                    if (path_len > FF_MAX_LFN)
+                        strcpy(full + drv_len, "?");
+                    else
+                        memcpy(full + drv_len, path, path_len + 1);
+                }
+
+                const char* get() const
+                {
+                    return full;
+                }
+
+            private:
+                char full[2 + FF_MAX_LFN + 1]; // "<pdrv>:", the path and its terminator
+        };
+
+        // a write accepted by the io task but not yet handed to FatFs
+        typedef struct queued_write_t
+        {
+                SDFile file;
+                SDBuffer data; // shared by every file a fan out write went to, freed after the last one wrote and synced it
+                size_t length;
+                uint64_t seq; // logger wide submission order, keeps per file ordering across lanes
+                uint32_t ticket; // the file's write sequence number, see try_write()
+                int64_t enqueue_us;
+                sd_priority_t priority;
+        } queued_write_t;
+
+        using WriteBatch = std::vector<queued_write_t>;
+
+        // a ticket someone waits for, resolved once its file is synced past it or can no longer get there
+        typedef struct durable_waiter_t
+        {
+                SDFile file;
+                uint32_t ticket;
+                DurableCallback callback; // nullptr for a task blocked in wait_durable()
+                void* arg;
+                SemaphoreHandle_t done;   // wait_durable()'s, given once resolved
+                bool* durable;            // wait_durable()'s result
+        } durable_waiter_t;
+
+        static const constexpr size_t LOST_RANGES_MAX = 8; // per file, the two oldest merge beyond it and vouch for less
+
+        static const constexpr uint32_t CARD_RETRY_MS = 1000; // delay between attempts to bring up a reinserted card
+        static const constexpr uint32_t BUDGET_BURST_MS = 100; // bandwidth budget a quiet logger may save up and spend at once
+
+        static void card_detect_isr(void* arg);
+        bool card_detect_start(const char* SUB_TAG);
+        void card_detect_stop();
+        void card_detect_check();
+        void card_detach();
+        bool card_attach();
+        static void io_task_trampoline(void* arg);
+        void io_task();
+        TickType_t io_task_wait_ticks();
+        sd_write_status_t submit(SDFile file, const char* data, size_t length, bool append_newline, sd_priority_t priority,
+                const char* SUB_TAG, const SDBuffer* shared = nullptr, uint32_t* ticket = nullptr);
+        sd_write_status_t submit_admitted(SDFile file, const char* data, size_t length, bool append_newline,
+                sd_priority_t priority, const char* SUB_TAG, const SDBuffer* shared = nullptr, uint32_t* ticket = nullptr);
+        bool rate_limit_admit(SDFile file, size_t length);
+        void rate_limit_summary(SDFile file, sd_priority_t priority, const char* SUB_TAG);
+        void budget_charge(size_t length);
+        int64_t budget_deficit_us();
+        void budget_pace(sd_priority_t priority);
+        sd_write_status_t enqueue(SDFile file, const char* data, size_t length, bool append_newline, sd_priority_t priority,
+                const char* SUB_TAG, const SDBuffer* shared = nullptr, uint32_t* ticket = nullptr);
+        bool make_room(size_t length, sd_overflow_policy_t policy, sd_priority_t priority, bool& evicted);
+        void evict_oldest(sd_priority_t lane);
+        void notify_space_waiters();
+        void drain_critical(WriteBatch* in_flight = nullptr, size_t in_flight_idx = 0);
+        void drain_bulk();
+        bool critical_pending();
+        void extract_file_records(SDFile file, WriteBatch& batch);
+        bool drain_file(SDFile file, const char* SUB_TAG);
+        bool write_batch(WriteBatch& batch, std::vector<SDFile>& touched, const char* SUB_TAG);
+        bool write_record(queued_write_t& record, std::vector<SDFile>& touched, const char* SUB_TAG);
+        bool sync_files(std::vector<SDFile>& touched, const char* SUB_TAG);
+        void record_latency(const WriteBatch& batch, int64_t durable_us);
+        uint32_t ticket_next(SDFile file);
+        static bool ticket_reached(uint32_t seq, uint32_t ticket);
+        void drain_durable();
+        void durable_resolve(SDFile file, bool synced, bool closing = false);
+        void ticket_lost(SDFile file, uint32_t first, uint32_t last);
+        bool ticket_was_lost(SDFile file, uint32_t ticket);
+        bool ticket_durable(SDFile file, uint32_t ticket);
+
+        // FatFs disk driver exposing a single partition of a card as a whole drive, used to build a volume inside a partition
+        typedef struct partition_view_t
+        {
+                sdmmc_card_t* card;
+                LBA_t offset;
+                LBA_t sector_count;
+                uint32_t block_size;
+        } partition_view_t;
+
+        static partition_view_t partition_views[FF_VOLUMES];
+        static DSTATUS partition_view_init(BYTE pdrv);
+        static DSTATUS partition_view_status(BYTE pdrv);
+        static DRESULT partition_view_read(BYTE pdrv, BYTE* buff, uint32_t sector, UINT count);
+        static DRESULT partition_view_write(BYTE pdrv, const BYTE* buff, uint32_t sector, UINT count);
+        static DRESULT partition_view_ioctl(BYTE pdrv, BYTE cmd, void* buff);
 
+        // FatFs disk driver for a mounted card, keeps the sectors FatFs loads into its window (FAT, directory, FSInfo) in
+        // an LRU so files growing in turn stop re-reading and re-writing the same FAT sector
+        typedef struct meta_cache_slot_t
+        {
+                LBA_t sector;
+                uint32_t last_use;
+                bool valid;
+                bool dirty;
+        } meta_cache_slot_t;
+
+        typedef enum trace_span_t
+        {
+            TRACE_F_WRITE,
+            TRACE_F_SYNC,
+            TRACE_SECTOR_WRITE,
+            TRACE_SECTOR_READ,
+            TRACE_ERASE,
+            TRACE_SPAN_MAX
+        } trace_span_t;
+
+        static const constexpr size_t MAX_TRACE_TASKS = 8; // tasks past this share the "other" track
+        static const constexpr size_t TRACE_EXPORT_BUF_SZ = 2048;
+        static const constexpr size_t TRACE_EVENT_JSON_MAX = 256; // longest event line written by export_trace()
+
+        typedef struct trace_event_t
+        {
+                int64_t start_us;
+                uint32_t dur_us;
+                uint8_t span;   // trace_span_t
+                uint8_t task;   // index into trace_ring_t::tasks, MAX_TRACE_TASKS for other tasks
+                bool failed;
+                uint64_t offset;  // file position before the call, first sector for card spans
+                uint32_t length;  // bytes for f_write(), sectors for card spans
+                uint32_t cluster; // current cluster of the file after the call
+        } trace_event_t;
+
+        // fixed ring of the latest spans around FatFs and card calls, guarded by io_mutex like the calls it records
+        typedef struct trace_ring_t
+        {
+                trace_event_t* events;
+                size_t capacity;
+                uint64_t recorded; // spans ever recorded, the ring holds the last capacity of them
+                bool enabled;
+                uint32_t max_us[TRACE_SPAN_MAX];
+                TaskHandle_t tasks[MAX_TRACE_TASKS];
+                char task_names[MAX_TRACE_TASKS][configMAX_TASK_NAME_LEN];
+                uint8_t task_count;
+        } trace_ring_t;
+
+        static void trace_record(trace_ring_t* ring, trace_span_t span, int64_t start_us, uint64_t offset, uint32_t length, uint32_t cluster,
+                bool failed);
+        FRESULT trace_f_write(FIL* fp, const void* buff, UINT btw, UINT* bw);
+        FRESULT trace_f_sync(FIL* fp);
+        bool trace_alloc(const char* SUB_TAG);
+        bool trace_flush(FIL* out, char* buffer, size_t& length, const char* SUB_TAG);
+
+        static const constexpr size_t MAX_ERASE_RANGES = 32;
+
+        // sectors of clusters FatFs freed (CTRL_TRIM), erased later by the io task
+        typedef struct erase_range_t
+        {
+                LBA_t start;
+                LBA_t count;
+        } erase_range_t;
+
+        typedef struct meta_cache_t
+        {
+                sdmmc_card_t* card;
+                const FATFS* fs;
+                const BYTE* win; // FATFS window of the volume, the only buffer FatFs moves metadata through
+                meta_cache_slot_t* slots;
+                BYTE* sectors;   // DMA capable, SD_SECTOR_SZ per slot
+                size_t slot_count; // 0 when the driver is only installed to queue freed clusters
+                uint32_t tick;
+                sd_meta_cache_stats_t stats;
+                erase_range_t erase_ranges[MAX_ERASE_RANGES]; // oldest first
+                size_t erase_count;
+                bool erase_enabled;
+                sdmmc_erase_arg_t erase_arg;
+                sd_erase_stats_t erase_stats;
+                trace_ring_t* trace; // card commands are recorded here when tracing is enabled
+                DWORD block_size;    // erase block (AU) in sectors, answered to GET_BLOCK_SIZE
+        } meta_cache_t;
+
+        static meta_cache_t meta_caches[FF_VOLUMES];
+        static DSTATUS meta_cache_init(BYTE pdrv);
+        static DSTATUS meta_cache_status(BYTE pdrv);
+        static DRESULT meta_cache_read(BYTE pdrv, BYTE* buff, uint32_t sector, UINT count);
+        static DRESULT meta_cache_write(BYTE pdrv, const BYTE* buff, uint32_t sector, UINT count);
+        static DRESULT meta_cache_ioctl(BYTE pdrv, BYTE cmd, void* buff);
+        static bool meta_cache_holds(const meta_cache_t& cache, const BYTE* buff, LBA_t sector, UINT count);
+        static meta_cache_slot_t* meta_cache_find(meta_cache_t& cache, LBA_t sector);
+        static meta_cache_slot_t* meta_cache_claim(meta_cache_t& cache, LBA_t sector, DRESULT& res);
+        static DRESULT meta_cache_write_back(meta_cache_t& cache, const FATFS* essential_only = nullptr);
+        static esp_err_t meta_cache_read_sectors(meta_cache_t& cache, void* buff, LBA_t sector, size_t count);
+        static esp_err_t meta_cache_write_sectors(meta_cache_t& cache, const void* buff, LBA_t sector, size_t count);
+        static void erase_queue_add(meta_cache_t& cache, LBA_t first, LBA_t last);
+        static void erase_queue_cut(meta_cache_t& cache, LBA_t sector, LBA_t count);
+        static void erase_queue_remove(meta_cache_t& cache, size_t idx);
+        static void erase_queue_drop(meta_cache_t& cache);
+        bool erase_pending();
+
+        bool meta_cache_attach(const char* SUB_TAG);
+        void meta_cache_detach(const char* SUB_TAG);
+        void meta_cache_discard();
+        void register_volume_driver();
+
+        bool format_au_aligned(size_t unit_size, void* work_buff, size_t work_buff_sz, const char* SUB_TAG);
+        // on disk layout of a fast seek table saved to CLMT_DIR, named after the file's first cluster
+        typedef struct clmt_sidecar_t
+        {
+                uint32_t magic;
+                uint32_t sclust;
+                uint64_t size; // file size covered by the table
+                uint16_t fdate;
+                uint16_t ftime;
+                uint32_t csize;
+                uint32_t fragments;
+        } clmt_sidecar_t;
+
+        // profile_card() writes test data into a contiguous file reserved for the run, deleted afterwards
+        static const constexpr char* PROFILE_PATH = "/SDLPROF.BIN";
+        static const constexpr uint32_t PROFILE_BLOCK_SZ[sd_profile_t::BLOCK_SIZES] = {512, 4096, 16384, 32768};
+        static const constexpr uint32_t PROFILE_STALL_MS[sd_profile_t::STALL_BUCKETS - 1] = {1, 2, 5, 10, 20, 50, 100, 200, 500};
+        static const constexpr uint32_t PROFILE_RANDOM_WRITES = 256;
+
+        // auto tuning rewrites the last TUNE_REGION_SECTORS of the card with their own contents
+        static const constexpr uint32_t TUNE_FREQS_KHZ[] = {10000, 16000, 20000, 26000, 32000, 40000};
+        static const constexpr size_t TUNE_SECTORS[] = {1, 4, 8, 16, 32}; // transfer sizes tried, multiples of 512 bytes
+        static const constexpr size_t TUNE_REGION_SECTORS = 32;
+        static const constexpr uint8_t TUNE_PASSES = 2;       // region writes and reads per setting
+        static const constexpr uint8_t TUNE_SIZE_MARGIN = 90; // smallest transfer within this % of the best write speed wins
+        static const constexpr uint32_t TUNE_MAGIC = 0x4E555453UL; // "STUN"
+        static const constexpr char* TUNE_NVS_NAMESPACE = "sdlogger";
+
+        // tuning result kept in NVS, reused while the same card is inserted
+        typedef struct tune_record_t
+        {
+                uint32_t magic;
+                uint32_t serial; // CID serial number of the measured card
+                uint32_t freq_khz;
+                uint32_t transfer_sz;
+        } tune_record_t;
+
+        // emergency_flush() skips the directory entry updates of f_sync() and records each file's size and first cluster
+        // here instead, the next mount extends the files to those sizes. One cluster, so its sectors are contiguous.
+        static const constexpr char* REPAIR_PATH = "/SDLREPR.BIN";
+        static const constexpr uint32_t REPAIR_MAGIC = 0x32504552UL; // "REP2"
+        static const constexpr size_t REPAIR_MAX_ENTRIES = 32;
+        static const constexpr size_t REPAIR_PATH_SZ = 244;
+        static const constexpr size_t REPAIR_MAX_FAT_SECTORS = 96;
+        static const constexpr uint32_t REPAIR_FAT_ALL = 0xFFFFFFFFUL;
+
+        // first sector of the journal, zeroed while the volume needs no repair
+        typedef struct repair_header_t
+        {
+                uint32_t magic;
+                uint32_t entries;     // repair_entry_t from the second sector on
+                uint32_t duration_us; // emergency_flush() up to the journal write
+                uint32_t complete;
+                uint64_t bytes;
+                uint32_t fat_sectors; // first FAT sectors written without their copies, REPAIR_FAT_ALL if they did not fit
+                uint32_t fat_offsets[REPAIR_MAX_FAT_SECTORS]; // from fatbase
+        } repair_header_t;
+
+        typedef struct repair_entry_t
+        {
+                uint64_t size;
+                uint32_t sclust; // a file whose directory entry names another one was replaced, it is not repaired
+                char path[REPAIR_PATH_SZ];
+        } repair_entry_t;
+
+        static const constexpr size_t REPAIR_ENTRIES_PER_SECTOR = SD_SECTOR_SZ / sizeof(repair_entry_t);
+
+        bool repair_journal_open(const char* SUB_TAG);
+        void repair_journal_close();
+        uint32_t repair_files(const BYTE* journal, size_t journal_sz, const char* SUB_TAG);
+        void repair_log_fat(repair_header_t* header, LBA_t sector);
+        bool repair_fat_mirror(const repair_header_t* header, const char* SUB_TAG);
+
+        static const constexpr uint32_t CLMT_MAGIC = 0x544D4C43UL; // "CLMT"
+        static const constexpr char* CLMT_DIR = "/SDLCLMT";
+
+        bool clmt_open(SDFile file, bool seek_end, const char* SUB_TAG);
+        bool clmt_load(SDFile file, const char* SUB_TAG);
+        bool clmt_save(SDFile file, const char* SUB_TAG);
+        void clmt_delete(DWORD sclust);
+        DWORD file_start_cluster(const char* path);
+        bool clmt_extend(SDFile file, const char* SUB_TAG);
+        bool clmt_append(SDFile file, DWORD cluster);
+        void clmt_reset(SDFile file, bool release = false);
+        bool clmt_seek(SDFile file, FSIZE_t offset, const char* SUB_TAG);
+        static void clmt_sidecar_path(DWORD sclust, char* path);
+        static bool fat_next_cluster(FATFS* fs, DWORD cluster, DWORD& next, BYTE* buff, LBA_t& buff_sect);
+        static bool fat_lock(FATFS* fs);
+        static void fat_unlock(FATFS* fs);
+
+        bool write_bytes(SDFile file, const char* data, size_t length, const char* SUB_TAG);
+        FSIZE_t file_tell(SDFile file);
+        DrivePath drive_path(const char* path);
+        FRESULT bus_f_open(FIL* fp, const char* path, BYTE mode);
+        FRESULT bus_f_close(FIL* fp);
+        bool write_through(SDFile file, const char* data, size_t length, const char* SUB_TAG);
+        bool alloc_cache(SDFile file, const char* SUB_TAG);
+        void free_cache(SDFile file);
+        bool flush_cache(SDFile file, const char* SUB_TAG);
+        bool profile_write(LBA_t sector, UINT count, const uint8_t* buffer, sd_profile_t& profile, uint32_t& latency_us);
+        bool tune_card(bool force, const char* SUB_TAG);
+        bool tune_measure(uint32_t freq_khz, size_t sectors, size_t start, const uint8_t* saved, uint8_t* scratch, sd_tune_result_t& result,
+                const char* SUB_TAG);
+        bool tune_set_clock(uint32_t freq_khz, const char* SUB_TAG);
+        bool tune_recover(uint32_t base_khz, const char* SUB_TAG);
+        bool tune_load(tune_record_t& record);
+        bool tune_save(const tune_record_t& record, const char* SUB_TAG);
         bool load_info();
         bool parse_info(const char* info_buffer);
         bool parse_info_field(const char* info_buffer, const char* key, char* output, size_t output_sz);
@@ -147,9 +1085,31 @@ class SDLogger
         bool posix_perms_2_fatfs_perms(const char* posix_perms, uint8_t& fatfs_perms);
         bool path_exists(const char* path, const char* SUB_TAG, bool suppress_no_dir_warning = false);
         bool get_and_register_free_drive(const char *SUB_TAG); 
+        bool is_path_open(const char* path);
+        bool file_resident(SDFile file, const char* SUB_TAG);
+        bool file_park(SDFile file, const char* SUB_TAG);
+        bool file_park_oldest(SDFile keep, const char* SUB_TAG);
+        void file_discard(SDFile file, const char* SUB_TAG);
+        bool delete_job_push(const char* name, const char* SUB_TAG);
+        void delete_job_pop(const char* SUB_TAG);
+        void delete_job_flush_batch(const char* SUB_TAG);
+        file_pool_t* file_pool_find(const char* directory);
+        file_pool_t* file_pool_take(SDFile file, pool_entry_t& entry, const char* SUB_TAG);
+        void file_pool_give_back(file_pool_t& pool, const pool_entry_t& entry, SDFile file, const char* SUB_TAG);
+        bool file_pool_scan(file_pool_t& pool, const char* SUB_TAG);
+        bool file_pool_create(file_pool_t& pool, const char* SUB_TAG);
+        bool file_pool_trim(SDFile file, const char* SUB_TAG);
+        void file_pool_forget(const char* path = nullptr);
+        static bool file_pool_normalize(const char* directory, char* normalized);
+        static void file_pool_path(const file_pool_t& pool, uint16_t number, char* path);
+        static uint8_t bus_users[SPI_HOST_MAX]; // SDLogger instances attached to each SPI host
+        static bool bus_owned[SPI_HOST_MAX];    // SPI host was initialized by an SDLogger instance
+
         bool initialized;
         bool mounted;
         sd_logger_config_t cfg;
+        spi_host_device_t spi_host;
+        sdspi_dev_handle_t card_handle;
         sdspi_device_config_t slot_cfg;
 
         // unpacked vfs_fat_sd_ctx_t into class
@@ -160,9 +1120,49 @@ class SDLogger
         BYTE pdrv;
         char drv[3] = {0, ':', 0};
         uint16_t max_open_files;
-        std::vector<SDFile> open_files;
+        std::vector<SDFile> open_files;   // files holding a FIL
+        std::vector<SDFile> parked_files; // open files whose FIL was closed, reopened at their position on the next write
+        uint32_t file_tick;
+        std::unique_ptr<delete_job_t> delete_job;
+        sd_delete_stats_t last_delete_stats;
+        std::vector<file_pool_t> file_pools;
+        volatile bool pool_refill_due; // a pool is below its count, read by the io task without io_mutex
+        int64_t pool_retry_us;         // no refill before this time after a failed create
+
+        SemaphoreHandle_t io_mutex;    // serializes FatFs calls and file state, held by the io task while draining
+        SemaphoreHandle_t queue_mutex; // protects the write queue, never held across card I/O
+        SemaphoreHandle_t io_task_done;
+        TaskHandle_t io_task_hdl;
+        volatile bool io_task_stop;
+        std::deque<queued_write_t> lanes[SD_PRIORITY_MAX];
+        size_t queued_bytes[SD_PRIORITY_MAX];
+        SemaphoreHandle_t queue_space;     // given by the io task to wake producers blocked on a full queue
+        uint8_t queue_space_waiters;       // blocked producers not yet given a token, cleared as they are given
+        bool force_drain;                  // drain bulk now regardless of batch size, set by blocked producers
+        sd_queue_stats_t queue_stats;
+        uint64_t next_seq;
+        int64_t budget_tokens;             // byte microseconds, see File::rate_tokens, guarded by queue_mutex
+        int64_t budget_refill_us;
+        int64_t budget_wait_since_us;      // start of the current wait for the budget, 0 while it is not overdrawn
+        volatile bool emergency;           // set by emergency_flush(), new records are refused until the next mount
+        sd_emergency_stats_t emergency_stats;
+        BYTE* repair_buf;                  // DMA capable, the whole journal, allocated at mount
+        LBA_t repair_lba;
+        size_t repair_sectors;             // 0 while no journal is reserved
+        sd_latency_stats_t latency_stats[SD_PRIORITY_MAX];
+        int64_t last_violation_log_us;
+        std::vector<durable_waiter_t> durable_waiters; // guarded by queue_mutex, the io task syncs their files
+
+        volatile bool card_present;         // false between a debounced removal and a successful remount
+        volatile bool card_detect_pending;  // io_cd changed level, set from the ISR
+        bool card_detect_installed;
+        bool card_retry;                    // reinserted card failed to come up, retried every CARD_RETRY_MS
+
+        std::vector<sd_tune_result_t> tune_results;
+        trace_ring_t trace;
 
         sd_info_t info;
 };
 
-typedef std::shared_ptr<SDLogger::File> SDFile;
\ No newline at end of file
+typedef std::shared_ptr<SDLogger::File> SDFile;
+typedef SDLogger::SDBuffer SDBuffer;
\ No newline at end of file
@@ -0,0 +1,402 @@
+#include "SDLoggerBenchmark.hpp"
+#include "SDRowWriter.hpp"
+
+bool SDLoggerBenchmark::aggregate_throughput(
+        SDLogger* const* loggers, size_t logger_count, size_t bytes_per_logger, size_t write_sz, sd_bench_result_t& result)
+{
+    const constexpr char* SUB_TAG = "SDBench->aggregate_throughput()";
+    writer_ctx_t ctx[MAX_LOGGERS];
+    SemaphoreHandle_t done = nullptr;
+    int64_t start_us = 0;
+    bool success = true;
+
+    if (logger_count == 0 || logger_count > MAX_LOGGERS || write_sz < 2)
+    {
+        ESP_LOGE(TAG, "%s: Invalid benchmark parameters.", SUB_TAG);
+        return false;
+    }
+
+    done = xSemaphoreCreateCounting(logger_count, 0);
+    if (done == nullptr)
+    {
+        ESP_LOGE(TAG, "%s: Could not create completion semaphore.", SUB_TAG);
+        return false;
+    }
+
+    start_us = esp_timer_get_time();
+
+    // one writer task per card so every card is kept busy at the same time
+    for (size_t i = 0; i < logger_count; i++)
+    {
+        ctx[i] = {loggers[i], static_cast<uint8_t>(i), bytes_per_logger, write_sz, done, false};
+
+        if (xTaskCreate(&writer_task, "sd_bench", WRITER_STACK_SZ, &ctx[i], 5, nullptr) != pdPASS)
+        {
+            ESP_LOGE(TAG, "%s: Could not create writer task %u.", SUB_TAG, static_cast<unsigned>(i));
+            xSemaphoreGive(done);
+        }
+    }
+
+    for (size_t i = 0; i < logger_count; i++)
+        xSemaphoreTake(done, portMAX_DELAY);
+
+    result.elapsed_us = esp_timer_get_time() - start_us;
+    result.logger_count = logger_count;
+    result.bytes = 0;
+
+    for (size_t i = 0; i < logger_count; i++)
+    {
+        success &= ctx[i].success;
+        if (ctx[i].success)
+            result.bytes += bytes_per_logger;
+    }
+
+    result.kib_per_s = (result.elapsed_us > 0) ? (result.bytes / 1024.0f) / (result.elapsed_us / 1000000.0f) : 0;
+
+    vSemaphoreDelete(done);
+
+    return success;
+}
+
+bool SDLoggerBenchmark::compare_card_count(SDLogger& first, SDLogger& second, size_t bytes_per_logger, size_t write_sz)
+{
+    const constexpr char* SUB_TAG = "SDBench->compare_card_count()";
+    SDLogger* const loggers[] = {&first, &second};
+    sd_bench_result_t single;
+    sd_bench_result_t dual;
+
+    if (!aggregate_throughput(loggers, 1, bytes_per_logger, write_sz, single))
+    {
+        ESP_LOGE(TAG, "%s: Single card run failed.", SUB_TAG);
+        return false;
+    }
+
+    if (!aggregate_throughput(loggers, 2, bytes_per_logger, write_sz, dual))
+    {
+        ESP_LOGE(TAG, "%s: Dual card run failed.", SUB_TAG);
+        return false;
+    }
+
+    ESP_LOGI(TAG,
+            "\n ------ SD Bus Benchmark ------ \n"
+            "Write size (bytes): %u \n"
+            "Bytes per card: %u \n"
+            "1 card (KiB/s): %.1f \n"
+            "2 cards (KiB/s): %.1f \n"
+            "Scaling: %.2fx \n"
+            "Bus handoffs: %lu \n"
+            "------------------------------ \n",
+            static_cast<unsigned>(write_sz), static_cast<unsigned>(bytes_per_logger), single.kib_per_s, dual.kib_per_s,
+            (single.kib_per_s > 0) ? dual.kib_per_s / single.kib_per_s : 0.0f,
+            static_cast<unsigned long>(first.get_bus_arbiter().get_handoff_count()));
+
+    return true;
+}
+
+bool SDLoggerBenchmark::channel_throughput(
+        SDLogger& logger, size_t channel_count, size_t bytes_per_channel, size_t write_sz, sd_channel_bench_result_t& result)
+{
+    const constexpr char* SUB_TAG = "SDBench->channel_throughput()";
+    std::vector<SDFile> files;
+    int64_t start_us = 0;
+    bool success = true;
+
+    if (channel_count == 0 || channel_count > MAX_CHANNELS || write_sz < 2)
+    {
+        ESP_LOGE(TAG, "%s: Invalid benchmark parameters.", SUB_TAG);
+        return false;
+    }
+
+    start_us = esp_timer_get_time();
+
+    success = write_files(logger, "bench/ch%03u.txt", 0, channel_count, bytes_per_channel, write_sz, files, result.bytes,
+            result.reopens);
+    if (!success)
+        ESP_LOGE(TAG, "%s: Run failed, channels beyond max_open_files need max_virtual_files.", SUB_TAG);
+
+    result.elapsed_us = esp_timer_get_time() - start_us;
+    result.channel_count = channel_count;
+    result.kib_per_s = (result.elapsed_us > 0) ? (result.bytes / 1024.0f) / (result.elapsed_us / 1000000.0f) : 0;
+
+    for (SDFile& f : files)
+        if (f)
+            logger.delete_file(f);
+
+    return success;
+}
+
+bool SDLoggerBenchmark::compare_channel_count(
+        SDLogger& logger, const size_t* channel_counts, size_t count, size_t bytes_per_channel, size_t write_sz)
+{
+    const constexpr char* SUB_TAG = "SDBench->compare_channel_count()";
+    sd_channel_bench_result_t result;
+
+    ESP_LOGI(TAG,
+            "\n ---- SD Channel Benchmark ---- \n"
+            "Write size (bytes): %u \n"
+            "Bytes per channel: %u \n"
+            "Channels | KiB/s | Reopens",
+            static_cast<unsigned>(write_sz), static_cast<unsigned>(bytes_per_channel));
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!channel_throughput(logger, channel_counts[i], bytes_per_channel, write_sz, result))
+        {
+            ESP_LOGE(TAG, "%s: Run with %u channels failed.", SUB_TAG, static_cast<unsigned>(channel_counts[i]));
+            return false;
+        }
+
+        ESP_LOGI(TAG, "%8u | %5.1f | %lu", static_cast<unsigned>(result.channel_count), result.kib_per_s,
+                static_cast<unsigned long>(result.reopens));
+    }
+
+    return true;
+}
+
+bool SDLoggerBenchmark::row_format(SDLogger& logger, size_t rows, sd_row_bench_result_t& result)
+{
+    const constexpr char* SUB_TAG = "SDBench->row_format()";
+    SDFile printf_file = SDLogger::File::create("bench/rows_printf.csv");
+    SDFile writer_file = SDLogger::File::create("bench/rows_writer.csv");
+    char line[ROW_SZ];
+    char writer_line[ROW_SZ];
+    size_t length = 0;
+    int64_t start_us = 0;
+    int64_t time_us = 0;
+    float value = 0;
+    bool success = true;
+
+    if (rows == 0 || !printf_file || !writer_file)
+    {
+        ESP_LOGE(TAG, "%s: Invalid benchmark parameters.", SUB_TAG);
+        return false;
+    }
+
+    // a typical sample row: timestamp, channel and three readings. Every row is formatted both ways and compared before
+    // anything is timed, a faster SDRowWriter is worth nothing if it writes other text.
+    start_us = esp_timer_get_time();
+
+    for (size_t i = 0; i < rows; i++)
+    {
+        time_us = start_us + i * 1000;
+        value = i * 0.125f - 512.0f;
+        length = printf_row(line, time_us, i, value);
+
+        if (writer_row(writer_line, time_us, i, value) != length || memcmp(line, writer_line, length) != 0)
+        {
+            ESP_LOGE(TAG, "%s: Row %u differs, printf \"%.*s\", SDRowWriter \"%.*s\".", SUB_TAG, static_cast<unsigned>(i),
+                    static_cast<int>(length - 1), line, static_cast<int>(strcspn(writer_line, "\n")), writer_line);
+            return false;
+        }
+    }
+
+    start_us = esp_timer_get_time();
+
+    for (size_t i = 0; i < rows; i++)
+    {
+        time_us = start_us + i * 1000;
+        value = i * 0.125f - 512.0f;
+        printf_row(line, time_us, i, value);
+    }
+
+    result.printf_format_us = esp_timer_get_time() - start_us;
+    start_us = esp_timer_get_time();
+
+    for (size_t i = 0; i < rows; i++)
+    {
+        time_us = start_us + i * 1000;
+        value = i * 0.125f - 512.0f;
+        writer_row(line, time_us, i, value);
+    }
+
+    result.writer_format_us = esp_timer_get_time() - start_us;
+
+    success = logger.open_file(printf_file, "w");
+    start_us = esp_timer_get_time();
+
+    for (size_t i = 0; i < rows && success; i++)
+    {
+        time_us = start_us + i * 1000;
+        value = i * 0.125f - 512.0f;
+        snprintf(line, sizeof(line), "%lld,%ld,%.3f,%.3f,%.3f", static_cast<long long>(time_us), static_cast<long>(i % 16),
+                value, value * 2.5f, value / 3.0f);
+        success = logger.write_line(printf_file, line);
+    }
+
+    success = logger.close_file(printf_file) && success;
+    result.printf_total_us = esp_timer_get_time() - start_us;
+
+    if (success)
+        success = logger.open_file(writer_file, "w");
+
+    // scoped, the writer's last block is written before the file is closed
+    if (success)
+    {
+        SDRowWriter writer(logger, writer_file);
+
+        success = writer.begin();
+        start_us = esp_timer_get_time();
+
+        for (size_t i = 0; i < rows && success; i++)
+        {
+            time_us = start_us + i * 1000;
+            value = i * 0.125f - 512.0f;
+            success = writer.add_int(time_us).add_int(i % 16).add_float(value, 3).add_float(value * 2.5f, 3)
+                              .add_float(value / 3.0f, 3)
+                              .end_row();
+        }
+
+        success = writer.flush() && success;
+    }
+
+    success = logger.close_file(writer_file) && success;
+    result.writer_total_us = esp_timer_get_time() - start_us;
+    result.rows = rows;
+
+    if (!success)
+        ESP_LOGE(TAG, "%s: Writing rows failed.", SUB_TAG);
+
+    logger.delete_file(printf_file);
+    logger.delete_file(writer_file);
+
+    return success;
+}
+
+size_t SDLoggerBenchmark::printf_row(char* line, int64_t time_us, size_t i, float value)
+{
+    return snprintf(line, ROW_SZ, "%lld,%ld,%.3f,%.3f,%.3f\n", static_cast<long long>(time_us), static_cast<long>(i % 16), value,
+            value * 2.5f, value / 3.0f);
+}
+
+size_t SDLoggerBenchmark::writer_row(char* line, int64_t time_us, size_t i, float value)
+{
+    char* p = line;
+
+    p += SDRowWriter::format_int(p, time_us);
+    *p++ = ',';
+    p += SDRowWriter::format_int(p, i % 16);
+    *p++ = ',';
+    p += SDRowWriter::format_float(p, value, 3);
+    *p++ = ',';
+    p += SDRowWriter::format_float(p, value * 2.5f, 3);
+    *p++ = ',';
+    p += SDRowWriter::format_float(p, value / 3.0f, 3);
+    *p++ = '\n';
+    *p = '\0';
+
+    return p - line;
+}
+
+bool SDLoggerBenchmark::compare_row_format(SDLogger& logger, size_t rows)
+{
+    const constexpr char* SUB_TAG = "SDBench->compare_row_format()";
+    sd_row_bench_result_t result;
+
+    if (!row_format(logger, rows, result))
+    {
+        ESP_LOGE(TAG, "%s: Run failed.", SUB_TAG);
+        return false;
+    }
+
+    ESP_LOGI(TAG,
+            "\n ---- SD Row Format Benchmark ---- \n"
+            "Rows: %u \n"
+            "Path      | Format rows/s | Total rows/s \n"
+            "snprintf  | %13.0f | %12.0f \n"
+            "RowWriter | %13.0f | %12.0f \n"
+            "Speedup (format / total): %.2fx / %.2fx",
+            static_cast<unsigned>(result.rows), rows_per_s(result.rows, result.printf_format_us),
+            rows_per_s(result.rows, result.printf_total_us), rows_per_s(result.rows, result.writer_format_us),
+            rows_per_s(result.rows, result.writer_total_us),
+            (result.writer_format_us > 0) ? static_cast<float>(result.printf_format_us) / result.writer_format_us : 0,
+            (result.writer_total_us > 0) ? static_cast<float>(result.printf_total_us) / result.writer_total_us : 0);
+
+    return true;
+}
+
+void SDLoggerBenchmark::writer_task(void* arg)
+{
+    writer_ctx_t* ctx = static_cast<writer_ctx_t*>(arg);
+    std::vector<SDFile> files;
+    uint64_t bytes = 0;
+    uint32_t reopens = 0;
+
+    ctx->success =
+            write_files(*ctx->logger, "bench/tput%u.txt", ctx->index, 1, ctx->bytes, ctx->write_sz, files, bytes, reopens);
+
+    for (SDFile& f : files)
+        if (f)
+            ctx->logger->delete_file(f);
+
+    xSemaphoreGive(ctx->done);
+    vTaskDelete(nullptr);
+}
+
+bool SDLoggerBenchmark::write_files(SDLogger& logger, const char* path_fmt, unsigned first_index, size_t file_count,
+        size_t bytes_per_file, size_t write_sz, std::vector<SDFile>& files, uint64_t& bytes, uint32_t& reopens)
+{
+    const constexpr char* SUB_TAG = "SDBench->write_files()";
+    sd_file_stats_t stats;
+    char path[24];
+    char* buffer = nullptr;
+    size_t written = 0;
+    bool success = true;
+
+    bytes = 0;
+    reopens = 0;
+
+    buffer = static_cast<char*>(malloc(write_sz));
+    if (buffer == nullptr)
+    {
+        ESP_LOGE(TAG, "%s: Could not allocate benchmark resources.", SUB_TAG);
+        return false;
+    }
+
+    // write() takes strings, fill with printable data and terminate
+    memset(buffer, 'A', write_sz - 2);
+    buffer[write_sz - 2] = '\n';
+    buffer[write_sz - 1] = '\0';
+
+    for (size_t i = 0; i < file_count && success; i++)
+    {
+        snprintf(path, sizeof(path), path_fmt, static_cast<unsigned>(first_index + i));
+        files.push_back(SDLogger::File::create(path));
+
+        success = files.back() && logger.open_file(files.back(), "w");
+        if (!success)
+            ESP_LOGE(TAG, "%s: Could not open %s.", SUB_TAG, path);
+    }
+
+    // round robin is the worst case for parking, every file is the least recently written one by its next turn
+    while (written < bytes_per_file && success)
+    {
+        for (SDFile& f : files)
+            success &= logger.write(f, buffer);
+
+        written += write_sz - 1;
+    }
+
+    for (SDFile& f : files)
+    {
+        if (!f)
+            continue;
+
+        // close syncs the file, its cost is part of the measurement
+        if (f->is_open())
+            success &= logger.close_file(f);
+
+        if (logger.get_file_stats(f, stats))
+            reopens += stats.reopens;
+    }
+
+    bytes = success ? static_cast<uint64_t>(written) * file_count : 0;
+
+    free(buffer);
+
+    return success;
+}
+
+float SDLoggerBenchmark::rows_per_s(size_t rows, int64_t elapsed_us)
+{
+    return (elapsed_us > 0) ? rows / (elapsed_us / 1000000.0f) : 0;
+}
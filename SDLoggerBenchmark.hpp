@@ -0,0 +1,101 @@
+#pragma once
+
+#include "SDLogger.hpp"
+
+typedef struct sd_bench_result_t
+{
+        uint8_t logger_count;
+        uint64_t bytes;
+        int64_t elapsed_us;
+        float kib_per_s;
+
+        sd_bench_result_t()
+            : logger_count(0)
+            , bytes(0)
+            , elapsed_us(0)
+            , kib_per_s(0)
+        {
+        }
+} sd_bench_result_t;
+
+typedef struct sd_channel_bench_result_t
+{
+        size_t channel_count;
+        uint64_t bytes;
+        int64_t elapsed_us;
+        float kib_per_s;
+        uint32_t reopens; // parked files opened again, 0 while channel_count fits max_open_files
+
+        sd_channel_bench_result_t()
+            : channel_count(0)
+            , bytes(0)
+            , elapsed_us(0)
+            , kib_per_s(0)
+            , reopens(0)
+        {
+        }
+} sd_channel_bench_result_t;
+
+typedef struct sd_row_bench_result_t
+{
+        size_t rows;
+        int64_t printf_format_us; // snprintf() only
+        int64_t printf_total_us;  // snprintf() and write_line(), closed and synced
+        int64_t writer_format_us; // SDRowWriter format functions only
+        int64_t writer_total_us;  // SDRowWriter rows, closed and synced
+
+        sd_row_bench_result_t()
+            : rows(0)
+            , printf_format_us(0)
+            , printf_total_us(0)
+            , writer_format_us(0)
+            , writer_total_us(0)
+        {
+        }
+} sd_row_bench_result_t;
+
+/**
+ * On-target throughput benchmarks. Every routine creates its own scratch files under /bench on the mounted
+ * loggers and deletes them afterwards; loggers must be initialized and mounted before calling.
+ */
+class SDLoggerBenchmark
+{
+    public:
+        static bool aggregate_throughput(SDLogger* const* loggers, size_t logger_count, size_t bytes_per_logger, size_t write_sz,
+                sd_bench_result_t& result);
+        static bool compare_card_count(SDLogger& first, SDLogger& second, size_t bytes_per_logger = 4UL * 1024UL * 1024UL,
+                size_t write_sz = 4096);
+        static bool channel_throughput(SDLogger& logger, size_t channel_count, size_t bytes_per_channel, size_t write_sz,
+                sd_channel_bench_result_t& result);
+        static bool compare_channel_count(SDLogger& logger, const size_t* channel_counts, size_t count,
+                size_t bytes_per_channel = 64UL * 1024UL, size_t write_sz = 256);
+        static bool row_format(SDLogger& logger, size_t rows, sd_row_bench_result_t& result);
+        static bool compare_row_format(SDLogger& logger, size_t rows = 20000);
+
+    private:
+        typedef struct writer_ctx_t
+        {
+                SDLogger* logger;
+                uint8_t index; // names the writer's file, loggers sharing a volume must not share a file
+                size_t bytes;
+                size_t write_sz;
+                SemaphoreHandle_t done;
+                bool success;
+        } writer_ctx_t;
+
+        static void writer_task(void* arg);
+        // opens file_count files named after path_fmt, writes bytes_per_file to each in turn and closes them, the files are
+        // left for the caller to delete
+        static bool write_files(SDLogger& logger, const char* path_fmt, unsigned first_index, size_t file_count,
+                size_t bytes_per_file, size_t write_sz, std::vector<SDFile>& files, uint64_t& bytes, uint32_t& reopens);
+        static float rows_per_s(size_t rows, int64_t elapsed_us);
+        // one sample row formatted with snprintf() and with the SDRowWriter field functions, the lengths are returned
+        static size_t printf_row(char* line, int64_t time_us, size_t i, float value);
+        static size_t writer_row(char* line, int64_t time_us, size_t i, float value);
+
+        static const constexpr uint8_t MAX_LOGGERS = 4;
+        static const constexpr size_t MAX_CHANNELS = 1000; // channel files are named bench/chNNN.txt
+        static const constexpr size_t ROW_SZ = 96;
+        static const constexpr uint32_t WRITER_STACK_SZ = 4096;
+        static const constexpr char* TAG = "SDLoggerBenchmark";
+};
@@ -0,0 +1,78 @@
+#include "SDLoggerSelfTest.hpp"
+
+bool SDLoggerSelfTest::durability_check(SDLogger& logger)
+{
+    const constexpr char* SUB_TAG = "SDSelfTest->durability_check()";
+    SDFile file = SDLogger::File::create("selftest/durable.bin");
+    sd_queue_stats_t queue;
+    sd_write_status_t status = SD_WRITE_ERROR;
+    char* record = nullptr;
+    size_t record_sz = 0;
+    uint32_t ticket = 0;
+    uint32_t previous = 0;
+    uint32_t evicted = 0;
+    bool evicted_durable = true;
+    bool later_durable = false;
+    bool success = true;
+
+    if (!file || !logger.get_queue_stats(queue) || queue.capacity < 4)
+    {
+        ESP_LOGE(TAG, "%s: Invalid file or no write queue.", SUB_TAG);
+        return false;
+    }
+
+    // two records never fit the queue together, the second evicts the first unless the io task has taken it already
+    record_sz = queue.capacity / 2 + 1;
+    record = static_cast<char*>(malloc(record_sz));
+    if (record == nullptr)
+    {
+        ESP_LOGE(TAG, "%s: Could not allocate check resources.", SUB_TAG);
+        return false;
+    }
+
+    memset(record, 'D', record_sz);
+
+    success = logger.open_file(file, "w") && logger.set_overflow_policy(file, SD_OVERFLOW_DROP_OLDEST);
+
+    // only this file is written, the record evicted from the bulk lane is the previous one
+    for (size_t i = 0; i < MAX_EVICTION_ATTEMPTS && success && evicted == 0; i++)
+    {
+        status = logger.try_write(file, record, record_sz, SD_PRIORITY_BULK, ticket);
+        success = SDLogger::status_ok(status);
+
+        if (status == SD_WRITE_QUEUED_EVICTED)
+            evicted = previous;
+
+        previous = ticket;
+    }
+
+    if (success && evicted == 0)
+    {
+        ESP_LOGE(TAG, "%s: No record was evicted, the check needs the io task and no other writers.", SUB_TAG);
+        success = false;
+    }
+
+    // the later ticket is synced past the evicted one, which must not be reported durable by the file's watermark
+    if (success)
+    {
+        later_durable = logger.wait_durable(file, ticket, DURABLE_TIMEOUT_MS);
+        evicted_durable = logger.is_durable(file, evicted) || logger.wait_durable(file, evicted, DURABLE_TIMEOUT_MS);
+        success = later_durable && !evicted_durable;
+
+        ESP_LOGI(TAG,
+                "\n ---- SD Durability Check ---- \n"
+                "Evicted ticket %lu durable: %s \n"
+                "Later ticket %lu durable: %s",
+                static_cast<unsigned long>(evicted), evicted_durable ? "yes (wrong)" : "no",
+                static_cast<unsigned long>(ticket), later_durable ? "yes" : "no (wrong)");
+    }
+
+    if (!success)
+        ESP_LOGE(TAG, "%s: Check failed.", SUB_TAG);
+
+    logger.close_file(file);
+    logger.delete_file(file);
+    free(record);
+
+    return success;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "SDLogger.hpp"
+
+/**
+ * On-target checks of SDLogger guarantees that benchmarks do not exercise. Every check creates its own scratch files
+ * under /selftest on the mounted logger and deletes them afterwards; the logger must be initialized and mounted, with
+ * its io task running and no other writers, before calling.
+ */
+class SDLoggerSelfTest
+{
+    public:
+        static bool durability_check(SDLogger& logger);
+
+    private:
+        static const constexpr size_t MAX_EVICTION_ATTEMPTS = 64;
+        static const constexpr uint32_t DURABLE_TIMEOUT_MS = 1000;
+        static const constexpr char* TAG = "SDLoggerSelfTest";
+};
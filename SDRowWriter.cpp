@@ -0,0 +1,364 @@
+#include "SDRowWriter.hpp"
+
+#include <math.h>
+
+SDRowWriter::SDRowWriter(SDLogger& logger, SDFile file, const sd_row_writer_config_t& cfg)
+    : logger(logger)
+    , file(file)
+    , cfg(cfg)
+    , block(nullptr)
+    , block_len(0)
+    , row_started(false)
+    , failed(false)
+    , spill{0}
+{
+}
+
+SDRowWriter::~SDRowWriter()
+{
+    if (block)
+    {
+        write_block();
+        heap_caps_free(block);
+    }
+}
+
+bool SDRowWriter::begin()
+{
+    const constexpr char* SUB_TAG = "SDRowWriter->begin()";
+
+    if (block)
+    {
+        ESP_LOGW(TAG, "%s: Already started.", SUB_TAG);
+        return false;
+    }
+
+    if (!file || cfg.block_sz <= MAX_FIELD_SZ)
+    {
+        ESP_LOGE(TAG, "%s: Invalid file or block size.", SUB_TAG);
+        return false;
+    }
+
+    // DMA capable and word aligned, write_block() then hands full blocks to the card without bouncing them
+    block = static_cast<char*>(heap_caps_malloc(cfg.block_sz, MALLOC_CAP_DMA));
+    if (block == nullptr)
+    {
+        ESP_LOGE(TAG, "%s: No DMA capable memory available for a %u byte block.", SUB_TAG, static_cast<unsigned>(cfg.block_sz));
+        return false;
+    }
+
+    return true;
+}
+
+SDRowWriter& SDRowWriter::add_int(int64_t value)
+{
+    size_t length = 0;
+    char* out = reserve(length);
+
+    if (out != nullptr)
+        commit(out, length + format_int(out + length, value));
+
+    return *this;
+}
+
+SDRowWriter& SDRowWriter::add_uint(uint64_t value)
+{
+    size_t length = 0;
+    char* out = reserve(length);
+
+    if (out != nullptr)
+        commit(out, length + format_uint(out + length, value));
+
+    return *this;
+}
+
+SDRowWriter& SDRowWriter::add_fixed(int64_t value, uint8_t decimals)
+{
+    size_t length = 0;
+    char* out = reserve(length);
+
+    if (out != nullptr)
+        commit(out, length + format_fixed(out + length, value, decimals));
+
+    return *this;
+}
+
+SDRowWriter& SDRowWriter::add_float(float value, uint8_t precision)
+{
+    size_t length = 0;
+    char* out = reserve(length);
+
+    if (out != nullptr)
+        commit(out, length + format_float(out + length, value, precision));
+
+    return *this;
+}
+
+SDRowWriter& SDRowWriter::add_timestamp(int64_t time_us)
+{
+    // seconds with microsecond decimals
+    return add_fixed(time_us, 6);
+}
+
+SDRowWriter& SDRowWriter::add_string(const char* value)
+{
+    if (block == nullptr || value == nullptr)
+        return *this;
+
+    if (row_started)
+        append(&cfg.separator, 1);
+
+    append(value, strlen(value));
+    row_started = true;
+
+    return *this;
+}
+
+bool SDRowWriter::end_row()
+{
+    bool success = false;
+
+    if (block == nullptr)
+        return false;
+
+    append("\n", 1);
+
+    success = !failed;
+    failed = false;
+    row_started = false;
+    stats.rows++;
+
+    return success;
+}
+
+bool SDRowWriter::flush()
+{
+    if (block == nullptr)
+        return false;
+
+    return write_block();
+}
+
+bool SDRowWriter::get_stats(sd_row_writer_stats_t& stats)
+{
+    stats = this->stats;
+
+    return true;
+}
+
+size_t SDRowWriter::format_uint(char* out, uint64_t value)
+{
+    char digits[20];
+    char* p = digits + sizeof(digits);
+    uint32_t low = 0;
+    size_t length = 0;
+
+    // 64 bit division is a library call on 32 bit targets, it is only used to split off 8 digits at a time
+    while (value > UINT32_MAX)
+    {
+        low = static_cast<uint32_t>(value % 100000000ULL);
+        value /= 100000000ULL;
+
+        for (uint8_t i = 0; i < 4; i++)
+        {
+            p -= 2;
+            memcpy(p, DIGIT_PAIRS + (low % 100) * 2, 2);
+            low /= 100;
+        }
+    }
+
+    low = static_cast<uint32_t>(value);
+
+    while (low >= 100)
+    {
+        p -= 2;
+        memcpy(p, DIGIT_PAIRS + (low % 100) * 2, 2);
+        low /= 100;
+    }
+
+    if (low >= 10)
+    {
+        p -= 2;
+        memcpy(p, DIGIT_PAIRS + low * 2, 2);
+    }
+    else
+    {
+        *--p = static_cast<char>('0' + low);
+    }
+
+    length = digits + sizeof(digits) - p;
+    memcpy(out, p, length);
+
+    return length;
+}
+
+size_t SDRowWriter::format_int(char* out, int64_t value)
+{
+    // negated as unsigned, INT64_MIN has no positive counterpart
+    if (value < 0)
+    {
+        *out = '-';
+        return 1 + format_uint(out + 1, 0ULL - static_cast<uint64_t>(value));
+    }
+
+    return format_uint(out, static_cast<uint64_t>(value));
+}
+
+size_t SDRowWriter::format_fixed(char* out, int64_t value, uint8_t decimals)
+{
+    char* p = out;
+    uint64_t magnitude = static_cast<uint64_t>(value);
+    uint64_t integer = 0;
+    uint32_t fraction = 0;
+
+    decimals = std::min(decimals, MAX_PRECISION);
+
+    if (value < 0)
+    {
+        *p++ = '-';
+        magnitude = 0ULL - magnitude;
+    }
+
+    if (magnitude <= UINT32_MAX)
+    {
+        integer = static_cast<uint32_t>(magnitude) / POW10[decimals];
+        fraction = static_cast<uint32_t>(magnitude) % POW10[decimals];
+    }
+    else
+    {
+        integer = magnitude / POW10[decimals];
+        fraction = static_cast<uint32_t>(magnitude % POW10[decimals]);
+    }
+
+    p += format_uint(p, integer);
+
+    if (decimals > 0)
+    {
+        *p++ = '.';
+        p += format_digits(p, fraction, decimals);
+    }
+
+    return p - out;
+}
+
+size_t SDRowWriter::format_float(char* out, float value, uint8_t precision)
+{
+    char* p = out;
+    double scaled = 0.0;
+
+    precision = std::min(precision, MAX_PRECISION);
+
+    if (isnan(value))
+    {
+        memcpy(out, "nan", 3);
+        return 3;
+    }
+
+    if (signbit(value))
+    {
+        *p++ = '-';
+        value = -value;
+    }
+
+    // rounded to nearest, ties to even like printf, one double multiply instead of printf's digit generation
+    scaled = rint(static_cast<double>(value) * POW10[precision]);
+
+    // infinities and values whose scaled form does not fit 63 bits are rare enough to leave to printf
+    if (!(scaled < 9.2e18))
+        return (p - out) + snprintf(p, MAX_FIELD_SZ - (p - out), "%.*e", precision, static_cast<double>(value));
+
+    return (p - out) + format_fixed(p, static_cast<int64_t>(scaled), precision);
+}
+
+char* SDRowWriter::reserve(size_t& length)
+{
+    char* out = nullptr;
+
+    if (block == nullptr)
+        return nullptr;
+
+    // formatted in place while a whole field fits the block, in the spill buffer near its end
+    out = (block_len + MAX_FIELD_SZ + 1 <= cfg.block_sz) ? block + block_len : spill;
+    length = 0;
+
+    if (row_started)
+        out[length++] = cfg.separator;
+
+    return out;
+}
+
+bool SDRowWriter::commit(const char* out, size_t length)
+{
+    row_started = true;
+
+    if (out == spill)
+        return append(spill, length);
+
+    block_len += length;
+
+    return true;
+}
+
+bool SDRowWriter::append(const char* data, size_t length)
+{
+    size_t chunk = 0;
+    bool success = true;
+
+    while (length > 0)
+    {
+        chunk = std::min(length, cfg.block_sz - block_len);
+        memcpy(block + block_len, data, chunk);
+        block_len += chunk;
+        data += chunk;
+        length -= chunk;
+
+        // only full blocks are written, every transfer keeps the size the block was sized for
+        if (block_len == cfg.block_sz)
+            success &= write_block();
+    }
+
+    return success;
+}
+
+bool SDRowWriter::write_block()
+{
+    bool success = true;
+
+    if (block_len == 0)
+        return true;
+
+    success = logger.write_block(file, block, block_len);
+
+    stats.blocks++;
+    stats.bytes += block_len;
+
+    if (!success)
+    {
+        stats.write_failures++;
+        failed = true;
+    }
+
+    block_len = 0;
+
+    return success;
+}
+
+size_t SDRowWriter::format_digits(char* out, uint32_t value, uint8_t digits)
+{
+    char* p = out + digits;
+    uint8_t left = digits;
+
+    // exactly digits characters, leading zeros included
+    while (left >= 2)
+    {
+        p -= 2;
+        memcpy(p, DIGIT_PAIRS + (value % 100) * 2, 2);
+        value /= 100;
+        left -= 2;
+    }
+
+    if (left > 0)
+        *--p = static_cast<char>('0' + value % 10);
+
+    return digits;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "SDLogger.hpp"
+
+typedef struct sd_row_writer_config_t
+{
+        size_t block_sz; // DMA capable block handed to write_block() once full, a multiple of 512 keeps transfers aligned
+        char separator;
+
+        sd_row_writer_config_t()
+            : block_sz(4096)
+            , separator(',')
+        {
+        }
+} sd_row_writer_config_t;
+
+typedef struct sd_row_writer_stats_t
+{
+        uint32_t rows;
+        uint64_t bytes;
+        uint32_t blocks;         // write_block() calls
+        uint32_t write_failures; // blocks lost to a card error
+
+        sd_row_writer_stats_t()
+            : rows(0)
+            , bytes(0)
+            , blocks(0)
+            , write_failures(0)
+        {
+        }
+} sd_row_writer_stats_t;
+
+/**
+ * CSV row builder in front of an SDFile. Fields are formatted straight into a DMA capable block with table driven
+ * integer conversion (two digits per step from a 200 byte table) and fixed precision floats scaled to integers, no printf
+ * involved. Full blocks go to write_block(), the write cache hands blocks of its own size to FatFs without copying them.
+ *
+ *   writer.add_timestamp(esp_timer_get_time()).add_int(channel).add_float(value, 3).end_row();
+ *
+ * Floats are rounded to nearest, ties to even as printf does, and printed without an exponent; values too large for
+ * that fall back to snprintf("%.*e"). Strings are written as they are, without quoting. One producer per writer.
+ */
+class SDRowWriter
+{
+    public:
+        SDRowWriter(SDLogger& logger, SDFile file, const sd_row_writer_config_t& cfg = sd_row_writer_config_t());
+        ~SDRowWriter();
+
+        bool begin();
+        SDRowWriter& add_int(int64_t value);
+        SDRowWriter& add_uint(uint64_t value);
+        SDRowWriter& add_fixed(int64_t value, uint8_t decimals);
+        SDRowWriter& add_float(float value, uint8_t precision);
+        SDRowWriter& add_timestamp(int64_t time_us);
+        SDRowWriter& add_string(const char* value);
+        bool end_row();
+        bool flush();
+        bool get_stats(sd_row_writer_stats_t& stats);
+
+        static size_t format_uint(char* out, uint64_t value);
+        static size_t format_int(char* out, int64_t value);
+        static size_t format_fixed(char* out, int64_t value, uint8_t decimals);
+        static size_t format_float(char* out, float value, uint8_t precision);
+
+        static const constexpr size_t MAX_FIELD_SZ = 32; // buffer size for the format functions, strings have no limit
+        static const constexpr uint8_t MAX_PRECISION = 9; // decimals of fixed point and float fields
+
+    private:
+        char* reserve(size_t& length);
+        bool commit(const char* out, size_t length);
+        bool append(const char* data, size_t length);
+        bool write_block();
+        static size_t format_digits(char* out, uint32_t value, uint8_t digits);
+
+        // "00" to "99", integers are converted two digits per division
+        static const constexpr char DIGIT_PAIRS[] = "00010203040506070809"
+                "10111213141516171819"
+                "20212223242526272829"
+                "30313233343536373839"
+                "40414243444546474849"
+                "50515253545556575859"
+                "60616263646566676869"
+                "70717273747576777879"
+                "80818283848586878889"
+                "90919293949596979899";
+        static const constexpr uint32_t POW10[MAX_PRECISION + 1] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+
+        SDLogger& logger;
+        SDFile file;
+        sd_row_writer_config_t cfg;
+        char* block;
+        size_t block_len;
+        bool row_started; // a separator goes in front of every field but the first
+        bool failed;      // a write failed since the last end_row()
+        char spill[MAX_FIELD_SZ + 1]; // fields that do not fit the rest of the block are formatted here, separator first
+        sd_row_writer_stats_t stats;
+
+        static const constexpr char* TAG = "SDRowWriter";
+};
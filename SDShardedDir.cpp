@@ -0,0 +1,137 @@
+#include "SDShardedDir.hpp"
+
+SDShardedDir::SDShardedDir(SDLogger& logger, const char* root, const sd_sharded_dir_config_t& cfg)
+    : logger(logger)
+    , cfg(cfg)
+    , root{0}
+    , leaves(1)
+    , valid(false)
+{
+    const constexpr char* SUB_TAG = "SDShardedDir()";
+    size_t length = 0;
+
+    // File::create() adds the leading '/' itself, "events" and "/events" name the same root
+    while (root != nullptr && *root == '/')
+        root++;
+
+    if (root == nullptr || strlen(root) + 1 > MAX_ROOT_SZ)
+    {
+        ESP_LOGE(TAG, "%s: Root must be a path shorter than %u characters.", SUB_TAG, static_cast<unsigned>(MAX_ROOT_SZ));
+        return;
+    }
+
+    if (cfg.levels == 0 || cfg.levels > MAX_LEVELS || cfg.fan_out < 2 || cfg.fan_out > MAX_FAN_OUT)
+    {
+        ESP_LOGE(TAG, "%s: Levels must be 1-%u and fan out 2-%u.", SUB_TAG, MAX_LEVELS, MAX_FAN_OUT);
+        return;
+    }
+
+    strcpy(this->root, root);
+
+    length = strlen(this->root);
+    while (length > 0 && this->root[length - 1] == '/')
+        this->root[--length] = '\0';
+
+    for (uint8_t i = 0; i < cfg.levels; i++)
+        leaves *= cfg.fan_out;
+
+    valid = true;
+}
+
+SDFile SDShardedDir::file(const char* name)
+{
+    char path[MAX_PATH_SZ];
+
+    if (!resolve(name, path, sizeof(path)))
+        return nullptr;
+
+    return SDLogger::File::create(path);
+}
+
+SDFile SDShardedDir::open(const char* name, const char* permissions)
+{
+    SDFile f = file(name);
+
+    // open_file() builds missing level directories
+    if (!f || !logger.open_file(f, permissions))
+        return nullptr;
+
+    return f;
+}
+
+bool SDShardedDir::exists(const char* name)
+{
+    SDFile f = file(name);
+
+    return f && logger.file_exists(f);
+}
+
+bool SDShardedDir::remove(const char* name)
+{
+    SDFile f = file(name);
+
+    // level directories stay, they are shared with other names and cheap to keep
+    return f && logger.delete_file(f);
+}
+
+bool SDShardedDir::resolve(const char* name, char* path, size_t path_sz)
+{
+    const constexpr char* SUB_TAG = "SDShardedDir->resolve()";
+    uint32_t leaf = 0;
+    uint32_t divisor = leaves;
+    size_t length = 0;
+
+    if (!valid)
+    {
+        ESP_LOGE(TAG, "%s: Invalid root or configuration.", SUB_TAG);
+        return false;
+    }
+
+    if (name == nullptr || name[0] == '\0' || strlen(name) + 1 > MAX_NAME_SZ || strchr(name, '/') != nullptr)
+    {
+        ESP_LOGE(TAG, "%s: Names must be 1-%u characters without '/'.", SUB_TAG, static_cast<unsigned>(MAX_NAME_SZ - 1));
+        return false;
+    }
+
+    leaf = hash(name) % leaves;
+
+    length = snprintf(path, path_sz, "%s", root);
+
+    // most significant digit first, so the first level spreads as evenly as the last
+    for (uint8_t i = 0; i < cfg.levels && length < path_sz; i++)
+    {
+        divisor /= cfg.fan_out;
+        length += snprintf(path + length, path_sz - length, (length > 0) ? "/%02X" : "%02X",
+                static_cast<unsigned>((leaf / divisor) % cfg.fan_out));
+    }
+
+    if (length < path_sz)
+        length += snprintf(path + length, path_sz - length, "/%s", name);
+
+    if (length >= path_sz)
+    {
+        ESP_LOGE(TAG, "%s: Path buffer too small.", SUB_TAG);
+        return false;
+    }
+
+    return true;
+}
+
+uint32_t SDShardedDir::get_leaf_count()
+{
+    return valid ? leaves : 0;
+}
+
+uint32_t SDShardedDir::hash(const char* name)
+{
+    uint32_t h = 2166136261UL;
+
+    // FNV-1a, FatFs compares names case insensitively so the hash does too
+    for (const char* c = name; *c != '\0'; c++)
+    {
+        h ^= static_cast<uint8_t>(toupper(static_cast<unsigned char>(*c)));
+        h *= 16777619UL;
+    }
+
+    return h;
+}
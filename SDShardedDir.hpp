@@ -0,0 +1,56 @@
+#pragma once
+
+#include "SDLogger.hpp"
+
+typedef struct sd_sharded_dir_config_t
+{
+        uint8_t levels;   // subdirectory levels between the root and the files
+        uint16_t fan_out; // subdirectories per level, fan_out ^ levels leaf directories in total
+
+        sd_sharded_dir_config_t()
+            : levels(2)
+            , fan_out(64)
+        {
+        }
+} sd_sharded_dir_config_t;
+
+/**
+ * Managed file naming for one file per event (or per anything) layouts. FatFs scans a directory's entries in order, so
+ * f_open() and f_stat() slow down linearly once a directory holds thousands of files. Files are addressed by a logical
+ * name instead, hashed (FNV-1a) onto one of fan_out ^ levels leaf directories:
+ *
+ *   <root>/<level 0>/<level 1>/<name>    ie. events/3F/A0/evt_000123.bin
+ *
+ * Level directories are two hex digit 8.3 names, created on first use by open_file(). Every lookup walks levels + 1
+ * directories of bounded size, so open and create latency depend on files per leaf rather than on the total. Keep files
+ * per leaf in the low hundreds: the defaults (4096 leaves) suit about a million files. Each directory costs one cluster.
+ */
+class SDShardedDir
+{
+    public:
+        SDShardedDir(SDLogger& logger, const char* root, const sd_sharded_dir_config_t& cfg = sd_sharded_dir_config_t());
+
+        SDFile file(const char* name);
+        SDFile open(const char* name, const char* permissions = "a+");
+        bool exists(const char* name);
+        bool remove(const char* name);
+        bool resolve(const char* name, char* path, size_t path_sz);
+        uint32_t get_leaf_count();
+
+        static const constexpr uint8_t MAX_LEVELS = 3;
+        static const constexpr uint16_t MAX_FAN_OUT = 256;
+        static const constexpr size_t MAX_ROOT_SZ = 24;
+        static const constexpr size_t MAX_NAME_SZ = 48; // logical names are used as the file name in the leaf directory
+        static const constexpr size_t MAX_PATH_SZ = MAX_ROOT_SZ + MAX_LEVELS * 3 + MAX_NAME_SZ + 1;
+
+    private:
+        static uint32_t hash(const char* name);
+
+        SDLogger& logger;
+        sd_sharded_dir_config_t cfg;
+        char root[MAX_ROOT_SZ]; // without leading or trailing '/' like other File paths, "" for the volume root
+        uint32_t leaves;        // fan_out ^ levels
+        bool valid;
+
+        static const constexpr char* TAG = "SDShardedDir";
+};
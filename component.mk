@@ -1,2 +1,2 @@
 COMPONENT_ADD_INCLUDEDIRS = .
-COMPONENT_DEPENDS = driver sdmmc fatfs
\ No newline at end of file
+COMPONENT_DEPENDS = driver sdmmc fatfs nvs_flash
\ No newline at end of file
@@ -0,0 +1,1151 @@
+#include "SDLogConverter.hpp"
+#include "../SDDeferredLog.hpp"
+
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+
+// pending column bytes per table before they are appended to the output files
+static const constexpr size_t TABLE_FLUSH_SZ = 4UL * 1024UL * 1024UL;
+
+static uint64_t record_time_us(const SDLogDecoder::record_t& record)
+{
+    // wall clock when the target had one, uptime otherwise
+    if (record.session->unix_s > 978307200ULL)
+        return record.session->unix_s * 1000000ULL + record.offset_us;
+
+    return record.session->uptime_us + record.offset_us;
+}
+
+static const char* column_ext(char type)
+{
+    switch (type)
+    {
+        case 'l':
+            return "i64";
+        case 'u':
+            return "u64";
+        case 'd':
+            return "f64";
+        default:
+            return "str";
+    }
+}
+
+static void put_u64(std::vector<uint8_t>& out, uint64_t value)
+{
+    uint8_t bytes[8];
+
+    for (int i = 0; i < 8; i++)
+        bytes[i] = static_cast<uint8_t>(value >> (8 * i));
+
+    out.insert(out.end(), bytes, bytes + 8);
+}
+
+template <typename T>
+static void put_raw(std::vector<uint8_t>& out, T value)
+{
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value); // hosts are little endian
+
+    out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+// fixed width digits without printf, these fields are on every row
+static void append_padded(std::string& out, uint64_t value, int digits, unsigned base)
+{
+    static const char DIGITS[] = "0123456789ABCDEF";
+    char buf[24];
+
+    for (int i = digits - 1; i >= 0; i--)
+    {
+        buf[i] = DIGITS[value % base];
+        value /= base;
+    }
+
+    out.append(buf, digits);
+}
+
+static bool parse_int(const char* value, size_t length, int64_t& out)
+{
+    const std::from_chars_result res = std::from_chars(value, value + length, out);
+
+    return (res.ec == std::errc() && res.ptr == value + length);
+}
+
+static bool parse_double(const char* value, size_t length, double& out)
+{
+    // from_chars() rejects a leading '+', printf style output never has one for doubles but hand written lines may
+    if (length > 0 && value[0] == '+')
+    {
+        value++;
+        length--;
+    }
+
+    const std::from_chars_result res = std::from_chars(value, value + length, out);
+
+    return (res.ec == std::errc() && res.ptr == value + length);
+}
+
+static bool append_file(const std::string& path, const uint8_t* data, size_t length)
+{
+    FILE* f = fopen(path.c_str(), "ab");
+    bool ok = false;
+
+    if (f == nullptr)
+        return false;
+
+    ok = (length == 0 || fwrite(data, 1, length, f) == length);
+
+    if (fclose(f) != 0)
+        ok = false;
+
+    return ok;
+}
+
+SDLogConverter::SDLogConverter(const sd_convert_config_t& cfg)
+    : cfg(cfg)
+    , next_scan(0)
+    , next_decode(0)
+    , merged(0)
+    , written(0)
+    , window(0)
+    , failed(false)
+    , merge_end(0)
+    , merge_input(SIZE_MAX)
+    , csv_out(nullptr)
+{
+}
+
+SDLogConverter::~SDLogConverter()
+{
+    if (csv_out != nullptr && csv_out != stdout)
+        fclose(csv_out);
+
+    close_inputs();
+}
+
+const sd_convert_stats_t& SDLogConverter::get_stats() const
+{
+    return stats;
+}
+
+bool SDLogConverter::run(const std::vector<std::string>& paths)
+{
+    const auto started = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    bool ok = true;
+
+    if (!open_inputs(paths))
+        return false;
+
+    infer_text_schema();
+    plan_chunks();
+
+    if (cfg.output == SD_CONVERT_CSV)
+    {
+        csv_out = (cfg.path == "-") ? stdout : fopen(cfg.path.c_str(), "wb");
+
+        if (csv_out == nullptr)
+        {
+            fprintf(stderr, "SDLogConverter: cannot create %s: %s\n", cfg.path.c_str(), strerror(errno));
+            return false;
+        }
+
+        setvbuf(csv_out, nullptr, _IOFBF, 1UL << 20);
+
+        // one header for all segments, repeated header lines are dropped while converting
+        if (!inputs.empty() && inputs[0].framed)
+            fputs("time_us,time,format_id,message\n", csv_out);
+        else if (!text_header.empty())
+            fprintf(csv_out, "%s\n", text_header.c_str());
+    }
+    else if (mkdir(cfg.path.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "SDLogConverter: cannot create %s: %s\n", cfg.path.c_str(), strerror(errno));
+        return false;
+    }
+
+    stats.threads = (cfg.threads > 0) ? cfg.threads : std::thread::hardware_concurrency();
+    if (stats.threads == 0)
+        stats.threads = 1;
+
+    // enough chunks in flight to keep every worker busy while the coordinator writes, few enough to bound memory
+    window = stats.threads * 4;
+
+    for (unsigned i = 0; i < stats.threads; i++)
+        workers.emplace_back(&SDLogConverter::worker, this);
+
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (written < chunks.size() && !failed)
+    {
+        if (merged < chunks.size() && chunks[merged].state == CHUNK_SCANNED)
+        {
+            chunk_t& chunk = chunks[merged];
+
+            lock.unlock();
+            merge_chunk(chunk);
+            lock.lock();
+
+            chunk.state = CHUNK_READY;
+            merged++;
+            cv.notify_all();
+            continue;
+        }
+
+        if (chunks[written].state == CHUNK_DECODED)
+        {
+            chunk_t& chunk = chunks[written];
+
+            lock.unlock();
+            ok = write_chunk(chunk);
+            lock.lock();
+
+            if (!ok)
+                failed = true;
+
+            written++;
+            cv.notify_all();
+            continue;
+        }
+
+        cv.wait(lock);
+    }
+
+    failed = failed || (written < chunks.size());
+    ok = !failed;
+    cv.notify_all();
+    lock.unlock();
+
+    for (std::thread& t : workers)
+        t.join();
+
+    if (!finish_output())
+        ok = false;
+
+    close_inputs();
+
+    stats.chunks = chunks.size();
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    return ok;
+}
+
+bool SDLogConverter::open_inputs(const std::vector<std::string>& paths)
+{
+    for (const std::string& path : paths)
+    {
+        input_t in = {path, nullptr, 0, false};
+        struct stat st;
+        const int fd = open(path.c_str(), O_RDONLY);
+
+        if (fd < 0 || fstat(fd, &st) != 0)
+        {
+            fprintf(stderr, "SDLogConverter: cannot open %s: %s\n", path.c_str(), strerror(errno));
+
+            if (fd >= 0)
+                close(fd);
+
+            return false;
+        }
+
+        in.size = static_cast<size_t>(st.st_size);
+
+        if (in.size > 0)
+        {
+            void* map = mmap(nullptr, in.size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (map == MAP_FAILED)
+            {
+                fprintf(stderr, "SDLogConverter: cannot map %s: %s\n", path.c_str(), strerror(errno));
+                close(fd);
+                return false;
+            }
+
+            madvise(map, in.size, MADV_SEQUENTIAL);
+            in.data = static_cast<const uint8_t*>(map);
+        }
+
+        close(fd);
+
+        if (cfg.input == SD_INPUT_AUTO)
+            in.framed = (in.size > 0 && SDLogDecoder::find_frame(in.data, 0, in.size < 65536 ? in.size : 65536) == 0);
+        else
+            in.framed = (cfg.input == SD_INPUT_FRAMED);
+
+        stats.input_bytes += in.size;
+        inputs.push_back(in);
+    }
+
+    return true;
+}
+
+void SDLogConverter::close_inputs()
+{
+    for (input_t& in : inputs)
+    {
+        if (in.data != nullptr)
+            munmap(const_cast<uint8_t*>(in.data), in.size);
+
+        in.data = nullptr;
+    }
+}
+
+bool SDLogConverter::infer_text_schema()
+{
+    const input_t* in = nullptr;
+    std::vector<std::vector<std::pair<const char*, size_t>>> rows;
+    std::vector<std::pair<const char*, size_t>> fields;
+    size_t pos = 0;
+    size_t columns = 0;
+    bool header = false;
+
+    for (const input_t& candidate : inputs)
+    {
+        if (!candidate.framed && candidate.size > 0)
+        {
+            in = &candidate;
+            break;
+        }
+    }
+
+    if (in == nullptr)
+        return false;
+
+    const char* data = reinterpret_cast<const char*>(in->data);
+
+    while (pos < in->size && rows.size() < cfg.infer_rows)
+    {
+        const char* nl = static_cast<const char*>(memchr(data + pos, '\n', in->size - pos));
+        size_t length = (nl != nullptr) ? static_cast<size_t>(nl - data) - pos : in->size - pos;
+        const char* line = data + pos;
+
+        pos += length + 1;
+
+        if (length > 0 && line[length - 1] == '\r')
+            length--;
+
+        if (length == 0 || memchr(line, 0, length) != nullptr)
+            continue;
+
+        split_fields(line, length, cfg.delimiter, fields);
+        rows.push_back(fields);
+
+        if (fields.size() > columns)
+            columns = fields.size();
+    }
+
+    if (rows.empty())
+        return false;
+
+    text_types.assign(columns, 0);
+
+    // a column is numeric when every non-empty sample after the first line parses, the first line is a header when
+    // none of its fields are numbers while some column is
+    for (size_t c = 0; c < columns; c++)
+    {
+        bool is_int = true;
+        bool is_double = true;
+        bool any = false;
+
+        for (size_t r = 1; r < rows.size(); r++)
+        {
+            int64_t i = 0;
+            double d = 0.0;
+
+            if (c >= rows[r].size() || rows[r][c].second == 0)
+                continue;
+
+            any = true;
+            is_int = is_int && parse_int(rows[r][c].first, rows[r][c].second, i);
+            is_double = is_double && parse_double(rows[r][c].first, rows[r][c].second, d);
+        }
+
+        text_types[c] = !any ? 's' : is_int ? 'l' : is_double ? 'd' : 's';
+    }
+
+    header = (rows.size() > 1);
+    for (size_t c = 0; c < rows[0].size() && header; c++)
+    {
+        double d = 0.0;
+
+        if (parse_double(rows[0][c].first, rows[0][c].second, d))
+            header = false;
+    }
+
+    if (header)
+    {
+        bool numeric = false;
+
+        for (char type : text_types)
+            numeric = numeric || (type != 's');
+
+        header = numeric;
+    }
+
+    // with a single sample line or no header, the first line is data and decides the types on its own
+    if (!header && rows.size() == 1)
+    {
+        for (size_t c = 0; c < rows[0].size(); c++)
+        {
+            int64_t i = 0;
+            double d = 0.0;
+
+            text_types[c] = parse_int(rows[0][c].first, rows[0][c].second, i)      ? 'l'
+                            : parse_double(rows[0][c].first, rows[0][c].second, d) ? 'd'
+                                                                                   : 's';
+        }
+    }
+
+    for (size_t c = 0; c < columns; c++)
+    {
+        std::string name;
+
+        if (header && c < rows[0].size())
+        {
+            for (size_t i = 0; i < rows[0][c].second; i++)
+            {
+                const char ch = rows[0][c].first[i];
+                name += (isalnum(static_cast<unsigned char>(ch)) || ch == '-') ? ch : '_';
+            }
+        }
+
+        if (name.empty())
+            name = "c" + std::to_string(c);
+
+        for (const std::string& other : text_names)
+        {
+            if (other == name)
+            {
+                name += "_" + std::to_string(c);
+                break;
+            }
+        }
+
+        text_names.push_back(name);
+    }
+
+    if (header)
+    {
+        const char* line = rows[0].front().first;
+        const char* last = rows[0].back().first + rows[0].back().second;
+
+        // quoted fields end after their closing quote
+        while (last < data + in->size && *last != '\n' && *last != '\r')
+            last++;
+
+        // the line start is the start of the first field unless it was quoted
+        if (line > data && line[-1] == '"')
+            line--;
+
+        text_header.assign(line, last - line);
+    }
+
+    return true;
+}
+
+void SDLogConverter::plan_chunks()
+{
+    const size_t chunk_sz = (cfg.chunk_sz >= 4096) ? cfg.chunk_sz : 4096;
+
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        for (size_t begin = 0; begin < inputs[i].size; begin += chunk_sz)
+        {
+            chunk_t chunk;
+
+            chunk.input = i;
+            chunk.begin = begin;
+            chunk.limit = (inputs[i].size - begin > chunk_sz) ? begin + chunk_sz : inputs[i].size;
+            chunk.state = CHUNK_PENDING;
+            chunk.first = 0;
+            chunk.end = 0;
+            chunk.start = begin;
+            chunk.in_session = false;
+
+            chunks.push_back(std::move(chunk));
+        }
+    }
+}
+
+void SDLogConverter::worker()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (!failed)
+    {
+        // finishing merged chunks first keeps the writer fed and memory bounded
+        if (next_decode < merged)
+        {
+            chunk_t& chunk = chunks[next_decode++];
+
+            chunk.state = CHUNK_DECODING;
+            lock.unlock();
+            decode_chunk(chunk);
+            lock.lock();
+
+            chunk.state = CHUNK_DECODED;
+            cv.notify_all();
+            continue;
+        }
+
+        if (next_scan < chunks.size() && next_scan < written + window)
+        {
+            chunk_t& chunk = chunks[next_scan++];
+
+            chunk.state = CHUNK_SCANNING;
+            lock.unlock();
+            scan_chunk(chunk);
+            lock.lock();
+
+            chunk.state = CHUNK_SCANNED;
+            cv.notify_all();
+            continue;
+        }
+
+        if (next_decode >= chunks.size())
+            break;
+
+        cv.wait(lock);
+    }
+}
+
+void SDLogConverter::scan_chunk(chunk_t& chunk)
+{
+    const input_t& in = inputs[chunk.input];
+
+    if (in.framed)
+        chunk.end = SDLogDecoder::scan_range(in.data, chunk.begin, chunk.limit, in.size, chunk.definitions, chunk.first);
+}
+
+void SDLogConverter::merge_chunk(chunk_t& chunk)
+{
+    const input_t& in = inputs[chunk.input];
+    bool changed = false;
+
+    if (!in.framed)
+        return;
+
+    // every segment starts with a frame search at its first byte, sessions carry over between segments
+    if (chunk.input != merge_input)
+    {
+        merge_input = chunk.input;
+        merge_end = 0;
+    }
+
+    // the scan started with a guess, a frame found before the previous chunk's last frame ended was a false sync
+    if (chunk.first < merge_end)
+    {
+        chunk.definitions.clear();
+        chunk.end = SDLogDecoder::scan_range(in.data, merge_end, chunk.limit, in.size, chunk.definitions, chunk.first);
+        chunk.stats.resyncs++;
+    }
+
+    chunk.start = merge_end;
+
+    if (!merge_session)
+        merge_session = std::make_shared<const SDLogDecoder::session_t>(merge_decoder.get_session());
+
+    chunk.session = merge_session;
+    chunk.in_session = merge_decoder.is_in_session();
+
+    for (size_t pos : chunk.definitions)
+        changed = merge_decoder.apply_definition(in.data + pos) || changed;
+
+    if (changed)
+        merge_session.reset();
+
+    merge_end = chunk.end;
+}
+
+void SDLogConverter::decode_chunk(chunk_t& chunk)
+{
+    if (inputs[chunk.input].framed)
+        decode_framed(chunk);
+    else
+        decode_text(chunk);
+}
+
+void SDLogConverter::decode_framed(chunk_t& chunk)
+{
+    const input_t& in = inputs[chunk.input];
+    SDLogDecoder decoder;
+    record_ctx_t ctx = {this, &chunk};
+    size_t end = 0;
+
+    if (cfg.output == SD_CONVERT_CSV)
+        chunk.csv.reserve((chunk.limit - chunk.begin) * 3);
+
+    decoder.set_session(*chunk.session, chunk.in_session);
+    end = decoder.decode_range(in.data, chunk.start, chunk.limit, in.size, on_record, &ctx);
+
+    if (chunk.limit == in.size && end < in.size)
+        chunk.stats.trailing_bytes += in.size - end;
+
+    chunk.stats.framed = decoder.get_stats();
+    chunk.session.reset();
+}
+
+void SDLogConverter::on_record(const SDLogDecoder::record_t& record, void* arg)
+{
+    record_ctx_t* ctx = static_cast<record_ctx_t*>(arg);
+    chunk_t& chunk = *ctx->chunk;
+    const uint64_t time_us = record_time_us(record);
+    char buf[32];
+
+    if (ctx->self->cfg.output == SD_CONVERT_CSV)
+    {
+        const std::to_chars_result res = std::to_chars(buf, buf + sizeof(buf), time_us);
+
+        chunk.csv.append(buf, res.ptr - buf);
+        chunk.csv += ',';
+        append_time(chunk.csv, record);
+        chunk.csv += ",0x";
+        append_padded(chunk.csv, record.format->id, 8, 16);
+        chunk.csv += ',';
+        thread_local std::string message;
+
+        message.clear();
+        SDLogDecoder::render(record, message);
+        append_csv_field(chunk.csv, message.data(), message.size());
+        chunk.csv += '\n';
+        return;
+    }
+
+    table_t& table = ctx->self->framed_table(chunk, *record.format);
+
+    put_raw(table.columns[0].data, static_cast<int64_t>(time_us));
+
+    for (size_t i = 0; i < record.args.size() && i + 1 < table.columns.size(); i++)
+    {
+        const SDLogDecoder::arg_t& a = record.args[i];
+        column_t& column = table.columns[i + 1];
+
+        switch (column.type)
+        {
+            case 'l':
+                put_raw(column.data, a.i);
+                break;
+
+            case 'u':
+                put_raw(column.data, a.u);
+                break;
+
+            case 'd':
+                put_raw(column.data, a.d);
+                break;
+
+            default:
+                column.data.insert(column.data.end(), a.s.begin(), a.s.end());
+                column.offsets.push_back(column.data.size());
+                break;
+        }
+    }
+
+    table.rows++;
+}
+
+SDLogConverter::table_t& SDLogConverter::framed_table(chunk_t& chunk, const SDLogDecoder::format_t& format)
+{
+    std::vector<size_t>& candidates = chunk.table_index[format.id];
+
+    for (size_t index : candidates)
+    {
+        if (chunk.tables[index].signature == format.signature)
+            return chunk.tables[index];
+    }
+
+    table_t table;
+
+    table.id = format.id;
+    table.signature = format.signature;
+    table.format = format.text;
+    table.rows = 0;
+    table.columns.push_back({"time_us", 'l', {}, {}});
+
+    for (size_t i = 0; i < format.signature.size(); i++)
+    {
+        const char code = format.signature[i];
+        const char type = (code == 'i') ? 'l' : (code == 'u' || code == 'p') ? 'u' : (code == 'f' || code == 'd') ? 'd' : 's';
+
+        table.columns.push_back({"a" + std::to_string(i), type, {}, {}});
+    }
+
+    candidates.push_back(chunk.tables.size());
+    chunk.tables.push_back(std::move(table));
+
+    return chunk.tables.back();
+}
+
+void SDLogConverter::decode_text(chunk_t& chunk)
+{
+    const input_t& in = inputs[chunk.input];
+    const char* data = reinterpret_cast<const char*>(in.data);
+    size_t pos = chunk.begin;
+
+    if (cfg.output == SD_CONVERT_CSV)
+        chunk.csv.reserve(chunk.limit - chunk.begin + 4096);
+
+    // a chunk owns the lines that start inside it, the line running into it belongs to the previous chunk
+    if (pos > 0)
+    {
+        const char* nl = static_cast<const char*>(memchr(data + pos - 1, '\n', chunk.limit - (pos - 1)));
+
+        if (nl == nullptr)
+            return;
+
+        pos = static_cast<size_t>(nl - data) + 1;
+    }
+
+    while (pos < chunk.limit)
+    {
+        const char* line = data + pos;
+        const char* nl = static_cast<const char*>(memchr(line, '\n', in.size - pos));
+        size_t length = (nl != nullptr) ? static_cast<size_t>(nl - line) : in.size - pos;
+
+        pos += length + 1;
+
+        if (length > 0 && line[length - 1] == '\r')
+            length--;
+
+        if (memchr(line, 0, length) != nullptr)
+            chunk.stats.damaged_lines++;
+        else if (length > 0)
+            text_row(chunk, line, length);
+    }
+}
+
+void SDLogConverter::text_row(chunk_t& chunk, const char* line, size_t length)
+{
+    std::vector<std::pair<const char*, size_t>> fields;
+
+    if (!text_header.empty() && length == text_header.size() && memcmp(line, text_header.data(), length) == 0)
+    {
+        chunk.stats.header_lines++;
+        return;
+    }
+
+    chunk.stats.lines++;
+
+    if (cfg.output == SD_CONVERT_CSV)
+    {
+        // comma separated lines are already CSV
+        if (cfg.delimiter == ',')
+        {
+            chunk.csv.append(line, length);
+            chunk.csv += '\n';
+            return;
+        }
+
+        split_fields(line, length, cfg.delimiter, fields);
+
+        for (size_t i = 0; i < fields.size(); i++)
+        {
+            if (i > 0)
+                chunk.csv += ',';
+
+            append_csv_field(chunk.csv, fields[i].first, fields[i].second);
+        }
+
+        chunk.csv += '\n';
+        return;
+    }
+
+    if (chunk.tables.empty())
+    {
+        table_t table;
+
+        table.name = "text";
+        table.id = 0;
+        table.rows = 0;
+
+        for (size_t c = 0; c < text_names.size(); c++)
+            table.columns.push_back({text_names[c], text_types[c], {}, {}});
+
+        chunk.tables.push_back(std::move(table));
+    }
+
+    table_t& table = chunk.tables[0];
+
+    split_fields(line, length, cfg.delimiter, fields);
+
+    if (fields.size() > table.columns.size())
+        chunk.stats.field_errors += fields.size() - table.columns.size();
+
+    for (size_t c = 0; c < table.columns.size(); c++)
+    {
+        column_t& column = table.columns[c];
+        const char* value = (c < fields.size()) ? fields[c].first : "";
+        const size_t value_length = (c < fields.size()) ? fields[c].second : 0;
+
+        if (column.type == 'l')
+        {
+            int64_t i = 0;
+
+            if (value_length > 0 && !parse_int(value, value_length, i))
+                chunk.stats.field_errors++;
+
+            put_raw(column.data, i);
+        }
+        else if (column.type == 'd')
+        {
+            double d = NAN;
+
+            if (value_length > 0 && !parse_double(value, value_length, d))
+            {
+                d = NAN;
+                chunk.stats.field_errors++;
+            }
+
+            put_raw(column.data, d);
+        }
+        else
+        {
+            column.data.insert(column.data.end(), value, value + value_length);
+            column.offsets.push_back(column.data.size());
+        }
+    }
+
+    table.rows++;
+}
+
+bool SDLogConverter::split_fields(const char* line, size_t length, char delimiter, std::vector<std::pair<const char*, size_t>>& fields)
+{
+    const char* end = line + length;
+    const char* pos = line;
+    bool ok = true;
+
+    fields.clear();
+
+    while (true)
+    {
+        // quoted fields keep delimiters, doubled quotes inside are left as they are
+        if (pos < end && *pos == '"')
+        {
+            const char* start = ++pos;
+
+            while (pos < end && !(*pos == '"' && (pos + 1 == end || pos[1] != '"')))
+                pos += (*pos == '"') ? 2 : 1;
+
+            if (pos >= end)
+            {
+                ok = false;
+                fields.push_back({start, static_cast<size_t>(end - start)});
+                break;
+            }
+
+            fields.push_back({start, static_cast<size_t>(pos - start)});
+            pos++;
+
+            while (pos < end && *pos != delimiter)
+                pos++;
+        }
+        else
+        {
+            const char* next = static_cast<const char*>(memchr(pos, delimiter, end - pos));
+            const char* stop = (next != nullptr) ? next : end;
+
+            fields.push_back({pos, static_cast<size_t>(stop - pos)});
+            pos = stop;
+        }
+
+        if (pos >= end)
+            break;
+
+        pos++; // delimiter
+    }
+
+    return ok;
+}
+
+void SDLogConverter::append_csv_field(std::string& out, const char* value, size_t length)
+{
+    bool quote = false;
+
+    for (size_t i = 0; i < length && !quote; i++)
+        quote = (value[i] == ',' || value[i] == '"' || value[i] == '\n' || value[i] == '\r');
+
+    if (!quote)
+    {
+        out.append(value, length);
+        return;
+    }
+
+    out += '"';
+
+    for (size_t i = 0; i < length; i++)
+    {
+        if (value[i] == '"')
+            out += '"';
+
+        out += value[i];
+    }
+
+    out += '"';
+}
+
+void SDLogConverter::append_time(std::string& out, const SDLogDecoder::record_t& record)
+{
+    // records arrive in time order, so the date part only changes once per second
+    thread_local uint64_t cached_s = UINT64_MAX;
+    thread_local char cached[24];
+    const uint64_t time_us = record_time_us(record);
+
+    if (record.session->unix_s <= 978307200ULL)
+    {
+        char buf[32];
+
+        snprintf(buf, sizeof(buf), "%llu.%06u", static_cast<unsigned long long>(time_us / 1000000ULL),
+                static_cast<unsigned>(time_us % 1000000ULL));
+        out += buf;
+        return;
+    }
+
+    if (time_us / 1000000ULL != cached_s)
+    {
+        const time_t secs = static_cast<time_t>(time_us / 1000000ULL);
+        struct tm tm;
+
+        gmtime_r(&secs, &tm);
+        strftime(cached, sizeof(cached), "%Y-%m-%d %H:%M:%S", &tm);
+        cached_s = time_us / 1000000ULL;
+    }
+
+    out += cached;
+    out += '.';
+    append_padded(out, time_us % 1000000ULL, 6, 10);
+}
+
+bool SDLogConverter::write_chunk(chunk_t& chunk)
+{
+    const input_t& in = inputs[chunk.input];
+    bool ok = true;
+
+    if (cfg.output == SD_CONVERT_CSV)
+    {
+        ok = (chunk.csv.empty() || fwrite(chunk.csv.data(), 1, chunk.csv.size(), csv_out) == chunk.csv.size());
+        stats.output_bytes += chunk.csv.size();
+    }
+
+    for (table_t& table : chunk.tables)
+    {
+        std::string key = table.name;
+        char name[32];
+
+        if (key.empty())
+        {
+            snprintf(name, sizeof(name), "%08X:", static_cast<unsigned>(table.id));
+            key = name + table.signature;
+        }
+
+        auto found = writers.find(key);
+
+        if (found == writers.end())
+        {
+            table_writer_t writer;
+            size_t same_id = 0;
+
+            // format strings that hash alike but capture different arguments get a table each
+            if (table.name.empty())
+            {
+                for (const std::string& other : writer_order)
+                    same_id += (writers[other].layout.id == table.id && writers[other].layout.name[0] == 'F') ? 1 : 0;
+
+                if (same_id == 0)
+                    snprintf(name, sizeof(name), "F%08X", static_cast<unsigned>(table.id));
+                else
+                    snprintf(name, sizeof(name), "F%08X_%zu", static_cast<unsigned>(table.id), same_id + 1);
+
+                table.name = name;
+            }
+
+            writer.layout.name = table.name;
+            writer.layout.id = table.id;
+            writer.layout.signature = table.signature;
+            writer.layout.format = table.format;
+            writer.layout.rows = 0;
+            writer.rows = 0;
+
+            for (const column_t& column : table.columns)
+                writer.layout.columns.push_back({column.name, column.type, {}, {}});
+
+            writer.base.assign(table.columns.size(), 0);
+            writer.pending.resize(table.columns.size());
+            writer.pending_offsets.resize(table.columns.size());
+
+            for (size_t c = 0; c < table.columns.size(); c++)
+            {
+                if (table.columns[c].type == 's')
+                    put_u64(writer.pending_offsets[c], 0);
+            }
+
+            const std::string dir = cfg.path + "/" + writer.layout.name;
+
+            if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+            {
+                fprintf(stderr, "SDLogConverter: cannot create %s: %s\n", dir.c_str(), strerror(errno));
+                return false;
+            }
+
+            // a previous run may have left column files behind
+            for (const column_t& column : table.columns)
+            {
+                unlink((dir + "/" + column.name + "." + column_ext(column.type)).c_str());
+                unlink((dir + "/" + column.name + ".off").c_str());
+            }
+
+            found = writers.emplace(key, std::move(writer)).first;
+            writer_order.push_back(key);
+        }
+
+        table_writer_t& writer = found->second;
+        size_t pending_sz = 0;
+
+        for (size_t c = 0; c < table.columns.size() && c < writer.pending.size(); c++)
+        {
+            column_t& column = table.columns[c];
+
+            writer.pending[c].insert(writer.pending[c].end(), column.data.begin(), column.data.end());
+
+            for (uint64_t offset : column.offsets)
+                put_u64(writer.pending_offsets[c], writer.base[c] + offset);
+
+            writer.base[c] += column.data.size();
+            pending_sz += writer.pending[c].size() + writer.pending_offsets[c].size();
+        }
+
+        writer.rows += table.rows;
+
+        if (pending_sz >= TABLE_FLUSH_SZ && !flush_table(writer, false))
+            ok = false;
+    }
+
+    stats.lines += chunk.stats.lines;
+    stats.header_lines += chunk.stats.header_lines;
+    stats.damaged_lines += chunk.stats.damaged_lines;
+    stats.field_errors += chunk.stats.field_errors;
+    stats.trailing_bytes += chunk.stats.trailing_bytes;
+    stats.resyncs += chunk.stats.resyncs;
+    stats.framed.frames += chunk.stats.framed.frames;
+    stats.framed.sessions += chunk.stats.framed.sessions;
+    stats.framed.strings += chunk.stats.framed.strings;
+    stats.framed.records += chunk.stats.framed.records;
+    stats.framed.crc_errors += chunk.stats.framed.crc_errors;
+    stats.framed.skipped_bytes += chunk.stats.framed.skipped_bytes;
+    stats.framed.orphan_records += chunk.stats.framed.orphan_records;
+    stats.framed.malformed += chunk.stats.framed.malformed;
+
+    // results are out, drop them and the input pages they came from
+    std::string().swap(chunk.csv);
+    std::vector<table_t>().swap(chunk.tables);
+    chunk.table_index.clear();
+    std::vector<size_t>().swap(chunk.definitions);
+
+    const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t first_page = (chunk.begin + page - 1) / page * page;
+    const size_t last_page = chunk.limit / page * page;
+
+    if (in.data != nullptr && last_page > first_page)
+        madvise(const_cast<uint8_t*>(in.data) + first_page, last_page - first_page, MADV_DONTNEED);
+
+    if (!ok)
+        fprintf(stderr, "SDLogConverter: write failed: %s\n", strerror(errno));
+
+    return ok;
+}
+
+bool SDLogConverter::flush_table(table_writer_t& writer, bool final)
+{
+    const std::string dir = cfg.path + "/" + writer.layout.name;
+    bool ok = true;
+
+    for (size_t c = 0; c < writer.layout.columns.size(); c++)
+    {
+        const column_t& column = writer.layout.columns[c];
+
+        ok = append_file(dir + "/" + column.name + "." + column_ext(column.type), writer.pending[c].data(), writer.pending[c].size()) && ok;
+        writer.pending[c].clear();
+
+        if (column.type == 's')
+        {
+            ok = append_file(dir + "/" + column.name + ".off", writer.pending_offsets[c].data(), writer.pending_offsets[c].size()) && ok;
+            writer.pending_offsets[c].clear();
+        }
+    }
+
+    if (final)
+    {
+        FILE* f = fopen((dir + "/schema.csv").c_str(), "w");
+
+        if (f == nullptr)
+            return false;
+
+        fputs("column,type\n", f);
+
+        for (const column_t& column : writer.layout.columns)
+            fprintf(f, "%s,%s\n", column.name.c_str(), column_ext(column.type));
+
+        ok = (fclose(f) == 0) && ok;
+    }
+
+    return ok;
+}
+
+bool SDLogConverter::finish_output()
+{
+    bool ok = true;
+
+    if (cfg.output == SD_CONVERT_CSV)
+    {
+        if (csv_out == nullptr)
+            return false;
+
+        ok = (fflush(csv_out) == 0);
+
+        if (csv_out != stdout)
+            ok = (fclose(csv_out) == 0) && ok;
+
+        csv_out = nullptr;
+
+        return ok;
+    }
+
+    std::string index = "table,rows,format_id,signature,format\n";
+
+    for (const std::string& key : writer_order)
+    {
+        table_writer_t& writer = writers[key];
+        char line[64];
+
+        ok = flush_table(writer, true) && ok;
+
+        snprintf(line, sizeof(line), "%s,%llu,0x%08X,", writer.layout.name.c_str(), static_cast<unsigned long long>(writer.rows),
+                static_cast<unsigned>(writer.layout.id));
+        index += line;
+        append_csv_field(index, writer.layout.signature.data(), writer.layout.signature.size());
+        index += ',';
+        append_csv_field(index, writer.layout.format.data(), writer.layout.format.size());
+        index += '\n';
+
+        for (size_t c = 0; c < writer.layout.columns.size(); c++)
+            stats.output_bytes += writer.base[c] + writer.rows * (writer.layout.columns[c].type == 's' ? 8 : 0);
+    }
+
+    FILE* f = fopen((cfg.path + "/tables.csv").c_str(), "w");
+
+    if (f == nullptr)
+        return false;
+
+    fwrite(index.data(), 1, index.size(), f);
+
+    return (fclose(f) == 0) && ok;
+}
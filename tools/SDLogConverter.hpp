@@ -0,0 +1,227 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "SDLogDecoder.hpp"
+
+typedef enum sd_convert_output_t
+{
+    SD_CONVERT_CSV,    // one CSV file or stdout
+    SD_CONVERT_COLUMNS // a directory with one table per record layout and one raw array file per column
+} sd_convert_output_t;
+
+typedef enum sd_convert_input_t
+{
+    SD_INPUT_AUTO,  // files starting with a valid frame are framed, everything else is text
+    SD_INPUT_TEXT,  // lines written with write()/write_line()
+    SD_INPUT_FRAMED // files written through SDDeferredLog
+} sd_convert_input_t;
+
+typedef struct sd_convert_config_t
+{
+        sd_convert_output_t output;
+        sd_convert_input_t input;
+        std::string path;  // output file ("-" for stdout) or directory
+        unsigned threads;  // 0 uses every core
+        size_t chunk_sz;   // input bytes per work item
+        char delimiter;    // field separator of text input
+        size_t infer_rows; // text lines sampled to pick column types
+
+        sd_convert_config_t()
+            : output(SD_CONVERT_CSV)
+            , input(SD_INPUT_AUTO)
+            , path("-")
+            , threads(0)
+            , chunk_sz(8UL * 1024UL * 1024UL)
+            , delimiter(',')
+            , infer_rows(1000)
+        {
+        }
+} sd_convert_config_t;
+
+typedef struct sd_convert_stats_t
+{
+        uint64_t input_bytes;
+        uint64_t output_bytes;
+        uint64_t chunks;
+        uint64_t lines;          // text lines converted
+        uint64_t header_lines;   // repeated column header lines that were skipped
+        uint64_t damaged_lines;  // text lines holding NUL bytes, usually preallocated or torn file tails
+        uint64_t field_errors;   // text fields that did not parse as their column type or did not fit the schema
+        uint64_t trailing_bytes; // incomplete frames at the end of framed files
+        uint64_t resyncs;        // chunks whose first frame guess was wrong and were rescanned
+        SDLogDecoder::decode_stats_t framed;
+        unsigned threads;
+        double seconds;
+
+        sd_convert_stats_t()
+            : input_bytes(0)
+            , output_bytes(0)
+            , chunks(0)
+            , lines(0)
+            , header_lines(0)
+            , damaged_lines(0)
+            , field_errors(0)
+            , trailing_bytes(0)
+            , resyncs(0)
+            , threads(0)
+            , seconds(0.0)
+        {
+        }
+} sd_convert_stats_t;
+
+/**
+ * Converts logger output into CSV or columnar files using every core. Inputs are memory mapped and cut into chunks.
+ *
+ * Text chunks own the lines that start inside them and decode on their own. A framed chunk needs the session header
+ * and format strings defined before it, so each chunk is first scanned in parallel for frame boundaries and definition
+ * frames, the scans are merged in file order (cheap, definitions are rare) and the chunk is then decoded in parallel
+ * from that state. Results are written in input order, so the output matches a sequential run. Several inputs are
+ * treated as consecutive segments of one log.
+ */
+class SDLogConverter
+{
+    public:
+        SDLogConverter(const sd_convert_config_t& cfg);
+        ~SDLogConverter();
+
+        bool run(const std::vector<std::string>& paths);
+        const sd_convert_stats_t& get_stats() const;
+
+    private:
+        typedef struct input_t
+        {
+                std::string path;
+                const uint8_t* data;
+                size_t size;
+                bool framed;
+        } input_t;
+
+        typedef struct column_t
+        {
+                std::string name;
+                char type; // 'l' int64, 'u' uint64, 'd' double, 's' string
+                std::vector<uint8_t> data;
+                std::vector<uint64_t> offsets; // string columns, end of each value within data
+        } column_t;
+
+        typedef struct table_t
+        {
+                std::string name;
+                uint32_t id;
+                std::string signature;
+                std::string format;
+                uint64_t rows;
+                std::vector<column_t> columns;
+        } table_t;
+
+        typedef enum chunk_state_t
+        {
+            CHUNK_PENDING,
+            CHUNK_SCANNING,
+            CHUNK_SCANNED,
+            CHUNK_READY, // merged, may be decoded
+            CHUNK_DECODING,
+            CHUNK_DECODED
+        } chunk_state_t;
+
+        typedef struct chunk_t
+        {
+                size_t input;
+                size_t begin;
+                size_t limit;
+                chunk_state_t state;
+
+                // scan results, framed input only
+                size_t first;
+                size_t end;
+                std::vector<size_t> definitions;
+
+                // decode state handed over by the merge
+                size_t start;
+                std::shared_ptr<const SDLogDecoder::session_t> session;
+                bool in_session;
+
+                // results
+                std::string csv;
+                std::vector<table_t> tables;
+                std::unordered_map<uint32_t, std::vector<size_t>> table_index;
+                sd_convert_stats_t stats;
+        } chunk_t;
+
+        typedef struct record_ctx_t
+        {
+                SDLogConverter* self;
+                chunk_t* chunk;
+        } record_ctx_t;
+
+        typedef struct table_writer_t
+        {
+                table_t layout; // names and types only
+                uint64_t rows;
+                std::vector<uint64_t> base; // bytes written to each string column
+                std::vector<std::vector<uint8_t>> pending;
+                std::vector<std::vector<uint8_t>> pending_offsets;
+        } table_writer_t;
+
+        bool open_inputs(const std::vector<std::string>& paths);
+        void close_inputs();
+        bool infer_text_schema();
+        void plan_chunks();
+
+        void worker();
+        void scan_chunk(chunk_t& chunk);
+        void decode_chunk(chunk_t& chunk);
+        void decode_text(chunk_t& chunk);
+        void decode_framed(chunk_t& chunk);
+        static void on_record(const SDLogDecoder::record_t& record, void* arg);
+
+        void merge_chunk(chunk_t& chunk);
+        bool write_chunk(chunk_t& chunk);
+        bool flush_table(table_writer_t& writer, bool final);
+        bool finish_output();
+
+        void text_row(chunk_t& chunk, const char* line, size_t length);
+        table_t& framed_table(chunk_t& chunk, const SDLogDecoder::format_t& format);
+        static bool split_fields(const char* line, size_t length, char delimiter, std::vector<std::pair<const char*, size_t>>& fields);
+        static void append_csv_field(std::string& out, const char* value, size_t length);
+        static void append_time(std::string& out, const SDLogDecoder::record_t& record);
+
+        sd_convert_config_t cfg;
+        sd_convert_stats_t stats;
+        std::vector<input_t> inputs;
+        std::vector<chunk_t> chunks;
+
+        // text columns, inferred from the first text input
+        std::vector<std::string> text_names;
+        std::vector<char> text_types;
+        std::string text_header;
+
+        // pipeline, guarded by mutex
+        std::mutex mutex;
+        std::condition_variable cv;
+        size_t next_scan;
+        size_t next_decode;
+        size_t merged;
+        size_t written;
+        size_t window;
+        bool failed;
+
+        // merge state, coordinator only
+        SDLogDecoder merge_decoder;
+        std::shared_ptr<const SDLogDecoder::session_t> merge_session;
+        size_t merge_end;
+        size_t merge_input;
+
+        // output, coordinator only
+        FILE* csv_out;
+        std::unordered_map<std::string, table_writer_t> writers;
+        std::vector<std::string> writer_order;
+};
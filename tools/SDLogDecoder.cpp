@@ -0,0 +1,586 @@
+#include "SDLogDecoder.hpp"
+#include "../SDDeferredLog.hpp"
+
+#include <charconv>
+#include <cmath>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+SDLogDecoder::SDLogDecoder()
+    : in_session(false)
+{
+}
+
+const SDLogDecoder::decode_stats_t& SDLogDecoder::get_stats() const
+{
+    return stats;
+}
+
+void SDLogDecoder::set_session(const session_t& session, bool in_session)
+{
+    this->session = session;
+    this->in_session = in_session;
+}
+
+const SDLogDecoder::session_t& SDLogDecoder::get_session() const
+{
+    return session;
+}
+
+bool SDLogDecoder::is_in_session() const
+{
+    return in_session;
+}
+
+size_t SDLogDecoder::decode(const uint8_t* data, size_t length, record_cb_t on_record, void* arg)
+{
+    return decode_range(data, 0, length, length, on_record, arg);
+}
+
+size_t SDLogDecoder::decode_range(const uint8_t* data, size_t begin, size_t limit, size_t length, record_cb_t on_record, void* arg)
+{
+    return walk(data, begin, limit, length, [&](const uint8_t* frame, size_t) {
+        const size_t payload_length = frame[2] | (static_cast<size_t>(frame[3]) << 8);
+
+        if (!handle_frame(frame[1], frame + SDDeferredLog::FRAME_HEADER_SZ, payload_length, on_record, arg))
+            stats.malformed++;
+    });
+}
+
+size_t SDLogDecoder::scan_range(
+        const uint8_t* data, size_t begin, size_t limit, size_t length, std::vector<size_t>& definitions, size_t& first)
+{
+    SDLogDecoder scanner;
+    size_t end = 0;
+
+    first = SIZE_MAX;
+
+    end = scanner.walk(data, begin, limit, length, [&](const uint8_t* frame, size_t pos) {
+        if (first == SIZE_MAX)
+            first = pos;
+
+        if (frame[1] != SD_FRAME_RECORD)
+            definitions.push_back(pos);
+    });
+
+    if (first == SIZE_MAX)
+        first = end;
+
+    return end;
+}
+
+bool SDLogDecoder::apply_definition(const uint8_t* frame)
+{
+    const size_t payload_length = frame[2] | (static_cast<size_t>(frame[3]) << 8);
+
+    stats.frames++;
+
+    if (frame[1] == SD_FRAME_RECORD || !handle_frame(frame[1], frame + SDDeferredLog::FRAME_HEADER_SZ, payload_length, nullptr, nullptr))
+    {
+        stats.malformed++;
+        return false;
+    }
+
+    return true;
+}
+
+template <typename Visitor>
+size_t SDLogDecoder::walk(const uint8_t* data, size_t begin, size_t limit, size_t length, Visitor visit)
+{
+    size_t pos = begin;
+
+    while (pos < limit && pos + SDDeferredLog::FRAME_OVERHEAD <= length)
+    {
+        if (data[pos] != SDDeferredLog::FRAME_SYNC || data[pos + 1] < SD_FRAME_HEADER || data[pos + 1] > SD_FRAME_RECORD)
+        {
+            stats.skipped_bytes++;
+            pos++;
+            continue;
+        }
+
+        const size_t payload_length = data[pos + 2] | (static_cast<size_t>(data[pos + 3]) << 8);
+        const size_t frame_length = SDDeferredLog::FRAME_OVERHEAD + payload_length;
+
+        // either a torn frame at the end of the data or a stray sync byte, only the latter has valid frames after it
+        if (pos + frame_length > length)
+        {
+            const size_t next = find_frame(data, pos + 1, length);
+
+            if (next >= length)
+                return pos;
+
+            stats.skipped_bytes += next - pos;
+            pos = next;
+            continue;
+        }
+
+        // a sync byte inside payload data or a torn frame, move on by one byte and look again
+        if (SDDeferredLog::crc8(data + pos + 1, SDDeferredLog::FRAME_HEADER_SZ - 1 + payload_length) != data[pos + frame_length - 1])
+        {
+            stats.crc_errors++;
+            stats.skipped_bytes++;
+            pos++;
+            continue;
+        }
+
+        stats.frames++;
+        visit(data + pos, pos);
+        pos += frame_length;
+    }
+
+    return pos;
+}
+
+size_t SDLogDecoder::find_frame(const uint8_t* data, size_t pos, size_t length)
+{
+    for (; pos + SDDeferredLog::FRAME_OVERHEAD <= length; pos++)
+    {
+        if (data[pos] != SDDeferredLog::FRAME_SYNC || data[pos + 1] < SD_FRAME_HEADER || data[pos + 1] > SD_FRAME_RECORD)
+            continue;
+
+        const size_t payload_length = data[pos + 2] | (static_cast<size_t>(data[pos + 3]) << 8);
+
+        if (pos + SDDeferredLog::FRAME_OVERHEAD + payload_length <= length &&
+                SDDeferredLog::crc8(data + pos + 1, SDDeferredLog::FRAME_HEADER_SZ - 1 + payload_length) ==
+                        data[pos + SDDeferredLog::FRAME_OVERHEAD + payload_length - 1])
+            return pos;
+    }
+
+    return length;
+}
+
+bool SDLogDecoder::handle_frame(uint8_t type, const uint8_t* payload, size_t length, record_cb_t on_record, void* arg)
+{
+    switch (type)
+    {
+        case SD_FRAME_HEADER:
+            return handle_header(payload, length);
+
+        case SD_FRAME_STRING:
+            return handle_string(payload, length);
+
+        case SD_FRAME_RECORD:
+            return handle_record(payload, length, on_record, arg);
+
+        default:
+            return false;
+    }
+}
+
+bool SDLogDecoder::handle_header(const uint8_t* payload, size_t length)
+{
+    uint32_t magic = 0;
+
+    if (length < 21)
+        return false;
+
+    for (int i = 0; i < 4; i++)
+        magic |= static_cast<uint32_t>(payload[i]) << (8 * i);
+
+    if (magic != SDDeferredLog::FILE_MAGIC || payload[4] != SDDeferredLog::VERSION)
+        return false;
+
+    session = session_t();
+
+    for (int i = 0; i < 8; i++)
+    {
+        session.uptime_us |= static_cast<uint64_t>(payload[5 + i]) << (8 * i);
+        session.unix_s |= static_cast<uint64_t>(payload[13 + i]) << (8 * i);
+    }
+
+    in_session = true;
+    stats.sessions++;
+
+    return true;
+}
+
+bool SDLogDecoder::handle_string(const uint8_t* payload, size_t length)
+{
+    const uint8_t* in = payload;
+    const uint8_t* end = payload + length;
+    const uint8_t* nul = nullptr;
+    uint64_t index = 0;
+    format_t format;
+
+    if (!SDDeferredLog::get_varint(in, end, index) || end - in < 4)
+        return false;
+
+    format.id = 0;
+    for (int i = 0; i < 4; i++)
+        format.id |= static_cast<uint32_t>(*in++) << (8 * i);
+
+    nul = static_cast<const uint8_t*>(memchr(in, 0, end - in));
+    if (nul == nullptr)
+        return false;
+
+    format.signature.assign(reinterpret_cast<const char*>(in), nul - in);
+    format.text.assign(reinterpret_cast<const char*>(nul + 1), end - nul - 1);
+
+    // indices are handed out in order, a gap means a definition frame was lost
+    if (index >= session.formats.size())
+        session.formats.resize(index + 1);
+
+    compile(format);
+    format.defined = true;
+    session.formats[index] = format;
+    stats.strings++;
+
+    return true;
+}
+
+bool SDLogDecoder::handle_record(const uint8_t* payload, size_t length, record_cb_t on_record, void* arg)
+{
+    const uint8_t* in = payload;
+    const uint8_t* end = payload + length;
+    uint64_t index = 0;
+
+    if (!SDDeferredLog::get_varint(in, end, index) || !SDDeferredLog::get_varint(in, end, record.offset_us))
+        return false;
+
+    if (!in_session || index >= session.formats.size() || !session.formats[index].defined)
+    {
+        stats.orphan_records++;
+        return true;
+    }
+
+    if (!decode_args(session.formats[index].signature, in, end, record.args))
+        return false;
+
+    record.session = &session;
+    record.format = &session.formats[index];
+    stats.records++;
+
+    if (on_record != nullptr)
+        on_record(record, arg);
+
+    return true;
+}
+
+bool SDLogDecoder::decode_args(const std::string& signature, const uint8_t* in, const uint8_t* end, std::vector<arg_t>& args)
+{
+    uint64_t value = 0;
+
+    args.resize(signature.size());
+
+    for (size_t i = 0; i < signature.size(); i++)
+    {
+        arg_t& a = args[i];
+
+        a.code = signature[i];
+
+        switch (a.code)
+        {
+            case 'i':
+                if (!SDDeferredLog::get_varint(in, end, value))
+                    return false;
+                a.i = static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+                a.u = static_cast<uint64_t>(a.i);
+                break;
+
+            case 'u':
+            case 'p':
+                if (!SDDeferredLog::get_varint(in, end, value))
+                    return false;
+                a.u = value;
+                a.i = static_cast<int64_t>(value);
+                break;
+
+            case 'f':
+            {
+                float f = 0.0f;
+
+                if (end - in < 4)
+                    return false;
+                memcpy(&f, in, 4);
+                in += 4;
+                a.d = f;
+                break;
+            }
+
+            case 'd':
+                if (end - in < 8)
+                    return false;
+                memcpy(&a.d, in, 8);
+                in += 8;
+                break;
+
+            case 's':
+                if (!SDDeferredLog::get_varint(in, end, value) || value > static_cast<uint64_t>(end - in))
+                    return false;
+                a.s.assign(reinterpret_cast<const char*>(in), value);
+                in += value;
+                break;
+
+            default:
+                return false;
+        }
+    }
+
+    return (in == end);
+}
+
+std::string SDLogDecoder::render_time(const record_t& record)
+{
+    char buf[48];
+    const uint64_t us = record.session->uptime_us + record.offset_us;
+
+    // before 2001 the target clock was never set, fall back to uptime
+    if (record.session->unix_s > 978307200ULL)
+    {
+        const uint64_t total_us = record.session->unix_s * 1000000ULL + record.offset_us;
+        const time_t secs = static_cast<time_t>(total_us / 1000000ULL);
+        struct tm tm;
+
+        gmtime_r(&secs, &tm);
+        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+        snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), ".%06u", static_cast<unsigned>(total_us % 1000000ULL));
+    }
+    else
+    {
+        snprintf(buf, sizeof(buf), "%llu.%06u", static_cast<unsigned long long>(us / 1000000ULL),
+                static_cast<unsigned>(us % 1000000ULL));
+    }
+
+    return buf;
+}
+
+void SDLogDecoder::compile(format_t& format)
+{
+    const std::string& fmt = format.text;
+    spec_t spec;
+
+    format.specs.clear();
+
+    for (size_t pos = 0; pos < fmt.size(); pos++)
+    {
+        if (fmt[pos] != '%')
+        {
+            spec.literal += fmt[pos];
+            continue;
+        }
+
+        if (++pos >= fmt.size())
+            break;
+
+        if (fmt[pos] == '%')
+        {
+            spec.literal += '%';
+            continue;
+        }
+
+        const size_t start = pos;
+
+        spec.printf_spec = "%";
+        spec.star_width = false;
+        spec.star_precision = false;
+        spec.precision = -1;
+
+        // flags, width and precision are kept, length modifiers are dropped and replaced to match the stored type
+        while (pos < fmt.size() && strchr("-+ #0", fmt[pos]) != nullptr)
+            spec.printf_spec += fmt[pos++];
+
+        if (pos < fmt.size() && fmt[pos] == '*')
+        {
+            spec.star_width = true;
+            spec.printf_spec += fmt[pos++];
+        }
+
+        while (pos < fmt.size() && fmt[pos] >= '0' && fmt[pos] <= '9')
+            spec.printf_spec += fmt[pos++];
+
+        const bool bare = (pos == start);
+
+        if (pos < fmt.size() && fmt[pos] == '.')
+        {
+            spec.printf_spec += fmt[pos++];
+
+            if (pos < fmt.size() && fmt[pos] == '*')
+            {
+                spec.star_precision = true;
+                spec.printf_spec += fmt[pos++];
+            }
+
+            const size_t digits = pos;
+
+            while (pos < fmt.size() && fmt[pos] >= '0' && fmt[pos] <= '9')
+                spec.printf_spec += fmt[pos++];
+
+            if (bare && !spec.star_precision)
+                spec.precision = atoi(fmt.c_str() + digits);
+        }
+
+        spec.plain = (pos == start);
+
+        while (pos < fmt.size() && strchr("hlLqjzt", fmt[pos]) != nullptr)
+            pos++;
+
+        if (pos >= fmt.size())
+            break;
+
+        spec.conv = fmt[pos];
+
+        switch (spec.conv)
+        {
+            case 'd':
+            case 'i':
+                spec.printf_spec += "lld";
+                break;
+
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+                spec.printf_spec += "ll";
+                spec.printf_spec += spec.conv;
+                break;
+
+            case 'p':
+                spec.printf_spec = "0x%llx";
+                spec.plain = false;
+                break;
+
+            default:
+                spec.printf_spec += spec.conv;
+                break;
+        }
+
+        format.specs.push_back(spec);
+        spec = spec_t();
+    }
+
+    spec.conv = 0;
+    format.specs.push_back(spec);
+}
+
+std::string SDLogDecoder::render(const record_t& record)
+{
+    std::string out;
+
+    render(record, out);
+
+    return out;
+}
+
+void SDLogDecoder::render(const record_t& record, std::string& out)
+{
+    size_t next = 0;
+    char buf[512];
+
+    for (const spec_t& spec : record.format->specs)
+    {
+        int width = 0;
+        int precision = 0;
+        int length = 0;
+
+        out += spec.literal;
+
+        if (spec.conv == 0)
+            break;
+
+        if (spec.star_width)
+            width = (next < record.args.size()) ? static_cast<int>(record.args[next++].i) : 0;
+
+        if (spec.star_precision)
+            precision = (next < record.args.size()) ? static_cast<int>(record.args[next++].i) : 0;
+
+        if (next >= record.args.size())
+        {
+            out += "<missing>";
+            continue;
+        }
+
+        const arg_t& a = record.args[next++];
+        const char* p = spec.printf_spec.c_str();
+
+        switch (spec.conv)
+        {
+            case 'd':
+            case 'i':
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+            case 'p':
+            {
+                const unsigned long long v = (spec.conv == 'd' || spec.conv == 'i') ? static_cast<unsigned long long>(a.i) : a.u;
+
+                // the common case, plain decimal and hex need no printf at all
+                if (spec.plain && (spec.conv == 'd' || spec.conv == 'i'))
+                    length = static_cast<int>(std::to_chars(buf, buf + sizeof(buf), a.i).ptr - buf);
+                else if (spec.plain && spec.conv == 'u')
+                    length = static_cast<int>(std::to_chars(buf, buf + sizeof(buf), a.u).ptr - buf);
+                else if (spec.plain && spec.conv == 'x')
+                    length = static_cast<int>(std::to_chars(buf, buf + sizeof(buf), a.u, 16).ptr - buf);
+                else if (spec.star_width && spec.star_precision)
+                    length = snprintf(buf, sizeof(buf), p, width, precision, v);
+                else if (spec.star_width)
+                    length = snprintf(buf, sizeof(buf), p, width, v);
+                else if (spec.star_precision)
+                    length = snprintf(buf, sizeof(buf), p, precision, v);
+                else
+                    length = snprintf(buf, sizeof(buf), p, v);
+                break;
+            }
+
+            case 'f':
+            case 'F':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+            {
+                const double d = (a.code == 'f' || a.code == 'd') ? a.d : static_cast<double>(a.i);
+
+                // to_chars() rounds exactly like printf, so "%.Nf" renders identically
+                if (spec.precision >= 0 && spec.conv == 'f' && std::isfinite(d))
+                    length = static_cast<int>(std::to_chars(buf, buf + sizeof(buf), d, std::chars_format::fixed, spec.precision).ptr - buf);
+                else if (spec.star_width && spec.star_precision)
+                    length = snprintf(buf, sizeof(buf), p, width, precision, d);
+                else if (spec.star_width)
+                    length = snprintf(buf, sizeof(buf), p, width, d);
+                else if (spec.star_precision)
+                    length = snprintf(buf, sizeof(buf), p, precision, d);
+                else
+                    length = snprintf(buf, sizeof(buf), p, d);
+                break;
+            }
+
+            case 'c':
+                length = spec.star_width ? snprintf(buf, sizeof(buf), p, width, static_cast<int>(a.i))
+                                         : snprintf(buf, sizeof(buf), p, static_cast<int>(a.i));
+                break;
+
+            case 's':
+            {
+                const char* str = (a.code == 's') ? a.s.c_str() : "<not a string>";
+
+                if (spec.plain)
+                {
+                    out += (a.code == 's') ? a.s : std::string(str);
+                    continue;
+                }
+
+                if (spec.star_width && spec.star_precision)
+                    length = snprintf(buf, sizeof(buf), p, width, precision, str);
+                else if (spec.star_width)
+                    length = snprintf(buf, sizeof(buf), p, width, str);
+                else if (spec.star_precision)
+                    length = snprintf(buf, sizeof(buf), p, precision, str);
+                else
+                    length = snprintf(buf, sizeof(buf), p, str);
+                break;
+            }
+
+            default:
+                out += "<bad format>";
+                continue;
+        }
+
+        if (length > 0)
+            out.append(buf, (static_cast<size_t>(length) < sizeof(buf)) ? static_cast<size_t>(length) : sizeof(buf) - 1);
+    }
+}
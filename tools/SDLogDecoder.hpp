@@ -0,0 +1,146 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+/**
+ * Host side reader for files written through SDDeferredLog. Frames are validated by their CRC, a damaged or partially
+ * written frame is skipped by resynchronizing on the next sync byte.
+ */
+class SDLogDecoder
+{
+    public:
+        typedef struct arg_t
+        {
+                char code;
+                uint64_t u;
+                int64_t i;
+                double d;
+                std::string s;
+
+                arg_t()
+                    : code(0)
+                    , u(0)
+                    , i(0)
+                    , d(0.0)
+                {
+                }
+        } arg_t;
+
+        // one printf conversion and the literal text in front of it, conv is 0 for the text after the last conversion
+        typedef struct spec_t
+        {
+                std::string literal;
+                std::string printf_spec; // flags, width and precision with the length modifier matching the stored type
+                char conv;
+                bool star_width;
+                bool star_precision;
+                bool plain;    // no flags, width or precision, integers take the to_chars() path
+                int precision; // fixed precision of a float conversion without flags or width, -1 otherwise
+        } spec_t;
+
+        typedef struct format_t
+        {
+                uint32_t id;
+                std::string signature;
+                std::string text;
+                std::vector<spec_t> specs; // text split up once when the definition is read
+                bool defined;
+
+                format_t()
+                    : id(0)
+                    , defined(false)
+                {
+                }
+        } format_t;
+
+        typedef struct session_t
+        {
+                uint64_t uptime_us; // target uptime when the session header was written
+                uint64_t unix_s;    // target wall clock at the same moment, 0 or small when it was never set
+                std::vector<format_t> formats;
+
+                session_t()
+                    : uptime_us(0)
+                    , unix_s(0)
+                {
+                }
+        } session_t;
+
+        typedef struct record_t
+        {
+                const session_t* session;
+                const format_t* format;
+                uint64_t offset_us; // since the session header
+                std::vector<arg_t> args;
+        } record_t;
+
+        typedef struct decode_stats_t
+        {
+                uint64_t frames;
+                uint64_t sessions;
+                uint64_t strings;
+                uint64_t records;
+                uint64_t crc_errors;
+                uint64_t skipped_bytes;   // bytes discarded while looking for a frame
+                uint64_t orphan_records;  // records whose session or format string was never seen
+                uint64_t malformed;       // frames with a valid CRC that did not parse
+
+                decode_stats_t()
+                    : frames(0)
+                    , sessions(0)
+                    , strings(0)
+                    , records(0)
+                    , crc_errors(0)
+                    , skipped_bytes(0)
+                    , orphan_records(0)
+                    , malformed(0)
+                {
+                }
+        } decode_stats_t;
+
+        typedef void (*record_cb_t)(const record_t& record, void* arg);
+
+        SDLogDecoder();
+
+        // decodes a complete buffer, returns the number of bytes consumed, a trailing incomplete frame is left over
+        size_t decode(const uint8_t* data, size_t length, record_cb_t on_record, void* arg);
+        // decodes the frames starting in [begin, limit), they may extend up to length, returns where the next frame search starts
+        size_t decode_range(const uint8_t* data, size_t begin, size_t limit, size_t length, record_cb_t on_record, void* arg);
+        // walks frames exactly like decode_range() but only collects the positions of header and string frames, first is
+        // set to the first frame found or to the returned position when there is none
+        static size_t scan_range(
+                const uint8_t* data, size_t begin, size_t limit, size_t length, std::vector<size_t>& definitions, size_t& first);
+        // applies a header or string frame found by scan_range()
+        bool apply_definition(const uint8_t* frame);
+
+        // lets a decoder continue a session that started in earlier data
+        void set_session(const session_t& session, bool in_session);
+        const session_t& get_session() const;
+        bool is_in_session() const;
+        const decode_stats_t& get_stats() const;
+
+        static std::string render(const record_t& record);
+        static void render(const record_t& record, std::string& out);
+        static void compile(format_t& format);
+        static std::string render_time(const record_t& record);
+
+        // position of the next CRC valid frame at or after pos, length if there is none
+        static size_t find_frame(const uint8_t* data, size_t pos, size_t length);
+
+    private:
+        template <typename Visitor>
+        size_t walk(const uint8_t* data, size_t begin, size_t limit, size_t length, Visitor visit);
+        bool handle_frame(uint8_t type, const uint8_t* payload, size_t length, record_cb_t on_record, void* arg);
+        bool handle_header(const uint8_t* payload, size_t length);
+        bool handle_string(const uint8_t* payload, size_t length);
+        bool handle_record(const uint8_t* payload, size_t length, record_cb_t on_record, void* arg);
+        static bool decode_args(const std::string& signature, const uint8_t* in, const uint8_t* end, std::vector<arg_t>& args);
+
+        session_t session;
+        bool in_session;
+        record_t record; // reused between records to keep the argument storage
+        decode_stats_t stats;
+};
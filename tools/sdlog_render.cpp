@@ -0,0 +1,87 @@
+#include "SDLogDecoder.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+/**
+ * Renders files written through SDDeferredLog back into text, one line per record. Several files are decoded in the
+ * order given, so rotated segments can be passed together.
+ *
+ *   sdlog_render [-q] FILE...
+ */
+
+static void print_record(const SDLogDecoder::record_t& record, void* arg)
+{
+    FILE* out = static_cast<FILE*>(arg);
+
+    fprintf(out, "%s %s\n", SDLogDecoder::render_time(record).c_str(), SDLogDecoder::render(record).c_str());
+}
+
+static bool read_file(const char* path, std::vector<uint8_t>& data)
+{
+    FILE* f = fopen(path, "rb");
+    long size = 0;
+
+    if (f == nullptr)
+        return false;
+
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    data.resize(size > 0 ? static_cast<size_t>(size) : 0);
+
+    const bool ok = (fread(data.data(), 1, data.size(), f) == data.size());
+    fclose(f);
+
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    SDLogDecoder decoder;
+    std::vector<uint8_t> data;
+    bool quiet = false;
+    int first = 1;
+
+    if (argc > 1 && strcmp(argv[1], "-q") == 0)
+    {
+        quiet = true;
+        first++;
+    }
+
+    if (first >= argc)
+    {
+        fprintf(stderr, "usage: %s [-q] FILE...\n", argv[0]);
+        return 2;
+    }
+
+    for (int i = first; i < argc; i++)
+    {
+        if (!read_file(argv[i], data))
+        {
+            fprintf(stderr, "%s: cannot read %s\n", argv[0], argv[i]);
+            return 1;
+        }
+
+        const size_t used = decoder.decode(data.data(), data.size(), print_record, stdout);
+
+        if (used < data.size() && !quiet)
+            fprintf(stderr, "%s: %zu trailing bytes in an incomplete frame\n", argv[i], data.size() - used);
+    }
+
+    if (!quiet)
+    {
+        const SDLogDecoder::decode_stats_t& stats = decoder.get_stats();
+
+        fprintf(stderr, "frames %llu, sessions %llu, strings %llu, records %llu, crc errors %llu, skipped bytes %llu, "
+                        "orphan records %llu, malformed %llu\n",
+                static_cast<unsigned long long>(stats.frames), static_cast<unsigned long long>(stats.sessions),
+                static_cast<unsigned long long>(stats.strings), static_cast<unsigned long long>(stats.records),
+                static_cast<unsigned long long>(stats.crc_errors), static_cast<unsigned long long>(stats.skipped_bytes),
+                static_cast<unsigned long long>(stats.orphan_records), static_cast<unsigned long long>(stats.malformed));
+    }
+
+    return 0;
+}
@@ -0,0 +1,188 @@
+#include "../SDDeferredLog.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+/**
+ * Writes synthetic logger output for benchmarking the host tools.
+ *
+ *   sdlog_synth text|framed SIZE_MIB OUT
+ *
+ * text writes CSV lines like write_line() telemetry, framed writes SDDeferredLog frames with a session header and a
+ * handful of format strings, restarting the session every 64 MiB the way a rotated or reopened file would.
+ */
+
+typedef struct synth_format_t
+{
+        const char* signature;
+        const char* text;
+} synth_format_t;
+
+static const synth_format_t FORMATS[] = {
+        {"ufff", "imu seq=%u ax=%.4f ay=%.4f az=%.4f"},
+        {"iid", "adc ch=%d raw=%d volts=%.6f"},
+        {"us", "event %u: %s"},
+        {"uuu", "heap free=%u min=%u largest=%u"},
+};
+
+static std::vector<uint8_t> out;
+
+static void put_frame(sd_deferred_frame_t type, const uint8_t* payload, size_t length)
+{
+    const size_t at = out.size();
+
+    out.resize(at + SDDeferredLog::FRAME_OVERHEAD + length);
+    SDDeferredLog::put_frame_header(out.data() + at, type, length);
+    memcpy(out.data() + at + SDDeferredLog::FRAME_HEADER_SZ, payload, length);
+    SDDeferredLog::put_frame_crc(out.data() + at, length);
+}
+
+static void put_session(uint64_t uptime_us)
+{
+    uint8_t payload[21];
+    const uint64_t unix_s = 1760000000ULL + uptime_us / 1000000ULL;
+
+    for (int i = 0; i < 4; i++)
+        payload[i] = static_cast<uint8_t>(SDDeferredLog::FILE_MAGIC >> (8 * i));
+
+    payload[4] = SDDeferredLog::VERSION;
+
+    for (int i = 0; i < 8; i++)
+    {
+        payload[5 + i] = static_cast<uint8_t>(uptime_us >> (8 * i));
+        payload[13 + i] = static_cast<uint8_t>(unix_s >> (8 * i));
+    }
+
+    put_frame(SD_FRAME_HEADER, payload, sizeof(payload));
+
+    for (size_t f = 0; f < sizeof(FORMATS) / sizeof(FORMATS[0]); f++)
+    {
+        std::vector<uint8_t> payload(5);
+        const uint32_t id = SDDeferredLog::hash(FORMATS[f].text);
+
+        payload.resize(SDDeferredLog::put_varint(payload.data(), f));
+
+        for (int i = 0; i < 4; i++)
+            payload.push_back(static_cast<uint8_t>(id >> (8 * i)));
+
+        payload.insert(payload.end(), FORMATS[f].signature, FORMATS[f].signature + strlen(FORMATS[f].signature) + 1);
+        payload.insert(payload.end(), FORMATS[f].text, FORMATS[f].text + strlen(FORMATS[f].text));
+        put_frame(SD_FRAME_STRING, payload.data(), payload.size());
+    }
+}
+
+template <typename... Args>
+static void put_record(uint32_t index, uint64_t offset_us, const Args&... args)
+{
+    uint8_t payload[20 + SDDeferredLog::MAX_ARGS_SZ];
+    size_t length = SDDeferredLog::put_varint(payload, index);
+
+    length += SDDeferredLog::put_varint(payload + length, offset_us);
+    length += SDDeferredLog::encode_args(payload + length, SDDeferredLog::MAX_ARGS_SZ, args...);
+    put_frame(SD_FRAME_RECORD, payload, length);
+}
+
+int main(int argc, char** argv)
+{
+    static const char* EVENTS[] = {"card inserted", "threshold crossed", "gps fix", "calibration saved"};
+
+    if (argc != 4 || (strcmp(argv[1], "text") != 0 && strcmp(argv[1], "framed") != 0))
+    {
+        fprintf(stderr, "usage: %s text|framed SIZE_MIB OUT\n", argv[0]);
+        return 2;
+    }
+
+    const bool framed = (strcmp(argv[1], "framed") == 0);
+    const uint64_t target = static_cast<uint64_t>(strtod(argv[2], nullptr) * 1024.0 * 1024.0);
+    FILE* f = fopen(argv[3], "wb");
+    uint64_t total = 0;
+    uint64_t session_start = 0;
+    uint64_t uptime_us = 1000000;
+    uint64_t base_us = 0;
+    uint32_t seq = 0;
+
+    if (f == nullptr)
+    {
+        perror(argv[3]);
+        return 1;
+    }
+
+    srand(1);
+
+    if (!framed)
+    {
+        const char* header = "time_us,seq,ax,ay,az,state\n";
+        out.insert(out.end(), header, header + strlen(header));
+    }
+
+    while (total + out.size() < target)
+    {
+        const float ax = static_cast<float>(rand() % 20000 - 10000) / 1000.0f;
+        const float ay = static_cast<float>(rand() % 20000 - 10000) / 1000.0f;
+        const float az = 9.81f + static_cast<float>(rand() % 200 - 100) / 1000.0f;
+
+        uptime_us += 1000 + rand() % 50;
+        seq++;
+
+        if (!framed)
+        {
+            char line[128];
+            const int length = snprintf(line, sizeof(line), "%llu,%u,%.4f,%.4f,%.4f,%s\n", static_cast<unsigned long long>(uptime_us),
+                    seq, ax, ay, az, (seq % 1000 == 0) ? "\"armed, ready\"" : "idle");
+
+            out.insert(out.end(), line, line + length);
+        }
+        else
+        {
+            if (seq == 1 || total + out.size() - session_start >= 64UL * 1024UL * 1024UL)
+            {
+                session_start = total + out.size();
+                base_us = uptime_us;
+                put_session(uptime_us);
+            }
+
+            const uint64_t offset_us = uptime_us - base_us;
+
+            switch (seq % 16)
+            {
+                case 0:
+                    put_record(1, offset_us, static_cast<int>(seq % 8), rand() % 4096, static_cast<double>(rand() % 3300) / 1000.0);
+                    break;
+
+                case 5:
+                    put_record(3, offset_us, 200000u + rand() % 1000, 150000u, 65536u);
+                    break;
+
+                case 9:
+                    if (seq % 256 == 9)
+                    {
+                        put_record(2, offset_us, seq, EVENTS[seq % 4]);
+                        break;
+                    }
+                    [[fallthrough]];
+
+                default:
+                    put_record(0, offset_us, seq, ax, ay, az);
+                    break;
+            }
+        }
+
+        if (out.size() >= (1UL << 20))
+        {
+            fwrite(out.data(), 1, out.size(), f);
+            total += out.size();
+            out.clear();
+        }
+    }
+
+    fwrite(out.data(), 1, out.size(), f);
+    total += out.size();
+    fclose(f);
+
+    printf("%s: %.1f MiB, %u records\n", argv[3], static_cast<double>(total) / (1024.0 * 1024.0), seq);
+
+    return 0;
+}